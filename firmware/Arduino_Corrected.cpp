@@ -4,10 +4,13 @@
  *
  * Fitur Utama:
  * - Pembacaan sensor aliran air
- * - Kontrol valve otomatis
+ * - Kontrol valve otomatis lewat state machine (gerak hanya saat transisi,
+ *   batas waktu tempuh motor, de-bounce perintah, status posisi dilaporkan)
  * - Monitoring tegangan
  * - Antarmuka LCD (Nokia 5110)
  * - Komunikasi dengan ESP8266 (NodeMCU) via SoftwareSerial (menggunakan JSON)
+ * - Skema frame serial bersama NodeMCU (link_schema.h): array posisional
+ *   tanpa kunci, encoder/decoder per jenis pesan dibangkitkan saat compile
  * - Integrasi status unlock via serial
  * - Valve tetap tertutup saat unlock aktif
  * - Valve aktif kembali saat unlock dinonaktifkan (tugas selesai)
@@ -15,17 +18,33 @@
  * - Menerima dan mengeksekusi perintah kontrol katup dari NodeMCU
  * - Mengirim status eksekusi perintah kembali ke NodeMCU
  * - Mengirim data meteran real-time ke NodeMCU
- * - Penyimpanan K_FACTOR dan jarakToleransi ke EEPROM
+ * - Registry parameter bertipe (rentang + default) untuk semua tunable,
+ *   diterapkan atomik per set dan disimpan sebagai satu blob EEPROM
+ *   berversi; dump lewat perintah get_config
+ * - Flight recorder: ring event biner di RAM (serial, valve, pintu, tegangan,
+ *   anomali, perintah, loop lambat), diunggah lewat perintah dump_trace
+ * - Statistik latensi loop (histogram log2, bagian paling blocking, deadline
+ *   miss) dikirim bersama agregat interval
  * - Penanganan error komunikasi serial yang lebih baik
  * - Logika buzzer non-blocking
+ * - Mode idle hemat daya (sleep AVR, bangun oleh pulsa flow / serial)
+ * - Ledger saldo lokal per nomor urut pembacaan (rekonsiliasi dengan server)
+ * - Alamat bus RS-485 untuk mode gateway multi-meter (hanya menjawab jika dipanggil)
+ * - Umur data (age_ms) di setiap frame agar NodeMCU bisa memberi waktu capture
+ * - Agregasi aliran per interval (volume, min/avg/max, detik aktif, histogram);
+ *   snapshot ringkas tetap mengikuti interval laporan (round-trip saldo)
+ * - Deteksi kebocoran/anomali aliran di perangkat (aliran terus-menerus,
+ *   volume berlebih, aliran saat valve tertutup) dengan opsi tutup valve lokal
  *
  * CORRECTED ISSUES:
  * - Removed conflicting LiquidCrystal_I2C library include
  * - Pin 19,18 for SoftwareSerial are VALID (A5,A4 as digital pins)
  * - Fixed pin 20 -> pin 12 for tilt sensor (pin 20 doesn't exist on Uno/Nano)
- * - Fixed pin 17 -> pin 13 for buzzer (pin 17 doesn't exist on Uno/Nano)
+ * - Fixed pin 17 -> pin 13 for buzzer
  * - Removed EEPROM.commit() calls (not needed for Arduino)
  * - Kept original flow sensor pin configuration
+ * - Pin tegangan A0 -> A2 (A0 = D14 sudah dipakai valve buka); pin kini
+ *   divalidasi saat compile (avr_pin.h) dan diakses langsung lewat port
  *
  * Dibuat & Dimodifikasi oleh: DODI SETIADI
  * Tanggal: [29/07/2025] - Corrected Version for IndoWater System
@@ -36,13 +55,45 @@
 #include <Wire.h>                 // Library untuk komunikasi I2C (jika diperlukan)
 #include <ArduinoJson.h>          // Library untuk parsing JSON
 #include <EEPROM.h>               // Library untuk penyimpanan EEPROM
+#include <avr/sleep.h>            // Untuk mode idle hemat daya
+#include "avr_pin.h"              // Pin compile-time dengan akses port langsung
+#include "trace_events.h"         // Format record flight recorder (sama dengan NodeMCU)
+#include "loop_stats.h"           // Histogram latensi loop (sama dengan NodeMCU)
+#include "link_schema.h"          // Skema frame serial ke/dari NodeMCU (sama dengan NodeMCU)
 
 // Alamat EEPROM untuk menyimpan konfigurasi
 #define EEPROM_K_FACTOR_ADDR 0
 #define EEPROM_JARAK_TOLERANSI_ADDR 4 // Float membutuhkan 4 byte
+#define EEPROM_BUS_ADDRESS_ADDR 8     // Alamat bus RS-485 (1 byte)
+#define EEPROM_PARAM_BLOB_ADDR 16     // Blob registry parameter (lihat PARAMS)
 
-PC08544 lcd(3,4,5,7,6); // Pins for Nokia 5110: SCLK, DIN, DC, CS, RST
-SoftwareSerial myArd(19, 18); // D19 (A5), D18 (A4) for communication with NodeMCU - CORRECTED: These pins are valid!
+// Pin Data - CORRECTED: Fixed invalid pins for Arduino Uno/Nano
+// Pin yang digerakkan sketch ini adalah tipe AvrPin<N> (port, mask dan
+// interrupt diselesaikan saat compile); pin milik library tetap angka.
+typedef AvrPin<2>  FlowPin;       // Pin untuk sensor aliran (Interrupt pin) - Pin 2 supports interrupt
+typedef AvrPin<10> EchoPin;       // Pin echo untuk sensor ultrasonik
+typedef AvrPin<11> TrigPin;       // Pin trigger untuk sensor ultrasonik
+typedef AvrPin<14> ValveOpenPin;  // Pin kontrol valve (untuk membuka) - A0 as digital
+typedef AvrPin<15> ValveClosePin; // Pin kontrol valve (untuk menutup) - A1 as digital
+typedef AvrPin<12> MiringPin;     // Pin untuk sensor kemiringan - CORRECTED: Pin 20 doesn't exist on Uno/Nano
+typedef AvrPin<13> BuzzerPin;     // Pin untuk buzzer (dulu 17 = A3, pin valid; dipindah ke 13)
+typedef AvrPin<8>  Rs485DePin;    // Driver enable transceiver RS-485 (DE dan /RE digabung)
+const uint8_t teganganPin = A2;   // Pin analog untuk pembacaan tegangan - CORRECTED: A0 dipakai valve buka
+const uint8_t lcdSclkPin = 3, lcdDinPin = 4, lcdDcPin = 5, lcdCsPin = 7, lcdRstPin = 6;
+const uint8_t nodeRxPin = 19, nodeTxPin = 18; // D19 (A5), D18 (A4) - CORRECTED: These pins are valid!
+
+// Setiap pin hanya boleh dipakai sekali dan harus ada di board
+constexpr uint8_t USED_PINS[] = {
+    FlowPin::NUMBER, EchoPin::NUMBER, TrigPin::NUMBER, ValveOpenPin::NUMBER,
+    ValveClosePin::NUMBER, MiringPin::NUMBER, BuzzerPin::NUMBER, Rs485DePin::NUMBER,
+    teganganPin, lcdSclkPin, lcdDinPin, lcdDcPin, lcdCsPin, lcdRstPin, nodeRxPin, nodeTxPin
+};
+static_assert(pinsValid(USED_PINS, sizeof(USED_PINS)), "Ada pin yang tidak ada di Uno/Nano");
+static_assert(pinsUnique(USED_PINS, sizeof(USED_PINS)), "Ada pin yang dipakai dua kali");
+static_assert(FlowPin::EXT_INT >= 0, "Sensor aliran harus di pin interrupt eksternal (D2/D3)");
+
+PC08544 lcd(lcdSclkPin, lcdDinPin, lcdDcPin, lcdCsPin, lcdRstPin); // Pins for Nokia 5110: SCLK, DIN, DC, CS, RST
+SoftwareSerial myArd(nodeRxPin, nodeTxPin); // Komunikasi dengan NodeMCU
 
 String idMeter = "";            // ID Meter dari NodeMCU
 bool isUnlocked = false;        // Status perangkat unlocked oleh teknisi
@@ -51,6 +102,7 @@ float tariffPerM3 = 0.0;        // Tarif air per m3 (didapat dari server via Nod
 
 // Variabel untuk sensor aliran
 volatile unsigned long pulseCount = 0; // Menggunakan unsigned long untuk pulsa
+unsigned long lastSampledPulseCount = 0; // pulseCount pada sampel flow sebelumnya
 float K_FACTOR = 7.5;           // K-Factor sensor (Pulses per Liter) - Akan dimuat dari EEPROM/diupdate via OTA
 unsigned long lastPulseTime = 0; // Waktu terakhir pulsa terdeteksi
 unsigned long lastFlowCalculationTime = 0; // Waktu terakhir perhitungan flow
@@ -60,18 +112,10 @@ float currentFlowRateLPM = 0.0; // Laju aliran dalam Liter per Menit (LPM)
 unsigned long totalVolumeMilliLitres = 0; // Total volume air dalam mililiter (untuk disimpan ke DB)
 float totalMeterReadingM3 = 0.0; // Total pembacaan meter dalam m3 (akumulatif)
 
-// Pin Data - CORRECTED: Fixed invalid pins for Arduino Uno/Nano
-int flowPin = 2;        // Pin untuk sensor aliran (Interrupt pin) - Pin 2 supports interrupt
-int echoPin = 10;       // Pin echo untuk sensor ultrasonik
-int trigPin = 11;       // Pin trigger untuk sensor ultrasonik
-int teganganPin = A0;   // Pin analog untuk pembacaan tegangan
-int pinValveOpen = 14;  // Pin kontrol valve (untuk membuka) - A0 as digital
-int pinValveClose = 15; // Pin kontrol valve (untuk menutup) - A1 as digital
-int miringPin = 12;     // Pin untuk sensor kemiringan - CORRECTED: Pin 20 doesn't exist on Uno/Nano
-int buzzerPin = 13;     // Pin untuk buzzer - CORRECTED: Pin 17 doesn't exist on Uno/Nano
-
 // Default Value (sebagian besar akan diganti oleh data server)
 float jarakToleransi = 15.0;    // Toleransi jarak untuk sensor ultrasonik (cm) - Akan dimuat dari EEPROM/diupdate via OTA
+float lowVoltageThreshold = 5.0; // Di bawah ini dianggap tegangan rendah (V)
+float lowCreditThreshold = 3000.0; // Pulsa rendah (Rp), buzzer kedip
 float teganganVolt;             // Nilai tegangan yang dibaca
 float pemakaianSesi = 0;        // Total pemakaian air dalam sesi saat ini (Liter)
 int distance = 0;               // Jarak dari sensor ultrasonik
@@ -81,15 +125,218 @@ bool buzzerTerusan = false;     // Status buzzer menyala terus
 bool kirimHabis = false;        // Status pengiriman data saat pulsa habis
 bool cekPintuTertutup = true;   // Status pengecekan pintu (true = tertutup, false = terbuka)
 bool cekValveTutupOtomatis = false; // Flag untuk valve yang tertutup otomatis (misal karena pulsa habis)
+
+// Kontroler valve: satu-satunya pemilik pin valve. Pemanggil hanya mengatur
+// target (requestValve); motor digerakkan saat target berubah selama
+// valveTravelTime lalu dilepas (valve_mati). Permintaan tutup langsung
+// dieksekusi; permintaan buka baru dieksekusi setelah target tutup stabil
+// VALVE_OPEN_HOLDOFF sehingga badai perintah buka/tutup tidak menggerakkan
+// motor bolak-balik.
+// Posisi valve = LinkValve (link_schema.h), dilaporkan apa adanya ke NodeMCU.
+LinkValve valveState = LINK_VALVE_UNKNOWN;  // Posisi belum diketahui saat boot
+bool valveTargetOpen = false;
+unsigned long valveMoveStart = 0;
+unsigned long valveLastCloseRequest = 0;
+bool valveForceClosed = false;          // Ditutup oleh perintah valve_close server
+unsigned long valveTravelTime = 8000;          // Waktu tempuh penuh motor valve
+const unsigned long VALVE_REVERSE_GAP = 200;   // Rem motor sebelum berbalik arah
+const unsigned long VALVE_OPEN_HOLDOFF = 3000; // De-bounce sebelum membuka
 bool lowVoltageDetected = false; // Flag untuk deteksi tegangan rendah
 
+// Agregasi aliran per interval: setiap sampel checkWaterFlow() (1 detik)
+// dimasukkan ke satu record berukuran tetap. Saat interval selesai, record
+// dikirim ke NodeMCU bersama pembacaan meter ("agg") lalu direset. Snapshot
+// tanpa agregat tetap dikirim setiap report_interval_ms (lihat loop()), dan
+// selama jendela raw_report_s pada batas bawah interval; event
+// (pintu/pulsa/tegangan) tetap dikirim seketika.
+#define FLOW_HIST_BINS 5
+const float FLOW_HIST_EDGES[FLOW_HIST_BINS - 1] = {0.1, 2.0, 6.0, 12.0}; // LPM; bin 0 = tidak mengalir
+struct FlowAggregate {
+    unsigned long startMillis;
+    float volumeL;            // Volume dalam interval (Liter)
+    float minLpm;
+    float maxLpm;
+    float sumLpm;             // Untuk rata-rata
+    uint16_t samples;
+    uint16_t activeSamples;   // Sampel dengan aliran > 0
+    uint16_t histogram[FLOW_HIST_BINS];
+};
+FlowAggregate flowAggregate;
+unsigned long aggregateInterval = 60000;  // Interval agregat (default 1 menit, diatur agg_interval_s)
+unsigned long rawReportUntil = 0;         // Snapshot mentah aktif sampai millis() ini
+bool rawReportActive = false;
+
+// Deteksi anomali aliran (streaming, memori O(1), biaya tetap per sampel):
+// - episode aliran: dimulai oleh pulsa dan baru selesai setelah leakGapMs
+//   tanpa pulsa. Aliran pelan (< ~8 LPM pada K 7.5) menghasilkan sampel
+//   1 detik tanpa pulsa, jadi sampel nol saja tidak mengakhiri episode.
+// - kebocoran: episode berlangsung leakWindowMs dengan rata-rata aliran
+//   >= leakMinLpm (misal toilet bocor semalaman)
+// - aliran_berlebih: volume satu episode aliran melebihi burstVolumeL
+// - aliran_saat_tertutup: pulsa flow setelah valve selesai menutup
+//   (dicek setiap pass loop dari pulseCount, reaksi < 1 detik); valve
+//   ditandai fault
+// Setiap anomali dikirim sekali per episode sebagai event prioritas; jika
+// anomalyCloseValve aktif valve langsung ditutup dan tetap tertutup sampai
+// ada perintah valve_open atau anomaly_reset.
+unsigned long leakWindowMs = 3600000;   // 1 jam aliran tanpa henti
+float leakMinLpm = 0.1;                 // Rata-rata aliran minimum episode kebocoran
+unsigned long leakGapMs = 120000;       // Tanpa pulsa selama ini = episode selesai
+float burstVolumeL = 300.0;             // Volume maksimum wajar satu episode
+float closedFlowL = 0.5;                // Volume yang ditoleransi setelah valve tertutup
+bool anomalyCloseValve = false;         // Tutup valve lokal saat anomali
+bool continuousFlow = false;
+unsigned long continuousFlowStart = 0;
+unsigned long lastFlowPulseMillis = 0;  // Sampel terakhir yang berisi pulsa
+float episodeVolumeL = 0.0;
+bool leakAlarm = false;
+bool burstAlarm = false;
+bool closedFlowAlarm = false;
+bool anomalyValveLock = false;          // Valve ditahan tertutup karena anomali
+unsigned long closedPulseBase = 0;
+bool closedPulseBaseValid = false;
+
 // Variabel untuk pengiriman data meteran periodik ke NodeMCU
 unsigned long lastMeterDataSendTime = 0;
-const long meterDataSendInterval = 5000; // Kirim data meteran setiap 5 detik
+long meterDataSendInterval = 5000; // Kirim data meteran setiap 5 detik (default, diatur NodeMCU via report_interval_ms)
+const long meterDataSendIntervalMin = 2000;   // Batas bawah interval dari NodeMCU
+const long meterDataSendIntervalMax = 300000; // Batas atas interval dari NodeMCU (5 menit)
+
+// Ledger saldo lokal: setiap potongan pulsa di checkWaterFlow() dicatat per
+// nomor urut pembacaan (seq). Saldo dari server dihitung dari pembacaan
+// tertentu (ack_seq), jadi saldo lokal = saldo server - potongan yang belum
+// tercermin di pembacaan tersebut. Saldo tidak lagi loncat mundur/maju.
+struct CreditLedgerEntry {
+    uint16_t seq;     // Nomor urut pembacaan
+    float deducted;   // Potongan (Rp) yang sudah termasuk di pembacaan ini
+};
+#define CREDIT_LEDGER_SIZE 12
+CreditLedgerEntry creditLedger[CREDIT_LEDGER_SIZE];
+uint8_t creditLedgerHead = 0;      // Slot berikutnya yang akan ditulis
+uint8_t creditLedgerCount = 0;
+uint16_t readingSeq = 0;           // Seq pembacaan terakhir yang dikirim ke NodeMCU
+uint16_t lastAppliedSeq = 0;       // Seq terakhir yang saldonya sudah diterapkan
+bool hasAppliedSeq = false;
+float unreportedDeduction = 0.0;   // Potongan sejak pembacaan terakhir dikirim
+
+// Mode bus RS-485 (gateway multi-meter): jika busAddress != 0, Arduino tidak
+// mengirim apa pun tanpa diminta. Frame dari NodeMCU hanya diproses jika
+// "addr" sama dengan busAddress; poll {"addr":N,"poll":1} dijawab dengan satu
+// frame dari outbox (event/ACK) atau, jika kosong, pembacaan meter terbaru.
+// busAddress = 0 berarti point-to-point dengan NodeMCU sendiri (perilaku lama).
+// Outbox penuh: snapshot rutin digabung (yang baru menggantikan yang lama)
+// atau dibuang lebih dulu, lalu frame bulk. Event dan ACK tidak pernah
+// digusur; jika outbox seluruhnya event/ACK (gateway berhenti poll), frame
+// baru ditolak dan dicatat di trace (TRACE_BUS_DROP).
+#define BUS_MAX_ADDRESS 31
+#define BUS_OUTBOX_SIZE 4
+#define BUS_FRAME_ROUTINE 0   // Snapshot pembacaan
+#define BUS_FRAME_BULK 1      // Agregat interval, dump config/trace
+#define BUS_FRAME_PRIORITY 2  // Event keselamatan dan ACK perintah
+struct BusOutboxEntry {
+    String frame;
+    unsigned long capturedAt; // millis() saat data frame diambil
+    uint8_t kind;             // BUS_FRAME_*
+};
+uint8_t busAddress = 0;
+BusOutboxEntry busOutbox[BUS_OUTBOX_SIZE]; // Frame yang menunggu poll, urut dari yang paling lama
+uint8_t busOutboxCount = 0;
+bool busReplyPending = false;      // Frame berikutnya adalah jawaban poll
+
+// Kapasitas dokumen frame ke NodeMCU, dihitung dari jumlah slot sebenarnya:
+// kode pesan + field skema + ekor + age_ms (ditambahkan transmitToNodeMCU).
+// Dokumen di stack dan di-serialize langsung ke myArd, tanpa String perantara.
+#define READING_DOC_SIZE JSON_ARRAY_SIZE(1 + LinkReading::FIELD_COUNT + 1)
+#define AGGREGATE_DOC_SIZE (JSON_ARRAY_SIZE(1 + LinkReading::FIELD_COUNT + 2 + 1) \
+    + JSON_OBJECT_SIZE(7) + JSON_ARRAY_SIZE(FLOW_HIST_BINS) \
+    + JSON_OBJECT_SIZE(8) + JSON_ARRAY_SIZE(LOOP_HIST_BUCKETS) \
+    + 56) // Salinan kunci F() objek "agg" di pool dokumen
+#define ACK_DOC_SIZE JSON_ARRAY_SIZE(1 + LinkAckFrame::FIELD_COUNT + 1)
+#define CONFIG_DOC_SIZE (JSON_ARRAY_SIZE(1 + LinkAckFrame::FIELD_COUNT + 1 + 1) + JSON_ARRAY_SIZE(PARAM_COUNT))
+#define TRACE_DOC_SIZE JSON_ARRAY_SIZE(1 + LinkTrace::FIELD_COUNT + 1)
 
 // Variabel untuk buzzer non-blocking
 unsigned long previousBuzzerMillis = 0;
-const long buzzerInterval = 100; // Interval kedip buzzer
+unsigned long buzzerInterval = 100; // Interval kedip buzzer
+
+// Mode idle hemat daya: setelah idleEntryDelay tanpa aliran, tanpa serial dan
+// tanpa alarm, loop() hanya berjalan setiap idleTickInterval. Di antara tick
+// MCU tidur (SLEEP_MODE_IDLE) dan bangun oleh pulsa flow (INT0), RX serial
+// (PCINT SoftwareSerial) atau tick Timer0. Pulsa tetap dihitung oleh ISR.
+unsigned long idleEntryDelay = 30000;        // Masuk mode idle setelah 30 detik tanpa aktivitas
+const unsigned long idleTickInterval = 250;  // Batas waktu reaksi sensor/valve saat idle
+unsigned long lastActivityTime = 0;
+bool isIdleMode = false;
+
+// Registry parameter: satu tabel (PROGMEM) untuk semua tunable yang bisa
+// diatur lewat arduino_config_update. Setiap entri punya tipe, rentang dan
+// default; satu set config divalidasi seluruhnya sebelum diterapkan (semua
+// atau tidak sama sekali) lalu disimpan sebagai satu blob EEPROM:
+//   [magic][versi][jumlah][crc8][nilai 4 byte x jumlah]
+// Tabel hanya boleh ditambah di akhir: blob lama tetap terbaca dan entri
+// baru memakai default. Ubah PARAM_BLOB_VERSION jika urutan/arti berubah.
+// Urutan ini juga urutan array "config" pada jawaban get_config dan harus
+// sama dengan LINK_PARAM_KEYS (link_schema.h); dicek saat compile.
+#define PARAM_FLOAT 0
+#define PARAM_ULONG 1
+#define PARAM_BOOL  2
+#define PARAM_BLOB_MAGIC 0x50
+#define PARAM_BLOB_VERSION LINK_PARAM_VERSION
+#define PARAM_BLOB_HEADER 4
+struct ParamDef {
+    char key[20];       // Kunci di config_data
+    uint8_t type;
+    void* value;        // Variabel global yang diatur
+    float minValue;     // Rentang dan default dalam satuan config
+    float maxValue;
+    float defaultValue;
+    uint16_t scale;     // Nilai variabel = nilai config x scale (misal detik -> ms)
+};
+constexpr ParamDef PARAMS[] PROGMEM = {
+    {"k_factor",            PARAM_FLOAT, &K_FACTOR,                0.1,   1000.0,   7.5,     1},
+    {"distance_tolerance",  PARAM_FLOAT, &jarakToleransi,          0.0,   400.0,    15.0,    1},
+    {"flow_interval_ms",    PARAM_ULONG, &flowCalculationInterval, 250,   10000,    1000,    1},
+    {"low_voltage_v",       PARAM_FLOAT, &lowVoltageThreshold,     0.0,   30.0,     5.0,     1},
+    {"low_credit_rp",       PARAM_FLOAT, &lowCreditThreshold,      0.0,   1000000,  3000.0,  1},
+    {"buzzer_interval_ms",  PARAM_ULONG, &buzzerInterval,          50,    2000,     100,     1},
+    {"idle_entry_ms",       PARAM_ULONG, &idleEntryDelay,          5000,  3600000,  30000,   1},
+    {"agg_interval_s",      PARAM_ULONG, &aggregateInterval,       60,    3600,     60,      1000},
+    {"leak_window_s",       PARAM_ULONG, &leakWindowMs,            60,    86400,    3600,    1000},
+    {"leak_min_lpm",        PARAM_FLOAT, &leakMinLpm,              0.01,  100.0,    0.1,     1},
+    {"burst_volume_l",      PARAM_FLOAT, &burstVolumeL,            1.0,   100000,   300.0,   1},
+    {"closed_flow_l",       PARAM_FLOAT, &closedFlowL,             0.05,  1000.0,   0.5,     1},
+    {"anomaly_close_valve", PARAM_BOOL,  &anomalyCloseValve,       0,     1,        0,       1},
+    {"valve_travel_ms",     PARAM_ULONG, &valveTravelTime,         1000,  60000,    8000,    1},
+    {"leak_gap_s",          PARAM_ULONG, &leakGapMs,               5,     3600,     120,     1000},
+};
+#define PARAM_COUNT (sizeof(PARAMS) / sizeof(PARAMS[0]))
+static_assert(PARAM_COUNT <= 16, "presentMask di applyConfigSet() hanya 16 bit");
+static_assert(linkParamKeysMatch(PARAMS), "Kunci PARAMS tidak sama dengan LINK_PARAM_KEYS di link_schema.h");
+int pendingConfigDumpId = -1;    // command_id get_config yang menunggu dijawab
+
+// Flight recorder (lihat trace_events.h). Ring kecil karena RAM AVR; event
+// hanya dicatat dari konteks loop (bukan ISR). Dump dikirim per bagian
+// TRACE_PART_RECORDS record agar frame serial tetap pendek.
+#define TRACE_RING_SIZE 16          // Harus pangkat dua
+#define TRACE_PART_RECORDS 8
+#define TRACE_OVERRUN_MS 250        // Satu pass loop lebih lama = overrun
+TraceRecord traceRing[TRACE_RING_SIZE];
+uint8_t traceHead = 0;
+uint16_t traceTotal = 0;            // Jumlah event sejak boot (boleh wrap)
+int pendingTraceDumpId = -1;        // command_id dump_trace yang menunggu dikirim
+
+// Statistik latensi loop (lihat loop_stats.h). Ringkasan jendela ikut frame
+// agregat interval. Pass lebih lama dari deadline membuat kedip buzzer
+// (buzzerInterval) dan respons pintu/valve tidak lagi tepat waktu.
+#define LOOP_DEADLINE_MS 100
+enum LoopTag {
+    LOOP_SERIAL, LOOP_FLOW, LOOP_DOOR, LOOP_VOLTAGE, LOOP_TILT,
+    LOOP_VALVE, LOOP_LCD, LOOP_BUZZER, LOOP_REPORT, LOOP_IDLE
+};
+const char* const LOOP_TAG_NAMES[] = {
+    "serial", "flow", "door", "voltage", "tilt", "valve", "lcd", "buzzer", "report", "idle"
+};
+LoopStats loopStats;
 
 // Fungsi interrupt untuk menghitung jumlah pulsa dari sensor aliran
 void pulseCounter() { // CORRECTED: Removed IRAM_ATTR (ESP8266 specific)
@@ -119,45 +366,38 @@ void setup() {
     Serial.begin(9600);    // Inisialisasi komunikasi serial utama (untuk debugging)
     myArd.begin(9600);     // Inisialisasi komunikasi serial dengan NodeMCU
     delay(2000);           // Delay untuk stabilisasi
+    trace(TRACE_BOOT, 0, 0);
 
     // CORRECTED: Arduino EEPROM doesn't need begin() call
     // EEPROM.begin(512); // Removed - Arduino specific
 
-    // Muat K_FACTOR dari EEPROM
-    float loadedKFactor = readFloatFromEEPROM(EEPROM_K_FACTOR_ADDR);
-    if (isnan(loadedKFactor) || loadedKFactor == 0.0) { // Cek jika nilai tidak valid atau nol
-        K_FACTOR = 7.5; // Gunakan nilai default
-        writeFloatToEEPROM(EEPROM_K_FACTOR_ADDR, K_FACTOR); // Simpan default ke EEPROM
-        Serial.println("K_FACTOR default (7.5) dimuat dan disimpan ke EEPROM.");
-    } else {
-        K_FACTOR = loadedKFactor;
-        Serial.print("K_FACTOR dimuat dari EEPROM: "); Serial.println(K_FACTOR, 2);
-    }
+    // Muat semua parameter (K_FACTOR, jarakToleransi, ambang, interval)
+    loadParams();
+    Serial.print("K_FACTOR: "); Serial.println(K_FACTOR, 2);
+    Serial.print("Jarak Toleransi: "); Serial.println(jarakToleransi, 2);
 
-    // Muat jarakToleransi dari EEPROM
-    float loadedJarakToleransi = readFloatFromEEPROM(EEPROM_JARAK_TOLERANSI_ADDR);
-    if (isnan(loadedJarakToleransi) || loadedJarakToleransi == 0.0) { // Cek jika nilai tidak valid atau nol
-        jarakToleransi = 15.0; // Gunakan nilai default
-        writeFloatToEEPROM(EEPROM_JARAK_TOLERANSI_ADDR, jarakToleransi); // Simpan default ke EEPROM
-        Serial.println("Jarak Toleransi default (15.0) dimuat dan disimpan ke EEPROM.");
-    } else {
-        jarakToleransi = loadedJarakToleransi;
-        Serial.print("Jarak Toleransi dimuat dari EEPROM: "); Serial.println(jarakToleransi, 2);
+    // Muat alamat bus RS-485 dari EEPROM (0xFF = EEPROM kosong)
+    busAddress = EEPROM.read(EEPROM_BUS_ADDRESS_ADDR);
+    if (busAddress > BUS_MAX_ADDRESS) {
+        busAddress = 0;
     }
+    Serial.print("Alamat bus: "); Serial.println(busAddress);
 
     // CORRECTED: Pin configuration for Arduino Uno/Nano
-    pinMode(flowPin, INPUT_PULLUP);    // Mengatur pin sensor aliran sebagai input dengan pull-up
-    attachInterrupt(digitalPinToInterrupt(flowPin), pulseCounter, FALLING); // Mengatur interrupt pada pin sensor aliran
-
-    pinMode(trigPin, OUTPUT);
-    pinMode(echoPin, INPUT);
-    pinMode(pinValveOpen, OUTPUT);
-    pinMode(pinValveClose, OUTPUT);
-    pinMode(miringPin, INPUT_PULLUP); // Added pull-up for stability
-    pinMode(buzzerPin, OUTPUT);
-    digitalWrite(buzzerPin, LOW); // Pastikan buzzer mati di awal
-
-    // Pastikan valve mati di awal
+    FlowPin::inputPullup();    // Mengatur pin sensor aliran sebagai input dengan pull-up
+    attachInterrupt(FlowPin::EXT_INT, pulseCounter, FALLING); // Mengatur interrupt pada pin sensor aliran
+
+    TrigPin::output();
+    EchoPin::input();
+    ValveOpenPin::output();
+    ValveClosePin::output();
+    MiringPin::inputPullup(); // Added pull-up for stability
+    BuzzerPin::output();
+    BuzzerPin::low(); // Pastikan buzzer mati di awal
+    Rs485DePin::output();
+    Rs485DePin::low(); // Transceiver RS-485 mode terima
+
+    // Pastikan valve mati di awal; loop() menentukan target pertama
     valve_mati();
 
     // Inisialisasi LCD
@@ -179,6 +419,8 @@ void setup() {
 
     lastFlowCalculationTime = millis();
     lastMeterDataSendTime = millis(); // Inisialisasi waktu pengiriman data meteran
+    resetFlowAggregate(millis());
+    lastActivityTime = millis();
 
     Serial.println("Arduino Corrected Version Initialized");
     Serial.println("Pin Configuration:");
@@ -186,27 +428,51 @@ void setup() {
     Serial.println("- NodeMCU Serial: Pins 19,18 (A5,A4 as digital)");
     Serial.println("- Ultrasonic: Pins 10,11 (Echo,Trig)");
     Serial.println("- Valve Control: Pins 14,15 (A0,A1 as digital)");
+    Serial.println("- Voltage: Pin A2");
+    Serial.println("- RS-485 DE: Pin 8");
     Serial.println("- Tilt Sensor: Pin 12");
     Serial.println("- Buzzer: Pin 13");
 }
 
 void loop() {
+    // --- Mode Idle: tidur sampai tick berikutnya, pulsa flow atau serial ---
+    if (isIdleMode) {
+        idleSleep();
+    }
+
     unsigned long currentMillis = millis();
+    loopPassBegin(loopStats, LOOP_SERIAL, currentMillis);
 
     // --- Pembacaan Serial dari NodeMCU ---
     if (myArd.available()) {
+        markActivity(); // Trafik serial membatalkan mode idle
         String msgFromNodeMCU = myArd.readStringUntil('\n');
         msgFromNodeMCU.trim();
+        trace(TRACE_SERIAL_RX, 0, msgFromNodeMCU.length());
         Serial.print("Rx NodeMCU: ");
         Serial.println(msgFromNodeMCU);
         
         handleNodeMCU_JSON(msgFromNodeMCU);
+
+        // Dump get_config dikirim setelah dokumen perintah dibebaskan (RAM)
+        if (pendingConfigDumpId >= 0) {
+            sendConfigToNodeMCU(pendingConfigDumpId);
+            pendingConfigDumpId = -1;
+        }
+        if (pendingTraceDumpId >= 0) {
+            sendTraceToNodeMCU(pendingTraceDumpId);
+            pendingTraceDumpId = -1;
+        }
     }
 
     // --- Pemantauan Sensor & Logika Kontrol ---
+    loopSection(loopStats, LOOP_FLOW, millis());
     checkWaterFlow(); // Ini juga mengurangi saldo dan mengupdate totalMeterReadingM3
+    loopSection(loopStats, LOOP_DOOR, millis());
     checkDoorStatus(); // Fungsi ini juga mengontrol valve berdasarkan isUnlocked
+    loopSection(loopStats, LOOP_VOLTAGE, millis());
     checkVoltage(); // Fungsi ini juga mengontrol valve
+    loopSection(loopStats, LOOP_TILT, millis());
     checkTiltSensor(); // Asumsi sensor miring diaktifkan (saat ini hanya buzzer)
 
     // --- Logika Kontrol Valve Utama (Prioritas Otomatis) ---
@@ -216,35 +482,41 @@ void loop() {
     // 3. Pintu tertutup
     // 4. Tegangan normal (tidak rendah)
     // 5. Tidak ada perintah penutupan otomatis yang aktif
+    // 6. Tidak ada anomali aliran yang mengunci valve
+    // 7. Tidak ditutup oleh perintah valve_close server
+    // Kontroler hanya menggerakkan motor jika target berubah.
     
-    if (!isUnlocked && dataPUL > 0 && cekPintuTertutup && !lowVoltageDetected && !cekValveTutupOtomatis) {
-        valve_buka(); // Tetap buka jika semua kondisi terpenuhi
-    } else {
-        valve_tutup(); // Tutup valve jika salah satu kondisi tidak terpenuhi
-    }
+    loopSection(loopStats, LOOP_VALVE, millis());
+    bool valveShouldOpen = !isUnlocked && dataPUL > 0 && cekPintuTertutup && !lowVoltageDetected && !cekValveTutupOtomatis && !anomalyValveLock && !valveForceClosed;
+    requestValve(valveShouldOpen, currentMillis);
+    updateValve(currentMillis);
+    checkClosedValveFlow(currentMillis);
 
     // --- Tampilan LCD ---
+    loopSection(loopStats, LOOP_LCD, millis());
     tampilLCD(String(dataPUL, 2), idMeter); // Tampilkan saldo dengan 2 desimal
 
     // --- Logika Buzzer (Prioritas) ---
     // Prioritas: Pintu Terbuka > Perangkat Miring > Tegangan Rendah > Pulsa Rendah
+    loopSection(loopStats, LOOP_BUZZER, millis());
     if (distance > jarakToleransi && !isUnlocked) { // Pintu terbuka dan tidak di-unlock
         buzzerTerus();
-    } else if (digitalRead(miringPin) == LOW) { // Perangkat miring
+    } else if (!MiringPin::read()) { // Perangkat miring
         buzzerTerus();
     } else if (lowVoltageDetected) { // Tegangan rendah
         buzzerKedip();
-    } else if (dataPUL < 3000.0 && dataPUL > 0.0) { // Pulsa rendah (Rp 3000 ke bawah)
+    } else if (dataPUL < lowCreditThreshold && dataPUL > 0.0) { // Pulsa rendah (default Rp 3000 ke bawah)
         buzzerKedip();
     } else {
         buzzerMati(); // Matikan buzzer jika tidak ada kondisi peringatan
     }
 
     // --- Peringatan Pulsa Habis ---
+    loopSection(loopStats, LOOP_REPORT, millis());
     if (dataPUL <= 0.0) {
         if (!kirimHabis) {
             // Kirim data pemakaian terakhir saat pulsa habis
-            sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, teganganVolt, distance > jarakToleransi, "pulsa_habis");
+            sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, teganganVolt, distance > jarakToleransi, LINK_STATUS_PULSA_HABIS);
             kirimHabis = true;
         }
         // Atur flag valve tertutup otomatis
@@ -254,11 +526,35 @@ void loop() {
         cekValveTutupOtomatis = false; // Reset flag jika pulsa sudah diisi kembali
     }
 
-    // --- Kirim Data Meteran ke NodeMCU secara Periodik ---
-    if (currentMillis - lastMeterDataSendTime >= meterDataSendInterval) {
+    // --- Kirim Snapshot ke NodeMCU ---
+    // Setiap snapshot adalah satu round-trip saldo/unlock/ack_seq ke server,
+    // jadi iramanya mengikuti report_interval_ms dari NodeMCU (interval
+    // adaptif), bukan interval agregat. Snapshot tidak membawa agregat;
+    // agregat dikirim checkWaterFlow() saat interval ditutup. raw_report_s
+    // mempercepat snapshot ke batas bawah interval selama jendela diminta.
+    // (mode bus: pembacaan dikirim sebagai jawaban poll gateway)
+    if (rawReportActive && (long)(currentMillis - rawReportUntil) >= 0) {
+        rawReportActive = false;
+        Serial.println("Snapshot mentah selesai, kembali ke interval laporan");
+    }
+    unsigned long reportInterval = rawReportActive ? meterDataSendIntervalMin : meterDataSendInterval;
+    if (busAddress == 0 && currentMillis - lastMeterDataSendTime >= reportInterval) {
         lastMeterDataSendTime = currentMillis;
         // Kirim data meteran saat ini ke NodeMCU
-        sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, teganganVolt, distance > jarakToleransi, "normal");
+        sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, teganganVolt, distance > jarakToleransi, LINK_STATUS_NORMAL);
+    }
+
+    // --- Evaluasi Mode Idle ---
+    loopSection(loopStats, LOOP_IDLE, millis());
+    updateIdleState(currentMillis);
+
+    // Pass loop yang lama (pulseIn tanpa echo, LCD, serial) dicatat di
+    // statistik loop dan trace
+    unsigned long passEnd = millis();
+    loopPassEnd(loopStats, currentMillis, passEnd, LOOP_DEADLINE_MS);
+    unsigned long passMs = passEnd - currentMillis;
+    if (passMs > TRACE_OVERRUN_MS) {
+        trace(TRACE_OVERRUN, 0, min(passMs, 65535UL));
     }
 }
 
@@ -278,128 +574,776 @@ void handleNodeMCU_JSON(String jsonString) {
     if (error) {
         Serial.print(F("Deserialisasi JSON gagal dari NodeMCU: "));
         Serial.println(error.c_str());
+        trace(TRACE_SERIAL_ERROR, 0, jsonString.length());
+        return;
+    }
+
+    // Frame array link_schema.h: [jenis, addr, field...]
+    JsonArrayConst frame = doc.as<JsonArrayConst>();
+
+    // --- Mode bus: abaikan frame untuk meter lain ---
+    if (busAddress != 0 && linkAddress(frame) != busAddress) {
         return;
     }
 
-    // --- Penanganan Perintah dari NodeMCU (Kontrol Katup atau Update Info) ---
-    if (doc.containsKey("command_type") && doc.containsKey("command_id")) {
-        String command_type = doc["command_type"].as<String>();
-        int command_id = doc["command_id"].as<int>();
-        String current_valve_status_from_node = doc["current_valve_status"].as<String>(); // Status katup yang dilaporkan NodeMCU
-
-        Serial.print("NodeMCU Command: "); Serial.println(command_type);
-        Serial.print("Command ID: "); Serial.println(command_id);
-        Serial.print("Current Valve Status (NodeMCU): "); Serial.println(current_valve_status_from_node);
-
-        String ack_status = "failed"; // Default status
-        String ack_notes = "Perintah tidak dikenali atau tidak dieksekusi.";
-        String reported_valve_status = current_valve_status_from_node; // Default, akan diupdate jika berhasil
-
-        if (command_type == "valve_open") {
-            if (dataPUL > 0 && cekPintuTertutup && !lowVoltageDetected) { // Hanya buka jika kondisi aman
-                valve_buka_by_command(); // Fungsi baru untuk eksekusi perintah
-                ack_status = "acknowledged";
-                ack_notes = "Katup berhasil dibuka oleh perintah.";
-                reported_valve_status = "open";
-            } else {
-                ack_status = "failed";
-                ack_notes = "Gagal membuka katup: Kondisi tidak terpenuhi (pulsa habis/pintu terbuka/tegangan rendah).";
-                // Tetap laporkan status katup saat ini
-                reported_valve_status = (digitalRead(pinValveOpen) == HIGH && digitalRead(pinValveClose) == LOW) ? "open" : "closed";
+    switch (linkMessageType(frame)) {
+        case LINK_MSG_POLL:
+            if (busAddress != 0) {
+                answerBusPoll();
             }
-        } else if (command_type == "valve_close") {
-            valve_tutup_by_command(); // Fungsi baru untuk eksekusi perintah
-            ack_status = "acknowledged";
-            ack_notes = "Katup berhasil ditutup oleh perintah.";
-            reported_valve_status = "closed";
-        } else if (command_type == "arduino_config_update" && doc.containsKey("config_data")) {
-            // Menerima update konfigurasi untuk Arduino
-            JsonObject configData = doc["config_data"];
-            if (configData.containsKey("k_factor")) {
-                float newKFactor = configData["k_factor"].as<float>();
-                if (!isnan(newKFactor) && newKFactor > 0) {
-                    K_FACTOR = newKFactor;
-                    writeFloatToEEPROM(EEPROM_K_FACTOR_ADDR, K_FACTOR);
-                    Serial.print("K_FACTOR diperbarui ke: "); Serial.println(K_FACTOR, 2);
-                    ack_notes += "K_FACTOR diperbarui. ";
-                } else {
-                    ack_notes += "K_FACTOR tidak valid. ";
-                }
+            return;
+        case LINK_MSG_COMMAND: {
+            LinkCommand command;
+            if (linkDecode(frame, command)) {
+                handleNodeMCUCommand(command);
+                return;
             }
-            if (configData.containsKey("distance_tolerance")) { // Changed from jarak_toleransi to match API
-                float newJarakToleransi = configData["distance_tolerance"].as<float>();
-                if (!isnan(newJarakToleransi) && newJarakToleransi >= 0) {
-                    jarakToleransi = newJarakToleransi;
-                    writeFloatToEEPROM(EEPROM_JARAK_TOLERANSI_ADDR, jarakToleransi);
-                    Serial.print("Jarak Toleransi diperbarui ke: "); Serial.println(jarakToleransi, 2);
-                    ack_notes += "Jarak Toleransi diperbarui. ";
-                } else {
-                    ack_notes += "Jarak Toleransi tidak valid. ";
-                }
+            break;
+        }
+        case LINK_MSG_UPDATE: {
+            LinkUpdate update;
+            if (linkDecode(frame, update)) {
+                applyNodeMCUUpdate(update);
+                return;
             }
-            ack_status = "acknowledged";
-            ack_notes = "Konfigurasi diperbarui: " + ack_notes;
+            break;
+        }
+    }
+    Serial.println(F("Frame NodeMCU tidak sesuai skema link, diabaikan."));
+    trace(TRACE_SERIAL_ERROR, 0, jsonString.length());
+}
+
+// --- Penanganan Perintah dari NodeMCU (Kontrol Katup atau Update Info) ---
+void handleNodeMCUCommand(const LinkCommand& command) {
+    trace(TRACE_COMMAND, command.code, command.commandId);
+    Serial.print("NodeMCU Command: "); Serial.println(linkName(command.code));
+    Serial.print("Command ID: "); Serial.println(command.commandId);
+    Serial.print("Current Valve Status (NodeMCU): "); Serial.println(linkName(command.valve)); // Status katup yang dilaporkan NodeMCU
+
+    LinkAck ack_status = LINK_ACK_FAILED; // Default status
+    String ack_notes = "Perintah tidak dikenali atau tidak dieksekusi.";
+    LinkValve reported_valve_status = command.valve; // Default, akan diupdate jika berhasil
+
+    if (command.code == TRACE_CMD_VALVE_OPEN) {
+        anomalyValveLock = false; // Perintah eksplisit membuka kunci anomali
+        valveForceClosed = false;
+        if (dataPUL > 0 && cekPintuTertutup && !lowVoltageDetected && !isUnlocked) { // Hanya buka jika kondisi aman
+            requestValve(true, millis());
+            updateValve(millis());
+            Serial.println("Valve dibuka oleh perintah server");
+            ack_status = LINK_ACK_ACKNOWLEDGED;
+            ack_notes = "Perintah buka katup diterima.";
+        } else {
+            ack_status = LINK_ACK_FAILED;
+            ack_notes = "Gagal membuka katup: Kondisi tidak terpenuhi (pulsa habis/pintu terbuka/tegangan rendah).";
+        }
+        reported_valve_status = valveState; // Posisi sebenarnya (bisa "opening")
+    } else if (command.code == TRACE_CMD_VALVE_CLOSE) {
+        valveForceClosed = true;
+        requestValve(false, millis());
+        updateValve(millis());
+        Serial.println("Valve ditutup oleh perintah server");
+        ack_status = LINK_ACK_ACKNOWLEDGED;
+        ack_notes = "Perintah tutup katup diterima.";
+        reported_valve_status = valveState;
+    } else if (command.code == TRACE_CMD_CONFIG_UPDATE && command.config.is<JsonObjectConst>()) {
+        // Menerima update konfigurasi untuk Arduino. Parameter registry
+        // divalidasi sebagai satu set; jika ada yang tidak valid tidak ada
+        // yang diubah (termasuk aksi di bawah).
+        JsonObjectConst configData = command.config.as<JsonObjectConst>();
+        int newBusAddress = configData["bus_address"] | 0;
+        ack_notes = "";
+        if (newBusAddress < 0 || newBusAddress > BUS_MAX_ADDRESS) {
+            ack_notes = "Parameter tidak valid: bus_address";
         }
-        // Tambahkan penanganan perintah lain jika ada (misal: "reset_flow")
+        if (ack_notes.length() > 0 || !applyConfigSet(configData, ack_notes)) {
+            ack_status = LINK_ACK_FAILED;
+            ack_notes = "Konfigurasi ditolak, tidak ada yang diubah. " + ack_notes;
+            sendACKToNodeMCU(command.commandId, ack_status, ack_notes, reported_valve_status);
+            return;
+        }
+        if (configData.containsKey("raw_report_s")) {
+            // Snapshot pada batas bawah interval selama N detik (0 = hentikan)
+            unsigned long rawSeconds = min(configData["raw_report_s"].as<unsigned long>(), 3600UL);
+            rawReportUntil = millis() + rawSeconds * 1000UL;
+            rawReportActive = rawSeconds > 0;
+            ack_notes += "Snapshot mentah diatur. ";
+        }
+        if (configData["anomaly_reset"] | false) {
+            anomalyValveLock = false;
+            ack_notes += "Kunci anomali dilepas. ";
+        }
+        if (configData.containsKey("bus_address")) {
+            // Berlaku setelah restart agar ACK ini masih sampai lewat alamat lama
+            EEPROM.write(EEPROM_BUS_ADDRESS_ADDR, newBusAddress);
+            Serial.print("Alamat bus disimpan: "); Serial.println(newBusAddress);
+            ack_notes += "Alamat bus disimpan (aktif setelah restart). ";
+        }
+        ack_status = LINK_ACK_ACKNOWLEDGED;
+        ack_notes = "Konfigurasi diperbarui: " + ack_notes;
+    } else if (command.code == TRACE_CMD_GET_CONFIG) {
+        // ACK berisi nilai dikirim dari loop() setelah dokumen ini dibebaskan
+        pendingConfigDumpId = command.commandId;
+        return;
+    } else if (command.code == TRACE_CMD_DUMP_TRACE) {
+        // Di-ACK oleh NodeMCU; Arduino hanya mengirim frame trace
+        pendingTraceDumpId = command.commandId;
+        return;
+    }
+    // Tambahkan penanganan perintah lain jika ada (misal: "reset_flow")
 
-        // Kirim status eksekusi kembali ke NodeMCU
-        sendACKToNodeMCU(command_id, ack_status, ack_notes, reported_valve_status);
+    // Kirim status eksekusi kembali ke NodeMCU
+    sendACKToNodeMCU(command.commandId, ack_status, ack_notes, reported_valve_status);
+}
 
+// Ini adalah data pulsa/tarif/id_meter/is_unlocked dari NodeMCU
+void applyNodeMCUUpdate(const LinkUpdate& update) {
+    // Interval kirim data meteran yang diatur oleh NodeMCU (adaptif; 0 = tetap)
+    if (update.reportIntervalMs > 0) {
+        meterDataSendInterval = constrain((long)update.reportIntervalMs, meterDataSendIntervalMin, meterDataSendIntervalMax);
+    }
+
+    idMeter = update.idMeter;
+    if (update.ackSeq >= 0) {
+        applyServerBalance(update.credit, update.ackSeq); // Saldo pulsa (Rupiah) menurut server
+    } else {
+        dataPUL = update.credit; // Tanpa seq (belum ada pembacaan yang di-ACK): timpa langsung
+    }
+    tariffPerM3 = update.tariff; // Tarif per m3 (Rupiah)
+    isUnlocked = update.unlocked; // Status unlock dari server
+
+    Serial.print("ID: "); Serial.println(idMeter);
+    Serial.print("Pulsa: "); Serial.println(dataPUL);
+    Serial.print("Tarif/m3: "); Serial.println(tariffPerM3);
+    Serial.print("Unlocked: "); Serial.println(isUnlocked ? "TRUE" : "FALSE");
+
+    // Perbarui logika kontrol valve berdasarkan isUnlocked dari server
+    if (isUnlocked) {
+        Serial.println("[PERANGKAT DI-UNLOCK OLEH SERVER]");
+        // Jika di-unlock, valve harus mati/terbuka (sesuai kebutuhan teknisi)
+        // Untuk tujuan teknisi, valve tidak boleh menutup otomatis
     } else {
-        // Ini adalah data pulsa/tarif/id_meter/is_unlocked dari NodeMCU
-        idMeter = doc["id_meter"].as<String>();
-        dataPUL = doc["data_pulsa"].as<float>(); // Saldo pulsa (Rupiah)
-        tariffPerM3 = doc["tarif_per_m3"].as<float>(); // Tarif per m3 (Rupiah)
-        isUnlocked = doc["is_unlocked"].as<bool>(); // Status unlock dari server
-
-        Serial.print("ID: "); Serial.println(idMeter);
-        Serial.print("Pulsa: "); Serial.println(dataPUL);
-        Serial.print("Tarif/m3: "); Serial.println(tariffPerM3);
-        Serial.print("Unlocked: "); Serial.println(isUnlocked ? "TRUE" : "FALSE");
-
-        // Perbarui logika kontrol valve berdasarkan isUnlocked dari server
-        if (isUnlocked) {
-            Serial.println("[PERANGKAT DI-UNLOCK OLEH SERVER]");
-            // Jika di-unlock, valve harus mati/terbuka (sesuai kebutuhan teknisi)
-            // Untuk tujuan teknisi, valve tidak boleh menutup otomatis
+        Serial.println("[PERANGKAT DALAM MODE NORMAL]");
+    }
+}
+
+// Fungsi untuk mengirim data meteran ke NodeMCU (frame LINK_MSG_READING)
+void sendMeterDataToNodeMCU(float flowRate, float meterReading, float voltage, bool doorOpen, LinkStatus status) {
+    StaticJsonDocument<READING_DOC_SIZE> doc;
+    LinkReading reading = {};
+    fillMeterData(reading, flowRate, meterReading, voltage, doorOpen, status);
+    JsonArray frame = doc.to<JsonArray>();
+    linkEncode(frame, reading);
+
+    transmitToNodeMCU(frame, millis(), status == LINK_STATUS_NORMAL ? BUS_FRAME_ROUTINE : BUS_FRAME_PRIORITY); // Kirim frame ke NodeMCU
+    Serial.print(F("Tx NodeMCU (Meter Data): "));
+    serializeJson(frame, Serial);
+    Serial.println();
+}
+
+// Pembacaan meter + agregat interval yang baru ditutup + statistik loop
+// (ekor "agg" dan "loop" frame pembacaan, diteruskan NodeMCU apa adanya).
+// Nilai desimal ditulis dtostrf() ke buffer stack; serialized(const char*)
+// hanya menyimpan pointer, jadi buffer harus hidup sampai frame terkirim.
+void sendAggregateToNodeMCU(unsigned long currentMillis) {
+    StaticJsonDocument<AGGREGATE_DOC_SIZE> doc;
+    LinkReading reading = {};
+    fillMeterData(reading, currentFlowRateLPM, totalMeterReadingM3, teganganVolt, distance > jarakToleransi, LINK_STATUS_NORMAL);
+    JsonArray frame = doc.to<JsonArray>();
+    linkEncode(frame, reading);
+
+    char volume[12], flowMin[8], flowAvg[8], flowMax[8];
+    dtostrf(flowAggregate.volumeL, 1, 3, volume);
+    dtostrf(flowAggregate.samples > 0 ? flowAggregate.minLpm : 0.0, 1, 2, flowMin);
+    dtostrf(flowAggregate.samples > 0 ? flowAggregate.sumLpm / flowAggregate.samples : 0.0, 1, 2, flowAvg);
+    dtostrf(flowAggregate.maxLpm, 1, 2, flowMax);
+
+    JsonObject agg = frame.createNestedObject();
+    agg[F("period_s")] = (currentMillis - flowAggregate.startMillis + 500) / 1000;
+    agg[F("vol_l")] = serialized((const char*)volume);
+    agg[F("flow_min")] = serialized((const char*)flowMin);
+    agg[F("flow_avg")] = serialized((const char*)flowAvg);
+    agg[F("flow_max")] = serialized((const char*)flowMax);
+    agg[F("active_s")] = (unsigned long)flowAggregate.activeSamples * flowCalculationInterval / 1000;
+    JsonArray hist = agg.createNestedArray(F("hist")); // Jumlah sampel per pita aliran
+    for (uint8_t i = 0; i < FLOW_HIST_BINS; i++) {
+        hist.add(flowAggregate.histogram[i]);
+    }
+    fillLoopStats(frame.createNestedObject(), loopStats, LOOP_TAG_NAMES[loopStats.maxSectionTag], LOOP_DEADLINE_MS, currentMillis);
+    loopStatsReset(loopStats, currentMillis);
+
+    transmitToNodeMCU(frame, millis(), BUS_FRAME_BULK);
+    Serial.print(F("Tx NodeMCU (Agregat): "));
+    serializeJson(frame, Serial);
+    Serial.println();
+}
+
+// Isi field pembacaan standar + seq ledger (dipakai snapshot, event dan agregat)
+void fillMeterData(LinkReading& reading, float flowRate, float meterReading, float voltage, bool doorOpen, LinkStatus status) {
+    reading.address = busAddress;
+    reading.flowRate = flowRate;         // Dikirim dengan 2 desimal
+    reading.meterReading = meterReading; // Dikirim dengan 3 desimal
+    reading.voltage = voltage;
+    reading.doorOpen = doorOpen ? 1 : 0; // Status pintu: 0 (closed) atau 1 (open)
+    reading.status = status;
+    reading.valve = valveState;
+
+    // Tutup akumulasi potongan untuk pembacaan ini di ledger
+    readingSeq++;
+    recordLedgerEntry(readingSeq, unreportedDeduction);
+    unreportedDeduction = 0.0;
+    reading.seq = readingSeq;
+}
+
+// Bangunkan NodeMCU dari light sleep sebelum mengirim frame. Byte ini bisa
+// rusak saat NodeMCU bangun dan akan terbaca sebagai baris kosong/diabaikan.
+void wakeNodeMCU() {
+    myArd.write('\n');
+    delay(5); // Waktu bangun NodeMCU dari light sleep (~3 ms)
+}
+
+// Jawaban get_config: ACK dengan ekor "config" berisi nilai setiap entri
+// PARAMS (satuan config) sesuai urutan tabel. Array tanpa kunci agar frame
+// tetap kecil; NodeMCU memetakan ke LINK_PARAM_KEYS sebelum diteruskan ke server.
+void sendConfigToNodeMCU(int commandId) {
+    StaticJsonDocument<CONFIG_DOC_SIZE> doc;
+    LinkAckFrame ack = {};
+    ack.address = busAddress;
+    ack.commandId = commandId;
+    ack.status = LINK_ACK_ACKNOWLEDGED;
+    ack.notes = "Konfigurasi saat ini";
+    ack.valve = valveState;
+    ack.configVersion = PARAM_BLOB_VERSION;
+    JsonArray frame = doc.to<JsonArray>();
+    linkEncode(frame, ack);
+
+    JsonArray config = frame.createNestedArray();
+    for (uint8_t i = 0; i < PARAM_COUNT; i++) {
+        ParamDef def;
+        readParamDef(i, def);
+        if (def.type == PARAM_BOOL) {
+            config.add(*(bool*)def.value);
+        } else if (def.type == PARAM_ULONG) {
+            config.add(*(unsigned long*)def.value / def.scale);
         } else {
-            Serial.println("[PERANGKAT DALAM MODE NORMAL]");
+            config.add(*(float*)def.value);
         }
     }
+
+    transmitToNodeMCU(frame, millis(), BUS_FRAME_BULK);
+    Serial.print(F("Tx NodeMCU (Config): "));
+    serializeJson(frame, Serial);
+    Serial.println();
 }
 
-// Fungsi untuk mengirim data meteran ke NodeMCU dalam format JSON
-void sendMeterDataToNodeMCU(float flowRate, float meterReading, float voltage, bool doorOpen, String statusMessage) {
-    DynamicJsonDocument doc(256); // Sesuaikan ukuran buffer jika data lebih besar
+// Fungsi untuk mengirim ACK perintah kembali ke NodeMCU
+void sendACKToNodeMCU(int commandId, LinkAck status, const String& notes, LinkValve reportedValveStatus) {
+    StaticJsonDocument<ACK_DOC_SIZE> doc;
+    LinkAckFrame ack = {};
+    ack.address = busAddress;
+    ack.commandId = commandId;
+    ack.status = status;
+    ack.notes = notes.c_str();
+    ack.valve = reportedValveStatus;
+    JsonArray frame = doc.to<JsonArray>();
+    linkEncode(frame, ack);
+
+    transmitToNodeMCU(frame, millis(), BUS_FRAME_PRIORITY); // Kirim frame ke NodeMCU
+    Serial.print(F("Tx NodeMCU (ACK): "));
+    serializeJson(frame, Serial);
+    Serial.println();
+}
 
-    doc["flow_rate_lpm"] = serialized(String(flowRate, 2)); // Format ke 2 desimal
-    doc["meter_reading_m3"] = serialized(String(meterReading, 3)); // Format ke 3 desimal
-    doc["current_voltage"] = serialized(String(voltage, 2));
-    doc["door_status"] = doorOpen ? 1 : 0; // Status pintu: 0 (closed) atau 1 (open)
-    doc["status_message"] = statusMessage; // Misal: "normal", "pulsa_habis", "pintu_terbuka", "tegangan_rendah"
+// Point-to-point: kirim langsung. Mode bus: kirim hanya sebagai jawaban
+// poll, selain itu simpan di outbox sampai gateway memanggil alamat ini.
+// capturedAt = millis() saat data frame diambil; umurnya (age_ms, elemen
+// terakhir frame) ditambahkan saat frame benar-benar dikirim, jadi dokumen
+// pemanggil harus menyisakan satu slot. kind = BUS_FRAME_* (prioritas di
+// outbox bus). Frame langsung di-serialize ke myArd; hanya frame yang masuk
+// outbox disalin ke String.
+void transmitToNodeMCU(JsonArray frame, unsigned long capturedAt, uint8_t kind) {
+    if (busAddress == 0) {
+        wakeNodeMCU();
+        frame.add(millis() - capturedAt);
+        trace(TRACE_SERIAL_TX, 0, measureJson(frame));
+        serializeJson(frame, myArd);
+        myArd.println();
+        return;
+    }
+    if (busReplyPending) {
+        busReplyPending = false;
+        frame.add(millis() - capturedAt);
+        trace(TRACE_SERIAL_TX, 0, measureJson(frame));
+        Rs485DePin::high();
+        serializeJson(frame, myArd);
+        myArd.println();
+        Rs485DePin::low();
+        return;
+    }
 
     String output;
-    serializeJson(doc, output);
+    output.reserve(measureJson(frame));
+    serializeJson(frame, output);
+    if (kind == BUS_FRAME_ROUTINE) {
+        // Snapshot yang belum terkirim diganti yang terbaru (meter kumulatif)
+        for (uint8_t i = 0; i < busOutboxCount; i++) {
+            if (busOutbox[i].kind == BUS_FRAME_ROUTINE) {
+                busOutbox[i].frame = output;
+                busOutbox[i].capturedAt = capturedAt;
+                return;
+            }
+        }
+    }
+    if (busOutboxCount >= BUS_OUTBOX_SIZE && !evictBusOutbox(kind)) {
+        trace(TRACE_BUS_DROP, kind, output.length());
+        Serial.println(F("Outbox bus penuh event/ACK, frame baru ditolak"));
+        return;
+    }
+    busOutbox[busOutboxCount].frame = output;
+    busOutbox[busOutboxCount].capturedAt = capturedAt;
+    busOutbox[busOutboxCount].kind = kind;
+    busOutboxCount++;
+}
 
-    myArd.println(output); // Kirim JSON string ke NodeMCU
-    Serial.print("Tx NodeMCU (Meter Data): ");
-    Serial.println(output);
+// Buang frame tertua dengan kelas terendah di bawah `kind`
+bool evictBusOutbox(uint8_t kind) {
+    for (uint8_t victimKind = BUS_FRAME_ROUTINE; victimKind < kind; victimKind++) {
+        for (uint8_t i = 0; i < busOutboxCount; i++) {
+            if (busOutbox[i].kind == victimKind) {
+                trace(TRACE_BUS_DROP, victimKind, busOutbox[i].frame.length());
+                removeBusOutbox(i);
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
-// Fungsi untuk mengirim ACK perintah kembali ke NodeMCU
-void sendACKToNodeMCU(int commandId, String status, String notes, String reportedValveStatus) {
-    DynamicJsonDocument doc(256);
-    doc["command_id_ack"] = commandId;
-    doc["ack_status"] = status;
-    doc["ack_notes"] = notes;
-    doc["valve_status_ack"] = reportedValveStatus;
+void removeBusOutbox(uint8_t index) {
+    for (uint8_t i = index; i + 1 < busOutboxCount; i++) {
+        busOutbox[i].frame = busOutbox[i + 1].frame;
+        busOutbox[i].capturedAt = busOutbox[i + 1].capturedAt;
+        busOutbox[i].kind = busOutbox[i + 1].kind;
+    }
+    busOutboxCount--;
+    busOutbox[busOutboxCount].frame = String(); // Lepas heap frame
+}
 
-    String output;
-    serializeJson(doc, output);
+// Kirim frame outbox dengan age_ms (umur data saat dikirim) sebagai elemen
+// terakhir array: isi tanpa ']' penutup, lalu ",age]" ditulis langsung ke
+// myArd tanpa salinan String. NodeMCU memetakan millis() Arduino ke jamnya
+// sendiri dengan mengurangkan umur ini dari waktu terima frame.
+// Driver RS-485 aktif hanya selama mengirim; TX SoftwareSerial sinkron, jadi
+// setelah println() selesai bus bisa langsung dilepas.
+void busWriteAged(const String& frame, unsigned long capturedAt) {
+    trace(TRACE_SERIAL_TX, 0, frame.length());
+    Rs485DePin::high();
+    myArd.write((const uint8_t*)frame.c_str(), frame.length() - 1);
+    myArd.write(',');
+    myArd.print(millis() - capturedAt);
+    myArd.println(']');
+    Rs485DePin::low();
+}
+
+// Jawab poll gateway dengan satu frame: outbox lebih dulu (event/ACK tertua
+// mendahului frame lain), lalu pembacaan terbaru
+void answerBusPoll() {
+    if (busOutboxCount > 0) {
+        uint8_t next = 0;
+        for (uint8_t i = 0; i < busOutboxCount; i++) {
+            if (busOutbox[i].kind == BUS_FRAME_PRIORITY) {
+                next = i;
+                break;
+            }
+        }
+        busWriteAged(busOutbox[next].frame, busOutbox[next].capturedAt);
+        removeBusOutbox(next);
+        return;
+    }
+    busReplyPending = true;
+    sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, teganganVolt, distance > jarakToleransi, LINK_STATUS_NORMAL);
+}
+
+// ======================================================
+// FUNGSI FLIGHT RECORDER
+// ======================================================
+
+// Waktu konstan: beberapa store + millis(), aman dipanggil di setiap jalur
+void trace(uint8_t type, uint8_t a, uint16_t b) {
+    TraceRecord& record = traceRing[traceHead];
+    record.t = millis();
+    record.type = type;
+    record.a = a;
+    record.b = b;
+    traceHead = (traceHead + 1) & (TRACE_RING_SIZE - 1);
+    traceTotal++;
+}
+
+// Kirim isi ring (paling lama dulu) sebagai frame LINK_MSG_TRACE per bagian
+// (records = hex TraceRecord). nowMs memungkinkan decoder memetakan t ke jam
+// NodeMCU/server.
+void sendTraceToNodeMCU(int commandId) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    uint8_t count = traceTotal < TRACE_RING_SIZE ? traceTotal : TRACE_RING_SIZE;
+    uint8_t first = (traceHead - count) & (TRACE_RING_SIZE - 1);
+    uint8_t parts = count == 0 ? 1 : (count + TRACE_PART_RECORDS - 1) / TRACE_PART_RECORDS;
+
+    for (uint8_t part = 0; part < parts; part++) {
+        char records[TRACE_PART_RECORDS * sizeof(TraceRecord) * 2 + 1];
+        char* hex = records;
+        for (uint8_t i = part * TRACE_PART_RECORDS; i < count && i < (part + 1) * TRACE_PART_RECORDS; i++) {
+            const uint8_t* bytes = (const uint8_t*)&traceRing[(first + i) & (TRACE_RING_SIZE - 1)];
+            for (uint8_t b = 0; b < sizeof(TraceRecord); b++) {
+                *hex++ = HEX_DIGITS[bytes[b] >> 4];
+                *hex++ = HEX_DIGITS[bytes[b] & 0x0F];
+            }
+        }
+        *hex = '\0';
+
+        LinkTrace frame = {};
+        frame.address = busAddress;
+        frame.commandId = commandId;
+        frame.part = part;
+        frame.parts = parts;
+        frame.nowMs = millis();
+        frame.total = traceTotal;
+        frame.records = records; // Disimpan sebagai pointer, tidak disalin
+        StaticJsonDocument<TRACE_DOC_SIZE> doc;
+        JsonArray encoded = doc.to<JsonArray>();
+        linkEncode(encoded, frame);
+
+        transmitToNodeMCU(encoded, millis(), BUS_FRAME_BULK);
+        Serial.print(F("Tx NodeMCU (Trace): bagian "));
+        Serial.println(part);
+    }
+}
+
+// ======================================================
+// FUNGSI REGISTRY PARAMETER
+// ======================================================
+
+void readParamDef(uint8_t index, ParamDef& def) {
+    memcpy_P(&def, &PARAMS[index], sizeof(ParamDef));
+}
+
+// Tulis nilai (satuan config) ke variabelnya jika tipe dan rentang valid
+bool paramSet(const ParamDef& def, float value) {
+    if (isnan(value) || value < def.minValue || value > def.maxValue) {
+        return false;
+    }
+    if (def.type == PARAM_BOOL) {
+        *(bool*)def.value = value != 0;
+    } else if (def.type == PARAM_ULONG) {
+        *(unsigned long*)def.value = (unsigned long)value * def.scale;
+    } else {
+        *(float*)def.value = value;
+    }
+    return true;
+}
+
+bool paramFromJson(const ParamDef& def, JsonVariantConst variant, float& value) {
+    if (def.type == PARAM_BOOL) {
+        if (!variant.is<bool>()) {
+            return false;
+        }
+        value = variant.as<bool>() ? 1 : 0;
+    } else {
+        if (!variant.is<float>()) {
+            return false;
+        }
+        value = variant.as<float>();
+    }
+    return !isnan(value) && value >= def.minValue && value <= def.maxValue;
+}
+
+// Nilai blob: 4 byte per entri (bool di byte pertama), sama dengan variabelnya
+void paramToBytes(const ParamDef& def, uint8_t* out) {
+    memset(out, 0, 4);
+    memcpy(out, def.value, def.type == PARAM_BOOL ? 1 : 4);
+}
+
+bool paramFromBytes(const ParamDef& def, const uint8_t* in) {
+    if (def.type == PARAM_BOOL) {
+        return in[0] <= 1 && paramSet(def, in[0]);
+    }
+    if (def.type == PARAM_ULONG) {
+        unsigned long stored;
+        memcpy(&stored, in, 4);
+        return paramSet(def, stored / def.scale);
+    }
+    float stored;
+    memcpy(&stored, in, 4);
+    return paramSet(def, stored);
+}
 
-    myArd.println(output); // Kirim JSON string ke NodeMCU
-    Serial.print("Tx NodeMCU (ACK): ");
-    Serial.println(output);
+// CRC-8 (poly 0x07) atas nilai di blob
+uint8_t paramBlobCrc(int address, uint8_t length) {
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < length; i++) {
+        crc ^= EEPROM.read(address + i);
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+void loadParams() {
+    ParamDef def;
+    for (uint8_t i = 0; i < PARAM_COUNT; i++) {
+        readParamDef(i, def);
+        paramSet(def, def.defaultValue);
+    }
+
+    uint8_t storedCount = EEPROM.read(EEPROM_PARAM_BLOB_ADDR + 2);
+    int valuesAddr = EEPROM_PARAM_BLOB_ADDR + PARAM_BLOB_HEADER;
+    bool blobValid = EEPROM.read(EEPROM_PARAM_BLOB_ADDR) == PARAM_BLOB_MAGIC &&
+                     EEPROM.read(EEPROM_PARAM_BLOB_ADDR + 1) == PARAM_BLOB_VERSION &&
+                     storedCount <= 32 &&
+                     EEPROM.read(EEPROM_PARAM_BLOB_ADDR + 3) == paramBlobCrc(valuesAddr, storedCount * 4);
+
+    if (blobValid) {
+        // Nilai yang rusak/di luar rentang tetap default
+        for (uint8_t i = 0; i < PARAM_COUNT && i < storedCount; i++) {
+            uint8_t bytes[4];
+            for (uint8_t b = 0; b < 4; b++) {
+                bytes[b] = EEPROM.read(valuesAddr + i * 4 + b);
+            }
+            readParamDef(i, def);
+            paramFromBytes(def, bytes);
+        }
+        Serial.println("Parameter dimuat dari EEPROM.");
+        if (storedCount != PARAM_COUNT) {
+            saveParams(); // Tambahkan entri baru (default) ke blob
+        }
+        return;
+    }
+
+    // Belum ada blob (firmware lama): pindahkan K_FACTOR dan jarakToleransi
+    // dari alamat lamanya agar kalibrasi di lapangan tidak hilang
+    float legacyKFactor = readFloatFromEEPROM(EEPROM_K_FACTOR_ADDR);
+    if (!isnan(legacyKFactor) && legacyKFactor > 0.0) {
+        readParamDef(0, def);
+        paramSet(def, legacyKFactor);
+    }
+    float legacyJarak = readFloatFromEEPROM(EEPROM_JARAK_TOLERANSI_ADDR);
+    if (!isnan(legacyJarak) && legacyJarak > 0.0) {
+        readParamDef(1, def);
+        paramSet(def, legacyJarak);
+    }
+    saveParams();
+    Serial.println("Blob parameter dibuat (default + nilai lama).");
+}
+
+// EEPROM.update() hanya menulis byte yang berubah (umur sel EEPROM)
+void saveParams() {
+    int valuesAddr = EEPROM_PARAM_BLOB_ADDR + PARAM_BLOB_HEADER;
+    for (uint8_t i = 0; i < PARAM_COUNT; i++) {
+        ParamDef def;
+        readParamDef(i, def);
+        uint8_t bytes[4];
+        paramToBytes(def, bytes);
+        for (uint8_t b = 0; b < 4; b++) {
+            EEPROM.update(valuesAddr + i * 4 + b, bytes[b]);
+        }
+    }
+    EEPROM.update(EEPROM_PARAM_BLOB_ADDR, PARAM_BLOB_MAGIC);
+    EEPROM.update(EEPROM_PARAM_BLOB_ADDR + 1, PARAM_BLOB_VERSION);
+    EEPROM.update(EEPROM_PARAM_BLOB_ADDR + 2, PARAM_COUNT);
+    EEPROM.update(EEPROM_PARAM_BLOB_ADDR + 3, paramBlobCrc(valuesAddr, PARAM_COUNT * 4));
+}
+
+// Terapkan set config: validasi semua kunci registry yang ada dulu, baru
+// tulis dan simpan sekali. Kunci lain (aksi seperti raw_report_s) diproses
+// pemanggil. Mengembalikan false (tanpa perubahan) jika ada nilai invalid.
+bool applyConfigSet(JsonObjectConst configData, String& notes) {
+    float staged[PARAM_COUNT];
+    uint16_t presentMask = 0;
+    ParamDef def;
+    for (uint8_t i = 0; i < PARAM_COUNT; i++) {
+        readParamDef(i, def);
+        JsonVariantConst variant = configData[(const char*)def.key];
+        if (variant.isNull()) {
+            continue;
+        }
+        if (!paramFromJson(def, variant, staged[i])) {
+            notes += "Parameter tidak valid: ";
+            notes += def.key;
+            return false;
+        }
+        presentMask |= (1 << i);
+    }
+    if (presentMask == 0) {
+        return true;
+    }
+
+    uint8_t applied = 0;
+    for (uint8_t i = 0; i < PARAM_COUNT; i++) {
+        if (presentMask & (1 << i)) {
+            readParamDef(i, def);
+            paramSet(def, staged[i]);
+            applied++;
+        }
+    }
+    saveParams();
+    Serial.print("Parameter diperbarui: "); Serial.println(applied);
+    notes += applied;
+    notes += " parameter disimpan. ";
+    return true;
+}
+
+// ======================================================
+// FUNGSI DETEKSI ANOMALI
+// ======================================================
+
+// Dipanggil setiap sampel flow (flowCalculationInterval)
+void detectFlowAnomalies(float volumeL, unsigned long currentMillis) {
+    if (volumeL <= 0.0) {
+        if (continuousFlow && currentMillis - lastFlowPulseMillis >= leakGapMs) {
+            // Episode aliran selesai: alarm episode boleh muncul lagi
+            continuousFlow = false;
+            episodeVolumeL = 0.0;
+            leakAlarm = false;
+            burstAlarm = false;
+        }
+        return;
+    }
+
+    if (!continuousFlow) {
+        continuousFlow = true;
+        continuousFlowStart = currentMillis - flowCalculationInterval;
+    }
+    lastFlowPulseMillis = currentMillis;
+    episodeVolumeL += volumeL;
+
+    // Rata-rata episode (L/menit), bukan laju per sampel yang bergantian nol
+    unsigned long episodeMs = currentMillis - continuousFlowStart;
+    float episodeLpm = episodeVolumeL * 60000.0 / episodeMs;
+    if (!leakAlarm && episodeMs >= leakWindowMs && episodeLpm >= leakMinLpm) {
+        leakAlarm = true;
+        raiseFlowAnomaly(LINK_STATUS_KEBOCORAN, TRACE_ANOMALY_LEAK);
+    }
+    if (!burstAlarm && episodeVolumeL >= burstVolumeL) {
+        burstAlarm = true;
+        raiseFlowAnomaly(LINK_STATUS_ALIRAN_BERLEBIH, TRACE_ANOMALY_BURST);
+    }
+}
+
+// Dipanggil setiap pass loop: pulsa setelah valve selesai menutup berarti
+// valve bocor atau di-bypass. Basis pulsa di-reset oleh startValveMove().
+void checkClosedValveFlow(unsigned long currentMillis) {
+    if (valveState != LINK_VALVE_CLOSED || closedFlowAlarm) {
+        return;
+    }
+    noInterrupts();
+    unsigned long pulses = pulseCount;
+    interrupts();
+    if (!closedPulseBaseValid) {
+        closedPulseBase = pulses;
+        closedPulseBaseValid = true;
+        return;
+    }
+    if ((pulses - closedPulseBase) / K_FACTOR >= closedFlowL) {
+        closedFlowAlarm = true;
+        valveState = LINK_VALVE_FAULT; // Valve tidak menutup rapat
+        trace(TRACE_VALVE, valveState, 0);
+        raiseFlowAnomaly(LINK_STATUS_ALIRAN_SAAT_TERTUTUP, TRACE_ANOMALY_CLOSED_FLOW);
+    }
+}
+
+void raiseFlowAnomaly(LinkStatus type, uint8_t traceCode) {
+    trace(TRACE_ANOMALY, traceCode, 0);
+    Serial.print("ANOMALI ALIRAN: "); Serial.println(linkName(type));
+    if (anomalyCloseValve) {
+        anomalyValveLock = true;
+        requestValve(false, millis()); // Langsung, tanpa menunggu pass loop berikutnya
+        updateValve(millis());
+    }
+    sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, teganganVolt, distance > jarakToleransi, type);
+}
+
+// ======================================================
+// FUNGSI AGREGASI ALIRAN
+// ======================================================
+
+void resetFlowAggregate(unsigned long startMillis) {
+    memset(&flowAggregate, 0, sizeof(flowAggregate));
+    flowAggregate.startMillis = startMillis;
+}
+
+void addFlowSample(float flowLpm, float volumeL) {
+    if (flowAggregate.samples == 0 || flowLpm < flowAggregate.minLpm) {
+        flowAggregate.minLpm = flowLpm;
+    }
+    if (flowLpm > flowAggregate.maxLpm) {
+        flowAggregate.maxLpm = flowLpm;
+    }
+    flowAggregate.sumLpm += flowLpm;
+    flowAggregate.volumeL += volumeL;
+    if (flowAggregate.samples < 0xFFFF) {
+        flowAggregate.samples++;
+    }
+
+    uint8_t bin = 0;
+    while (bin < FLOW_HIST_BINS - 1 && flowLpm >= FLOW_HIST_EDGES[bin]) {
+        bin++;
+    }
+    if (flowAggregate.histogram[bin] < 0xFFFF) {
+        flowAggregate.histogram[bin]++;
+    }
+    if (bin > 0 && flowAggregate.activeSamples < 0xFFFF) {
+        flowAggregate.activeSamples++;
+    }
+}
+
+// ======================================================
+// FUNGSI LEDGER SALDO
+// ======================================================
+
+void recordLedgerEntry(uint16_t seq, float deducted) {
+    creditLedger[creditLedgerHead].seq = seq;
+    creditLedger[creditLedgerHead].deducted = deducted;
+    creditLedgerHead = (creditLedgerHead + 1) % CREDIT_LEDGER_SIZE;
+    if (creditLedgerCount < CREDIT_LEDGER_SIZE) {
+        creditLedgerCount++;
+    }
+}
+
+// Terapkan saldo server yang dihitung dari pembacaan ackSeq sebagai delta:
+// saldo lokal = saldo server - semua potongan setelah pembacaan ackSeq.
+// Top-up otomatis ikut masuk karena sudah termasuk di saldo server.
+void applyServerBalance(float serverBalance, uint16_t ackSeq) {
+    // Abaikan respons yang lebih tua dari yang sudah diterapkan
+    if (hasAppliedSeq && (int16_t)(ackSeq - lastAppliedSeq) < 0) {
+        Serial.print("Saldo untuk seq lama diabaikan: "); Serial.println(ackSeq);
+        return;
+    }
+
+    uint8_t oldest = (creditLedgerHead + CREDIT_LEDGER_SIZE - creditLedgerCount) % CREDIT_LEDGER_SIZE;
+    bool found = false;
+    float pendingDeduction = unreportedDeduction;
+    for (uint8_t i = 0; i < creditLedgerCount; i++) {
+        CreditLedgerEntry& entry = creditLedger[(oldest + i) % CREDIT_LEDGER_SIZE];
+        if (found) {
+            pendingDeduction += entry.deducted;
+        } else if (entry.seq == ackSeq) {
+            found = true;
+        }
+    }
+
+    if (!found) {
+        // Seq sudah keluar dari ledger; tunggu respons berikutnya
+        Serial.print("Seq tidak ada di ledger, saldo diabaikan: "); Serial.println(ackSeq);
+        return;
+    }
+
+    dataPUL = max(0.0, serverBalance - pendingDeduction);
+    lastAppliedSeq = ackSeq;
+    hasAppliedSeq = true;
+
+    Serial.print("Saldo server seq "); Serial.print(ackSeq);
+    Serial.print(": Rp "); Serial.print(serverBalance, 2);
+    Serial.print(" - pending Rp "); Serial.println(pendingDeduction, 2);
 }
 
 // ======================================================
@@ -416,9 +1360,11 @@ void checkWaterFlow() {
         unsigned long currentPulseCount = pulseCount;
         interrupts();
         
-        // Hitung flow rate dalam LPM
-        float pulsesInInterval = currentPulseCount - (pulseCount - currentPulseCount);
-        currentFlowRateLPM = (pulsesInInterval / K_FACTOR) * (60000.0 / flowCalculationInterval); // LPM
+        // Hitung flow rate dalam LPM dari pulsa sejak sampel sebelumnya
+        // (pulseCount tidak pernah di-reset karena juga dipakai mode idle)
+        float pulsesInInterval = currentPulseCount - lastSampledPulseCount;
+        lastSampledPulseCount = currentPulseCount;
+        currentFlowRateLPM = (pulsesInInterval / K_FACTOR) * (60000.0 / (currentMillis - lastFlowCalculationTime)); // LPM
         
         // Update total volume
         float volumeInInterval = pulsesInInterval / K_FACTOR; // Liter
@@ -429,6 +1375,7 @@ void checkWaterFlow() {
         if (volumeInInterval > 0 && tariffPerM3 > 0) {
             float cost = (volumeInInterval / 1000.0) * tariffPerM3; // Cost in Rupiah (convert L to m3)
             dataPUL = max(0.0, dataPUL - cost);
+            unreportedDeduction += cost; // Dicatat di ledger saat pembacaan berikutnya dikirim
             
             Serial.print("Konsumsi: "); Serial.print(volumeInInterval, 3); Serial.println(" L");
             Serial.print("Biaya: Rp "); Serial.println(cost, 2);
@@ -436,6 +1383,17 @@ void checkWaterFlow() {
         }
         
         lastFlowCalculationTime = currentMillis;
+
+        // Deteksi anomali per sampel
+        detectFlowAnomalies(volumeInInterval, currentMillis);
+
+        // Masukkan sampel ke agregat; tutup dan kirim jika interval selesai
+        addFlowSample(currentFlowRateLPM, volumeInInterval);
+        if (currentMillis - flowAggregate.startMillis >= aggregateInterval) {
+            sendAggregateToNodeMCU(currentMillis);
+            resetFlowAggregate(currentMillis);
+            lastMeterDataSendTime = currentMillis; // Frame agregat juga membawa pembacaan terkini
+        }
         
         Serial.print("Flow Rate: "); Serial.print(currentFlowRateLPM, 2); Serial.println(" LPM");
         Serial.print("Total Reading: "); Serial.print(totalMeterReadingM3, 3); Serial.println(" m3");
@@ -444,13 +1402,15 @@ void checkWaterFlow() {
 
 void checkDoorStatus() {
     // Baca sensor ultrasonik
-    digitalWrite(trigPin, LOW);
+    // Akses port langsung: lebar pulsa trigger tidak lagi tergeser ~3-4 us
+    // oleh digitalWrite
+    TrigPin::low();
     delayMicroseconds(2);
-    digitalWrite(trigPin, HIGH);
+    TrigPin::high();
     delayMicroseconds(10);
-    digitalWrite(trigPin, LOW);
+    TrigPin::low();
     
-    long duration = pulseIn(echoPin, HIGH);
+    long duration = pulseIn(EchoPin::NUMBER, HIGH);
     distance = duration * 0.034 / 2; // Convert to cm
     
     bool doorCurrentlyOpen = (distance > jarakToleransi);
@@ -458,25 +1418,27 @@ void checkDoorStatus() {
     if (doorCurrentlyOpen) {
         if (cekPintuTertutup) { // Jika sebelumnya tertutup, sekarang terbuka
             cekPintuTertutup = false;
+            trace(TRACE_DOOR, 1, distance);
             if (!isUnlocked) { // Jika tidak dalam mode teknisi
-                valve_tutup(); // Tutup valve jika pintu terbuka dan bukan mode teknisi
-                sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, teganganVolt, true, "pintu_terbuka");
+                requestValve(false, millis()); // Tutup valve jika pintu terbuka dan bukan mode teknisi
+                updateValve(millis());
+                sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, teganganVolt, true, LINK_STATUS_PINTU_TERBUKA);
             }
         }
     } else {
         if (!cekPintuTertutup) { // Jika sebelumnya terbuka, sekarang tertutup
             cekPintuTertutup = true;
+            trace(TRACE_DOOR, 0, distance);
             if (!isUnlocked) { // Jika tidak dalam mode teknisi
                 // Valve akan diatur oleh logika utama loop() berdasarkan semua kondisi
-                sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, teganganVolt, false, "pintu_tertutup");
+                sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, teganganVolt, false, LINK_STATUS_PINTU_TERTUTUP);
             }
         }
     }
 }
 
 void checkTiltSensor() {
-    int bacaSensor = digitalRead(miringPin);
-    if (bacaSensor == LOW) { // Asumsi LOW = miring
+    if (!MiringPin::read()) { // Asumsi LOW = miring
         Serial.println("Tilt detected");
         // Buzzer dikontrol di loop() utama
         // sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, teganganVolt, distance > jarakToleransi, "miring_terdeteksi");
@@ -489,22 +1451,22 @@ void buzzerKedip() {
     unsigned long currentMillis = millis();
     if (currentMillis - previousBuzzerMillis >= buzzerInterval) {
         previousBuzzerMillis = currentMillis;
-        if (digitalRead(buzzerPin) == LOW) {
-            tone(buzzerPin, 500);
+        if (!BuzzerPin::read()) {
+            tone(BuzzerPin::NUMBER, 500);
         } else {
-            noTone(buzzerPin);
+            noTone(BuzzerPin::NUMBER);
         }
     }
 }
 
 void buzzerTerus() {
-    tone(buzzerPin, 500);
+    tone(BuzzerPin::NUMBER, 500);
     previousBuzzerMillis = millis(); // Reset timer kedip jika buzzer terus
 }
 
 void buzzerMati() {
-    noTone(buzzerPin);
-    digitalWrite(buzzerPin, LOW);
+    noTone(BuzzerPin::NUMBER);
+    BuzzerPin::low();
 }
 
 void checkVoltage() {
@@ -519,12 +1481,15 @@ void checkVoltage() {
     teganganVolt = actualVoltage;
 
     bool currentLowVoltage = false;
-    if (actualVoltage < 5.0) { // Angka 5.0V ini bisa disesuaikan ambang batas tegangan rendah
+    if (actualVoltage < lowVoltageThreshold) { // Ambang diatur lewat low_voltage_v
         currentLowVoltage = true;
         if (!lowVoltageDetected) { // Jika baru terdeteksi rendah
-            sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, actualVoltage, distance > jarakToleransi, "tegangan_rendah");
+            sendMeterDataToNodeMCU(currentFlowRateLPM, totalMeterReadingM3, actualVoltage, distance > jarakToleransi, LINK_STATUS_TEGANGAN_RENDAH);
         }
     }
+    if (currentLowVoltage != lowVoltageDetected) {
+        trace(TRACE_VOLTAGE, currentLowVoltage, actualVoltage * 100);
+    }
     lowVoltageDetected = currentLowVoltage;
 
     Serial.print("Voltage: "); Serial.println(actualVoltage, 2);
@@ -557,6 +1522,8 @@ void tampilLCD(String lcdpulsa, String nopelanggan) {
     // Status indicator
     if (isUnlocked) {
         lcd.print("UNLOCKED");
+    } else if (anomalyValveLock) {
+        lcd.print("ANOMALI");
     } else if (dataPUL <= 0) {
         lcd.print("NO CREDIT");
     } else if (!cekPintuTertutup) {
@@ -568,32 +1535,132 @@ void tampilLCD(String lcdpulsa, String nopelanggan) {
     }
 }
 
+// ======================================================
+// FUNGSI MODE IDLE
+// ======================================================
+
+void markActivity() {
+    lastActivityTime = millis();
+    isIdleMode = false;
+}
+
+// Kondisi yang butuh loop penuh: aliran, alarm, buzzer, mode teknisi
+bool hasActiveCondition() {
+    return currentFlowRateLPM > 0.0 ||
+           !cekPintuTertutup ||
+           !MiringPin::read() ||
+           lowVoltageDetected ||
+           (dataPUL < lowCreditThreshold && dataPUL > 0.0) || // Buzzer kedip butuh loop cepat
+           isUnlocked;
+}
+
+void updateIdleState(unsigned long currentMillis) {
+    if (hasActiveCondition()) {
+        markActivity();
+    } else if (!isIdleMode && currentMillis - lastActivityTime >= idleEntryDelay) {
+        isIdleMode = true;
+        Serial.println("Masuk mode idle");
+    }
+}
+
+// Tidur di SLEEP_MODE_IDLE sampai tick berikutnya. Timer0 (millis), INT0
+// (FlowPin) dan PCINT (RX SoftwareSerial) tetap aktif sehingga tidak ada
+// pulsa atau byte serial yang hilang.
+void idleSleep() {
+    unsigned long tickStart = millis();
+    noInterrupts();
+    unsigned long startPulseCount = pulseCount;
+    interrupts();
+
+    while (millis() - tickStart < idleTickInterval) {
+        if (myArd.available()) {
+            break;
+        }
+        noInterrupts();
+        bool pulsed = (pulseCount != startPulseCount);
+        interrupts();
+        if (pulsed) {
+            markActivity(); // Air mulai mengalir
+            break;
+        }
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_enable();
+        sleep_cpu();      // Bangun oleh interrupt apa pun
+        sleep_disable();
+    }
+}
+
 // ======================================================
 // FUNGSI KONTROL VALVE
 // ======================================================
 
+// Sisi yang berlawanan selalu dimatikan lebih dulu agar driver H-bridge
+// tidak pernah menerima kedua input aktif
 void valve_buka() {
-    digitalWrite(pinValveOpen, HIGH);
-    digitalWrite(pinValveClose, LOW);
+    ValveClosePin::low();
+    ValveOpenPin::high();
 }
 
 void valve_tutup() {
-    digitalWrite(pinValveOpen, LOW);
-    digitalWrite(pinValveClose, HIGH);
+    ValveOpenPin::low();
+    ValveClosePin::high();
 }
 
 void valve_mati() {
-    digitalWrite(pinValveOpen, LOW);
-    digitalWrite(pinValveClose, LOW);
+    ValveOpenPin::low();
+    ValveClosePin::low();
 }
 
-// Fungsi khusus untuk eksekusi perintah dari server
-void valve_buka_by_command() {
-    valve_buka();
-    Serial.println("Valve dibuka oleh perintah server");
+// valve_buka/valve_tutup/valve_mati hanya dipanggil kontroler di bawah.
+// Pemanggil lain cukup requestValve(); updateValve() dijalankan tiap loop.
+void requestValve(bool open, unsigned long currentMillis) {
+    valveTargetOpen = open;
+    if (!open) {
+        valveLastCloseRequest = currentMillis;
+    }
+}
+
+void updateValve(unsigned long currentMillis) {
+    // Waktu tempuh habis: lepas motor
+    if ((valveState == LINK_VALVE_OPENING || valveState == LINK_VALVE_CLOSING) && currentMillis - valveMoveStart >= valveTravelTime) {
+        valve_mati();
+        valveState = (valveState == LINK_VALVE_OPENING) ? LINK_VALVE_OPEN : LINK_VALVE_CLOSED;
+        trace(TRACE_VALVE, valveState, currentMillis - valveMoveStart);
+        Serial.print("Valve: "); Serial.println(valveStateName());
+    }
+
+    bool atTarget = valveTargetOpen
+        ? (valveState == LINK_VALVE_OPEN || valveState == LINK_VALVE_OPENING)
+        : (valveState == LINK_VALVE_CLOSED || valveState == LINK_VALVE_CLOSING || valveState == LINK_VALVE_FAULT);
+    if (atTarget) {
+        return;
+    }
+    // De-bounce: buka hanya jika target tutup terakhir sudah cukup lama
+    if (valveTargetOpen && valveState != LINK_VALVE_UNKNOWN && currentMillis - valveLastCloseRequest < VALVE_OPEN_HOLDOFF) {
+        return;
+    }
+    startValveMove(valveTargetOpen, currentMillis);
+}
+
+void startValveMove(bool open, unsigned long currentMillis) {
+    if (valveState == LINK_VALVE_OPENING || valveState == LINK_VALVE_CLOSING) {
+        // Berbalik arah di tengah gerak: rem dulu agar driver motor aman
+        valve_mati();
+        delay(VALVE_REVERSE_GAP);
+    }
+    if (open) {
+        valve_buka();
+    } else {
+        valve_tutup();
+    }
+    valveState = open ? LINK_VALVE_OPENING : LINK_VALVE_CLOSING;
+    valveMoveStart = currentMillis;
+    trace(TRACE_VALVE, valveState, 0);
+    closedFlowAlarm = false;
+    closedPulseBaseValid = false;
+    Serial.print("Valve: "); Serial.println(valveStateName());
 }
 
-void valve_tutup_by_command() {
-    valve_tutup();
-    Serial.println("Valve ditutup oleh perintah server");
+const char* valveStateName() {
+    return linkName(valveState);
 }
\ No newline at end of file
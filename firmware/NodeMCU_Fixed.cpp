@@ -2,16 +2,43 @@
 * Sistem Monitoring Air dengan NodeMCU ESP8266 (Fixed Version)
 *
 * Fitur Utama:
-* - Koneksi Wi-Fi (STA Mode)
+* - Koneksi Wi-Fi (STA Mode), reconnect cepat dengan BSSID/channel/lease
+*   terakhir dari RTC memory (fallback ke scan penuh + DHCP)
 * - Mode Access Point (AP) untuk Provisioning Awal
 * - Antarmuka Web Sederhana untuk Provisioning
+*   (disimpan gzip di flash, di-cache browser via ETag)
 * - Komunikasi dengan Arduino via SoftwareSerial (JSON)
+*   (frame array posisional sesuai skema bersama link_schema.h, frame objek
+*   dari firmware Arduino lama tetap diterima)
 * - Registrasi perangkat ke server backend
 * - Pengiriman data sensor dari Arduino ke server
+*   (event keselamatan lewat jalur prioritas terpisah dengan retry)
 * - Penerimaan perintah kontrol dari server (misal: kontrol valve)
+*   (ikut di respons pembacaan meter, poll terpisah hanya saat idle)
 * - OTA (Over-The-Air) Updates
 * - Penyimpanan kredensial Wi-Fi dan JWT ke EEPROM
+* - Siklus hidup JWT: klaim exp dibaca lokal, token diperbarui sebelum
+*   kedaluwarsa; 401 memicu satu refresh + retry lalu backoff
 * - Penanganan error dan retry
+* - Mode hemat daya (modem/light sleep) di antara pertukaran data
+* - Endpoint /metrics (format Prometheus) di mode STA
+* - Jalur request HTTP tanpa alokasi String (buffer tetap)
+* - Engine HTTP asinkron: antrian request terbatas dengan callback per
+*   request; serial, web server dan timer tetap berjalan selama menunggu server
+* - Body uplink CBOR (kunci integer, angka fixed-point) untuk endpoint yang
+*   mengiklankannya lewat Accept-Post, JSON sebagai fallback
+* - HTTPS via BearSSL: pinning sertifikat, resumption sesi, MFLN
+* - Mode gateway: satu NodeMCU melayani beberapa meter Arduino di bus RS-485
+* - Sinkronisasi waktu SNTP dengan koreksi drift; pembacaan membawa waktu capture
+* - Meneruskan agregat aliran per interval dari Arduino (volume, min/avg/max, histogram)
+* - Meneruskan dump get_config Arduino ke server sebagai objek berkunci
+* - Checkpoint state di RTC memory (antrian event dan ACK, jadwal poll, waktu,
+*   pulsa terakhir) dipulihkan setelah reset non-power-on, dibuang setelah
+*   beberapa reset crash berturut-turut (boot-loop guard)
+* - Flight recorder: ring event biner (serial, HTTP, Wi-Fi, perintah, loop
+*   lambat) + relay trace Arduino, diunggah lewat perintah dump_trace
+* - Statistik latensi loop NodeMCU dan Arduino (histogram log2, bagian paling
+*   blocking, deadline miss) dikirim berkala bersama data meter
 *
 * FIXED ISSUES:
 * - Updated API_BASE_URL to point to IndoWater system
@@ -27,25 +54,55 @@
 #include <ESP8266WiFi.h>
 #include <ESP8266HTTPClient.h>
 #include <WiFiClient.h>
+#include <WiFiClientSecure.h> // BearSSL untuk API HTTPS
 #include <ArduinoJson.h>
 #include <EEPROM.h>
 #include <SoftwareSerial.h>
 #include <ESP8266WebServer.h> // Untuk server web di mode AP
 #include <ESP8266mDNS.h>      // Untuk mDNS di mode AP (opsional, tapi bagus)
 #include <ESP8266httpUpdate.h> // Untuk OTA updates
+#include <WiFiUdp.h>          // Untuk SNTP
+#include "trace_events.h"      // Format record flight recorder (sama dengan Arduino)
+#include "link_schema.h"       // Skema frame serial (sama dengan Arduino)
+#include "loop_stats.h"        // Histogram latensi loop (sama dengan Arduino)
+
+extern "C" {
+#include "user_interface.h"    // Untuk wakeup GPIO saat light sleep
+}
 
 // =====================================================
 // KONFIGURASI UMUM
 // =====================================================
 #define DEBUG_SERIAL Serial // Menggunakan Serial untuk debug
 #define ARDUINO_SERIAL mySerial // Menggunakan SoftwareSerial untuk komunikasi dengan Arduino
+#define ARDUINO_SERIAL_RX_BUFFER 1024 // Byte; ~1 detik data pada 9600 baud
+
+// Mode daya saat idle (lihat FUNGSI MANAJEMEN DAYA)
+#define POWER_MODE_ACTIVE 0       // Radio selalu aktif (perilaku lama)
+#define POWER_MODE_MODEM_SLEEP 1  // Radio tidur di antara beacon, CPU tetap jalan
+#define POWER_MODE_LIGHT_SLEEP 2  // Radio + CPU tidur, bangun oleh serial Arduino / timer
+#define POWER_MODE POWER_MODE_MODEM_SLEEP
+#define ARDUINO_RX_PIN D6         // Pin RX dari Arduino, juga dipakai sebagai sumber wakeup
+
+// Mode gateway multi-meter (lihat FUNGSI BUS RS-485). 0 = satu Arduino
+// point-to-point (perilaku lama), 1 = polling beberapa Arduino beralamat
+// di bus RS-485 half-duplex lewat pin serial yang sama.
+#define GATEWAY_MODE 0
+#define RS485_DE_PIN D5           // Driver enable transceiver RS-485 (DE dan /RE digabung)
+// Uji bus di host: 1 = frame bus lewat Serial USB (115200) alih-alih
+// transceiver RS-485, dijawab meter simulasi tools/bus_sim.py
+#define BUS_PORT_USB 0
 
 // Alamat EEPROM untuk menyimpan kredensial
-#define EEPROM_SIZE 512
+#define EEPROM_SIZE (GATEWAY_MODE ? 4096 : 512)
 #define EEPROM_SSID_ADDR 0
 #define EEPROM_PASS_ADDR 32
 #define EEPROM_ID_METER_ADDR 64
 #define EEPROM_JWT_ADDR 96
+#define EEPROM_PROVISION_ADDR 352  // Token provisioning (1+63), untuk registrasi ulang
+#define PROVISION_TOKEN_MAX 63
+#define EEPROM_BUS_TABLE_ADDR 512  // Tabel meter bus (khusus mode gateway)
+#define EEPROM_BUS_ENTRY_SIZE 288  // Alamat (1) + id meter (1+23) + JWT (1+255) + cadangan
 
 // URL API Backend - FIXED: Updated to IndoWater system
 // CHANGE THIS TO YOUR INDOWATER API SERVER URL
@@ -56,6 +113,24 @@ const char* SUBMIT_READING_ENDPOINT = "/device/MeterReading.php";
 const char* GET_COMMANDS_ENDPOINT = "/device/get_commands.php"; // Endpoint untuk polling perintah
 const char* ACK_COMMAND_ENDPOINT = "/device/ack_command.php"; // Endpoint untuk ACK perintah
 const char* OTA_UPDATE_ENDPOINT = "/ota/firmware.bin"; // Endpoint untuk OTA firmware
+// TLS untuk API HTTPS: isi salah satu pin di bawah. Jika keduanya kosong,
+// semua request HTTPS ditolak (fail closed) kecuali API_TLS_INSECURE
+// didefinisikan. API_TLS_INSECURE hanya untuk pengujian: sertifikat server
+// apa pun diterima, jadi JWT dan data tagihan bisa bocor ke server palsu.
+// #define API_TLS_INSECURE
+const char* API_TLS_FINGERPRINT = ""; // SHA-1 fingerprint sertifikat server, misal "AB:CD:..."
+const char API_ROOT_CA[] PROGMEM = R"CERT(
+)CERT"; // Root CA (PEM) server API
+const uint16_t TLS_MFLN_SIZE = 1024;  // Max Fragment Length yang dinegosiasikan (buffer RX/TX)
+
+// Server waktu (SNTP). Bisa diarahkan ke server NTP lokal / gateway LAN.
+const char* NTP_SERVER = "pool.ntp.org";
+const uint16_t NTP_PORT = 123;
+
+const char* SUBMIT_EVENT_ENDPOINT = "/device/event.php"; // Endpoint khusus event prioritas (pintu/pulsa/tegangan)
+const char* SUBMIT_BATCH_ENDPOINT = "/device/readings_batch.php"; // Upload gabungan pembacaan (mode gateway)
+const char* REGISTER_BUS_METER_ENDPOINT = "/device/register_bus_meter.php"; // Registrasi meter bus oleh gateway
+const char* REFRESH_TOKEN_ENDPOINT = "/device/refresh_token.php"; // Perpanjang JWT perangkat/meter bus
 
 // Kredensial Wi-Fi (akan disimpan di EEPROM setelah provisioning)
 String sta_ssid = "";
@@ -64,248 +139,676 @@ String sta_password = "";
 // Informasi Perangkat (akan disimpan di EEPROM setelah registrasi)
 String idMeter = "";
 String deviceJwtToken = ""; // JWT yang diterima dari server setelah registrasi
+String deviceProvisioningToken = ""; // Token provisioning, dipakai lagi jika JWT ditolak
+
+// Batas waktu koneksi Wi-Fi (lihat connectWiFiSTA)
+#define WIFI_CONNECT_TIMEOUT 30000      // Scan penuh + DHCP
+#define WIFI_FAST_CONNECT_TIMEOUT 3000  // Jalur cepat (cache RTC) sebelum fallback
+#define WIFI_CONNECT_POLL 10            // ms; delay() juga memberi waktu ke stack Wi-Fi
+#define WIFI_FAST_MAX_REUSE 16          // Reconnect cepat berturut-turut sebelum DHCP dipaksa
 
 // Status Koneksi
 bool isWiFiConnected = false;
 bool isDeviceRegistered = false;
 
 // Variabel untuk komunikasi dengan Arduino
-SoftwareSerial mySerial(D6, D7); // RX, TX (sesuaikan dengan pin yang terhubung ke Arduino)
+SoftwareSerial mySerial(ARDUINO_RX_PIN, D7); // RX, TX (sesuaikan dengan pin yang terhubung ke Arduino)
+
+// =====================================================
+// INTERVAL ADAPTIF
+// =====================================================
+// Interval poll/upload/reconnect/OTA tidak lagi konstan. Interval dipersempit
+// ke batas minimum saat ada aktivitas (air mengalir, perintah baru, pulsa
+// rendah) dan diperlebar eksponensial saat idle atau saat server error.
+// Setiap jadwal diberi jitter +/-20% agar perangkat satu armada tidak
+// melakukan request bersamaan. Batas min/max bisa di-override server lewat
+// objek "intervals" di respons pembacaan atau poll perintah.
+struct AdaptiveInterval {
+  unsigned long minMs;       // Batas tercepat (aktivitas tinggi)
+  unsigned long maxMs;       // Batas terlama (idle / error)
+  unsigned long currentMs;   // Interval dasar saat ini
+  unsigned long nextDelayMs; // currentMs + jitter untuk jadwal berikutnya
+};
 
 // Variabel untuk polling perintah dari server
 unsigned long lastCommandPollTime = 0;
-const long commandPollInterval = 10000; // Poll setiap 10 detik
+AdaptiveInterval commandPollInterval = {5000, 120000, 10000, 10000}; // Default poll setiap 10 detik
+
+// Interval kirim data meteran Arduino (diteruskan ke Arduino sebagai report_interval_ms)
+AdaptiveInterval meterDataSendInterval = {5000, 60000, 5000, 5000};
+
+// Perintah juga ikut dikirim di respons submitMeterReading (piggyback).
+// Poll terpisah hanya dijalankan jika tidak ada respons pembacaan yang
+// membawa daftar perintah dalam interval poll terakhir.
+unsigned long lastReadingExchangeTime = 0;
+bool hasReadingExchange = false;
 
 // Variabel untuk retry koneksi
 unsigned long lastReconnectAttempt = 0;
-const long reconnectInterval = 5000; // Coba reconnect setiap 5 detik
+AdaptiveInterval reconnectInterval = {5000, 300000, 5000, 5000}; // Mulai dari 5 detik, maks 5 menit
 
 // Variabel untuk OTA
 unsigned long lastOTACheckTime = 0;
-const long otaCheckInterval = 3600000; // Cek OTA setiap 1 jam (3600000 ms)
+AdaptiveInterval otaCheckInterval = {3600000, 21600000, 3600000, 3600000}; // 1 jam, maks 6 jam saat error
+
+// Status aktivitas untuk menentukan cadence
+const float LOW_CREDIT_THRESHOLD = 3000.0;        // Sama dengan ambang pulsa rendah di Arduino
+const unsigned long COMMAND_ACTIVITY_HOLD = 60000; // Tetap rapat 60 detik setelah perintah
+unsigned long lastCommandActivityTime = 0;
+bool hasCommandActivity = false;
+float lastKnownCredit = -1.0;                      // -1 = belum diketahui
+
+// =====================================================
+// ANTRIAN KELUAR (EVENT PRIORITAS & DATA RUTIN)
+// =====================================================
+// Pesan dari Arduino dipisah menjadi dua kelas:
+// - Event keselamatan (pintu_terbuka, pulsa_habis, tegangan_rendah, serta
+//   anomali aliran kebocoran/aliran_berlebih/aliran_saat_tertutup) masuk
+//   eventQueue, dikirim lebih dulu ke SUBMIT_EVENT_ENDPOINT dan di-retry
+//   dengan backoff sampai diterima server. Tidak pernah dibuang karena
+//   antrian rutin penuh.
+// - Snapshot rutin masuk readingQueue; jika penuh, snapshot tertua tanpa
+//   agregat dibuang (data terbaru selalu membawa total meter terkini).
+//   Pembacaan yang membawa agregat interval tertutup tidak dibuang saat
+//   upload gagal: tetap di depan antrian dan di-retry dengan backoff seperti
+//   event. Agregat hanya hilang jika antrian penuh agregat (gangguan lebih
+//   dari READING_QUEUE_SIZE interval), dihitung di droppedAggregates.
+struct QueuedReading {
+  float flowRate;
+  float meterReading;
+  float voltage;
+  int doorStatus;
+  LinkStatus status;
+  LinkValve valve;
+  long seq;                    // Nomor urut pembacaan dari Arduino (-1 = tidak ada)
+  unsigned long detectedAt;    // millis() saat event terdeteksi (perkiraan)
+  unsigned long nextAttemptAt; // Jadwal retry berikutnya (khusus event)
+  uint8_t attempts;
+  uint8_t meter;               // Slot tabel meter bus, BUS_LOCAL_METER = Arduino lokal
+  char aggregate[128];         // Objek "agg" (JSON) dari Arduino, kosong = snapshot biasa
+  char arduinoLoop[160];       // Objek "loop" (statistik loop Arduino), kosong = tidak ada
+};
+
+#define EVENT_QUEUE_SIZE 8
+#define READING_QUEUE_SIZE 4
+QueuedReading eventQueue[EVENT_QUEUE_SIZE];
+QueuedReading readingQueue[READING_QUEUE_SIZE];
+uint8_t eventQueueHead = 0;
+uint8_t eventQueueCount = 0;
+uint8_t readingQueueHead = 0;
+uint8_t readingQueueCount = 0;
+
+const unsigned long EVENT_RETRY_BASE = 1000;  // Retry pertama setelah 1 detik
+const unsigned long EVENT_RETRY_MAX = 30000;  // Retry paling lambat setiap 30 detik
+unsigned long droppedReadings = 0;            // Snapshot rutin yang dibuang karena antrian penuh
+unsigned long droppedAggregates = 0;          // Agregat interval yang hilang karena antrian penuh agregat
+bool readingHeadInFlight = false;             // Pembacaan terdepan sedang dikirim (tidak boleh digusur)
+unsigned long droppedEvents = 0;              // Hanya jika eventQueue sendiri penuh
+unsigned long lastEventLatencyMs = 0;         // Deteksi di Arduino -> diterima server
+unsigned long maxEventLatencyMs = 0;
+long readingInFlightSeq = -1;                 // Pembacaan rutin yang sedang dikirim: seq,
+float readingInFlightFlowRate = 0.0;          // laju aliran (interval adaptif) dan
+bool readingInFlightLoopReport = false;       // apakah node_loop ikut terkirim
+
+// ACK perintah (hasil eksekusi dari Arduino/meter bus, dump_trace NodeMCU)
+// masuk ackQueue, tidak langsung ke engine HTTP: dikirim satu per satu
+// setelah event prioritas dan di-retry dengan backoff sampai server
+// menjawab. Penolakan final (4xx selain 401/408/429) tidak di-retry. ACK
+// ikut checkpoint RTC (tanpa notes dan nilai config).
+#define ACK_QUEUE_SIZE 6
+#define ACK_NOTES_SIZE 48
+#define ACK_NO_VALVE LINK_VALVE_COUNT    // ACK tanpa status valve (dump_trace NodeMCU)
+struct QueuedAck {
+  long commandId;
+  LinkAck status;
+  uint8_t valve;               // LinkValve, ACK_NO_VALVE = tidak dilaporkan
+  uint8_t meter;               // Slot tabel meter bus, BUS_LOCAL_METER = perangkat
+  uint8_t configCount;         // Nilai PARAMS jawaban get_config, 0 = tanpa config
+  uint16_t configBools;        // Bit per nilai config bertipe bool
+  float config[LINK_PARAM_COUNT];
+  char notes[ACK_NOTES_SIZE];
+  unsigned long nextAttemptAt;
+  uint8_t attempts;
+};
+static_assert(LINK_PARAM_COUNT <= 16, "configBools di QueuedAck hanya 16 bit");
+
+QueuedAck ackQueue[ACK_QUEUE_SIZE];
+uint8_t ackQueueHead = 0;
+uint8_t ackQueueCount = 0;
+unsigned long droppedAcks = 0;                // Hanya jika ackQueue sendiri penuh
+
+// =====================================================
+// GATEWAY MULTI-METER (BUS RS-485)
+// =====================================================
+// Pada mode gateway, satu NodeMCU (satu asosiasi WiFi) melayani beberapa
+// Arduino beralamat di bus RS-485. Gateway bergiliran mengirim frame
+// LINK_MSG_POLL ke alamat N; hanya meter beralamat N yang menjawab, sehingga bus
+// half-duplex tidak pernah bertabrakan. Setiap meter punya id meter dan JWT
+// sendiri (registrasi lewat gateway), pembacaan terakhir, dan antrian frame
+// (update saldo/perintah) yang dikirim saat gilirannya. Pembacaan semua
+// meter diunggah dalam satu request gabungan; event prioritas dan ACK tetap
+// dikirim per meter dengan JWT meter tersebut. Alamat yang menjawab tapi
+// belum dikenal diregistrasi otomatis (discovery): handler frame hanya
+// mencatat alamatnya, registrasi berjalan async dari loop satu per satu.
+#define BUS_METER_SLOTS (GATEWAY_MODE ? 8 : 1)
+#define BUS_MAX_ADDRESS 31
+#define BUS_FRAME_QUEUE_SIZE 3
+#define BUS_FRAME_SIZE 192
+#define BUS_LOCAL_METER 0xFF
+#define BATCH_CARRIED_AGG 0x01
+#define BATCH_CARRIED_LOOP 0x02
+
+struct BusMeter {
+  uint8_t address;          // 1..BUS_MAX_ADDRESS, 0 = slot kosong
+  char idMeter[24];
+  char jwt[256];
+  bool online;
+  uint8_t missedPolls;
+  unsigned long lastSeen;
+  bool hasReading;          // Ada pembacaan baru untuk upload gabungan berikutnya
+  bool inBatch;             // Meter ini ikut upload gabungan yang sedang berjalan
+  bool readingSent;         // reading = snapshot yang dikirim di upload itu (belum diganti)
+  uint8_t batchCarried;     // BATCH_CARRIED_*: bagian reading yang juga ada di upload itu
+  long batchSeq;            // seq pembacaan di upload gabungan yang berjalan (-1 = tanpa seq)
+  bool legacyLink;          // Firmware lama: frame objek berkunci, bukan array skema
+  QueuedReading reading;
+  char frames[BUS_FRAME_QUEUE_SIZE][BUS_FRAME_SIZE]; // Frame JSON siap kirim ke meter ini
+  uint8_t frameHead;
+  uint8_t frameCount;
+};
+
+BusMeter busMeters[BUS_METER_SLOTS];
+Stream* busPort = &ARDUINO_SERIAL;            // Serial USB jika BUS_PORT_USB (lihat setup)
+const unsigned long BUS_POLL_GAP = 50;         // Jeda minimum antar frame dari gateway
+const unsigned long BUS_RESPONSE_TIMEOUT = 1500; // Loop Arduino bisa tertahan pulseIn/LCD
+const uint8_t BUS_OFFLINE_AFTER = 3;           // Poll tak terjawab berturut-turut sebelum offline
+uint8_t busAwaitingAddress = 0;                // Alamat yang sedang ditunggu jawabannya (0 = bus bebas)
+unsigned long busLastTxTime = 0;
+uint8_t busNextSlot = 0;                       // Giliran poll round-robin
+uint8_t busProbeAddress = 1;                   // Alamat berikutnya untuk discovery
+bool busProbeLegacy = false;                   // Putaran discovery ini memakai poll format lama
+unsigned long lastBusBatchTime = 0;
+float busBatchFlowRate = 0.0;                  // Laju aliran maksimum di upload yang berjalan
+bool busBatchLoopReport = false;               // node_loop ikut upload yang berjalan
+uint32_t busPollTimeouts = 0;
+uint32_t busFramesDropped = 0;
+uint32_t busPendingRegistrations = 0;          // Bit per alamat yang menunggu registrasi
+uint8_t busRegisteringAddress = 0;             // Registrasi yang sedang berjalan (0 = tidak ada)
+
+// =====================================================
+// MANAJEMEN DAYA
+// =====================================================
+// Di antara pertukaran data terjadwal, radio (dan pada mode light sleep juga
+// CPU) ditidurkan. Node bangun jika ada aktivitas serial dari Arduino atau
+// jadwal berikutnya tiba. Selama sesi perintah aktif radio tetap bangun agar
+// latensi perintah tidak bertambah. Duty cycle (persentase waktu bangun)
+// diukur per jendela laporan dan dikirim bersama data meteran.
+const unsigned long POWER_IDLE_SLICE = 20;    // Cek serial setiap 20 ms saat idle
+const unsigned long POWER_IDLE_MAX = 1000;    // Paling lama tidur 1 detik per pass loop
+const unsigned long POWER_AWAKE_DELAY = 100;  // Jeda loop saat radio harus bangun
+const uint8_t POWER_LISTEN_INTERVAL = 3;      // Bangun setiap 3 DTIM beacon
+bool powerSaveEngaged = false;                // Sleep mode WiFi sedang aktif
+unsigned long powerWindowStart = 0;           // Awal jendela pengukuran duty cycle
+unsigned long powerSleepMs = 0;               // Total waktu idle/tidur di jendela ini
+float lastPowerDutyPct = 100.0;               // Duty cycle jendela sebelumnya
+
+// =====================================================
+// WAKTU PERANGKAT (SNTP)
+// =====================================================
+// Waktu epoch dihitung dari titik sinkron SNTP terakhir ditambah millis()
+// yang sudah dikoreksi drift kristal. Setiap pembacaan dan event membawa
+// waktu capture ("ts", epoch ms) sehingga antrian, retry dan upload
+// gabungan tidak menggeser timeline pemakaian. Sebelum sinkron pertama,
+// pembacaan membawa "age_ms" (umur data saat dikirim) sebagai fallback
+// monotonic; server menghitung waktu capture = waktu terima - age_ms.
+WiFiUDP ntpUdp;
+bool timeSynced = false;
+uint64_t syncEpochMs = 0;              // Epoch (ms) pada titik sinkron terakhir
+unsigned long syncMillis = 0;          // millis() pada titik sinkron terakhir
+float clockDriftPpm = 0.0;             // Koreksi drift millis() (+ = millis() lebih lambat)
+long lastNtpOffsetMs = 0;              // Selisih prediksi vs NTP saat sinkron terakhir
+uint32_t ntpSyncCount = 0;
+uint32_t ntpSyncFailures = 0;
+unsigned long lastNtpSyncTime = 0;
+AdaptiveInterval ntpSyncInterval = {600000, 21600000, 600000, 600000}; // 10 menit, diperlebar sampai 6 jam
+const unsigned long NTP_TIMEOUT = 1000;
+const uint16_t NTP_LOCAL_PORT = 2390;
+const uint32_t NTP_UNIX_OFFSET = 2208988800UL; // Detik 1900-01-01 -> 1970-01-01
+const float NTP_MAX_DRIFT_PPM = 500.0;         // Kristal ESP8266 jauh di bawah ini
+const long NTP_STEP_THRESHOLD_MS = 10000;      // Selisih lebih besar = jam di-reset, bukan drift
+
+// =====================================================
+// ENGINE HTTP ASINKRON
+// =====================================================
+// Request API tidak dijalankan di tempat: pemanggil memasukkannya ke antrian
+// httpRequests beserta callback, lalu httpService() (setiap pass loop)
+// menjalankan state machine tiap request:
+//   QUEUED -> connect + kirim -> WAITING -> baca respons tanpa blocking
+//   setiap pass -> parse JSON -> callback -> FREE
+// Selama server memproses request, loop tetap melayani serial Arduino/bus,
+// web server dan timer. Yang masih blocking hanya connect (TCP + handshake
+// TLS, singkat berkat resumption sesi); buffer RX SoftwareSerial menampung
+// frame yang masuk selama itu. Respons diminta sebagai HTTP/1.0 (tanpa
+// chunked, koneksi ditutup server) dan dikumpulkan di buffer koneksi.
+// Jumlah koneksi bersamaan = HTTP_MAX_INFLIGHT; setiap koneksi TLS punya
+// buffer BearSSL sendiri (2 x TLS_MFLN_SIZE jika MFLN didukung).
+// Body yang tidak muat di slot (upload gabungan gateway) memakai satu
+// buffer besar bersama; request kedua yang butuh buffer itu selagi masih
+// dipakai ditolak seperti antrian penuh. Dengan begitu RAM statis gateway
+// tidak naik 4 KB per slot antrian. Sisa heap setelah handshake TLS
+// dilaporkan di indowater_heap_free_after_connect_min_bytes (lihat
+// tools/heap_soak.py).
+#define HTTP_QUEUE_SIZE (GATEWAY_MODE ? 3 : 4)   // Request antri + berjalan (~1.2 KB per slot)
+#define HTTP_MAX_INFLIGHT 1                      // Koneksi API bersamaan
+#define HTTP_BODY_SIZE 1024                      // Body per slot antrian
+#define HTTP_LARGE_BODY_SIZE (GATEWAY_MODE ? 4096 : 1) // Gateway mengirim pembacaan semua meter sekaligus
+#define HTTP_RESPONSE_SIZE (GATEWAY_MODE ? 4096 : 1536) // Header + body satu respons
+#define HTTP_REQUEST_TIMEOUT 15000               // Request terkirim -> respons lengkap
+#define HTTP_WAIT_SLICE 2                        // ms; jeda httpPOST() di antara servis
+
+enum HttpRequestState {
+  HTTP_REQ_FREE = 0,
+  HTTP_REQ_QUEUED,     // Menunggu koneksi bebas
+  HTTP_REQ_WAITING,    // Terkirim, respons sedang dibaca
+  HTTP_REQ_AUTH_WAIT   // Dapat 401, menunggu refresh JWT lalu dikirim ulang
+};
+
+#define HTTP_AUTH_NONE 0xFE    // Request tanpa Authorization (lihat HttpRequest.auth)
+
+// Dipanggil tepat sekali per request. httpCode -1 = gagal koneksi/timeout;
+// response selalu punya "status" ("error" + "message" jika gagal).
+typedef void (*HttpCallback)(int httpCode, JsonDocument& response, uintptr_t context);
+
+struct HttpRequest {
+  uint8_t state;
+  uint8_t endpointIndex;       // METRIC_EP_*
+  uint8_t uplinkPath;          // Indeks UPLINK_PATHS, UPLINK_PATH_NONE = selalu JSON
+  bool post;
+  bool cbor;                   // Body CBOR (lihat UPLINK BINER), false = JSON
+  char path[128];              // Endpoint + query, relatif ke API_BASE_URL
+  uint8_t auth;                // Pemilik JWT: slot meter bus, BUS_LOCAL_METER = perangkat, HTTP_AUTH_NONE
+  bool authRetried;            // Sudah dikirim ulang sekali setelah refresh karena 401
+  char* body;                  // bodyBuffer atau httpLargeBody
+  size_t bodyCapacity;
+  size_t bodyLength;
+  char bodyBuffer[HTTP_BODY_SIZE];
+  size_t responseCapacity;     // Kapasitas dokumen respons sementara
+  JsonDocument* responseDoc;   // Dokumen milik pemanggil, nullptr = dokumen sementara
+  HttpCallback callback;
+  uintptr_t context;
+  uint32_t order;              // Urutan masuk antrian (FIFO)
+  unsigned long queuedAt;
+  unsigned long sentAt;
+};
+
+struct HttpConnection {
+  HttpRequest* request;        // nullptr = koneksi bebas
+  char response[HTTP_RESPONSE_SIZE];
+  size_t length;
+  size_t bodyOffset;           // 0 = header belum lengkap
+  long contentLength;          // -1 = tidak ada, body sampai koneksi ditutup
+  int statusCode;
+  int8_t acceptsCbor;          // Header Accept-Post: -1 tidak ada, 0 tanpa CBOR, 1 CBOR
+};
+
+HttpRequest httpRequests[HTTP_QUEUE_SIZE];
+HttpConnection httpConnections[HTTP_MAX_INFLIGHT];
+char httpLargeBody[HTTP_LARGE_BODY_SIZE];
+HttpRequest* httpLargeBodyOwner = nullptr;  // nullptr = buffer besar bebas
+uint32_t httpHeapAfterConnectMin = 0;       // Heap bebas terendah tepat setelah connect (0 = belum ada)
+uint32_t httpRequestOrder = 0;
+uint32_t httpQueueRejected = 0;       // Request ditolak karena antrian penuh
+uint32_t httpTimeouts = 0;
+unsigned long httpQueueWaitLastMs = 0; // Masuk antrian -> mulai dikirim
+unsigned long httpQueueWaitMaxMs = 0;
+
+// Hasil httpPOST() yang menunggu request-nya selesai
+struct HttpWait {
+  bool done;
+  int httpCode;
+};
+
+// =====================================================
+// SIKLUS HIDUP JWT
+// =====================================================
+// JWT perangkat dan JWT tiap meter bus membawa klaim exp. Klaim dibaca lokal
+// setiap kali token dimuat atau diganti (payload = segmen tengah JWT; token
+// base64 JSON polos dari server lama juga dikenali), tanpa verifikasi tanda
+// tangan karena hanya dipakai untuk jadwal. Token diperbarui lewat
+// REFRESH_TOKEN_ENDPOINT sebelum kedaluwarsa: saat sisa umurnya kurang dari
+// 1/5 umur total (exp - iat), atau kurang dari JWT_REFRESH_MARGIN jika iat
+// tidak ada. Request refresh membawa Bearer token lama (boleh sudah
+// kedaluwarsa) plus id_meter dan device_id (chip id, "<chip>-<alamat>" untuk
+// meter bus) sebagai identitas yang tidak kedaluwarsa. Jadwal ini butuh jam
+// SNTP; sebelum sinkron hanya jalur 401 yang berlaku:
+// - Request ber-JWT yang dijawab 401 diparkir di slot antriannya, token
+//   di-refresh, lalu request dikirim ulang sekali dengan token baru.
+// - 401 lagi setelah retry, atau refresh yang ditolak server, menandai token
+//   ditolak: request ber-JWT pemilik itu langsung gagal tanpa ke jaringan.
+// - Refresh yang ditolak (401/403) diikuti registrasi ulang: perangkat lewat
+//   REGISTER_DEVICE_ENDPOINT dengan token provisioning tersimpan (server
+//   mengembalikan meter yang sama dengan JWT baru), meter bus lewat
+//   REGISTER_BUS_METER_ENDPOINT dengan JWT gateway. Tanpa token provisioning
+//   tersimpan (perangkat diprovisioning firmware lama) hanya refresh yang
+//   dicoba lagi dengan backoff eksponensial sampai berhasil.
+// Backoff kembali ke awal setelah ada request ber-JWT yang berhasil.
+const uint32_t JWT_REFRESH_MARGIN = 86400;       // Detik sebelum exp (token tanpa iat)
+const unsigned long JWT_CHECK_INTERVAL = 600000; // Cek jadwal refresh setiap 10 menit
+const unsigned long JWT_BACKOFF_BASE = 60000;
+const unsigned long JWT_BACKOFF_MAX = 3600000;
+
+struct JwtState {
+  uint32_t expiresAt;          // Klaim exp (epoch detik), 0 = tidak diketahui
+  uint32_t issuedAt;           // Klaim iat, 0 = tidak ada
+  bool refreshing;             // Request refresh sedang antri/berjalan
+  bool rejected;               // Ditolak server: request ber-JWT ditahan sampai refresh berhasil
+  unsigned long backoffSince;
+  unsigned long backoffMs;     // 0 = tidak dalam backoff
+};
+
+JwtState deviceJwtState;
+JwtState busJwtStates[BUS_METER_SLOTS];
+unsigned long lastJwtCheckTime = 0;
+uint32_t jwtRefreshes = 0;
+uint32_t jwtRefreshFailures = 0;
+uint32_t jwtUnauthorized = 0;   // Respons 401 untuk request ber-JWT
+uint32_t jwtRequestsHeld = 0;   // Request yang tidak dikirim karena token ditolak
+
+// =====================================================
+// UPLINK BINER (CBOR)
+// =====================================================
+// Body POST bisa dikirim sebagai CBOR (RFC 8949, Content-Type
+// application/cbor) alih-alih JSON. Kunci yang ada di UPLINK_FIELDS diganti
+// integer (indeksnya) dan field ber-scale dikirim sebagai integer
+// fixed-point (nilai x scale); kunci lain (mis. isi "agg" dari Arduino)
+// tetap string dan angka lain float32. Pemanggil tetap menyusun dokumen
+// JSON yang sama; format dipilih per path (UPLINK_PATHS, bukan per metrik
+// METRIC_EP_*: readings_batch dan MeterReading, register_bus_meter dan
+// register_device berbagi metrik tapi bisa dilayani skrip server berbeda):
+// - Respons dengan header "Accept-Post: application/cbor, ..." membuat
+//   request berikutnya ke path itu memakai CBOR; Accept-Post tanpa
+//   application/cbor mengembalikannya ke JSON.
+// - Server tanpa header Accept-Post tetap menerima JSON seperti biasa.
+// - 415 untuk body CBOR juga mengembalikan path ke JSON (request itu
+//   gagal dan di-retry/diganti seperti kegagalan lain).
+// tools/uplink_server.py adalah server tiruan yang men-decode body CBOR
+// dengan tabel ini dan membandingkan ukurannya dengan JSON.
+struct UplinkField {
+  const char* name;
+  uint16_t scale;              // > 0: integer fixed-point (nilai x scale)
+};
+
+// Kunci integer = indeks tabel; entri hanya boleh ditambah di akhir
+const UplinkField UPLINK_FIELDS[] = {
+  {"id_meter", 0}, {"flow_rate_lpm", 1000}, {"meter_reading_m3", 10000},
+  {"current_voltage", 100}, {"door_status", 0}, {"status_message", 0},
+  {"valve_status", 0}, {"include_commands", 0}, {"power_duty_pct", 10},
+  {"seq", 0}, {"event_latency_ms", 0}, {"wifi_connect_ms", 0},
+  {"ts", 0}, {"age_ms", 0}, {"agg", 0}, {"loop", 0}, {"node_loop", 0},
+  {"event_type", 0}, {"queued_ms", 0}, {"attempt", 0},
+  {"command_id", 0}, {"status", 0}, {"notes", 0}, {"valve_status_ack", 0},
+  {"config", 0}, {"gateway_id", 0}, {"readings", 0}
+};
+const uint8_t UPLINK_FIELD_COUNT = sizeof(UPLINK_FIELDS) / sizeof(UPLINK_FIELDS[0]);
+
+#define UPLINK_FORMAT_JSON 0
+#define UPLINK_FORMAT_CBOR 1
+#define UPLINK_RAW_SIZE 192              // JSON mentah terbesar di dokumen ("loop" Arduino)
+
+struct CborWriter {
+  uint8_t* out;
+  size_t capacity;
+  size_t length;
+  bool failed;                 // Tidak muat atau nilai tidak bisa di-encode
+};
+
+#define UPLINK_PATH_NONE 0xFF                // Path tanpa negosiasi format (GET, OTA)
+uint16_t uplinkCborPaths = 0;              // Bit per indeks UPLINK_PATHS: path menerima CBOR
+uint32_t uplinkBytes[2] = {0, 0};          // Byte body terkirim per UPLINK_FORMAT_*
+uint32_t uplinkEncodeUs[2] = {0, 0};       // Waktu encode per UPLINK_FORMAT_*
+uint32_t uplinkJsonEquivalentBytes = 0;   // Ukuran JSON dari body yang dikirim sebagai CBOR
+uint32_t uplinkJsonEquivalentUs = 0;      // Waktu measureJson() untuk body tersebut
+
+// =====================================================
+// KLIEN TLS
+// =====================================================
+// Satu klien BearSSL per koneksi engine HTTP, dipakai ulang untuk semua
+// request HTTPS. Sesi TLS di-cache (resumption, dipakai bersama semua
+// klien) sehingga hanya request pertama yang melakukan full handshake; sesi
+// juga disimpan di RTC memory agar tetap berlaku setelah restart
+// non-power-on. Jika server mendukung MFLN, buffer BearSSL diperkecil dari
+// ~16 KB ke TLS_MFLN_SIZE.
+BearSSL::WiFiClientSecure secureClients[HTTP_MAX_INFLIGHT];
+BearSSL::Session tlsSession;
+BearSSL::X509List tlsTrustAnchor;
+WiFiClient plainClients[HTTP_MAX_INFLIGHT];
+bool apiUsesTLS = false;
+bool tlsMflnSupported = false;
+bool tlsMflnProbed = false;
+char apiHost[64];
+char apiBasePath[64];          // Path di API_BASE_URL (tanpa "/" akhir), boleh kosong
+uint16_t apiPort = 80;
+
+// Layout RTC user memory (blok 4 byte, total 128 blok)
+#define RTC_TLS_SESSION_BLOCK 0
+#define RTC_TLS_SESSION_MAGIC 0x544C5331 // "TLS1"
+struct RtcTlsSession {
+  uint32_t magic;
+  uint32_t crc;
+  br_ssl_session_parameters params;
+};
+#define RTC_WIFI_CACHE_BLOCK 32
+#define RTC_WIFI_CACHE_MAGIC 0x57494631 // "WIF1"
+static_assert(sizeof(RtcTlsSession) <= RTC_WIFI_CACHE_BLOCK * 4, "Sesi TLS menimpa cache Wi-Fi di RTC memory");
+
+// Koneksi Wi-Fi terakhir yang berhasil lewat scan penuh + DHCP. Dipakai
+// ulang untuk reconnect tanpa scan channel dan tanpa DHCP (lihat
+// connectWiFiSTA). Lease dipakai sebagai IP statis, jadi setelah
+// WIFI_FAST_MAX_REUSE reconnect cepat berturut-turut koneksi penuh dipaksa
+// agar lease diperbarui.
+struct RtcWifiCache {
+  uint32_t magic;
+  uint32_t crc;
+  uint32_t ssidCrc;            // Cache hanya berlaku untuk SSID yang sama
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t reuseCount;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns1;
+  uint32_t dns2;
+};
+
+// Statistik handshake TLS (dilaporkan di /metrics)
+uint32_t tlsHandshakeCount = 0;
+uint32_t tlsHandshakeFailures = 0;
+uint32_t tlsHandshakeSumMs = 0;
+unsigned long tlsHandshakeLastMs = 0;
+uint32_t tlsRefused = 0;       // Koneksi HTTPS ditolak karena tidak ada pin TLS
+bool tlsTrustConfigured = false;
+
+// Buffer tetap untuk request OTA (ESPhttpUpdate, di luar engine HTTP)
+char httpUrl[192];
+char httpAuthHeader[300];  // "Bearer " + JWT (maks 255 karakter di EEPROM)
+char serialFrame[512];     // Satu frame JSON dari Arduino (frame agregat + loop ~450 byte)
+bool arduinoLegacyLink = false; // Arduino lokal memakai frame objek lama (lihat link_schema.h)
+
+// =====================================================
+// CHECKPOINT WARM RESTART (RTC MEMORY)
+// =====================================================
+// State runtime yang mahal dibangun ulang (antrian event, snapshot terbaru,
+// jadwal interval, titik sinkron waktu, pulsa terakhir) disalin ke RTC user
+// memory setiap kali berubah: perubahan menandai checkpointDirty dan
+// checkpoint ditulis di akhir pass loop. Setelah reset non-power-on
+// (watchdog, exception, ESP.restart() setelah OTA, reset eksternal) state
+// dipulihkan di setup(). Lama reset diukur dari jam RTC yang tetap berjalan,
+// sehingga umur event, waktu epoch dan jadwal poll tetap benar. ACK perintah
+// yang belum terkirim ikut tanpa notes dan nilai config. Agregat dan
+// statistik loop tidak ikut (tidak muat di RTC memory).
+// Boot-loop guard: checkpoint juga menghitung reset exception/watchdog
+// berturut-turut yang memulihkannya. Jika state yang dipulihkan sendiri
+// penyebab crash, setelah CHECKPOINT_MAX_CRASH_RESTORES kali checkpoint
+// dibuang dan perangkat mulai dari state kosong. Hitungan kembali 0 setelah
+// perangkat berjalan CHECKPOINT_STABLE_MS tanpa reset.
+#define RTC_CHECKPOINT_BLOCK 42
+#define RTC_CHECKPOINT_MAGIC 0x434B5033 // "CKP3", ganti jika layout berubah
+#define CHECKPOINT_MAX_CRASH_RESTORES 3
+#define CHECKPOINT_STABLE_MS 300000UL   // 5 menit
+#define CHECKPOINT_MAX_DOWNTIME_MS 3600000UL // Downtime lebih lama = jam RTC tidak bisa dipercaya
+#define CHECKPOINT_READINGS 1           // Snapshot rutin terbaru (membawa total meter)
+#define CHECKPOINT_INTERVAL_COUNT 5
+#define CHECKPOINT_ACKS 3               // ACK tertua yang belum terkirim
+
+AdaptiveInterval* const CHECKPOINT_INTERVALS[CHECKPOINT_INTERVAL_COUNT] = {
+  &commandPollInterval, &meterDataSendInterval, &reconnectInterval, &otaCheckInterval, &ntpSyncInterval
+};
+unsigned long* const CHECKPOINT_LAST_TIMES[CHECKPOINT_INTERVAL_COUNT] = {
+  &lastCommandPollTime, &lastBusBatchTime, &lastReconnectAttempt, &lastOTACheckTime, &lastNtpSyncTime
+};
+
+struct CheckpointReading {
+  float flowRate;
+  float meterReading;
+  float voltage;
+  int32_t seq;
+  uint32_t ageMs;              // Umur data saat checkpoint ditulis
+  int8_t doorStatus;
+  uint8_t status;              // LinkStatus (link_schema.h)
+  uint8_t valve;               // LinkValve
+  uint8_t meter;
+};
+
+struct CheckpointAck {
+  int32_t commandId;
+  uint8_t status;              // LinkAck
+  uint8_t valve;               // LinkValve, ACK_NO_VALVE = tidak dilaporkan
+  uint8_t meter;
+};
+
+struct CheckpointInterval {
+  uint32_t currentMs;
+  uint32_t nextDelayMs;
+  uint32_t sinceLastMs;        // now - lastTime saat checkpoint ditulis
+};
+
+struct RtcCheckpoint {
+  uint32_t magic;
+  uint32_t crc;
+  uint32_t rtcTime;            // system_get_rtc_time() saat ditulis
+  uint64_t epochMs;            // Epoch saat ditulis, 0 = waktu belum sinkron
+  float clockDriftPpm;
+  float lastKnownCredit;
+  CheckpointInterval intervals[CHECKPOINT_INTERVAL_COUNT];
+  uint8_t eventCount;
+  uint8_t readingCount;
+  uint8_t crashRestores;       // Reset exception/WDT berturut-turut yang memulihkan checkpoint ini
+  uint8_t ackCount;
+  CheckpointReading events[EVENT_QUEUE_SIZE];
+  CheckpointReading readings[CHECKPOINT_READINGS];
+  CheckpointAck acks[CHECKPOINT_ACKS];
+};
+static_assert(sizeof(RtcWifiCache) <= (RTC_CHECKPOINT_BLOCK - RTC_WIFI_CACHE_BLOCK) * 4, "Cache Wi-Fi menimpa checkpoint di RTC memory");
+static_assert(sizeof(RtcCheckpoint) <= (128 - RTC_CHECKPOINT_BLOCK) * 4, "Checkpoint tidak muat di RTC user memory");
+
+bool checkpointDirty = false;
+bool checkpointRestored = false;
+uint8_t checkpointCrashRestores = 0; // Ditulis ulang ke checkpoint (boot-loop guard)
+bool checkpointDiscarded = false;    // Checkpoint dibuang oleh boot-loop guard saat boot ini
+
+// =====================================================
+// FLIGHT RECORDER (lihat trace_events.h)
+// =====================================================
+// Ring event biner di RAM, selalu aktif. dump_trace mengunggah ring ini per
+// bagian (muat di body request HTTP) ke TRACE_UPLOAD_ENDPOINT lalu meneruskan
+// perintah ke Arduino; frame trace Arduino diunggah begitu diterima.
+#define TRACE_UPLOAD_ENDPOINT "/device/trace_dump.php"
+#define TRACE_RING_SIZE 128              // Harus pangkat dua (1 KB)
+#define TRACE_UPLOAD_RECORDS (GATEWAY_MODE ? 32 : 20) // Record per POST
+#define TRACE_OVERRUN_MS 2000            // Pass loop (tanpa idle) lebih lama = overrun
+TraceRecord traceRing[TRACE_RING_SIZE];
+uint16_t traceHead = 0;
+uint32_t traceTotal = 0;                 // Jumlah event sejak boot
+bool traceFrozen = false;                // Ring tidak diubah selama diunggah
+long pendingTraceDumpId = -1;            // command_id dump_trace yang menunggu
+uint8_t pendingTraceDumpMeter = BUS_LOCAL_METER;
+
+// =====================================================
+// STATISTIK LATENSI LOOP (lihat loop_stats.h)
+// =====================================================
+// Waktu idle (powerIdle) tidak dihitung. Ringkasan jendela ikut pembacaan
+// meter sebagai "node_loop" paling cepat setiap LOOP_REPORT_INTERVAL dan
+// direset setelah terkirim; statistik Arduino diteruskan sebagai "loop".
+#define LOOP_DEADLINE_MS 1000            // Pass lebih lama = deadline miss (frame Arduino tertunda)
+#define LOOP_REPORT_INTERVAL 300000UL    // 5 menit
+enum LoopTag {
+  LOOP_WEB, LOOP_SERIAL, LOOP_UPLOAD, LOOP_COMMANDS, LOOP_OTA,
+  LOOP_NTP, LOOP_TRACE, LOOP_WIFI, LOOP_REGISTER, LOOP_HTTP
+};
+const char* const LOOP_TAG_NAMES[] = {
+  "web", "serial", "upload", "commands", "ota", "ntp", "trace", "wifi", "register", "http"
+};
+LoopStats loopStats;
+
+// =====================================================
+// METRIK RUNTIME (/metrics, format teks Prometheus)
+// =====================================================
+// Semua metrik disimpan di counter berukuran tetap; pencatatan di jalur
+// request tidak mengalokasikan memori. Output /metrics dirender bertahap
+// ke buffer statis dan dikirim chunked.
+#define METRIC_EP_REGISTER 0
+#define METRIC_EP_READING 1
+#define METRIC_EP_COMMANDS 2
+#define METRIC_EP_ACK 3
+#define METRIC_EP_EVENT 4
+#define METRIC_EP_OTA 5
+#define METRIC_EP_OTHER 6
+#define METRIC_EP_AUTH 7
+#define METRIC_EP_COUNT 8
+const char* const METRIC_EP_NAMES[METRIC_EP_COUNT] = {
+  "register", "reading", "commands", "ack", "event", "ota", "other", "auth"
+};
+
+#define LATENCY_BUCKET_COUNT 8
+const uint16_t LATENCY_BUCKETS_MS[LATENCY_BUCKET_COUNT] = {50, 100, 250, 500, 1000, 2500, 5000, 10000};
+
+struct EndpointMetrics {
+  uint32_t buckets[LATENCY_BUCKET_COUNT + 1]; // Non-kumulatif; slot terakhir = +Inf
+  uint32_t latencySumMs;
+  uint32_t success;       // HTTP 2xx
+  uint32_t failure;       // Error koneksi atau status non-2xx
+  uint32_t bytesSent;
+  uint32_t bytesReceived;
+};
+
+EndpointMetrics endpointMetrics[METRIC_EP_COUNT];
+uint32_t serialFramesReceived = 0;
+uint32_t serialParseErrors = 0;
+uint32_t wifiReconnectCount = 0;
+uint32_t wifiFastConnects = 0;      // Reconnect lewat cache RTC yang berhasil
+uint32_t wifiFastFallbacks = 0;     // Jalur cepat gagal, lanjut scan penuh
+unsigned long wifiConnectMs = 0;    // Durasi koneksi Wi-Fi terakhir (target < 500 ms di jalur cepat)
+bool webServerStarted = false;
+char metricsLine[160]; // Buffer render satu baris /metrics
 
 // =====================================================
 // SERVER WEB UNTUK PROVISIONING (MODE AP)
 // =====================================
 ESP8266WebServer server(80);
 
-// HTML untuk halaman provisioning - Enhanced with better styling
-const char PROVISIONING_HTML[] PROGMEM = R"rawliteral(
-<!DOCTYPE html>
-<html>
-<head>
-    <meta charset="UTF-8">
-    <meta name="viewport" content="width=device-width, initial-scale=1.0">
-    <title>IndoWater Device Setup</title>
-    <style>
-        body {
-            font-family: Arial, sans-serif;
-            background: linear-gradient(135deg, #667eea 0%, #764ba2 100%);
-            margin: 0;
-            padding: 20px;
-            min-height: 100vh;
-            display: flex;
-            align-items: center;
-            justify-content: center;
-        }
-        .container {
-            background: white;
-            padding: 30px;
-            border-radius: 15px;
-            box-shadow: 0 10px 30px rgba(0,0,0,0.3);
-            max-width: 400px;
-            width: 100%;
-        }
-        .logo {
-            text-align: center;
-            margin-bottom: 30px;
-        }
-        .logo h1 {
-            color: #2c5aa0;
-            margin: 0;
-            font-size: 28px;
-        }
-        .logo p {
-            color: #666;
-            margin: 5px 0 0 0;
-            font-size: 14px;
-        }
-        .form-group {
-            margin-bottom: 20px;
-        }
-        label {
-            display: block;
-            margin-bottom: 5px;
-            color: #333;
-            font-weight: bold;
-        }
-        input[type="text"], input[type="password"] {
-            width: 100%;
-            padding: 12px;
-            border: 2px solid #ddd;
-            border-radius: 8px;
-            font-size: 16px;
-            box-sizing: border-box;
-            transition: border-color 0.3s;
-        }
-        input[type="text"]:focus, input[type="password"]:focus {
-            outline: none;
-            border-color: #2c5aa0;
-        }
-        button {
-            width: 100%;
-            padding: 12px;
-            background: #2c5aa0;
-            color: white;
-            border: none;
-            border-radius: 8px;
-            font-size: 16px;
-            cursor: pointer;
-            transition: background 0.3s;
-        }
-        button:hover {
-            background: #1e3d6f;
-        }
-        button:disabled {
-            background: #ccc;
-            cursor: not-allowed;
-        }
-        .status {
-            margin-top: 20px;
-            padding: 10px;
-            border-radius: 5px;
-            text-align: center;
-            display: none;
-        }
-        .status.success {
-            background: #d4edda;
-            color: #155724;
-            border: 1px solid #c3e6cb;
-        }
-        .status.error {
-            background: #f8d7da;
-            color: #721c24;
-            border: 1px solid #f5c6cb;
-        }
-        .device-info {
-            background: #f8f9fa;
-            padding: 15px;
-            border-radius: 8px;
-            margin-bottom: 20px;
-            font-size: 14px;
-        }
-        .device-info strong {
-            color: #2c5aa0;
-        }
-    </style>
-</head>
-<body>
-    <div class="container">
-        <div class="logo">
-            <h1>🌊 IndoWater</h1>
-            <p>Smart Water Meter Setup</p>
-        </div>
-        
-        <div class="device-info">
-            <strong>Device ID:</strong> <span id="deviceId">Loading...</span><br>
-            <strong>Status:</strong> <span id="deviceStatus">Ready for setup</span>
-        </div>
-        
-        <form id="provisioningForm">
-            <div class="form-group">
-                <label for="token">Provisioning Token:</label>
-                <input type="text" id="token" name="token" required 
-                       placeholder="Enter provisioning token" maxlength="32">
-            </div>
-            
-            <div class="form-group">
-                <label for="ssid">WiFi Network:</label>
-                <input type="text" id="ssid" name="ssid" required 
-                       placeholder="Enter WiFi network name">
-            </div>
-            
-            <div class="form-group">
-                <label for="password">WiFi Password:</label>
-                <input type="password" id="password" name="password" required 
-                       placeholder="Enter WiFi password">
-            </div>
-            
-            <button type="submit" id="submitBtn">Setup Device</button>
-        </form>
-        
-        <div id="status" class="status"></div>
-    </div>
-
-    <script>
-        // Get device ID
-        fetch('/device-info')
-            .then(response => response.json())
-            .then(data => {
-                document.getElementById('deviceId').textContent = data.device_id;
-            })
-            .catch(error => {
-                document.getElementById('deviceId').textContent = 'Unknown';
-            });
-
-        document.getElementById('provisioningForm').addEventListener('submit', function(e) {
-            e.preventDefault();
-            
-            const submitBtn = document.getElementById('submitBtn');
-            const statusDiv = document.getElementById('status');
-            
-            submitBtn.disabled = true;
-            submitBtn.textContent = 'Setting up...';
-            statusDiv.style.display = 'none';
-            
-            const formData = {
-                token: document.getElementById('token').value,
-                ssid: document.getElementById('ssid').value,
-                password: document.getElementById('password').value
-            };
-            
-            fetch('/provision', {
-                method: 'POST',
-                headers: {
-                    'Content-Type': 'application/json',
-                },
-                body: JSON.stringify(formData)
-            })
-            .then(response => response.json())
-            .then(data => {
-                statusDiv.style.display = 'block';
-                if (data.status === 'success') {
-                    statusDiv.className = 'status success';
-                    statusDiv.textContent = data.message;
-                    document.getElementById('deviceStatus').textContent = 'Setup complete';
-                    setTimeout(() => {
-                        statusDiv.textContent += ' Device will restart in 3 seconds...';
-                    }, 1000);
-                } else {
-                    statusDiv.className = 'status error';
-                    statusDiv.textContent = data.message;
-                    submitBtn.disabled = false;
-                    submitBtn.textContent = 'Setup Device';
-                }
-            })
-            .catch(error => {
-                statusDiv.style.display = 'block';
-                statusDiv.className = 'status error';
-                statusDiv.textContent = 'Connection error. Please try again.';
-                submitBtn.disabled = false;
-                submitBtn.textContent = 'Setup Device';
-            });
-        });
-    </script>
-</body>
-</html>
-)rawliteral";
+// Halaman provisioning disimpan sudah di-minify + gzip (sumber: assets/provisioning.html,
+// generate ulang dengan tools/build_provisioning_assets.py setelah edit HTML)
+#include "provisioning_html_gz.h"
+#define PROVISIONING_CHUNK_SIZE 512
 
 // =====================================================
 // FUNGSI SETUP
 // =====================================================
 void setup() {
   DEBUG_SERIAL.begin(115200);
-  ARDUINO_SERIAL.begin(9600);
+  // Buffer RX besar: frame tetap tertampung selama connect/handshake API
+  ARDUINO_SERIAL.begin(9600, SWSERIAL_8N1, ARDUINO_RX_PIN, D7, false, ARDUINO_SERIAL_RX_BUFFER);
+  trace(TRACE_BOOT, ESP.getResetInfoPtr()->reason, 0);
   
   DEBUG_SERIAL.println();
   DEBUG_SERIAL.println("=================================");
@@ -317,6 +820,21 @@ void setup() {
   // Load credentials from EEPROM
   loadCredentials();
   
+  if (GATEWAY_MODE) {
+    pinMode(RS485_DE_PIN, OUTPUT);
+    digitalWrite(RS485_DE_PIN, LOW); // Mode terima
+    if (BUS_PORT_USB) {
+      busPort = &DEBUG_SERIAL; // Log debug ikut tercampur; bus_sim.py hanya membaca baris frame
+    }
+    loadBusMeters();
+  }
+  
+  // Lanjutkan antrian, jadwal dan waktu dari sebelum reset (jika ada)
+  checkpointRestored = restoreCheckpoint();
+  
+  // Siapkan klien TLS (pin sertifikat, sesi tersimpan)
+  setupTlsClient();
+  
   // Cek apakah sudah ada kredensial Wi-Fi
   if (sta_ssid.length() > 0 && sta_password.length() > 0) {
     DEBUG_SERIAL.println("Found saved WiFi credentials, attempting connection...");
@@ -327,6 +845,15 @@ void setup() {
       DEBUG_SERIAL.print("IP Address: ");
       DEBUG_SERIAL.println(WiFi.localIP());
       
+      // Endpoint /metrics lokal di mode STA
+      setupMetricsServer();
+      
+      // Sinkron waktu pertama; gagal tidak masalah (fallback age_ms).
+      // Waktu dari checkpoint tetap disinkron ulang sesuai jadwal.
+      if (!timeSynced) {
+        syncTime();
+      }
+      
       // Cek apakah device sudah terdaftar
       if (idMeter.length() > 0 && deviceJwtToken.length() > 0) {
         isDeviceRegistered = true;
@@ -351,45 +878,125 @@ void setup() {
 // =====================================================
 void loop() {
   unsigned long currentMillis = millis();
+  loopPassBegin(loopStats, LOOP_WEB, currentMillis);
   
-  // Handle web server requests in AP mode
-  if (WiFi.getMode() == WIFI_AP || WiFi.getMode() == WIFI_AP_STA) {
+  // Handle web server requests (provisioning di mode AP, /metrics di mode STA)
+  if (webServerStarted) {
     server.handleClient();
   }
   
+  // Wi-Fi putus saat berjalan: tandai agar jalur reconnect di bawah dipakai
+  if (isWiFiConnected && WiFi.status() != WL_CONNECTED) {
+    isWiFiConnected = false;
+    trace(TRACE_WIFI, 0, 0);
+    DEBUG_SERIAL.println("WiFi connection lost");
+  }
+  
+  // Request API yang antri/berjalan; respons diproses callback masing-masing
+  loopSection(loopStats, LOOP_HTTP, millis());
+  httpService();
+  
   // Main operations only if connected and registered
   if (isWiFiConnected && isDeviceRegistered) {
-    // Handle Arduino communication
-    handleArduinoCommunication();
+    loopSection(loopStats, LOOP_SERIAL, millis());
+    if (GATEWAY_MODE) {
+      // Poll meter di bus RS-485 dan unggah pembacaan secara gabungan
+      processBus();
+      registerPendingBusMeter();
+      if (intervalDue(meterDataSendInterval, lastBusBatchTime, currentMillis)) {
+        loopSection(loopStats, LOOP_UPLOAD, millis());
+        submitBusBatch();
+      }
+    } else {
+      // Handle Arduino communication
+      handleArduinoCommunication();
+    }
     
-    // Poll for commands from server
-    if (currentMillis - lastCommandPollTime >= commandPollInterval) {
-      lastCommandPollTime = currentMillis;
+    // Perpanjang JWT sebelum exp / setelah ditolak server
+    jwtService(currentMillis);
+    
+    // Kirim antrian keluar: event prioritas lebih dulu, lalu data rutin
+    loopSection(loopStats, LOOP_UPLOAD, millis());
+    processOutboundQueues();
+    
+    // Poll for commands from server (only when readings are not carrying them).
+    // Pada mode gateway perintah tiap meter ikut di respons upload gabungan.
+    bool readingRecent = hasReadingExchange && (currentMillis - lastReadingExchangeTime < commandPollInterval.nextDelayMs);
+    if (!GATEWAY_MODE && !readingRecent && intervalDue(commandPollInterval, lastCommandPollTime, currentMillis)) {
+      loopSection(loopStats, LOOP_COMMANDS, millis());
       pollCommands();
     }
     
-    // Check for OTA updates
-    if (currentMillis - lastOTACheckTime >= otaCheckInterval) {
-      lastOTACheckTime = currentMillis;
+    // Check for OTA updates (memakai koneksi engine HTTP secara langsung)
+    if (httpIdle() && intervalDue(otaCheckInterval, lastOTACheckTime, currentMillis)) {
+      loopSection(loopStats, LOOP_OTA, millis());
       checkOTAUpdate();
     }
+    
+    // Sinkron ulang waktu (juga memperbarui estimasi drift)
+    if (intervalDue(ntpSyncInterval, lastNtpSyncTime, currentMillis)) {
+      loopSection(loopStats, LOOP_NTP, millis());
+      syncTime();
+    }
+    
+    if (pendingTraceDumpId >= 0) {
+      loopSection(loopStats, LOOP_TRACE, millis());
+      uploadNodeTrace(pendingTraceDumpId, pendingTraceDumpMeter);
+      pendingTraceDumpId = -1;
+    }
   } else if (isWiFiConnected && !isDeviceRegistered) {
     // Try to register device if we have WiFi but not registered
     // This would need a provisioning token - for now just log
     DEBUG_SERIAL.println("WiFi connected but device not registered");
+    loopSection(loopStats, LOOP_REGISTER, millis());
     delay(10000); // Wait 10 seconds before next attempt
   } else if (!isWiFiConnected) {
     // Try to reconnect WiFi
-    if (currentMillis - lastReconnectAttempt >= reconnectInterval) {
-      lastReconnectAttempt = currentMillis;
+    if (intervalDue(reconnectInterval, lastReconnectAttempt, currentMillis)) {
       if (sta_ssid.length() > 0) {
         DEBUG_SERIAL.println("Attempting WiFi reconnection...");
+        loopSection(loopStats, LOOP_WIFI, millis());
         connectWiFiSTA();
+        if (isWiFiConnected) {
+          wifiReconnectCount++;
+          if (!webServerStarted) {
+            setupMetricsServer();
+          }
+          if (!timeSynced) {
+            syncTime();
+          }
+          intervalTighten(reconnectInterval);
+        } else {
+          intervalBackoff(reconnectInterval);
+        }
       }
     }
   }
   
-  delay(100); // Small delay to prevent watchdog issues
+  // Pass loop yang lama (HTTP/TLS yang tersendat) dicatat di statistik
+  // loop dan trace
+  unsigned long passEnd = millis();
+  loopPassEnd(loopStats, currentMillis, passEnd, LOOP_DEADLINE_MS);
+  unsigned long passMs = passEnd - currentMillis;
+  if (passMs > TRACE_OVERRUN_MS) {
+    trace(TRACE_OVERRUN, 0, min(passMs, 65535UL));
+  }
+  
+  // Perangkat stabil: state yang dipulihkan bukan penyebab crash
+  if (checkpointCrashRestores > 0 && currentMillis >= CHECKPOINT_STABLE_MS) {
+    checkpointCrashRestores = 0;
+    checkpointDirty = true;
+  }
+  if (checkpointDirty) {
+    saveCheckpoint();
+  }
+  
+  // Idle dengan radio tidur jika memungkinkan (juga mencegah watchdog)
+  if (isWiFiConnected && isDeviceRegistered) {
+    powerIdle();
+  } else {
+    delay(100); // Small delay to prevent watchdog issues
+  }
 }
 
 // =====================================================
@@ -398,417 +1005,2963 @@ void loop() {
 void handleArduinoCommunication() {
   // Read data from Arduino
   if (ARDUINO_SERIAL.available()) {
-    String msgFromArduino = ARDUINO_SERIAL.readStringUntil('\n');
-    msgFromArduino.trim();
+    char* frame;
+    size_t length = readArduinoFrame(ARDUINO_SERIAL, frame);
     
-    if (msgFromArduino.length() > 0) {
-      DEBUG_SERIAL.print("Rx Arduino: ");
-      DEBUG_SERIAL.println(msgFromArduino);
-      
+    if (length > 0) {
       // Parse and handle Arduino message
-      handleArduinoMessage(msgFromArduino);
+      handleArduinoMessage(frame, length);
     }
   }
 }
 
-void handleArduinoMessage(String jsonString) {
-  DynamicJsonDocument doc(512);
-  DeserializationError error = deserializeJson(doc, jsonString);
+// Baca satu baris ke serialFrame lalu trim. Mengembalikan panjang frame
+// (0 jika kosong) dan pointer ke awal frame lewat parameter frame.
+size_t readArduinoFrame(Stream& port, char*& frame) {
+  size_t length = port.readBytesUntil('\n', serialFrame, sizeof(serialFrame) - 1);
+  serialFrame[length] = '\0';
+  
+  // Trim whitespace (termasuk byte wake-up dari Arduino)
+  frame = serialFrame;
+  while (*frame != '\0' && (*frame <= ' ' || *frame > '~')) {
+    frame++;
+    length--;
+  }
+  while (length > 0 && frame[length - 1] <= ' ') {
+    frame[--length] = '\0';
+  }
+  
+  if (length > 0) {
+    serialFramesReceived++;
+    trace(TRACE_SERIAL_RX, 0, length);
+    DEBUG_SERIAL.print("Rx Arduino: ");
+    DEBUG_SERIAL.println(frame);
+  }
+  return length;
+}
+
+void handleArduinoMessage(const char* jsonString, size_t length) {
+  DynamicJsonDocument doc(768); // Frame agregat + loop; di heap agar stack tetap kecil
+  DeserializationError error = deserializeJson(doc, jsonString, length);
   
   if (error) {
+    serialParseErrors++;
+    trace(TRACE_SERIAL_ERROR, 0, length);
     DEBUG_SERIAL.print(F("Arduino JSON parse failed: "));
     DEBUG_SERIAL.println(error.c_str());
     return;
   }
-  
-  // Check if this is meter data or command acknowledgment
-  if (doc.containsKey("command_id_ack")) {
-    // This is a command acknowledgment
-    int commandId = doc["command_id_ack"].as<int>();
-    String ackStatus = doc["ack_status"].as<String>();
-    String ackNotes = doc["ack_notes"].as<String>();
-    String valveStatusAck = doc["valve_status_ack"].as<String>();
-    
-    DEBUG_SERIAL.print("Command ACK received: ID=");
-    DEBUG_SERIAL.print(commandId);
-    DEBUG_SERIAL.print(", Status=");
-    DEBUG_SERIAL.println(ackStatus);
-    
-    // Send ACK to server
-    sendCommandACK(commandId, ackStatus, ackNotes, valveStatusAck);
-    
-  } else if (doc.containsKey("flow_rate_lpm")) {
-    // This is meter reading data
-    float flowRate = doc["flow_rate_lpm"].as<float>();
-    float meterReading = doc["meter_reading_m3"].as<float>();
-    float voltage = doc["current_voltage"].as<float>();
-    int doorStatus = doc["door_status"].as<int>();
-    String statusMessage = doc["status_message"].as<String>();
-    
-    DEBUG_SERIAL.print("Meter data: Flow=");
-    DEBUG_SERIAL.print(flowRate);
-    DEBUG_SERIAL.print("LPM, Reading=");
-    DEBUG_SERIAL.print(meterReading);
-    DEBUG_SERIAL.print("m3, Status=");
-    DEBUG_SERIAL.println(statusMessage);
-    
-    // Determine valve status based on conditions
-    String valveStatus = "unknown";
-    if (statusMessage == "pulsa_habis" || doorStatus == 1) {
-      valveStatus = "closed";
-    } else if (statusMessage == "normal") {
-      valveStatus = "open";
+  
+  // Frame objek berkunci = firmware Arduino sebelum link_schema.h; dijawab
+  // dengan format yang sama
+  bool legacy = doc.is<JsonObject>();
+  JsonArrayConst frame = doc.as<JsonArrayConst>();
+  
+  // Mode gateway: frame dari bus dipetakan ke slot meter lewat alamatnya
+  uint8_t meter = BUS_LOCAL_METER;
+  if (GATEWAY_MODE) {
+    uint8_t address = legacy ? (doc["addr"] | 0) : linkAddress(frame);
+    if (address == 0) {
+      return; // Frame tanpa alamat tidak valid di bus
+    }
+    if (address == busAwaitingAddress) {
+      busAwaitingAddress = 0; // Jawaban diterima, bus bebas
+    }
+    meter = busSlotForAddress(address);
+    if (meter == BUS_LOCAL_METER) {
+      // Alamat baru di bus (discovery): diregistrasi dari loop, frame ini
+      // dibuang dan meter dipoll lagi setelah terdaftar
+      if (address <= BUS_MAX_ADDRESS) {
+        busPendingRegistrations |= 1UL << address;
+      }
+      return;
+    }
+    BusMeter& busMeter = busMeters[meter];
+    if (!busMeter.online) {
+      DEBUG_SERIAL.printf("Bus meter %u online\n", address);
+    }
+    busMeter.online = true;
+    busMeter.missedPolls = 0;
+    busMeter.lastSeen = millis();
+    busMeter.legacyLink = legacy;
+  } else {
+    arduinoLegacyLink = legacy;
+  }
+  
+  // Waktu frame selesai dikirim Arduino: waktu terima dikurangi waktu transit
+  // di serial 9600 baud (~1 ms per byte, 10 bit per byte). Umur data di
+  // Arduino (age_ms, diukur dengan millis() Arduino) dikurangi per pesan.
+  unsigned long receivedAt = millis() - (length + 2) * 10000UL / 9600UL;
+  
+  if (legacy) {
+    handleLegacyArduinoMessage(doc.as<JsonObjectConst>(), meter, receivedAt);
+    return;
+  }
+  
+  switch (linkMessageType(frame)) {
+    case LINK_MSG_READING: {
+      LinkReading m;
+      if (linkDecode(frame, m)) {
+        handleArduinoReading(m, m.seq, meter, receivedAt);
+        return;
+      }
+      break;
+    }
+    case LINK_MSG_ACK: {
+      LinkAckFrame m;
+      if (linkDecode(frame, m)) {
+        handleArduinoAck(m, meter);
+        return;
+      }
+      break;
+    }
+    case LINK_MSG_TRACE: {
+      LinkTrace m;
+      if (linkDecode(frame, m)) {
+        handleArduinoTrace(m, meter, receivedAt);
+        return;
+      }
+      break;
+    }
+  }
+  
+  // Jenis tidak dikenal atau field kurang dari skema
+  serialParseErrors++;
+  trace(TRACE_SERIAL_ERROR, 0, length);
+  DEBUG_SERIAL.printf("Arduino frame rejected (type %u)\n", linkMessageType(frame));
+}
+
+// Frame objek dari firmware Arduino lama: jenis ditentukan kunci yang ada
+void handleLegacyArduinoMessage(JsonObjectConst doc, uint8_t meter, unsigned long receivedAt) {
+  if (doc.containsKey("trace_cmd")) {
+    LinkTrace m;
+    linkDecodeKeyed(doc, m);
+    if (m.parts == 0) {
+      m.parts = 1;
+    }
+    handleArduinoTrace(m, meter, receivedAt);
+    
+  } else if (doc.containsKey("command_id_ack")) {
+    LinkAckFrame m;
+    linkDecodeKeyed(doc, m);
+    handleArduinoAck(m, meter);
+    
+  } else if (doc.containsKey("flow_rate_lpm")) {
+    LinkReading m;
+    linkDecodeKeyed(doc, m);
+    // Firmware tanpa valve_status: tebak posisi valve dari kondisi
+    if (!doc.containsKey("valve_status")) {
+      if (m.status == LINK_STATUS_PULSA_HABIS || m.doorOpen == 1) {
+        m.valve = LINK_VALVE_CLOSED;
+      } else if (m.status == LINK_STATUS_NORMAL) {
+        m.valve = LINK_VALVE_OPEN;
+      }
+    }
+    handleArduinoReading(m, doc.containsKey("seq") ? (long)m.seq : -1, meter, receivedAt);
+  }
+}
+
+void handleArduinoTrace(const LinkTrace& m, uint8_t meter, unsigned long receivedAt) {
+  // Bagian dump trace Arduino: diunggah apa adanya. Jam Arduino saat frame
+  // dibuat (now_ms) dipetakan ke jam perangkat seperti waktu capture.
+  if (!uploadTracePart(m.commandId, "arduino", meter, m.part, m.parts, m.nowMs,
+                       deviceEpochMs(receivedAt - m.ageMs), m.total, m.records, false)) {
+    DEBUG_SERIAL.printf("Arduino trace part %u not queued\n", m.part);
+  }
+}
+
+void handleArduinoAck(const LinkAckFrame& m, uint8_t meter) {
+  DEBUG_SERIAL.print("Command ACK received: ID=");
+  DEBUG_SERIAL.print(m.commandId);
+  DEBUG_SERIAL.print(", Status=");
+  DEBUG_SERIAL.println(linkName(m.status));
+  
+  // Send ACK to server (jawaban get_config membawa array nilai PARAMS)
+  JsonArrayConst config;
+  if (m.configVersion == LINK_PARAM_VERSION) {
+    config = m.config.as<JsonArrayConst>();
+  }
+  enqueueCommandAck(m.commandId, m.status, m.notes, m.valve, config, meter);
+}
+
+// seq -1 = firmware lama tanpa nomor urut
+void handleArduinoReading(const LinkReading& m, long seq, uint8_t meter, unsigned long receivedAt) {
+  DEBUG_SERIAL.print("Meter data: Flow=");
+  DEBUG_SERIAL.print(m.flowRate);
+  DEBUG_SERIAL.print("LPM, Reading=");
+  DEBUG_SERIAL.print(m.meterReading);
+  DEBUG_SERIAL.print("m3, Status=");
+  DEBUG_SERIAL.println(linkName(m.status));
+  
+  // Perkiraan waktu capture: umur data di Arduino saat frame dikirim
+  unsigned long detectedAt = receivedAt - m.ageMs;
+  
+  QueuedReading entry;
+  fillQueuedReading(entry, m.flowRate, m.meterReading, m.voltage, m.doorOpen, m.status, m.valve, seq, detectedAt, meter);
+  
+  // Agregat interval yang baru ditutup Arduino diteruskan apa adanya
+  if (!m.aggregate.isNull()) {
+    if (measureJson(m.aggregate) < sizeof(entry.aggregate)) {
+      serializeJson(m.aggregate, entry.aggregate, sizeof(entry.aggregate));
+    } else {
+      DEBUG_SERIAL.println("Aggregate too large, dropped");
+    }
+  }
+  if (!m.loop.isNull()) {
+    if (measureJson(m.loop) < sizeof(entry.arduinoLoop)) {
+      serializeJson(m.loop, entry.arduinoLoop, sizeof(entry.arduinoLoop));
+    } else {
+      DEBUG_SERIAL.println("Loop stats too large, dropped");
+    }
+  }
+
+  // Masukkan ke antrian sesuai kelasnya
+  if (isPriorityEvent(m.status)) {
+    enqueueEvent(entry);
+  } else if (meter != BUS_LOCAL_METER) {
+    // Hanya pembacaan terbaru per meter yang ikut upload gabungan;
+    // agregat snapshot lama selalu dibawa snapshot pengganti. Agregat yang
+    // juga ada di upload yang sedang berjalan ditandai batchCarried dan baru
+    // dibuang setelah onBusBatchResponse memastikan upload itu berhasil.
+    BusMeter& busMeter = busMeters[meter];
+    if (busMeter.hasReading) {
+      uint8_t inFlight = busMeter.readingSent ? BATCH_CARRIED_AGG | BATCH_CARRIED_LOOP : busMeter.batchCarried;
+      uint8_t carried = 0;
+      if (busMeter.reading.aggregate[0] != '\0' && entry.aggregate[0] == '\0') {
+        carried |= BATCH_CARRIED_AGG;
+      }
+      if (busMeter.reading.arduinoLoop[0] != '\0' && entry.arduinoLoop[0] == '\0') {
+        carried |= BATCH_CARRIED_LOOP;
+      }
+      carryAggregate(busMeter.reading, entry);
+      busMeter.batchCarried = busMeter.inBatch ? carried & inFlight : 0;
+    }
+    busMeter.reading = entry;
+    busMeter.hasReading = true;
+    busMeter.readingSent = false;
+  } else {
+    enqueueReading(entry);
+  }
+}
+
+// =====================================================
+// FUNGSI WAKTU (SNTP)
+// =====================================================
+uint32_t readUint32BE(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Timestamp NTP (detik + fraksi 2^-32 sejak 1900) ke epoch Unix dalam ms
+uint64_t ntpToEpochMs(const uint8_t* p) {
+  uint64_t seconds = readUint32BE(p) - NTP_UNIX_OFFSET;
+  uint64_t fractionMs = ((uint64_t)readUint32BE(p + 4) * 1000) >> 32;
+  return seconds * 1000 + fractionMs;
+}
+
+// Epoch (ms) untuk suatu nilai millis(), termasuk nilai sebelum titik
+// sinkron terakhir (selisih dihitung bertanda). 0 jika belum pernah sinkron.
+uint64_t deviceEpochMs(unsigned long atMillis) {
+  if (!timeSynced) {
+    return 0;
+  }
+  long elapsed = (long)(atMillis - syncMillis);
+  return syncEpochMs + elapsed + (int64_t)(elapsed * (double)clockDriftPpm / 1e6);
+}
+
+// Tambahkan waktu capture ke payload: "ts" jika waktu sudah sinkron,
+// selain itu "age_ms" (fallback monotonic, relatif terhadap waktu kirim)
+void addCaptureTime(JsonObject target, unsigned long capturedAt) {
+  if (timeSynced) {
+    target["ts"] = deviceEpochMs(capturedAt);
+  } else {
+    target["age_ms"] = millis() - capturedAt;
+  }
+}
+
+// Pasang titik sinkron baru dan perbarui estimasi drift dari selisih
+// antara prediksi jam lokal dan waktu NTP.
+void applyTimeSync(uint64_t epochMs, unsigned long atMillis) {
+  if (timeSynced) {
+    unsigned long elapsed = atMillis - syncMillis;
+    lastNtpOffsetMs = (long)((int64_t)epochMs - (int64_t)deviceEpochMs(atMillis));
+    if (labs(lastNtpOffsetMs) > NTP_STEP_THRESHOLD_MS) {
+      clockDriftPpm = 0.0; // Jam server/lokal loncat: ukur drift dari awal
+    } else if (elapsed >= 60000) {
+      // Sisa drift yang belum terkoreksi, dirata-rata agar jitter jaringan tidak dominan
+      float residualPpm = lastNtpOffsetMs * 1e6f / elapsed;
+      clockDriftPpm = constrain(clockDriftPpm + residualPpm * 0.5f, -NTP_MAX_DRIFT_PPM, NTP_MAX_DRIFT_PPM);
+    }
+  }
+  syncEpochMs = epochMs;
+  syncMillis = atMillis;
+  timeSynced = true;
+  checkpointDirty = true;
+}
+
+// Satu query SNTP (RFC 4330). Sukses memperlebar interval sinkron karena
+// drift sudah terukur; gagal mengembalikan interval ke batas minimum.
+bool syncTime() {
+  uint8_t packet[48];
+  memset(packet, 0, sizeof(packet));
+  packet[0] = 0x23; // LI = 0, versi 4, mode 3 (client)
+
+  ntpUdp.begin(NTP_LOCAL_PORT);
+  unsigned long sentAt = millis();
+  if (!ntpUdp.beginPacket(NTP_SERVER, NTP_PORT)) {
+    ntpUdp.stop();
+    ntpSyncFailures++;
+    intervalTighten(ntpSyncInterval);
+    return false;
+  }
+  ntpUdp.write(packet, sizeof(packet));
+  ntpUdp.endPacket();
+
+  while (millis() - sentAt < NTP_TIMEOUT) {
+    if (ntpUdp.parsePacket() >= (int)sizeof(packet)) {
+      unsigned long receivedAt = millis();
+      ntpUdp.read(packet, sizeof(packet));
+      ntpUdp.stop();
+
+      uint8_t mode = packet[0] & 0x07;
+      uint8_t stratum = packet[1];
+      if (mode != 4 || stratum == 0 || stratum > 15) {
+        break; // Bukan balasan server atau kiss-of-death
+      }
+      // T2 = server terima (byte 32), T3 = server kirim (byte 40). Waktu
+      // sekarang = T3 + setengah delay jaringan (RTT dikurangi proses server).
+      uint64_t serverReceiveMs = ntpToEpochMs(packet + 32);
+      uint64_t serverTransmitMs = ntpToEpochMs(packet + 40);
+      unsigned long roundTrip = receivedAt - sentAt;
+      unsigned long serverHold = (unsigned long)(serverTransmitMs - serverReceiveMs);
+      unsigned long networkDelay = roundTrip > serverHold ? roundTrip - serverHold : 0;
+      applyTimeSync(serverTransmitMs + networkDelay / 2, receivedAt);
+
+      ntpSyncCount++;
+      intervalBackoff(ntpSyncInterval);
+      DEBUG_SERIAL.printf("SNTP sync ok: offset %ld ms, drift %.1f ppm, delay %lu ms\n", lastNtpOffsetMs, clockDriftPpm, networkDelay);
+      return true;
+    }
+    delay(10);
+  }
+
+  ntpUdp.stop();
+  ntpSyncFailures++;
+  intervalTighten(ntpSyncInterval);
+  DEBUG_SERIAL.println("SNTP sync failed");
+  return false;
+}
+
+// =====================================================
+// FUNGSI KLIEN TLS
+// =====================================================
+// Ambil host, port dan path dari API_BASE_URL ("https://host[:port][/path]")
+void parseApiBaseUrl() {
+  apiUsesTLS = strncmp(API_BASE_URL, "https://", 8) == 0;
+  apiPort = apiUsesTLS ? 443 : 80;
+  const char* host = strstr(API_BASE_URL, "://");
+  host = host ? host + 3 : API_BASE_URL;
+  size_t len = strcspn(host, ":/");
+  if (len >= sizeof(apiHost)) {
+    len = sizeof(apiHost) - 1;
+  }
+  memcpy(apiHost, host, len);
+  apiHost[len] = '\0';
+  if (host[len] == ':') {
+    apiPort = (uint16_t)atoi(host + len + 1);
+  }
+  const char* path = strchr(host + len, '/');
+  strlcpy(apiBasePath, path ? path : "", sizeof(apiBasePath));
+  size_t pathLen = strlen(apiBasePath);
+  if (pathLen > 0 && apiBasePath[pathLen - 1] == '/') {
+    apiBasePath[pathLen - 1] = '\0'; // Endpoint sudah diawali "/"
+  }
+}
+
+uint32_t crc32(const uint8_t* data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  while (length--) {
+    crc ^= *data++;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+void saveTlsSession() {
+  RtcTlsSession stored;
+  stored.magic = RTC_TLS_SESSION_MAGIC;
+  memcpy(&stored.params, tlsSession.getSession(), sizeof(stored.params));
+  stored.crc = crc32((const uint8_t*)&stored.params, sizeof(stored.params));
+  ESP.rtcUserMemoryWrite(RTC_TLS_SESSION_BLOCK, (uint32_t*)&stored, sizeof(stored));
+}
+
+void restoreTlsSession() {
+  RtcTlsSession stored;
+  if (!ESP.rtcUserMemoryRead(RTC_TLS_SESSION_BLOCK, (uint32_t*)&stored, sizeof(stored))) {
+    return;
+  }
+  if (stored.magic != RTC_TLS_SESSION_MAGIC ||
+      stored.crc != crc32((const uint8_t*)&stored.params, sizeof(stored.params))) {
+    return; // Power-on reset atau data rusak: mulai dengan full handshake
+  }
+  memcpy(tlsSession.getSession(), &stored.params, sizeof(stored.params));
+  DEBUG_SERIAL.println("TLS session restored from RTC memory");
+}
+
+// =====================================================
+// FUNGSI CHECKPOINT RTC
+// =====================================================
+void packCheckpointReading(CheckpointReading& out, const QueuedReading& in, unsigned long now) {
+  out.flowRate = in.flowRate;
+  out.meterReading = in.meterReading;
+  out.voltage = in.voltage;
+  out.seq = in.seq;
+  out.ageMs = now - in.detectedAt;
+  out.doorStatus = in.doorStatus;
+  out.status = in.status;
+  out.valve = in.valve;
+  out.meter = in.meter;
+}
+
+void unpackCheckpointReading(QueuedReading& out, const CheckpointReading& in, unsigned long now, uint32_t downtimeMs) {
+  LinkStatus status = (LinkStatus)(in.status < LINK_STATUS_COUNT ? in.status : LINK_STATUS_NORMAL);
+  LinkValve valve = (LinkValve)(in.valve < LINK_VALVE_COUNT ? in.valve : LINK_VALVE_UNKNOWN);
+  fillQueuedReading(out, in.flowRate, in.meterReading, in.voltage, in.doorStatus, status, valve, in.seq, now - in.ageMs - downtimeMs, in.meter);
+}
+
+void saveCheckpoint() {
+  RtcCheckpoint cp;
+  memset(&cp, 0, sizeof(cp));
+  unsigned long now = millis();
+  cp.rtcTime = system_get_rtc_time();
+  cp.epochMs = deviceEpochMs(now);
+  cp.clockDriftPpm = clockDriftPpm;
+  cp.lastKnownCredit = lastKnownCredit;
+  for (uint8_t i = 0; i < CHECKPOINT_INTERVAL_COUNT; i++) {
+    cp.intervals[i].currentMs = CHECKPOINT_INTERVALS[i]->currentMs;
+    cp.intervals[i].nextDelayMs = CHECKPOINT_INTERVALS[i]->nextDelayMs;
+    cp.intervals[i].sinceLastMs = now - *CHECKPOINT_LAST_TIMES[i];
+  }
+  cp.crashRestores = checkpointCrashRestores;
+  cp.eventCount = eventQueueCount;
+  for (uint8_t i = 0; i < eventQueueCount; i++) {
+    packCheckpointReading(cp.events[i], eventQueue[(eventQueueHead + i) % EVENT_QUEUE_SIZE], now);
+  }
+  // Hanya snapshot rutin terbaru; snapshot lama boleh hilang (total meter ikut yang terbaru)
+  cp.readingCount = min(readingQueueCount, (uint8_t)CHECKPOINT_READINGS);
+  for (uint8_t i = 0; i < cp.readingCount; i++) {
+    uint8_t index = readingQueueCount - cp.readingCount + i;
+    packCheckpointReading(cp.readings[i], readingQueue[(readingQueueHead + index) % READING_QUEUE_SIZE], now);
+  }
+  cp.ackCount = min(ackQueueCount, (uint8_t)CHECKPOINT_ACKS);
+  for (uint8_t i = 0; i < cp.ackCount; i++) {
+    const QueuedAck& ack = ackQueue[(ackQueueHead + i) % ACK_QUEUE_SIZE];
+    cp.acks[i].commandId = ack.commandId;
+    cp.acks[i].status = ack.status;
+    cp.acks[i].valve = ack.valve;
+    cp.acks[i].meter = ack.meter;
+  }
+  cp.magic = RTC_CHECKPOINT_MAGIC;
+  cp.crc = crc32((const uint8_t*)&cp.rtcTime, sizeof(cp) - 2 * sizeof(uint32_t));
+  ESP.rtcUserMemoryWrite(RTC_CHECKPOINT_BLOCK, (uint32_t*)&cp, sizeof(cp));
+  checkpointDirty = false;
+}
+
+// Dipanggil sekali di setup(). True jika state sebelum reset dipulihkan.
+bool restoreCheckpoint() {
+  uint32_t reason = ESP.getResetInfoPtr()->reason;
+  if (reason == REASON_DEFAULT_RST) {
+    return false; // Power-on: isi RTC memory tidak berarti
+  }
+  RtcCheckpoint cp;
+  if (!ESP.rtcUserMemoryRead(RTC_CHECKPOINT_BLOCK, (uint32_t*)&cp, sizeof(cp))) {
+    return false;
+  }
+  if (cp.magic != RTC_CHECKPOINT_MAGIC ||
+      cp.crc != crc32((const uint8_t*)&cp.rtcTime, sizeof(cp) - 2 * sizeof(uint32_t))) {
+    return false; // Data rusak atau layout firmware lama
+  }
+
+  // Boot-loop guard: hanya reset crash yang dihitung; OTA/reset eksternal
+  // memulai hitungan baru
+  bool crashReset = reason == REASON_EXCEPTION_RST || reason == REASON_WDT_RST || reason == REASON_SOFT_WDT_RST;
+  checkpointCrashRestores = crashReset ? cp.crashRestores + 1 : 0;
+  if (checkpointCrashRestores > CHECKPOINT_MAX_CRASH_RESTORES) {
+    DEBUG_SERIAL.printf("Checkpoint discarded: %u consecutive crash resets after restoring it\n", cp.crashRestores);
+    checkpointCrashRestores = 0;
+    checkpointDiscarded = true;
+    uint32_t invalid = 0;
+    ESP.rtcUserMemoryWrite(RTC_CHECKPOINT_BLOCK, &invalid, sizeof(invalid)); // Magic rusak
+    return false;
+  }
+
+  // Jam RTC tetap berjalan selama reset software/crash; periodenya (us,
+  // fixed point Q12) dikalibrasi SDK. Selisihnya = waktu sejak checkpoint
+  // ditulis. Reset eksternal (pin RST/CHIP_EN) memulai ulang penghitung RTC
+  // tapi RTC memory tetap ada, jadi selisihnya tidak berarti. Downtime yang
+  // tidak bisa dipercaya dianggap 0 dan jam tidak dipulihkan: timeSynced
+  // tetap false dan SNTP langsung jatuh tempo.
+  unsigned long now = millis();
+  uint32_t rtcNow = system_get_rtc_time();
+  uint32_t downtimeMs = (uint32_t)((((uint64_t)(rtcNow - cp.rtcTime) * system_rtc_clock_cali_proc()) >> 12) / 1000);
+  bool downtimeKnown = reason != REASON_EXT_SYS_RST && rtcNow >= cp.rtcTime && downtimeMs <= CHECKPOINT_MAX_DOWNTIME_MS;
+  if (!downtimeKnown) {
+    DEBUG_SERIAL.printf("Checkpoint downtime not trusted (reset reason %u), clock not restored\n", reason);
+    downtimeMs = 0;
+  }
+
+  if (cp.epochMs != 0 && downtimeKnown) {
+    syncEpochMs = cp.epochMs + downtimeMs;
+    syncMillis = now;
+    clockDriftPpm = cp.clockDriftPpm;
+    timeSynced = true;
+  } else {
+    timeSynced = false;
+  }
+  lastKnownCredit = cp.lastKnownCredit;
+  for (uint8_t i = 0; i < CHECKPOINT_INTERVAL_COUNT; i++) {
+    AdaptiveInterval& iv = *CHECKPOINT_INTERVALS[i];
+    iv.currentMs = constrain((unsigned long)cp.intervals[i].currentMs, iv.minMs, iv.maxMs);
+    iv.nextDelayMs = cp.intervals[i].nextDelayMs;
+    // Jadwal yang terlewat selama reset langsung jatuh tempo
+    *CHECKPOINT_LAST_TIMES[i] = now - min(cp.intervals[i].sinceLastMs + downtimeMs, iv.nextDelayMs);
+  }
+  if (!timeSynced) {
+    lastNtpSyncTime = now - ntpSyncInterval.nextDelayMs; // Sinkron ulang segera
+  }
+  for (uint8_t i = 0; i < cp.eventCount && i < EVENT_QUEUE_SIZE; i++) {
+    QueuedReading entry;
+    unpackCheckpointReading(entry, cp.events[i], now, downtimeMs);
+    enqueueEvent(entry);
+  }
+  for (uint8_t i = 0; i < cp.readingCount && i < CHECKPOINT_READINGS; i++) {
+    QueuedReading entry;
+    unpackCheckpointReading(entry, cp.readings[i], now, downtimeMs);
+    enqueueReading(entry);
+  }
+  for (uint8_t i = 0; i < cp.ackCount && i < CHECKPOINT_ACKS; i++) {
+    LinkAck status = (LinkAck)(cp.acks[i].status < LINK_ACK_COUNT ? cp.acks[i].status : LINK_ACK_FAILED);
+    uint8_t valve = cp.acks[i].valve < LINK_VALVE_COUNT ? cp.acks[i].valve : ACK_NO_VALVE;
+    enqueueCommandAck(cp.acks[i].commandId, status, "", valve, JsonArrayConst(), cp.acks[i].meter);
+  }
+  DEBUG_SERIAL.printf("Checkpoint restored: %u events, %u readings, %u ACKs, reset took %lu ms\n", cp.eventCount, cp.readingCount, cp.ackCount, (unsigned long)downtimeMs);
+  return true;
+}
+
+// Dipanggil sekali saat boot
+void setupTlsClient() {
+  parseApiBaseUrl();
+  if (!apiUsesTLS) {
+    return;
+  }
+
+  bool pinned = strlen_P(API_ROOT_CA) > 8;
+  bool fingerprinted = strlen(API_TLS_FINGERPRINT) > 0;
+  tlsTrustConfigured = pinned || fingerprinted;
+#ifdef API_TLS_INSECURE
+  if (!tlsTrustConfigured) {
+    DEBUG_SERIAL.println("WARNING: API_TLS_INSECURE, server certificate NOT verified");
+  }
+#else
+  if (!tlsTrustConfigured) {
+    // Fail closed: tanpa pin, JWT dan data tagihan tidak dikirim ke server
+    // mana pun yang kebetulan menjawab
+    DEBUG_SERIAL.println("ERROR: no TLS pin configured (API_ROOT_CA / API_TLS_FINGERPRINT), HTTPS refused");
+    return;
+  }
+#endif
+  if (pinned) {
+    tlsTrustAnchor.append(API_ROOT_CA);
+  }
+  for (uint8_t i = 0; i < HTTP_MAX_INFLIGHT; i++) {
+    if (pinned) {
+      secureClients[i].setTrustAnchors(&tlsTrustAnchor);
+    } else if (fingerprinted) {
+      secureClients[i].setFingerprint(API_TLS_FINGERPRINT);
+    } else {
+      secureClients[i].setInsecure(); // Hanya dengan API_TLS_INSECURE
+    }
+    secureClients[i].setSession(&tlsSession);
+  }
+  restoreTlsSession();
+}
+
+// Negosiasi MFLN sekali setelah WiFi terhubung
+void probeTlsFragmentLength() {
+  if (!apiUsesTLS || tlsMflnProbed) {
+    return;
+  }
+  tlsMflnSupported = BearSSL::WiFiClientSecure::probeMaxFragmentLength(apiHost, apiPort, TLS_MFLN_SIZE);
+  tlsMflnProbed = true;
+  if (tlsMflnSupported) {
+    for (uint8_t i = 0; i < HTTP_MAX_INFLIGHT; i++) {
+      secureClients[i].setBufferSizes(TLS_MFLN_SIZE, TLS_MFLN_SIZE);
+    }
+  }
+  DEBUG_SERIAL.printf("TLS MFLN %u: %s\n", TLS_MFLN_SIZE, tlsMflnSupported ? "supported" : "not supported");
+}
+
+// Klien untuk koneksi engine ke-`connection` (TLS atau plain sesuai URL)
+WiFiClient& apiClient(uint8_t connection) {
+  if (apiUsesTLS) {
+    return secureClients[connection];
+  }
+  return plainClients[connection];
+}
+
+// Buka koneksi ke server API (TCP, plus handshake TLS untuk HTTPS yang
+// waktunya diukur). HTTPClient (OTA) memakai ulang koneksi yang sudah terbuka.
+WiFiClient* openApiClient(uint8_t connection) {
+  WiFiClient& client = apiClient(connection);
+  client.stop();
+  if (!apiUsesTLS) {
+    return client.connect(apiHost, apiPort) ? &client : nullptr;
+  }
+
+#ifndef API_TLS_INSECURE
+  if (!tlsTrustConfigured) {
+    tlsRefused++;
+    return nullptr;
+  }
+#endif
+  probeTlsFragmentLength();
+  BearSSL::WiFiClientSecure& secureClient = secureClients[connection];
+  unsigned long handshakeStart = millis();
+  if (!secureClient.connect(apiHost, apiPort)) {
+    tlsHandshakeFailures++;
+    char error[64];
+    int code = secureClient.getLastSSLError(error, sizeof(error));
+    DEBUG_SERIAL.printf("TLS connect failed (%d): %s\n", code, error);
+    return nullptr;
+  }
+  tlsHandshakeLastMs = millis() - handshakeStart;
+  tlsHandshakeSumMs += tlsHandshakeLastMs;
+  tlsHandshakeCount++;
+  saveTlsSession(); // Simpan sesi terbaru untuk resumption setelah restart
+  return &secureClient;
+}
+
+// =====================================================
+// FUNGSI ENCODING UPLINK (CBOR)
+// =====================================================
+void cborPut(CborWriter& w, uint8_t byte) {
+  if (w.length < w.capacity) {
+    w.out[w.length++] = byte;
+  } else {
+    w.failed = true;
+  }
+}
+
+// Head item: major type + argumen (nilai/panjang) dalam bentuk terpendek
+void cborHead(CborWriter& w, uint8_t major, uint64_t value) {
+  major <<= 5;
+  if (value < 24) {
+    cborPut(w, major | (uint8_t)value);
+    return;
+  }
+  uint8_t bytes = value <= 0xFF ? 1 : value <= 0xFFFF ? 2 : value <= 0xFFFFFFFFULL ? 4 : 8;
+  cborPut(w, major | (bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27));
+  for (int8_t i = bytes - 1; i >= 0; i--) {
+    cborPut(w, (uint8_t)(value >> (8 * i)));
+  }
+}
+
+void cborInt(CborWriter& w, int64_t value) {
+  if (value >= 0) {
+    cborHead(w, 0, (uint64_t)value);
+  } else {
+    cborHead(w, 1, (uint64_t)(-1 - value));
+  }
+}
+
+void cborText(CborWriter& w, const char* text) {
+  size_t len = strlen(text);
+  cborHead(w, 3, len);
+  for (size_t i = 0; i < len; i++) {
+    cborPut(w, (uint8_t)text[i]);
+  }
+}
+
+void cborFloat(CborWriter& w, float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  cborPut(w, 0xFA);
+  for (int8_t i = 3; i >= 0; i--) {
+    cborPut(w, (uint8_t)(bits >> (8 * i)));
+  }
+}
+
+// Indeks kunci di UPLINK_FIELDS, -1 jika tidak ada (dikirim sebagai string)
+int uplinkFieldIndex(const char* name) {
+  for (uint8_t i = 0; i < UPLINK_FIELD_COUNT; i++) {
+    if (strcmp(UPLINK_FIELDS[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// scale > 0: angka dikirim sebagai integer fixed-point
+void cborValue(CborWriter& w, JsonVariantConst value, uint16_t scale) {
+  if (value.isNull()) {
+    cborPut(w, 0xF6);
+  } else if (value.is<bool>()) {
+    cborPut(w, value.as<bool>() ? 0xF5 : 0xF4);
+  } else if (scale > 0 && (value.is<long long>() || value.is<double>())) {
+    cborInt(w, llround(value.as<double>() * scale));
+  } else if (value.is<long long>()) {
+    cborInt(w, value.as<long long>());
+  } else if (value.is<double>()) {
+    cborFloat(w, value.as<float>());
+  } else if (value.is<const char*>()) {
+    cborText(w, value.as<const char*>());
+  } else if (value.is<JsonObjectConst>()) {
+    JsonObjectConst object = value.as<JsonObjectConst>();
+    cborHead(w, 5, object.size());
+    for (JsonPairConst kv : object) {
+      int field = uplinkFieldIndex(kv.key().c_str());
+      if (field >= 0) {
+        cborInt(w, field);
+      } else {
+        cborText(w, kv.key().c_str());
+      }
+      cborValue(w, kv.value(), field >= 0 ? UPLINK_FIELDS[field].scale : 0);
+    }
+  } else if (value.is<JsonArrayConst>()) {
+    JsonArrayConst array = value.as<JsonArrayConst>();
+    cborHead(w, 4, array.size());
+    for (JsonVariantConst item : array) {
+      cborValue(w, item, scale);
+    }
+  } else {
+    // serialized(): JSON mentah dari Arduino ("agg", "loop") diurai dulu
+    char raw[UPLINK_RAW_SIZE];
+    size_t len = serializeJson(value, raw, sizeof(raw));
+    DynamicJsonDocument nested(512);
+    if (len == 0 || len >= sizeof(raw) - 1 || deserializeJson(nested, (const char*)raw, len)) {
+      w.failed = true;
+      return;
+    }
+    cborValue(w, nested.as<JsonVariantConst>(), scale);
+  }
+}
+
+// Encode payload ke body CBOR. 0 jika tidak muat atau gagal di-encode.
+size_t encodeCborBody(const JsonDocument& payload, char* out, size_t capacity) {
+  CborWriter w = {(uint8_t*)out, capacity, 0, false};
+  cborValue(w, payload.as<JsonVariantConst>(), 0);
+  return w.failed ? 0 : w.length;
+}
+
+// Isi body request dalam format yang diterima endpoint-nya dan catat
+// ukuran serta waktu encode. False jika payload tidak muat.
+bool encodeRequestBody(HttpRequest& request, const JsonDocument& payload) {
+  request.cbor = false;
+  if (request.uplinkPath != UPLINK_PATH_NONE && (uplinkCborPaths & (1U << request.uplinkPath))) {
+    unsigned long start = micros();
+    request.bodyLength = encodeCborBody(payload, request.body, request.bodyCapacity);
+    unsigned long encodeUs = micros() - start;
+    if (request.bodyLength > 0) {
+      request.cbor = true;
+      uplinkBytes[UPLINK_FORMAT_CBOR] += request.bodyLength;
+      uplinkEncodeUs[UPLINK_FORMAT_CBOR] += encodeUs;
+      // Pembanding: body yang sama sebagai JSON
+      start = micros();
+      uplinkJsonEquivalentBytes += measureJson(payload);
+      uplinkJsonEquivalentUs += micros() - start;
+      return true;
+    }
+    // Gagal encode CBOR: kirim JSON
+  }
+
+  unsigned long start = micros();
+  request.bodyLength = serializeJson(payload, request.body, request.bodyCapacity);
+  if (request.bodyLength == 0 || request.bodyLength >= request.bodyCapacity - 1) {
+    return false;
+  }
+  uplinkBytes[UPLINK_FORMAT_JSON] += request.bodyLength;
+  uplinkEncodeUs[UPLINK_FORMAT_JSON] += micros() - start;
+  return true;
+}
+
+// =====================================================
+// FUNGSI HTTP REQUEST
+// =====================================================
+// Baris request, header dan payload disusun di buffer tetap (snprintf /
+// serializeJson ke slot antrian dan buffer koneksi), dan respons di-parse
+// dari buffer koneksi. Tidak ada String sementara per request sehingga heap
+// tidak terfragmentasi setelah berhari-hari berjalan.
+
+// Susun URL lengkap ke httpUrl (request OTA). False jika tidak muat.
+bool buildApiUrl(const char* endpoint, const char* query) {
+  int len = snprintf(httpUrl, sizeof(httpUrl), "%s%s%s", API_BASE_URL, endpoint, query ? query : "");
+  if (len < 0 || len >= (int)sizeof(httpUrl)) {
+    DEBUG_SERIAL.println("URL too long for buffer");
+    return false;
+  }
+  return true;
+}
+
+void addAuthHeader(HTTPClient& http, const char* authToken) {
+  snprintf(httpAuthHeader, sizeof(httpAuthHeader), "Bearer %s", authToken);
+  http.addHeader(F("Authorization"), httpAuthHeader);
+}
+
+void setHttpError(JsonDocument& responseDoc, const char* message) {
+  responseDoc.clear();
+  responseDoc["status"] = "error";
+  responseDoc["message"] = message;
+}
+
+// Masukkan request ke antrian engine; payload = nullptr untuk GET.
+// responseDoc = dokumen milik pemanggil yang diisi respons (harus tetap
+// hidup sampai callback), nullptr = dokumen sementara berkapasitas
+// responseCapacity yang hanya berlaku selama callback. auth = slot meter
+// pemilik JWT (BUS_LOCAL_METER = JWT perangkat), HTTP_AUTH_NONE = tanpa
+// auth; token dibaca saat request dikirim sehingga token hasil refresh
+// langsung terpakai. False jika antrian penuh atau request tidak muat
+// (callback tidak dipanggil).
+bool httpRequestAsync(const char* endpoint, const char* query, const JsonDocument* payload, uint8_t auth, JsonDocument* responseDoc, size_t responseCapacity, HttpCallback callback, uintptr_t context) {
+  HttpRequest* request = nullptr;
+  for (uint8_t i = 0; i < HTTP_QUEUE_SIZE && request == nullptr; i++) {
+    if (httpRequests[i].state == HTTP_REQ_FREE) {
+      request = &httpRequests[i];
+    }
+  }
+  if (request == nullptr) {
+    httpQueueRejected++;
+    DEBUG_SERIAL.printf("HTTP queue full, request dropped: %s\n", endpoint);
+    return false;
+  }
+
+  int len = snprintf(request->path, sizeof(request->path), "%s%s", endpoint, query ? query : "");
+  if (len < 0 || len >= (int)sizeof(request->path)) {
+    DEBUG_SERIAL.println("URL too long for buffer");
+    return false;
+  }
+  request->endpointIndex = endpointMetricIndex(endpoint);
+  request->uplinkPath = uplinkPathIndex(endpoint);
+  request->body = request->bodyBuffer;
+  request->bodyCapacity = sizeof(request->bodyBuffer);
+  request->bodyLength = 0;
+  request->cbor = false;
+  // Ukuran JSON juga batas atas CBOR-nya
+  if (GATEWAY_MODE && payload != nullptr && measureJson(*payload) >= request->bodyCapacity - 1) {
+    if (httpLargeBodyOwner != nullptr) {
+      httpQueueRejected++;
+      DEBUG_SERIAL.printf("HTTP large body in use, request dropped: %s\n", endpoint);
+      return false;
+    }
+    request->body = httpLargeBody;
+    request->bodyCapacity = sizeof(httpLargeBody);
+  }
+  if (payload != nullptr && !encodeRequestBody(*request, *payload)) {
+    DEBUG_SERIAL.println("Payload too large for buffer");
+    return false;
+  }
+  if (request->body == httpLargeBody) {
+    httpLargeBodyOwner = request;
+  }
+  request->auth = auth;
+  request->authRetried = false;
+  request->post = payload != nullptr;
+  request->responseDoc = responseDoc;
+  request->responseCapacity = responseCapacity;
+  request->callback = callback;
+  request->context = context;
+  request->order = httpRequestOrder++;
+  request->queuedAt = millis();
+  request->state = HTTP_REQ_QUEUED;
+  return true;
+}
+
+// Request antri paling lama, nullptr jika tidak ada
+HttpRequest* httpNextQueued() {
+  HttpRequest* next = nullptr;
+  for (uint8_t i = 0; i < HTTP_QUEUE_SIZE; i++) {
+    HttpRequest& request = httpRequests[i];
+    if (request.state == HTTP_REQ_QUEUED && (next == nullptr || (int32_t)(request.order - next->order) < 0)) {
+      next = &request;
+    }
+  }
+  return next;
+}
+
+// True jika tidak ada request antri atau berjalan
+bool httpIdle() {
+  for (uint8_t i = 0; i < HTTP_QUEUE_SIZE; i++) {
+    if (httpRequests[i].state != HTTP_REQ_FREE) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// True jika request ke endpoint metrik ini masih antri atau berjalan
+bool httpPending(uint8_t endpointIndex) {
+  for (uint8_t i = 0; i < HTTP_QUEUE_SIZE; i++) {
+    if (httpRequests[i].state != HTTP_REQ_FREE && httpRequests[i].endpointIndex == endpointIndex) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// True jika ada byte respons yang menunggu dibaca
+bool httpResponseAvailable() {
+  for (uint8_t c = 0; c < HTTP_MAX_INFLIGHT; c++) {
+    if (httpConnections[c].request != nullptr && apiClient(c).available() > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Selesaikan request: metrik, trace, penanganan 401 (lihat SIKLUS HIDUP
+// JWT) lalu httpDeliver(). body/bodyLength = body respons, hanya dipakai
+// jika errorMessage == nullptr.
+void httpComplete(HttpRequest& request, int httpCode, const char* errorMessage, const char* body, size_t bodyLength) {
+  unsigned long latencyMs = millis() - request.sentAt;
+  recordHttpMetric(request.endpointIndex, httpCode, latencyMs, request.bodyLength, bodyLength);
+  trace(TRACE_HTTP, request.endpointIndex, httpCode);
+  DEBUG_SERIAL.printf("[HTTP] %s -> %d (%lu ms, queued %lu ms)%s%s\n", request.path, httpCode, latencyMs, request.sentAt - request.queuedAt, errorMessage ? ": " : "", errorMessage ? errorMessage : "");
+
+  if (request.auth != HTTP_AUTH_NONE && request.endpointIndex != METRIC_EP_AUTH) {
+    JwtState& jwt = jwtStateForSlot(request.auth);
+    if (httpCode == 401) {
+      jwtUnauthorized++;
+      if (!request.authRetried) {
+        // Parkir di slotnya; dikirim ulang atau digagalkan oleh jwtRefreshDone()
+        request.authRetried = true;
+        request.state = HTTP_REQ_AUTH_WAIT;
+        jwtRefresh(request.auth);
+        return;
+      }
+      jwtBackoff(jwt, true); // Token baru pun ditolak
+    } else if (httpCode >= 200 && httpCode < 300) {
+      jwt.backoffMs = 0;
+    }
+  }
+  httpDeliver(request, httpCode, errorMessage, body, bodyLength);
+}
+
+// Parse respons lalu callback; slot request dibebaskan
+void httpDeliver(HttpRequest& request, int httpCode, const char* errorMessage, const char* body, size_t bodyLength) {
+  // Dokumen sementara kosong jika pemanggil menyediakan dokumennya sendiri
+  DynamicJsonDocument scratch(request.responseDoc != nullptr ? 0 : request.responseCapacity);
+  JsonDocument& response = request.responseDoc != nullptr ? *request.responseDoc : scratch;
+  if (errorMessage != nullptr) {
+    setHttpError(response, errorMessage);
+  } else {
+    DeserializationError error = deserializeJson(response, body, bodyLength);
+    if (error) {
+      DEBUG_SERIAL.print(F("Response JSON parse failed: "));
+      DEBUG_SERIAL.println(error.c_str());
+      setHttpError(response, "Invalid JSON response");
+    } else {
+      DEBUG_SERIAL.print("Response: ");
+      serializeJson(response, DEBUG_SERIAL);
+      DEBUG_SERIAL.println();
+    }
+  }
+
+  // Slot dibebaskan sebelum callback agar callback boleh mengantrikan request baru
+  HttpCallback callback = request.callback;
+  uintptr_t context = request.context;
+  request.state = HTTP_REQ_FREE;
+  if (httpLargeBodyOwner == &request) {
+    httpLargeBodyOwner = nullptr;
+  }
+  callback(httpCode, response, context);
+}
+
+// Mulai request di koneksi bebas: connect (blocking) lalu kirim header + body
+void httpSend(HttpRequest& request, uint8_t connection) {
+  HttpConnection& conn = httpConnections[connection];
+  // Token ditolak server: tidak ada gunanya dikirim sampai refresh berhasil
+  if (request.auth != HTTP_AUTH_NONE && request.endpointIndex != METRIC_EP_AUTH && jwtStateForSlot(request.auth).rejected) {
+    jwtRequestsHeld++;
+    httpDeliver(request, 401, "JWT rejected, waiting for refresh", nullptr, 0);
+    return;
+  }
+  request.sentAt = millis();
+  httpQueueWaitLastMs = request.sentAt - request.queuedAt;
+  httpQueueWaitMaxMs = max(httpQueueWaitMaxMs, httpQueueWaitLastMs);
+  if (!isWiFiConnected) {
+    httpComplete(request, -1, "No WiFi connection", nullptr, 0);
+    return;
+  }
+
+  trace(TRACE_HTTP_START, request.endpointIndex, 0);
+  WiFiClient* client = openApiClient(connection);
+  if (client == nullptr) {
+    httpComplete(request, -1, "Connection failed", nullptr, 0);
+    return;
+  }
+  // Titik heap terendah: buffer BearSSL koneksi ini sudah dialokasikan
+  uint32_t heapFree = ESP.getFreeHeap();
+  if (httpHeapAfterConnectMin == 0 || heapFree < httpHeapAfterConnectMin) {
+    httpHeapAfterConnectMin = heapFree;
+  }
+
+  // Header (< 700 byte) disusun di buffer respons koneksi yang belum terpakai
+  int len = snprintf(conn.response, sizeof(conn.response), "%s %s%s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n", request.post ? "POST" : "GET", apiBasePath, request.path, apiHost);
+  if (request.auth != HTTP_AUTH_NONE) {
+    len += snprintf(conn.response + len, sizeof(conn.response) - len, "Authorization: Bearer %s\r\n", meterJwtForSlot(request.auth));
+  }
+  if (request.post) {
+    len += snprintf(conn.response + len, sizeof(conn.response) - len, "Content-Type: application/%s\r\nContent-Length: %u\r\n", request.cbor ? "cbor" : "json", (unsigned)request.bodyLength);
+  }
+  len += snprintf(conn.response + len, sizeof(conn.response) - len, "\r\n");
+
+  DEBUG_SERIAL.print(request.post ? "POST to: " : "GET from: ");
+  DEBUG_SERIAL.println(request.path);
+  if (request.cbor) {
+    DEBUG_SERIAL.printf("Payload: %u byte CBOR\n", (unsigned)request.bodyLength);
+  } else if (request.post) {
+    DEBUG_SERIAL.print("Payload: ");
+    DEBUG_SERIAL.write((const uint8_t*)request.body, request.bodyLength);
+    DEBUG_SERIAL.println();
+  }
+
+  size_t sent = client->write((const uint8_t*)conn.response, len);
+  if (request.post) {
+    sent += client->write((const uint8_t*)request.body, request.bodyLength);
+  }
+  if (sent != (size_t)len + request.bodyLength) {
+    client->stop();
+    httpComplete(request, -1, "Send failed", nullptr, 0);
+    return;
+  }
+
+  conn.request = &request;
+  conn.length = 0;
+  conn.bodyOffset = 0;
+  conn.contentLength = -1;
+  conn.statusCode = -1;
+  conn.acceptsCbor = -1;
+  request.state = HTTP_REQ_WAITING;
+}
+
+// Status dan Content-Length, begitu header respons lengkap
+void httpParseHeader(HttpConnection& conn) {
+  char* end = strstr(conn.response, "\r\n\r\n");
+  if (end == nullptr) {
+    return;
+  }
+  conn.bodyOffset = end + 4 - conn.response;
+  const char* status = strchr(conn.response, ' '); // "HTTP/1.1 200 OK"
+  conn.statusCode = status != nullptr ? atoi(status + 1) : -1;
+  for (const char* line = strstr(conn.response, "\r\n"); line != nullptr && line < end; line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+      conn.contentLength = atol(line + 17);
+    } else if (strncasecmp(line + 2, "Accept-Post:", 12) == 0) {
+      const char* cbor = strstr(line + 2, "application/cbor");
+      conn.acceptsCbor = cbor != nullptr && cbor < strstr(line + 2, "\r\n") ? 1 : 0;
+    }
+  }
+}
+
+// Tutup koneksi lalu selesaikan request-nya
+void httpFinish(uint8_t connection, int httpCode, const char* errorMessage) {
+  HttpConnection& conn = httpConnections[connection];
+  HttpRequest& request = *conn.request;
+  apiClient(connection).stop();
+  conn.request = nullptr;
+
+  // Negosiasi format body uplink untuk path ini (lihat UPLINK BINER)
+  if (request.uplinkPath != UPLINK_PATH_NONE) {
+    uint16_t pathBit = 1U << request.uplinkPath;
+    bool cborBefore = uplinkCborPaths & pathBit;
+    if (conn.acceptsCbor == 1) {
+      uplinkCborPaths |= pathBit;
+    } else if (conn.acceptsCbor == 0 || (request.cbor && httpCode == 415)) {
+      uplinkCborPaths &= ~pathBit;
+    }
+    if (cborBefore != (bool)(uplinkCborPaths & pathBit)) {
+      DEBUG_SERIAL.printf("Uplink %s: %s\n", uplinkPathName(request.uplinkPath), cborBefore ? "JSON" : "CBOR");
+    }
+  }
+  size_t bodyLength = conn.bodyOffset > 0 ? conn.length - conn.bodyOffset : 0;
+  httpComplete(request, httpCode, errorMessage, conn.response + conn.bodyOffset, bodyLength);
+}
+
+// Ambil byte respons yang sudah tiba tanpa menunggu; selesaikan request
+// jika respons lengkap, koneksi putus atau batas waktu habis
+void httpReceive(uint8_t connection) {
+  HttpConnection& conn = httpConnections[connection];
+  WiFiClient& client = apiClient(connection);
+  int available = client.available();
+  while (available > 0 && conn.length < sizeof(conn.response) - 1) {
+    size_t chunk = min((size_t)available, sizeof(conn.response) - 1 - conn.length);
+    int n = client.read((uint8_t*)conn.response + conn.length, chunk);
+    if (n <= 0) {
+      break;
+    }
+    conn.length += n;
+    available = client.available();
+  }
+  conn.response[conn.length] = '\0';
+  if (conn.bodyOffset == 0) {
+    httpParseHeader(conn);
+  }
+
+  bool closed = !client.connected() && client.available() == 0;
+  size_t bodyLength = conn.bodyOffset > 0 ? conn.length - conn.bodyOffset : 0;
+  if (conn.bodyOffset > 0 && (closed || (conn.contentLength >= 0 && bodyLength >= (size_t)conn.contentLength))) {
+    httpFinish(connection, conn.statusCode, nullptr);
+  } else if (closed) {
+    httpFinish(connection, -1, "Connection closed");
+  } else if (conn.length >= sizeof(conn.response) - 1) {
+    httpFinish(connection, -1, "Response too large");
+  } else if (millis() - conn.request->sentAt > HTTP_REQUEST_TIMEOUT) {
+    httpTimeouts++;
+    httpFinish(connection, -1, "Request timeout");
+  }
+}
+
+// Dipanggil setiap pass loop (dan selama httpPOST() menunggu)
+void httpService() {
+  for (uint8_t c = 0; c < HTTP_MAX_INFLIGHT; c++) {
+    if (httpConnections[c].request != nullptr) {
+      httpReceive(c);
+    }
+    if (httpConnections[c].request == nullptr) {
+      HttpRequest* next = httpNextQueued();
+      if (next != nullptr) {
+        httpSend(*next, c);
+      }
+    }
+  }
+}
+
+void httpWaitDone(int httpCode, JsonDocument& response, uintptr_t context) {
+  HttpWait* wait = (HttpWait*)context;
+  wait->httpCode = httpCode;
+  wait->done = true;
+}
+
+// POST yang menunggu hasilnya, hanya untuk pemanggil jarang di tingkat loop
+// (registrasi perangkat, dump trace NodeMCU). Jangan dipanggil dari handler
+// frame atau callback HTTP: engine dilayani ulang selama menunggu.
+// Request antri di belakang request async lain; selama menunggu, engine dan
+// /metrics tetap dilayani. Respons (atau error) selalu tersedia di
+// responseDoc dengan field "status". auth seperti httpRequestAsync().
+int httpPOST(const char* endpoint, const JsonDocument& payload, JsonDocument& responseDoc, uint8_t auth) {
+  HttpWait wait = {false, -1};
+  if (!httpRequestAsync(endpoint, nullptr, &payload, auth, &responseDoc, 0, httpWaitDone, (uintptr_t)&wait)) {
+    setHttpError(responseDoc, "Request not queued");
+    return -1;
+  }
+  while (!wait.done) {
+    httpService();
+    // Di mode AP handler provisioning sendiri yang memanggil registerDevice()
+    if (webServerStarted && isDeviceRegistered) {
+      server.handleClient();
+    }
+    delay(HTTP_WAIT_SLICE);
+  }
+  return wait.httpCode;
+}
+
+// =====================================================
+// FUNGSI JWT
+// =====================================================
+JwtState& jwtStateForSlot(uint8_t meter) {
+  return meter == BUS_LOCAL_METER ? deviceJwtState : busJwtStates[meter];
+}
+
+// Base64 standar maupun base64url, padding opsional. 0 jika ada karakter
+// tidak valid atau hasil tidak muat.
+size_t base64Decode(const char* in, size_t length, uint8_t* out, size_t capacity) {
+  uint32_t bits = 0;
+  uint8_t pending = 0;
+  size_t n = 0;
+  for (size_t i = 0; i < length && in[i] != '='; i++) {
+    char c = in[i];
+    uint8_t value;
+    if (c >= 'A' && c <= 'Z') {
+      value = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      value = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      value = c - '0' + 52;
+    } else if (c == '+' || c == '-') {
+      value = 62;
+    } else if (c == '/' || c == '_') {
+      value = 63;
+    } else {
+      return 0;
+    }
+    bits = (bits << 6) | value;
+    pending += 6;
+    if (pending >= 8) {
+      pending -= 8;
+      if (n >= capacity) {
+        return 0;
+      }
+      out[n++] = bits >> pending;
+    }
+  }
+  return n;
+}
+
+// Klaim exp/iat token milik slot. Dipanggil setiap kali token dimuat atau
+// diganti; token tanpa exp yang terbaca hanya di-refresh lewat jalur 401.
+void jwtLoadClaims(uint8_t meter) {
+  JwtState& state = jwtStateForSlot(meter);
+  state.expiresAt = 0;
+  state.issuedAt = 0;
+
+  const char* token = meterJwtForSlot(meter);
+  const char* payload = token;
+  size_t length = strlen(token);
+  const char* dot = strchr(token, '.');
+  if (dot != nullptr) {
+    payload = dot + 1;
+    const char* end = strchr(payload, '.');
+    length = end != nullptr ? (size_t)(end - payload) : strlen(payload);
+  }
+
+  uint8_t decoded[192]; // Token maksimal 255 karakter
+  size_t decodedLength = base64Decode(payload, length, decoded, sizeof(decoded));
+  StaticJsonDocument<32> filter;
+  filter["exp"] = true;
+  filter["iat"] = true;
+  StaticJsonDocument<64> claims;
+  if (decodedLength == 0 || deserializeJson(claims, decoded, decodedLength, DeserializationOption::Filter(filter))) {
+    DEBUG_SERIAL.printf("JWT %s: exp claim not readable\n", meterIdForSlot(meter));
+    return;
+  }
+  state.expiresAt = claims["exp"] | 0UL;
+  state.issuedAt = claims["iat"] | 0UL;
+  DEBUG_SERIAL.printf("JWT %s: exp %lu\n", meterIdForSlot(meter), (unsigned long)state.expiresAt);
+}
+
+// Sisa umur token dalam detik. False jika exp tidak diketahui atau jam
+// belum sinkron.
+bool jwtExpiresIn(const JwtState& state, long& seconds) {
+  if (state.expiresAt == 0 || !timeSynced) {
+    return false;
+  }
+  seconds = (long)state.expiresAt - (long)(deviceEpochMs(millis()) / 1000);
+  return true;
+}
+
+bool jwtRefreshDue(const JwtState& state) {
+  uint32_t margin = JWT_REFRESH_MARGIN;
+  if (state.issuedAt > 0 && state.expiresAt > state.issuedAt) {
+    margin = (state.expiresAt - state.issuedAt) / 5;
+  }
+  long remaining;
+  return jwtExpiresIn(state, remaining) && remaining < (long)margin;
+}
+
+bool jwtInBackoff(const JwtState& state, unsigned long now) {
+  return state.backoffMs > 0 && now - state.backoffSince < state.backoffMs;
+}
+
+// rejected = server menolak token: request ber-JWT ditahan sampai refresh berhasil
+void jwtBackoff(JwtState& state, bool rejected) {
+  state.backoffMs = state.backoffMs == 0 ? JWT_BACKOFF_BASE : min(state.backoffMs * 2, JWT_BACKOFF_MAX);
+  state.backoffSince = millis();
+  if (rejected) {
+    state.rejected = true;
+  }
+}
+
+// ID perangkat yang dikirim saat registrasi: chip id untuk perangkat,
+// "<chip>-<alamat>" untuk meter bus
+void deviceIdForSlot(uint8_t meter, char* out, size_t size) {
+  if (meter == BUS_LOCAL_METER) {
+    snprintf(out, size, "%u", ESP.getChipId());
+  } else {
+    snprintf(out, size, "%u-%u", ESP.getChipId(), busMeters[meter].address);
+  }
+}
+
+// Antrikan refresh token milik slot (sekali jalan per slot)
+void jwtRefresh(uint8_t meter) {
+  JwtState& state = jwtStateForSlot(meter);
+  if (state.refreshing) {
+    return;
+  }
+  char deviceId[24];
+  deviceIdForSlot(meter, deviceId, sizeof(deviceId));
+  StaticJsonDocument<128> doc;
+  doc["id_meter"] = meterIdForSlot(meter);
+  doc["device_id"] = deviceId;
+  state.refreshing = true;
+  DEBUG_SERIAL.printf("Refreshing JWT for %s\n", meterIdForSlot(meter));
+  if (!httpRequestAsync(REFRESH_TOKEN_ENDPOINT, nullptr, &doc, meter, nullptr, 512, onJwtRefreshResponse, meter)) {
+    jwtRefreshDone(meter, false, false);
+  }
+}
+
+void onJwtRefreshResponse(int httpCode, JsonDocument& responseDoc, uintptr_t context) {
+  uint8_t meter = (uint8_t)context;
+  const char* token = responseDoc["jwt_token"] | "";
+  size_t length = strlen(token);
+  if (responseDoc["status"] != "success" || length == 0 || length >= sizeof(busMeters[0].jwt)) {
+    DEBUG_SERIAL.printf("JWT refresh failed (%d): %s\n", httpCode, responseDoc["message"] | "");
+    jwtRefreshDone(meter, false, httpCode == 401 || httpCode == 403);
+    return;
+  }
+
+  if (meter == BUS_LOCAL_METER) {
+    deviceJwtToken = token;
+    saveString(EEPROM_JWT_ADDR, deviceJwtToken);
+  } else {
+    strlcpy(busMeters[meter].jwt, token, sizeof(busMeters[meter].jwt));
+    saveBusMeter(meter);
+  }
+  jwtLoadClaims(meter);
+  jwtRefreshDone(meter, true, false);
+}
+
+// Akhir refresh: request yang diparkir karena 401 dikirim ulang (berhasil)
+// atau diteruskan ke callback-nya sebagai 401 (gagal)
+void jwtRefreshDone(uint8_t meter, bool success, bool rejected) {
+  JwtState& state = jwtStateForSlot(meter);
+  state.refreshing = false;
+  if (success) {
+    jwtRefreshes++;
+    state.rejected = false;
+  } else {
+    jwtRefreshFailures++;
+    jwtBackoff(state, rejected);
+  }
+
+  for (uint8_t i = 0; i < HTTP_QUEUE_SIZE; i++) {
+    HttpRequest& request = httpRequests[i];
+    if (request.state != HTTP_REQ_AUTH_WAIT || request.auth != meter) {
+      continue;
+    }
+    if (success) {
+      request.state = HTTP_REQ_QUEUED; // Urutan lama tetap, jadi dikirim lebih dulu
+    } else {
+      httpDeliver(request, 401, "JWT refresh failed", nullptr, 0);
+    }
+  }
+  if (rejected) {
+    jwtReregister(meter);
+  }
+}
+
+// Server menolak refresh: minta token baru lewat registrasi ulang. Meter bus
+// masuk antrian registrasi (registerPendingBusMeter memperbarui slotnya).
+void jwtReregister(uint8_t meter) {
+  if (meter != BUS_LOCAL_METER) {
+    busPendingRegistrations |= 1UL << busMeters[meter].address;
+    return;
+  }
+  if (deviceProvisioningToken.length() == 0) {
+    DEBUG_SERIAL.println("JWT rejected, no provisioning token stored; refresh retried after backoff");
+    return;
+  }
+  char deviceId[24];
+  deviceIdForSlot(BUS_LOCAL_METER, deviceId, sizeof(deviceId));
+  StaticJsonDocument<192> doc;
+  doc["provisioning_token"] = deviceProvisioningToken.c_str();
+  doc["device_id"] = deviceId;
+  deviceJwtState.refreshing = true; // Tidak ada refresh bersamaan dengan registrasi ulang
+  DEBUG_SERIAL.println("JWT rejected, re-registering device");
+  if (!httpRequestAsync(REGISTER_DEVICE_ENDPOINT, nullptr, &doc, HTTP_AUTH_NONE, nullptr, 512, onDeviceReregistered, 0)) {
+    deviceJwtState.refreshing = false;
+  }
+}
+
+void onDeviceReregistered(int httpCode, JsonDocument& responseDoc, uintptr_t context) {
+  deviceJwtState.refreshing = false;
+  const char* token = responseDoc["jwt_token"] | "";
+  size_t length = strlen(token);
+  if (responseDoc["status"] != "success" || length == 0 || length >= sizeof(busMeters[0].jwt)) {
+    DEBUG_SERIAL.printf("Device re-registration failed (%d): %s\n", httpCode, responseDoc["message"] | "");
+    return; // Tetap ditolak; refresh dicoba lagi setelah backoff
+  }
+
+  const char* meterId = responseDoc["id_meter"] | "";
+  if (meterId[0] != '\0' && idMeter != meterId) {
+    idMeter = meterId;
+    saveString(EEPROM_ID_METER_ADDR, idMeter);
+  }
+  deviceJwtToken = token;
+  saveString(EEPROM_JWT_ADDR, deviceJwtToken);
+  memset(&deviceJwtState, 0, sizeof(deviceJwtState));
+  jwtLoadClaims(BUS_LOCAL_METER);
+  jwtRefreshes++;
+  DEBUG_SERIAL.printf("Device re-registered as %s\n", idMeter.c_str());
+}
+
+void jwtServiceSlot(uint8_t meter, unsigned long now, bool scheduled) {
+  JwtState& state = jwtStateForSlot(meter);
+  if (state.refreshing || jwtInBackoff(state, now)) {
+    return;
+  }
+  if (state.rejected || (scheduled && jwtRefreshDue(state))) {
+    jwtRefresh(meter);
+  }
+}
+
+// Dipanggil setiap pass loop: refresh token yang ditolak setelah backoff,
+// dan (setiap JWT_CHECK_INTERVAL) token yang mendekati exp
+void jwtService(unsigned long now) {
+  bool scheduled = now - lastJwtCheckTime >= JWT_CHECK_INTERVAL;
+  if (scheduled) {
+    lastJwtCheckTime = now;
+  }
+  jwtServiceSlot(BUS_LOCAL_METER, now, scheduled);
+  for (uint8_t i = 0; GATEWAY_MODE && i < BUS_METER_SLOTS; i++) {
+    if (busMeters[i].address != 0) {
+      jwtServiceSlot(i, now, scheduled);
+    }
+  }
+}
+
+// =====================================================
+// FUNGSI API CALLS
+// =====================================================
+bool registerDevice(String provisioningToken) {
+  StaticJsonDocument<256> doc;
+  doc["provisioning_token"] = provisioningToken;
+  doc["device_id"] = String(ESP.getChipId()); // Menggunakan Chip ID sebagai ID unik perangkat
+
+  DynamicJsonDocument responseDoc(512);
+  httpPOST(REGISTER_DEVICE_ENDPOINT, doc, responseDoc, HTTP_AUTH_NONE);
+
+  if (responseDoc["status"] == "success") {
+    idMeter = responseDoc["id_meter"].as<String>();
+    deviceJwtToken = responseDoc["jwt_token"].as<String>();
+    
+    // Save to EEPROM
+    saveString(EEPROM_ID_METER_ADDR, idMeter);
+    saveString(EEPROM_JWT_ADDR, deviceJwtToken);
+    if (provisioningToken.length() <= PROVISION_TOKEN_MAX) {
+      deviceProvisioningToken = provisioningToken;
+      saveString(EEPROM_PROVISION_ADDR, deviceProvisioningToken);
+    } else {
+      DEBUG_SERIAL.println("Provisioning token too long to keep; no re-registration fallback");
+    }
+    memset(&deviceJwtState, 0, sizeof(deviceJwtState));
+    jwtLoadClaims(BUS_LOCAL_METER);
+    
+    isDeviceRegistered = true;
+    
+    DEBUG_SERIAL.println("Device registered successfully!");
+    DEBUG_SERIAL.print("Meter ID: ");
+    DEBUG_SERIAL.println(idMeter);
+    
+    return true;
+  } else {
+    DEBUG_SERIAL.print("Device registration failed: ");
+    DEBUG_SERIAL.println(responseDoc["message"].as<String>());
+    return false;
+  }
+}
+
+// Antrikan pembacaan ke server; hasilnya diproses onMeterReadingResponse().
+// False jika tidak bisa diantrikan.
+bool submitMeterReading(float flowRate, float meterReading, float voltage, int doorStatus, LinkStatus status, LinkValve valve, long seq, unsigned long capturedAt, const char* aggregate, const char* arduinoLoop) {
+  if (!isDeviceRegistered) {
+    DEBUG_SERIAL.println("Device not registered, cannot submit reading");
+    return false;
+  }
+  
+  DynamicJsonDocument doc(768);
+  doc["id_meter"] = idMeter.c_str();
+  doc["flow_rate_lpm"] = flowRate;
+  doc["meter_reading_m3"] = meterReading;
+  doc["current_voltage"] = voltage;
+  doc["door_status"] = doorStatus;
+  doc["status_message"] = linkName(status);
+  doc["valve_status"] = linkName(valve);
+  doc["include_commands"] = true; // Minta server menyertakan perintah pending di respons
+  doc["power_duty_pct"] = roundf(takePowerDutyCycle() * 10.0) / 10.0; // Persentase waktu radio bangun
+  if (seq >= 0) {
+    doc["seq"] = seq;
+  }
+  if (lastEventLatencyMs > 0) {
+    doc["event_latency_ms"] = lastEventLatencyMs; // Latensi event prioritas terakhir
+  }
+  if (wifiConnectMs > 0) {
+    doc["wifi_connect_ms"] = wifiConnectMs; // Durasi koneksi Wi-Fi terakhir
+  }
+  addCaptureTime(doc.as<JsonObject>(), capturedAt);
+  if (aggregate[0] != '\0') {
+    doc["agg"] = serialized(aggregate); // Agregat interval (volume, min/avg/max, histogram)
+  }
+  if (arduinoLoop[0] != '\0') {
+    doc["loop"] = serialized(arduinoLoop); // Statistik loop Arduino
+  }
+  bool loopReportDue = millis() - loopStats.windowStart >= LOOP_REPORT_INTERVAL;
+  if (loopReportDue) {
+    fillLoopStats(doc.createNestedObject("node_loop"), loopStats, LOOP_TAG_NAMES[loopStats.maxSectionTag], LOOP_DEADLINE_MS, millis());
+  }
+
+  readingInFlightSeq = seq;
+  readingInFlightFlowRate = flowRate;
+  readingInFlightLoopReport = loopReportDue;
+  // Respons cukup 1 KB: data pulsa + daftar perintah
+  return httpRequestAsync(SUBMIT_READING_ENDPOINT, nullptr, &doc, BUS_LOCAL_METER, nullptr, 1024, onMeterReadingResponse, 0);
+}
+
+void onMeterReadingResponse(int httpCode, JsonDocument& responseDoc, uintptr_t context) {
+  bool submitted = responseDoc["status"] == "success";
+  if (submitted) {
+    DEBUG_SERIAL.println("Meter reading submitted successfully");
+    if (readingInFlightLoopReport) {
+      loopStatsReset(loopStats, millis());
+    }
+    
+    // Update pulsa dan status unlock dari server
+    float newPulsa = responseDoc["data_pulsa"].as<float>();
+    float newTarif = responseDoc["tarif_per_m3"].as<float>();
+    bool newUnlockedStatus = responseDoc["is_unlocked"].as<bool>();
+    lastKnownCredit = newPulsa;
+    checkpointDirty = true;
+
+    // Override batas interval dari server (opsional)
+    if (responseDoc.containsKey("intervals")) {
+      applyIntervalConfig(responseDoc["intervals"].as<JsonObject>());
+    }
+
+    // Kirim ke Arduino
+    LinkUpdate update;
+    update.address = 0;
+    update.idMeter = idMeter.c_str();
+    update.credit = newPulsa;
+    update.tariff = newTarif;
+    update.unlocked = newUnlockedStatus;
+    update.reportIntervalMs = meterDataSendInterval.currentMs;
+    // Saldo dihitung dari pembacaan ini; Arduino menerapkannya sebagai delta
+    update.ackSeq = responseDoc["ack_seq"] | readingInFlightSeq;
+    StaticJsonDocument<192> arduinoUpdateDoc;
+    linkEncodeFrame(arduinoUpdateDoc, update, arduinoLegacyLink);
+    
+    size_t txLength = serializeJson(arduinoUpdateDoc, ARDUINO_SERIAL);
+    ARDUINO_SERIAL.println();
+    trace(TRACE_SERIAL_TX, 0, txLength);
+    DEBUG_SERIAL.print("Tx Arduino (Update): ");
+    serializeJson(arduinoUpdateDoc, DEBUG_SERIAL);
+    DEBUG_SERIAL.println();
+
+    // Perintah pending yang ikut di respons pembacaan. Server lama yang tidak
+    // mengirim "commands" tetap dilayani oleh pollCommands() biasa.
+    if (responseDoc.containsKey("commands")) {
+      dispatchCommands(responseDoc["commands"].as<JsonArray>(), BUS_LOCAL_METER);
+      lastReadingExchangeTime = millis();
+      hasReadingExchange = true;
+    }
+  } else {
+    DEBUG_SERIAL.print("Failed to submit meter reading: ");
+    DEBUG_SERIAL.println(responseDoc["message"].as<const char*>());
+  }
+  updateActivityIntervals(readingInFlightFlowRate, submitted);
+  finishQueuedReading(submitted);
+}
+
+void pollCommands() {
+  if (!isDeviceRegistered || httpPending(METRIC_EP_COMMANDS)) {
+    return;
+  }
+
+  char query[48];
+  snprintf(query, sizeof(query), "?id_meter=%s", idMeter.c_str());
+  if (!httpRequestAsync(GET_COMMANDS_ENDPOINT, query, nullptr, BUS_LOCAL_METER, nullptr, 1024, onCommandsResponse, 0)) {
+    intervalBackoff(commandPollInterval);
+  }
+}
+
+void onCommandsResponse(int httpCode, JsonDocument& responseDoc, uintptr_t context) {
+  if (responseDoc["status"] != "success") {
+    intervalBackoff(commandPollInterval);
+    return;
+  }
+
+  if (responseDoc.containsKey("intervals")) {
+    applyIntervalConfig(responseDoc["intervals"].as<JsonObject>());
+  }
+
+  if (responseDoc.containsKey("commands") && responseDoc["commands"].as<JsonArray>().size() > 0) {
+    dispatchCommands(responseDoc["commands"].as<JsonArray>(), BUS_LOCAL_METER);
+  } else if (!isDeviceActive()) {
+    intervalBackoff(commandPollInterval); // Tidak ada perintah dan idle
+  }
+}
+
+// Antrikan event terdepan eventQueue ke endpoint khusus; hasilnya diproses
+// onPriorityEventResponse(). False jika tidak bisa diantrikan.
+bool submitPriorityEvent(const QueuedReading& event) {
+  if (!isDeviceRegistered) {
+    return false;
+  }
+
+  StaticJsonDocument<384> doc;
+  doc["id_meter"] = meterIdForSlot(event.meter);
+  doc["event_type"] = linkName(event.status);
+  doc["flow_rate_lpm"] = event.flowRate;
+  doc["meter_reading_m3"] = event.meterReading;
+  doc["current_voltage"] = event.voltage;
+  doc["door_status"] = event.doorStatus;
+  doc["valve_status"] = linkName(event.valve);
+  if (event.seq >= 0) {
+    doc["seq"] = event.seq;
+  }
+  doc["queued_ms"] = millis() - event.detectedAt;
+  addCaptureTime(doc.as<JsonObject>(), event.detectedAt);
+  doc["attempt"] = event.attempts + 1;
+
+  return httpRequestAsync(SUBMIT_EVENT_ENDPOINT, nullptr, &doc, event.meter, nullptr, 256, onPriorityEventResponse, 0);
+}
+
+void onPriorityEventResponse(int httpCode, JsonDocument& responseDoc, uintptr_t context) {
+  if (eventQueueCount == 0) {
+    return;
+  }
+  QueuedReading& event = eventQueue[eventQueueHead];
+  if (responseDoc["status"] != "success") {
+    DEBUG_SERIAL.print("Failed to submit event: ");
+    DEBUG_SERIAL.println(responseDoc["message"].as<const char*>());
+    retryPriorityEvent(event);
+    return;
+  }
+
+  lastEventLatencyMs = millis() - event.detectedAt;
+  if (lastEventLatencyMs > maxEventLatencyMs) {
+    maxEventLatencyMs = lastEventLatencyMs;
+  }
+  DEBUG_SERIAL.printf("Event %s accepted, latency %lu ms (attempt %u)\n", linkName(event.status), lastEventLatencyMs, event.attempts + 1);
+  eventQueueHead = (eventQueueHead + 1) % EVENT_QUEUE_SIZE;
+  eventQueueCount--;
+  checkpointDirty = true;
+}
+
+// Teruskan daftar perintah dari server ke Arduino.
+// Dipakai oleh pollCommands(), respons submitMeterReading() dan respons
+// upload gabungan (meter = slot bus, frame diantrikan sampai giliran meter).
+void dispatchCommands(JsonArray commands, uint8_t meter) {
+  if (commands.size() > 0) {
+    markCommandActivity();
+  }
+
+  for (JsonObject command : commands) {
+    const char* command_type = command["command_type"] | "";
+    int command_id = command["command_id"].as<int>();
+    LinkCommand arduinoCommand;
+    arduinoCommand.commandId = command_id;
+    linkFromName(command_type, arduinoCommand.code);
+    linkFromName(command["current_valve_status"] | "", arduinoCommand.valve);
+
+    trace(TRACE_COMMAND, arduinoCommand.code, command_id);
+    DEBUG_SERIAL.print("Received command: ");
+    DEBUG_SERIAL.print(command_type);
+    DEBUG_SERIAL.print(" (ID: ");
+    DEBUG_SERIAL.print(command_id);
+    DEBUG_SERIAL.println(")");
+
+    // dump_trace: ring NodeMCU diunggah dari loop(), perintah tetap
+    // diteruskan agar Arduino mengirim ring miliknya
+    if (arduinoCommand.code == TRACE_CMD_DUMP_TRACE) {
+      pendingTraceDumpId = command_id;
+      pendingTraceDumpMeter = meter;
+    }
+    
+    // Forward command to Arduino (config data hanya untuk config update)
+    if (arduinoCommand.code == TRACE_CMD_CONFIG_UPDATE) {
+      arduinoCommand.config = command["parameters"];
+    }
+    
+    StaticJsonDocument<256> arduinoCommandDoc;
+    if (meter != BUS_LOCAL_METER) {
+      arduinoCommand.address = busMeters[meter].address;
+      linkEncodeFrame(arduinoCommandDoc, arduinoCommand, busMeters[meter].legacyLink);
+      enqueueBusFrame(meter, arduinoCommandDoc);
+      continue;
+    }
+    arduinoCommand.address = 0;
+    linkEncodeFrame(arduinoCommandDoc, arduinoCommand, arduinoLegacyLink);
+    
+    size_t txLength = serializeJson(arduinoCommandDoc, ARDUINO_SERIAL);
+    ARDUINO_SERIAL.println();
+    trace(TRACE_SERIAL_TX, 0, txLength);
+    DEBUG_SERIAL.print("Tx Arduino (Command): ");
+    serializeJson(arduinoCommandDoc, DEBUG_SERIAL);
+    DEBUG_SERIAL.println();
+  }
+}
+
+// Antrikan ACK perintah (lihat ackQueue); dikirim processOutboundQueues()
+void enqueueCommandAck(long commandId, LinkAck status, const char* notes, uint8_t valve, JsonArrayConst config, uint8_t meter) {
+  if (ackQueueCount >= ACK_QUEUE_SIZE) {
+    // ACK yang lebih lama belum terkirim tetap dipertahankan
+    droppedAcks++;
+    DEBUG_SERIAL.printf("ACK queue full, ACK for command %ld dropped\n", commandId);
+    return;
+  }
+  QueuedAck& ack = ackQueue[(ackQueueHead + ackQueueCount) % ACK_QUEUE_SIZE];
+  ack.commandId = commandId;
+  ack.status = status;
+  ack.valve = valve;
+  ack.meter = meter;
+  strlcpy(ack.notes, notes != nullptr ? notes : "", sizeof(ack.notes));
+  ack.configCount = 0;
+  ack.configBools = 0;
+  for (uint8_t i = 0; !config.isNull() && i < LINK_PARAM_COUNT && i < config.size(); i++) {
+    if (config[i].is<bool>()) {
+      ack.configBools |= 1 << i;
+    }
+    ack.config[i] = config[i].as<float>();
+    ack.configCount++;
+  }
+  ack.nextAttemptAt = millis();
+  ack.attempts = 0;
+  ackQueueCount++;
+  checkpointDirty = true;
+}
+
+// Antrikan ACK terdepan ackQueue; hasilnya diproses onCommandAckResponse().
+// False jika tidak bisa diantrikan.
+bool submitCommandAck(const QueuedAck& ack) {
+  if (!isDeviceRegistered) {
+    return false;
+  }
+  
+  StaticJsonDocument<768> doc;
+  doc["command_id"] = ack.commandId;
+  doc["status"] = linkName(ack.status);
+  doc["notes"] = (const char*)ack.notes;
+  doc["valve_status_ack"] = ack.valve == ACK_NO_VALVE ? "" : linkName((LinkValve)ack.valve);
+  if (ack.configCount > 0) {
+    // Jawaban get_config: nilai PARAMS dipetakan ke kuncinya
+    JsonObject configObj = doc.createNestedObject("config");
+    for (uint8_t i = 0; i < ack.configCount; i++) {
+      if (ack.configBools & (1 << i)) {
+        configObj[LINK_PARAM_KEYS[i]] = ack.config[i] != 0;
+      } else {
+        configObj[LINK_PARAM_KEYS[i]] = ack.config[i];
+      }
+    }
+  }
+  doc["attempt"] = ack.attempts + 1;
+  
+  return httpRequestAsync(ACK_COMMAND_ENDPOINT, nullptr, &doc, ack.meter, nullptr, 128, onCommandAckResponse, (uintptr_t)ack.commandId);
+}
+
+void onCommandAckResponse(int httpCode, JsonDocument& responseDoc, uintptr_t context) {
+  if (ackQueueCount == 0) {
+    return;
+  }
+  QueuedAck& ack = ackQueue[ackQueueHead];
+  // Request, bukan koneksi, yang salah: kirim ulang tidak akan berhasil
+  bool rejected = httpCode >= 400 && httpCode < 500 && httpCode != 401 && httpCode != 408 && httpCode != 429;
+  if (responseDoc["status"] == "success") {
+    DEBUG_SERIAL.print("Command ACK sent successfully for ID: ");
+    DEBUG_SERIAL.println((long)context);
+  } else if (rejected) {
+    DEBUG_SERIAL.printf("Command ACK %ld rejected (%d): %s\n", ack.commandId, httpCode, responseDoc["message"] | "");
+  } else {
+    DEBUG_SERIAL.print("Failed to send command ACK: ");
+    DEBUG_SERIAL.println(responseDoc["message"].as<const char*>());
+    retryCommandAck(ack);
+    return;
+  }
+  ackQueueHead = (ackQueueHead + 1) % ACK_QUEUE_SIZE;
+  ackQueueCount--;
+  checkpointDirty = true;
+}
+
+// =====================================================
+// FUNGSI OTA UPDATE
+// =====================================================
+void checkOTAUpdate() {
+  if (!isDeviceRegistered) {
+    return;
+  }
+  if (deviceJwtState.rejected) {
+    intervalBackoff(otaCheckInterval); // Tunggu refresh JWT (jwtService)
+    return;
+  }
+  
+  DEBUG_SERIAL.println("Checking for OTA updates...");
+  
+  char query[48];
+  snprintf(query, sizeof(query), "?device_id=%u&version=1.0.0", ESP.getChipId());
+  if (!buildApiUrl(OTA_UPDATE_ENDPOINT, query)) {
+    return;
+  }
+  WiFiClient* client = openApiClient(0); // loop() hanya memanggil saat engine HTTP kosong
+  if (client == nullptr) {
+    intervalBackoff(otaCheckInterval);
+    return;
+  }
+  
+  HTTPClient http;
+  http.begin(*client, httpUrl);
+  addAuthHeader(http, deviceJwtToken.c_str());
+  
+  unsigned long requestStart = millis();
+  int httpCode = http.GET();
+  recordHttpMetric(METRIC_EP_OTA, httpCode, millis() - requestStart, 0, 0);
+  
+  if (httpCode == HTTP_CODE_OK) {
+    int contentLength = http.getSize();
+    if (contentLength > 0) {
+      DEBUG_SERIAL.println("OTA update available, starting download...");
+      saveCheckpoint(); // Update sukses langsung me-restart perangkat
+      
+      t_httpUpdate_return ret = ESPhttpUpdate.update(*client, httpUrl, "1.0.0");
+      
+      switch (ret) {
+        case HTTP_UPDATE_FAILED:
+          DEBUG_SERIAL.printf("OTA Update failed. Error (%d): %s\n", ESPhttpUpdate.getLastError(), ESPhttpUpdate.getLastErrorString().c_str());
+          break;
+        case HTTP_UPDATE_NO_UPDATES:
+          DEBUG_SERIAL.println("OTA: No updates available");
+          break;
+        case HTTP_UPDATE_OK:
+          DEBUG_SERIAL.println("OTA Update successful, restarting...");
+          ESP.restart();
+          break;
+      }
+    }
+    intervalTighten(otaCheckInterval);
+  } else if (httpCode == HTTP_CODE_NOT_MODIFIED) {
+    DEBUG_SERIAL.println("OTA: Firmware is up to date");
+    intervalTighten(otaCheckInterval);
+  } else if (httpCode == HTTP_CODE_UNAUTHORIZED) {
+    // Bukan lewat engine: cukup refresh, cek berikutnya memakai token baru
+    DEBUG_SERIAL.println("OTA check unauthorized, refreshing JWT");
+    jwtUnauthorized++;
+    jwtRefresh(BUS_LOCAL_METER);
+    intervalBackoff(otaCheckInterval);
+  } else {
+    DEBUG_SERIAL.printf("OTA check failed, HTTP code: %d\n", httpCode);
+    intervalBackoff(otaCheckInterval);
+  }
+  
+  http.end();
+}
+
+// =====================================================
+// FUNGSI ANTRIAN KELUAR
+// =====================================================
+bool isPriorityEvent(LinkStatus status) {
+  return status != LINK_STATUS_NORMAL && status != LINK_STATUS_PINTU_TERTUTUP;
+}
+
+void fillQueuedReading(QueuedReading& entry, float flowRate, float meterReading, float voltage, int doorStatus, LinkStatus status, LinkValve valve, long seq, unsigned long detectedAt, uint8_t meter) {
+  entry.flowRate = flowRate;
+  entry.meterReading = meterReading;
+  entry.voltage = voltage;
+  entry.doorStatus = doorStatus;
+  entry.status = status;
+  entry.valve = valve;
+  entry.seq = seq;
+  entry.detectedAt = detectedAt;
+  entry.nextAttemptAt = millis();
+  entry.attempts = 0;
+  entry.meter = meter;
+  entry.aggregate[0] = '\0';
+  entry.arduinoLoop[0] = '\0';
+}
+
+// Agregat interval (dan statistik loop yang ikut frame-nya) tidak boleh
+// hilang saat snapshot lama diganti/dibuang: pindahkan ke snapshot yang
+// menggantikannya jika snapshot itu belum punya.
+void carryAggregate(const QueuedReading& from, QueuedReading& to) {
+  if (from.aggregate[0] != '\0' && to.aggregate[0] == '\0') {
+    memcpy(to.aggregate, from.aggregate, sizeof(to.aggregate));
+  }
+  if (from.arduinoLoop[0] != '\0' && to.arduinoLoop[0] == '\0') {
+    memcpy(to.arduinoLoop, from.arduinoLoop, sizeof(to.arduinoLoop));
+  }
+}
+
+void enqueueEvent(const QueuedReading& entry) {
+  if (eventQueueCount >= EVENT_QUEUE_SIZE) {
+    // Event yang lebih lama belum terkirim tetap dipertahankan
+    droppedEvents++;
+    DEBUG_SERIAL.print("Event queue full, event dropped: ");
+    DEBUG_SERIAL.println(linkName(entry.status));
+    return;
+  }
+  uint8_t slot = (eventQueueHead + eventQueueCount) % EVENT_QUEUE_SIZE;
+  eventQueue[slot] = entry;
+  eventQueueCount++;
+  checkpointDirty = true;
+  DEBUG_SERIAL.print("Priority event queued: ");
+  DEBUG_SERIAL.println(linkName(entry.status));
+}
+
+QueuedReading& queuedReadingAt(uint8_t index) {
+  return readingQueue[(readingQueueHead + index) % READING_QUEUE_SIZE];
+}
+
+void removeQueuedReading(uint8_t index) {
+  for (uint8_t i = index; i + 1 < readingQueueCount; i++) {
+    queuedReadingAt(i) = queuedReadingAt(i + 1);
+  }
+  readingQueueCount--;
+}
+
+void enqueueReading(const QueuedReading& entry) {
+  checkpointDirty = true;
+  if (readingQueueCount >= READING_QUEUE_SIZE) {
+    // Buang snapshot tertua tanpa agregat; total meter terbaru tetap
+    // terkirim. Entri yang sedang dikirim tidak pernah digusur.
+    uint8_t first = readingHeadInFlight ? 1 : 0;
+    uint8_t victim = first;
+    while (victim < readingQueueCount && queuedReadingAt(victim).aggregate[0] != '\0') {
+      victim++;
+    }
+    droppedReadings++;
+    if (victim < readingQueueCount) {
+      removeQueuedReading(victim);
+    } else if (entry.aggregate[0] == '\0') {
+      // Semua membawa agregat: snapshot baru menggantikan pembacaan
+      // terakhir, agregatnya ikut dibawa
+      QueuedReading& newest = queuedReadingAt(readingQueueCount - 1);
+      QueuedReading replacement = entry;
+      carryAggregate(newest, replacement);
+      newest = replacement;
+      return;
+    } else {
+      droppedAggregates++;
+      DEBUG_SERIAL.println("Reading queue full of aggregates, oldest aggregate dropped");
+      removeQueuedReading(first);
+    }
+  }
+  queuedReadingAt(readingQueueCount) = entry;
+  readingQueueCount++;
+}
+
+// Retry dengan backoff eksponensial, event (dan agregat interval) tidak dibuang
+void retryPriorityEvent(QueuedReading& event) {
+  unsigned long retryDelay = EVENT_RETRY_BASE << min((int)event.attempts, 5);
+  event.attempts++;
+  event.nextAttemptAt = millis() + min(retryDelay, EVENT_RETRY_MAX);
+}
+
+// Backoff yang sama dengan event; ACK tidak dibuang
+void retryCommandAck(QueuedAck& ack) {
+  unsigned long retryDelay = EVENT_RETRY_BASE << min((int)ack.attempts, 5);
+  ack.attempts++;
+  ack.nextAttemptAt = millis() + min(retryDelay, EVENT_RETRY_MAX);
+}
+
+// Paling banyak satu event, satu ACK dan satu pembacaan rutin berjalan di
+// engine HTTP; hasilnya diproses callback masing-masing.
+void processOutboundQueues() {
+  unsigned long now = millis();
+
+  // Event prioritas selalu didahulukan
+  if (eventQueueCount > 0) {
+    if (httpPending(METRIC_EP_EVENT)) {
+      return; // Event terdepan sedang dikirim; data rutin menunggu di belakangnya
+    }
+    QueuedReading& event = eventQueue[eventQueueHead];
+    if ((long)(now - event.nextAttemptAt) >= 0) {
+      if (!submitPriorityEvent(event)) {
+        retryPriorityEvent(event);
+      }
+      return;
+    }
+  }
+
+  // ACK perintah setelah event; tidak menahan data rutin
+  if (ackQueueCount > 0 && !httpPending(METRIC_EP_ACK)) {
+    QueuedAck& ack = ackQueue[ackQueueHead];
+    if ((long)(now - ack.nextAttemptAt) >= 0 && !submitCommandAck(ack)) {
+      retryCommandAck(ack);
+    }
+  }
+
+  if (readingQueueCount > 0 && !readingHeadInFlight) {
+    QueuedReading& reading = readingQueue[readingQueueHead];
+    if ((long)(now - reading.nextAttemptAt) < 0) {
+      return; // Agregat menunggu jadwal retry
+    }
+    if (submitMeterReading(reading.flowRate, reading.meterReading, reading.voltage, reading.doorStatus, reading.status, reading.valve, reading.seq, reading.detectedAt, reading.aggregate, reading.arduinoLoop)) {
+      readingHeadInFlight = true; // Dilepas di onMeterReadingResponse()
+    } else {
+      updateActivityIntervals(reading.flowRate, false);
+      finishQueuedReading(false);
+    }
+  }
+}
+
+// Hasil upload pembacaan terdepan. Snapshot biasa tidak di-retry (snapshot
+// berikutnya membawa total terbaru); pembacaan dengan agregat interval
+// tertutup tetap di antrian dan di-retry dengan backoff.
+void finishQueuedReading(bool submitted) {
+  readingHeadInFlight = false;
+  if (readingQueueCount == 0) {
+    return;
+  }
+  QueuedReading& reading = readingQueue[readingQueueHead];
+  if (!submitted && reading.aggregate[0] != '\0') {
+    retryPriorityEvent(reading);
+    DEBUG_SERIAL.printf("Aggregate upload failed, retry #%u\n", reading.attempts);
+    return;
+  }
+  readingQueueHead = (readingQueueHead + 1) % READING_QUEUE_SIZE;
+  readingQueueCount--;
+  checkpointDirty = true;
+}
+
+// =====================================================
+// FUNGSI BUS RS-485 (MODE GATEWAY)
+// =====================================================
+uint8_t busSlotForAddress(uint8_t address) {
+  for (uint8_t i = 0; i < BUS_METER_SLOTS; i++) {
+    if (busMeters[i].address != 0 && busMeters[i].address == address) {
+      return i;
+    }
+  }
+  return BUS_LOCAL_METER;
+}
+
+uint8_t busSlotForMeterId(const char* id) {
+  for (uint8_t i = 0; i < BUS_METER_SLOTS; i++) {
+    if (busMeters[i].address != 0 && strcmp(busMeters[i].idMeter, id) == 0) {
+      return i;
+    }
+  }
+  return BUS_LOCAL_METER;
+}
+
+const char* meterIdForSlot(uint8_t meter) {
+  return meter == BUS_LOCAL_METER ? idMeter.c_str() : busMeters[meter].idMeter;
+}
+
+const char* meterJwtForSlot(uint8_t meter) {
+  return meter == BUS_LOCAL_METER ? deviceJwtToken.c_str() : busMeters[meter].jwt;
+}
+
+// Kirim satu frame ke bus. TX SoftwareSerial sinkron, jadi saat write()
+// selesai bit terakhir sudah keluar dan driver boleh dilepas.
+void busTransmit(const char* frame, size_t length) {
+  digitalWrite(RS485_DE_PIN, HIGH);
+  busPort->write((const uint8_t*)frame, length);
+  busPort->write('\n');
+  digitalWrite(RS485_DE_PIN, LOW);
+  busLastTxTime = millis();
+  trace(TRACE_SERIAL_TX, 0, length);
+  DEBUG_SERIAL.print("Tx Bus: ");
+  DEBUG_SERIAL.write((const uint8_t*)frame, length);
+  DEBUG_SERIAL.println();
+}
+
+// legacy = poll format objek untuk firmware Arduino lama
+void sendBusPoll(uint8_t address, bool legacy) {
+  char frame[24];
+  int length;
+  if (legacy) {
+    length = snprintf(frame, sizeof(frame), "{\"addr\":%u,\"poll\":1}", address);
+  } else {
+    StaticJsonDocument<32> doc;
+    LinkPoll poll;
+    poll.address = address;
+    linkEncode(doc.to<JsonArray>(), poll);
+    length = serializeJson(doc, frame, sizeof(frame));
+  }
+  busTransmit(frame, length);
+  busAwaitingAddress = address;
+}
+
+// Antrikan frame untuk meter; dikirim saat giliran meter tersebut di bus.
+// Alamat sudah ada di frame (field address pesan skema).
+void enqueueBusFrame(uint8_t meter, JsonDocument& doc) {
+  BusMeter& m = busMeters[meter];
+  if (measureJson(doc) >= BUS_FRAME_SIZE) {
+    busFramesDropped++;
+    DEBUG_SERIAL.printf("Bus frame for meter %u too large, dropped\n", m.address);
+    return;
+  }
+  if (m.frameCount >= BUS_FRAME_QUEUE_SIZE) {
+    // Buang frame tertua; update saldo berikutnya membawa nilai terbaru
+    m.frameHead = (m.frameHead + 1) % BUS_FRAME_QUEUE_SIZE;
+    m.frameCount--;
+    busFramesDropped++;
+  }
+  uint8_t slot = (m.frameHead + m.frameCount) % BUS_FRAME_QUEUE_SIZE;
+  serializeJson(doc, m.frames[slot], BUS_FRAME_SIZE);
+  m.frameCount++;
+}
+
+// Dipanggil setiap loop pada mode gateway. Tidak pernah menunggu jawaban
+// secara blocking: satu frame keluar per panggilan, jawaban diproses saat
+// masuk, dan meter yang tidak menjawab dalam BUS_RESPONSE_TIMEOUT dilewati.
+void processBus() {
+  if (busPort->available()) {
+    char* frame;
+    size_t length = readArduinoFrame(*busPort, frame);
+    if (length > 0) {
+      handleArduinoMessage(frame, length);
+    }
+    return;
+  }
+
+  unsigned long now = millis();
+  if (busAwaitingAddress != 0) {
+    if (now - busLastTxTime < BUS_RESPONSE_TIMEOUT) {
+      return;
+    }
+    // Probe ke alamat kosong memang tidak dijawab; hanya meter terdaftar yang dihitung
+    uint8_t meter = busSlotForAddress(busAwaitingAddress);
+    if (meter != BUS_LOCAL_METER) {
+      BusMeter& m = busMeters[meter];
+      busPollTimeouts++;
+      if (m.missedPolls < 255) {
+        m.missedPolls++;
+      }
+      if (m.online && m.missedPolls >= BUS_OFFLINE_AFTER) {
+        m.online = false;
+        DEBUG_SERIAL.printf("Bus meter %u offline\n", m.address);
+      }
+    }
+    busAwaitingAddress = 0;
+  }
+
+  if (now - busLastTxTime >= BUS_POLL_GAP) {
+    pollNextBusMeter();
+  }
+}
+
+// Round-robin: frame antrian meter (update saldo/perintah) lebih dulu, lalu
+// poll. Setelah satu putaran penuh, satu alamat baru di-probe (discovery).
+void pollNextBusMeter() {
+  while (busNextSlot < BUS_METER_SLOTS && busMeters[busNextSlot].address == 0) {
+    busNextSlot++;
+  }
+  if (busNextSlot >= BUS_METER_SLOTS) {
+    busNextSlot = 0;
+    probeNextBusAddress();
+    return;
+  }
+
+  BusMeter& m = busMeters[busNextSlot];
+  if (m.frameCount > 0) {
+    const char* frame = m.frames[m.frameHead];
+    busTransmit(frame, strlen(frame));
+    m.frameHead = (m.frameHead + 1) % BUS_FRAME_QUEUE_SIZE;
+    m.frameCount--;
+    return; // Meter yang sama di-poll pada giliran berikutnya
+  }
+  sendBusPoll(m.address, m.legacyLink);
+  busNextSlot++;
+}
+
+void probeNextBusAddress() {
+  if (busSlotForAddress(0) == BUS_LOCAL_METER) {
+    return; // Tabel penuh
+  }
+  for (uint8_t i = 0; i < BUS_MAX_ADDRESS; i++) {
+    uint8_t address = busProbeAddress;
+    busProbeAddress = busProbeAddress % BUS_MAX_ADDRESS + 1;
+    if (busProbeAddress == 1) {
+      busProbeLegacy = !busProbeLegacy; // Sapuan berikutnya mencari firmware lama/baru
+    }
+    if (busSlotForAddress(address) == BUS_LOCAL_METER) {
+      sendBusPoll(address, busProbeLegacy);
+      return;
+    }
+  }
+}
+
+// Unggah pembacaan terbaru semua meter dalam satu request. Respons berisi
+// saldo dan perintah per meter yang diteruskan lewat antrian frame bus
+// (onBusBatchResponse). Bus tetap di-poll selama upload berjalan.
+void submitBusBatch() {
+  if (httpPending(METRIC_EP_READING)) {
+    return; // Upload sebelumnya belum selesai
+  }
+  DynamicJsonDocument doc(2560);
+  doc["gateway_id"] = idMeter.c_str();
+  doc["include_commands"] = true;
+  if (wifiConnectMs > 0) {
+    doc["wifi_connect_ms"] = wifiConnectMs;
+  }
+  JsonArray readings = doc.createNestedArray("readings");
+  float maxFlowRate = 0.0;
+  for (uint8_t i = 0; i < BUS_METER_SLOTS; i++) {
+    BusMeter& m = busMeters[i];
+    if (m.address == 0 || !m.hasReading) {
+      continue;
+    }
+    JsonObject r = readings.createNestedObject();
+    r["id_meter"] = (const char*)m.idMeter;
+    r["flow_rate_lpm"] = m.reading.flowRate;
+    r["meter_reading_m3"] = m.reading.meterReading;
+    r["current_voltage"] = m.reading.voltage;
+    r["door_status"] = m.reading.doorStatus;
+    r["status_message"] = linkName(m.reading.status);
+    r["valve_status"] = linkName(m.reading.valve);
+    if (m.reading.seq >= 0) {
+      r["seq"] = m.reading.seq;
+    }
+    addCaptureTime(r, m.reading.detectedAt);
+    if (m.reading.aggregate[0] != '\0') {
+      r["agg"] = serialized((const char*)m.reading.aggregate);
+    }
+    if (m.reading.arduinoLoop[0] != '\0') {
+      r["loop"] = serialized((const char*)m.reading.arduinoLoop);
+    }
+    maxFlowRate = max(maxFlowRate, m.reading.flowRate);
+    m.inBatch = true;
+    m.readingSent = true;
+    m.batchCarried = 0;
+    m.batchSeq = m.reading.seq;
+  }
+
+  if (readings.size() == 0) {
+    intervalBackoff(meterDataSendInterval);
+    return;
+  }
+  bool loopReportDue = millis() - loopStats.windowStart >= LOOP_REPORT_INTERVAL;
+  if (loopReportDue) {
+    fillLoopStats(doc.createNestedObject("node_loop"), loopStats, LOOP_TAG_NAMES[loopStats.maxSectionTag], LOOP_DEADLINE_MS, millis());
+  }
+
+  busBatchFlowRate = maxFlowRate;
+  busBatchLoopReport = loopReportDue;
+  // Respons 3 KB: saldo + perintah untuk semua meter
+  if (!httpRequestAsync(SUBMIT_BATCH_ENDPOINT, nullptr, &doc, BUS_LOCAL_METER, nullptr, 3072, onBusBatchResponse, 0)) {
+    for (uint8_t i = 0; i < BUS_METER_SLOTS; i++) {
+      busMeters[i].inBatch = false;
+      busMeters[i].readingSent = false;
+      busMeters[i].batchSeq = -1;
+    }
+    updateActivityIntervals(maxFlowRate, false);
+  }
+}
+
+void onBusBatchResponse(int httpCode, JsonDocument& responseDoc, uintptr_t context) {
+  bool submitted = responseDoc["status"] == "success";
+  if (submitted) {
+    if (busBatchLoopReport) {
+      loopStatsReset(loopStats, millis());
+    }
+    if (responseDoc.containsKey("intervals")) {
+      applyIntervalConfig(responseDoc["intervals"].as<JsonObject>());
+    }
+
+    // Format: "meters":[{"id_meter":..,"data_pulsa":..,"tarif_per_m3":..,"is_unlocked":..,"ack_seq":..,"commands":[..]}]
+    for (JsonObject result : responseDoc["meters"].as<JsonArray>()) {
+      uint8_t meter = busSlotForMeterId(result["id_meter"] | "");
+      if (meter == BUS_LOCAL_METER) {
+        continue;
+      }
+      BusMeter& m = busMeters[meter];
+      if (result.containsKey("data_pulsa")) {
+        LinkUpdate update;
+        update.address = m.address;
+        update.idMeter = m.idMeter;
+        update.credit = result["data_pulsa"].as<float>();
+        update.tariff = result["tarif_per_m3"].as<float>();
+        update.unlocked = result["is_unlocked"].as<bool>();
+        update.reportIntervalMs = 0; // Jadwal laporan bus diatur gateway
+        // Tanpa ack_seq dari server: seq yang benar-benar dikirim di upload
+        // ini, bukan pembacaan yang mungkin sudah menggantikannya
+        update.ackSeq = result["ack_seq"] | m.batchSeq;
+        StaticJsonDocument<192> doc;
+        linkEncodeFrame(doc, update, m.legacyLink);
+        enqueueBusFrame(meter, doc);
+      }
+      if (result.containsKey("commands")) {
+        dispatchCommands(result["commands"].as<JsonArray>(), meter);
+      }
+    }
+  } else {
+    DEBUG_SERIAL.print("Failed to submit batch: ");
+    DEBUG_SERIAL.println(responseDoc["message"].as<const char*>());
+  }
+  // Pembacaan yang masuk selama upload tetap menunggu upload berikutnya,
+  // tanpa agregat yang sudah diterima server lewat upload ini. Jika upload
+  // gagal, agregat itu ikut upload berikutnya.
+  for (uint8_t i = 0; i < BUS_METER_SLOTS; i++) {
+    BusMeter& m = busMeters[i];
+    if (submitted && m.inBatch) {
+      if (m.readingSent) {
+        m.hasReading = false;
+      } else {
+        if (m.batchCarried & BATCH_CARRIED_AGG) {
+          m.reading.aggregate[0] = '\0';
+        }
+        if (m.batchCarried & BATCH_CARRIED_LOOP) {
+          m.reading.arduinoLoop[0] = '\0';
+        }
+      }
+    }
+    m.inBatch = false;
+    m.readingSent = false;
+    m.batchCarried = 0;
+    m.batchSeq = -1;
+  }
+  updateActivityIntervals(busBatchFlowRate, submitted);
+}
+
+// Registrasi alamat baru yang ditemukan processBus(), satu per satu dan
+// tanpa menunggu (hasil di onBusMeterRegistered). Alamat yang gagal
+// diregistrasi dicatat lagi saat menjawab probe berikutnya.
+void registerPendingBusMeter() {
+  if (busPendingRegistrations == 0 || busRegisteringAddress != 0) {
+    return;
+  }
+  uint8_t address = 1;
+  while (!(busPendingRegistrations & (1UL << address))) {
+    address++;
+  }
+  busPendingRegistrations &= ~(1UL << address);
+  uint8_t slot = busSlotForAddress(address);
+  if (slot != BUS_LOCAL_METER && !busJwtStates[slot].rejected) {
+    return; // Sudah terdaftar dengan token yang berlaku
+  }
+  if (slot == BUS_LOCAL_METER && busSlotForAddress(0) == BUS_LOCAL_METER) {
+    DEBUG_SERIAL.printf("Bus table full, meter %u ignored\n", address);
+    return;
+  }
+
+  // Slot terdaftar yang tokennya ditolak: registrasi ulang untuk JWT baru
+  char deviceId[24];
+  snprintf(deviceId, sizeof(deviceId), "%u-%u", ESP.getChipId(), address);
+  StaticJsonDocument<192> doc;
+  doc["device_id"] = deviceId;
+  doc["gateway_id"] = idMeter.c_str();
+  doc["bus_address"] = address;
+
+  // Registrasi memakai JWT gateway
+  if (httpRequestAsync(REGISTER_BUS_METER_ENDPOINT, nullptr, &doc, BUS_LOCAL_METER, nullptr, 512, onBusMeterRegistered, address)) {
+    busRegisteringAddress = address;
+  }
+}
+
+void onBusMeterRegistered(int httpCode, JsonDocument& responseDoc, uintptr_t context) {
+  uint8_t address = (uint8_t)context;
+  busRegisteringAddress = 0;
+  if (responseDoc["status"] != "success") {
+    DEBUG_SERIAL.printf("Bus meter %u registration failed: %s\n", address, responseDoc["message"] | "");
+    return;
+  }
+  uint8_t slot = busSlotForAddress(address);
+  bool renewed = slot != BUS_LOCAL_METER; // Registrasi ulang setelah token ditolak
+  if (!renewed) {
+    slot = busSlotForAddress(0);
+    if (slot == BUS_LOCAL_METER) {
+      return; // Tabel penuh selama request berjalan
     }
-    
-    // Submit meter reading to server
-    submitMeterReading(flowRate, meterReading, voltage, doorStatus, statusMessage, valveStatus);
+    memset(&busMeters[slot], 0, sizeof(busMeters[slot]));
+    busMeters[slot].address = address;
+    busMeters[slot].batchSeq = -1;
   }
+
+  BusMeter& m = busMeters[slot];
+  strlcpy(m.idMeter, responseDoc["id_meter"] | m.idMeter, sizeof(m.idMeter));
+  strlcpy(m.jwt, responseDoc["jwt_token"] | "", sizeof(m.jwt));
+  saveBusMeter(slot);
+  memset(&busJwtStates[slot], 0, sizeof(busJwtStates[slot]));
+  jwtLoadClaims(slot);
+  DEBUG_SERIAL.printf("Bus meter %u %s as %s\n", address, renewed ? "re-registered" : "registered", m.idMeter);
 }
 
 // =====================================================
-// FUNGSI HTTP REQUEST
+// FUNGSI MANAJEMEN DAYA
 // =====================================================
-String httpPOST(String endpoint, String payload, String authToken = "") {
-  if (!isWiFiConnected) {
-    DEBUG_SERIAL.println("WiFi not connected, cannot make HTTP request");
-    return "{\"status\":\"error\",\"message\":\"No WiFi connection\"}";
+// Radio harus tetap bangun selama sesi perintah atau antrian keluar belum kosong
+bool isCommandSessionActive() {
+  if (GATEWAY_MODE) {
+    return true; // Gateway terus mem-poll bus; radio dan CPU tidak ditidurkan
   }
-  
-  WiFiClient client;
-  HTTPClient http;
-  
-  String url = String(API_BASE_URL) + endpoint;
-  http.begin(client, url);
-  http.addHeader("Content-Type", "application/json");
-  
-  if (authToken.length() > 0) {
-    http.addHeader("Authorization", "Bearer " + authToken);
+  if (hasCommandActivity && millis() - lastCommandActivityTime < COMMAND_ACTIVITY_HOLD) {
+    return true;
   }
-  
-  DEBUG_SERIAL.print("POST to: ");
-  DEBUG_SERIAL.println(url);
-  DEBUG_SERIAL.print("Payload: ");
-  DEBUG_SERIAL.println(payload);
-  
-  int httpResponseCode = http.POST(payload);
-  String response = "";
-  
-  if (httpResponseCode > 0) {
-    DEBUG_SERIAL.printf("[HTTP] POST... code: %d\n", httpResponseCode);
-    response = http.getString();
-    DEBUG_SERIAL.print("Response: ");
-    DEBUG_SERIAL.println(response);
+  return eventQueueCount > 0 || ackQueueCount > 0 || readingQueueCount > 0 || !httpIdle();
+}
+
+void setPowerSave(bool engage) {
+  if (POWER_MODE == POWER_MODE_ACTIVE || engage == powerSaveEngaged) {
+    return;
+  }
+  if (engage) {
+    if (POWER_MODE == POWER_MODE_LIGHT_SLEEP) {
+      // Start bit dari Arduino (level LOW) membangunkan CPU
+      gpio_pin_wakeup_enable(GPIO_ID_PIN(ARDUINO_RX_PIN), GPIO_PIN_INTR_LOLEVEL);
+      WiFi.setSleepMode(WIFI_LIGHT_SLEEP, POWER_LISTEN_INTERVAL);
+    } else {
+      WiFi.setSleepMode(WIFI_MODEM_SLEEP, POWER_LISTEN_INTERVAL);
+    }
   } else {
-    DEBUG_SERIAL.printf("[HTTP] POST... failed, error: %s\n", http.errorToString(httpResponseCode).c_str());
-    response = "{\"status\":\"error\",\"message\":\"HTTP request failed\"}";
+    WiFi.setSleepMode(WIFI_NONE_SLEEP);
+    if (POWER_MODE == POWER_MODE_LIGHT_SLEEP) {
+      gpio_pin_wakeup_disable();
+    }
   }
-  
-  http.end();
-  return response;
+  powerSaveEngaged = engage;
 }
 
-String httpGET(String endpoint, String authToken = "") {
-  if (!isWiFiConnected) {
-    DEBUG_SERIAL.println("WiFi not connected, cannot make HTTP request");
-    return "{\"status\":\"error\",\"message\":\"No WiFi connection\"}";
+// Waktu sampai jadwal terdekat (poll perintah atau retry event)
+unsigned long msUntilNextSchedule() {
+  unsigned long now = millis();
+  unsigned long wait = POWER_IDLE_MAX;
+  unsigned long sincePoll = now - lastCommandPollTime;
+  if (sincePoll >= commandPollInterval.nextDelayMs) {
+    return 0;
   }
-  
-  WiFiClient client;
-  HTTPClient http;
-  
-  String url = String(API_BASE_URL) + endpoint;
-  http.begin(client, url);
-  
-  if (authToken.length() > 0) {
-    http.addHeader("Authorization", "Bearer " + authToken);
+  wait = min(wait, commandPollInterval.nextDelayMs - sincePoll);
+  unsigned long sinceOTA = now - lastOTACheckTime;
+  if (sinceOTA >= otaCheckInterval.nextDelayMs) {
+    return 0;
   }
-  
-  DEBUG_SERIAL.print("GET from: ");
-  DEBUG_SERIAL.println(url);
-  
-  int httpResponseCode = http.GET();
-  String response = "";
-  
-  if (httpResponseCode > 0) {
-    DEBUG_SERIAL.printf("[HTTP] GET... code: %d\n", httpResponseCode);
-    response = http.getString();
-  } else {
-    DEBUG_SERIAL.printf("[HTTP] GET... failed, error: %s\n", http.errorToString(httpResponseCode).c_str());
-    response = "{\"status\":\"error\",\"message\":\"HTTP request failed\"}";
+  return min(wait, otaCheckInterval.nextDelayMs - sinceOTA);
+}
+
+// Pengganti delay(100) di loop(): tidur sampai serial aktif atau jadwal tiba.
+void powerIdle() {
+  if (POWER_MODE == POWER_MODE_ACTIVE || isCommandSessionActive()) {
+    setPowerSave(false);
+    // Tetap bangun, tapi kembali segera jika frame serial mulai masuk agar
+    // buffer SoftwareSerial tidak meluap (frame bus bisa ~200 byte), atau
+    // jika respons HTTP tiba
+    unsigned long start = millis();
+    while (millis() - start < POWER_AWAKE_DELAY && !ARDUINO_SERIAL.available() && !httpResponseAvailable()) {
+      delay(POWER_IDLE_SLICE);
+    }
+    return;
   }
-  
-  http.end();
-  return response;
+
+  setPowerSave(true);
+  unsigned long start = millis();
+  unsigned long budget = msUntilNextSchedule();
+  while (millis() - start < budget && !ARDUINO_SERIAL.available()) {
+    delay(POWER_IDLE_SLICE); // SDK menidurkan radio/CPU selama delay
+  }
+  powerSleepMs += millis() - start;
+}
+
+// Ambil duty cycle jendela saat ini lalu mulai jendela baru
+float takePowerDutyCycle() {
+  unsigned long now = millis();
+  unsigned long window = now - powerWindowStart;
+  if (window > 0) {
+    unsigned long sleptMs = min(powerSleepMs, window);
+    lastPowerDutyPct = 100.0 * (window - sleptMs) / window;
+  }
+  powerWindowStart = now;
+  powerSleepMs = 0;
+  return lastPowerDutyPct;
 }
 
 // =====================================================
-// FUNGSI API CALLS
+// FUNGSI INTERVAL ADAPTIF
 // =====================================================
-bool registerDevice(String provisioningToken) {
-  DynamicJsonDocument doc(256);
-  doc["provisioning_token"] = provisioningToken;
-  doc["device_id"] = String(ESP.getChipId()); // Menggunakan Chip ID sebagai ID unik perangkat
+unsigned long intervalJitter(unsigned long baseMs) {
+  // +/-20% agar jadwal perangkat tidak sinkron satu sama lain
+  unsigned long spread = baseMs / 5;
+  return baseMs - spread + random(spread * 2 + 1);
+}
 
-  String payload;
-  serializeJson(doc, payload);
+// True jika interval sudah lewat; sekaligus menjadwalkan berikutnya.
+bool intervalDue(AdaptiveInterval& iv, unsigned long& lastTime, unsigned long now) {
+  if (now - lastTime < iv.nextDelayMs) {
+    return false;
+  }
+  lastTime = now;
+  iv.nextDelayMs = intervalJitter(iv.currentMs);
+  checkpointDirty = true;
+  return true;
+}
 
-  String response = httpPOST(REGISTER_DEVICE_ENDPOINT, payload);
+// Aktivitas: kembali ke batas minimum dan majukan jadwal berikutnya.
+void intervalTighten(AdaptiveInterval& iv) {
+  iv.currentMs = iv.minMs;
+  if (iv.nextDelayMs > iv.minMs) {
+    iv.nextDelayMs = intervalJitter(iv.minMs);
+  }
+  checkpointDirty = true;
+}
 
-  DynamicJsonDocument responseDoc(512);
-  DeserializationError error = deserializeJson(responseDoc, response);
+// Idle atau error: lipat dua sampai batas maksimum.
+void intervalBackoff(AdaptiveInterval& iv) {
+  iv.currentMs = (iv.currentMs >= iv.maxMs / 2) ? iv.maxMs : iv.currentMs * 2;
+  checkpointDirty = true;
+}
 
-  if (error) {
-    DEBUG_SERIAL.print(F("Device registration JSON parse failed: "));
-    DEBUG_SERIAL.println(error.c_str());
-    return false;
+bool isDeviceActive() {
+  if (hasCommandActivity && millis() - lastCommandActivityTime < COMMAND_ACTIVITY_HOLD) {
+    return true;
   }
+  return lastKnownCredit >= 0.0 && lastKnownCredit < LOW_CREDIT_THRESHOLD;
+}
 
-  if (responseDoc["status"] == "success") {
-    idMeter = responseDoc["id_meter"].as<String>();
-    deviceJwtToken = responseDoc["jwt_token"].as<String>();
-    
-    // Save to EEPROM
-    saveString(EEPROM_ID_METER_ADDR, idMeter);
-    saveString(EEPROM_JWT_ADDR, deviceJwtToken);
-    
-    isDeviceRegistered = true;
-    
-    DEBUG_SERIAL.println("Device registered successfully!");
-    DEBUG_SERIAL.print("Meter ID: ");
-    DEBUG_SERIAL.println(idMeter);
-    
-    return true;
+void markCommandActivity() {
+  lastCommandActivityTime = millis();
+  hasCommandActivity = true;
+  intervalTighten(commandPollInterval);
+  intervalTighten(meterDataSendInterval);
+}
+
+// Dipanggil setiap kali data meteran dari Arduino diproses.
+void updateActivityIntervals(float flowRate, bool submitted) {
+  if (submitted && (flowRate > 0.0 || isDeviceActive())) {
+    intervalTighten(meterDataSendInterval);
+    intervalTighten(commandPollInterval);
   } else {
-    DEBUG_SERIAL.print("Device registration failed: ");
-    DEBUG_SERIAL.println(responseDoc["message"].as<String>());
-    return false;
+    // Idle atau server error: perlebar interval
+    intervalBackoff(meterDataSendInterval);
+    intervalBackoff(commandPollInterval);
   }
 }
 
-void submitMeterReading(float flowRate, float meterReading, float voltage, int doorStatus, String statusMessage, String valveStatus) {
-  if (!isDeviceRegistered) {
-    DEBUG_SERIAL.println("Device not registered, cannot submit reading");
+void applyIntervalBounds(AdaptiveInterval& iv, JsonObject bounds) {
+  if (bounds.isNull()) {
     return;
   }
-  
-  DynamicJsonDocument doc(512);
-  doc["id_meter"] = idMeter;
-  doc["flow_rate_lpm"] = flowRate;
-  doc["meter_reading_m3"] = meterReading;
-  doc["current_voltage"] = voltage;
-  doc["door_status"] = doorStatus;
-  doc["status_message"] = statusMessage;
-  doc["valve_status"] = valveStatus;
-
-  String payload;
-  serializeJson(doc, payload);
-
-  String response = httpPOST(SUBMIT_READING_ENDPOINT, payload, deviceJwtToken);
+  unsigned long newMin = bounds["min_ms"] | iv.minMs;
+  unsigned long newMax = bounds["max_ms"] | iv.maxMs;
+  if (newMin == 0 || newMin > newMax) {
+    DEBUG_SERIAL.println("Ignoring invalid interval bounds from server");
+    return;
+  }
+  iv.minMs = newMin;
+  iv.maxMs = newMax;
+  iv.currentMs = constrain(iv.currentMs, iv.minMs, iv.maxMs);
+  iv.nextDelayMs = constrain(iv.nextDelayMs, iv.minMs, iv.maxMs);
+}
 
-  DynamicJsonDocument responseDoc(256);
-  DeserializationError error = deserializeJson(responseDoc, response);
+// Format: {"poll":{"min_ms":..,"max_ms":..},"report":{..},"reconnect":{..},"ota":{..}}
+void applyIntervalConfig(JsonObject config) {
+  applyIntervalBounds(commandPollInterval, config["poll"]);
+  applyIntervalBounds(meterDataSendInterval, config["report"]);
+  applyIntervalBounds(reconnectInterval, config["reconnect"]);
+  applyIntervalBounds(otaCheckInterval, config["ota"]);
+  DEBUG_SERIAL.println("Interval bounds updated from server");
+}
 
-  if (error) {
-    DEBUG_SERIAL.print(F("Submit reading JSON parse failed: "));
-    DEBUG_SERIAL.println(error.c_str());
+// =====================================================
+// FUNGSI FLIGHT RECORDER
+// =====================================================
+// Waktu konstan: beberapa store + millis(), aman dipanggil di setiap jalur
+void trace(uint8_t type, uint8_t a, uint16_t b) {
+  if (traceFrozen) {
     return;
   }
+  TraceRecord& record = traceRing[traceHead];
+  record.t = millis();
+  record.type = type;
+  record.a = a;
+  record.b = b;
+  traceHead = (traceHead + 1) & (TRACE_RING_SIZE - 1);
+  traceTotal++;
+}
 
-  if (responseDoc["status"] == "success") {
-    DEBUG_SERIAL.println("Meter reading submitted successfully");
-    
-    // Update pulsa dan status unlock dari server
-    float newPulsa = responseDoc["data_pulsa"].as<float>();
-    float newTarif = responseDoc["tarif_per_m3"].as<float>();
-    bool newUnlockedStatus = responseDoc["is_unlocked"].as<bool>();
-
-    // Kirim ke Arduino
-    DynamicJsonDocument arduinoUpdateDoc(128);
-    arduinoUpdateDoc["id_meter"] = idMeter;
-    arduinoUpdateDoc["data_pulsa"] = newPulsa;
-    arduinoUpdateDoc["tarif_per_m3"] = newTarif;
-    arduinoUpdateDoc["is_unlocked"] = newUnlockedStatus;
-    
-    String arduinoUpdatePayload;
-    serializeJson(arduinoUpdateDoc, arduinoUpdatePayload);
-    
-    ARDUINO_SERIAL.println(arduinoUpdatePayload);
-    DEBUG_SERIAL.print("Tx Arduino (Update): ");
-    DEBUG_SERIAL.println(arduinoUpdatePayload);
+// Unggah satu bagian dump. records = hex record (lihat trace_events.h),
+// epochMs = waktu server untuk nowMs sumber (0 jika jam belum sinkron).
+// wait = false (bagian trace Arduino, dari handler frame): request hanya
+// diantrikan, true jika berhasil diantrikan; hasilnya dicatat di log.
+bool uploadTracePart(long commandId, const char* source, uint8_t meter, uint8_t part, uint8_t parts, uint32_t nowMs, uint64_t epochMs, uint32_t total, const char* records, bool wait) {
+  StaticJsonDocument<256> doc;
+  doc["command_id"] = commandId;
+  doc["id_meter"] = meterIdForSlot(meter);
+  doc["source"] = source;
+  doc["part"] = part;
+  doc["parts"] = parts;
+  doc["now_ms"] = nowMs;
+  if (epochMs > 0) {
+    doc["epoch_ms"] = epochMs;
+  }
+  doc["total"] = total;
+  doc["records"] = records;
+  
+  if (!wait) {
+    return httpRequestAsync(TRACE_UPLOAD_ENDPOINT, nullptr, &doc, meter, nullptr, 128, onTracePartResponse, part);
+  }
+  StaticJsonDocument<128> responseDoc;
+  int httpCode = httpPOST(TRACE_UPLOAD_ENDPOINT, doc, responseDoc, meter);
+  return httpCode >= 200 && httpCode < 300;
+}
 
-  } else {
-    DEBUG_SERIAL.print("Failed to submit meter reading: ");
-    DEBUG_SERIAL.println(responseDoc["message"].as<String>());
+void onTracePartResponse(int httpCode, JsonDocument& responseDoc, uintptr_t context) {
+  if (httpCode < 200 || httpCode >= 300) {
+    DEBUG_SERIAL.printf("Arduino trace part %u upload failed (%d)\n", (unsigned)context, httpCode);
   }
 }
 
-void pollCommands() {
-  if (!isDeviceRegistered) {
-    return;
+// Unggah ring NodeMCU (paling lama dulu) lalu ACK perintah dump_trace.
+// Ring dibekukan selama unggah agar request dump sendiri tidak menimpa
+// record yang belum terkirim.
+void uploadNodeTrace(long commandId, uint8_t meter) {
+  static const char HEX_DIGITS[] = "0123456789abcdef";
+  char records[TRACE_UPLOAD_RECORDS * sizeof(TraceRecord) * 2 + 1];
+  
+  traceFrozen = true;
+  uint16_t count = traceTotal < TRACE_RING_SIZE ? traceTotal : TRACE_RING_SIZE;
+  uint16_t first = (traceHead - count) & (TRACE_RING_SIZE - 1);
+  uint8_t parts = count == 0 ? 1 : (count + TRACE_UPLOAD_RECORDS - 1) / TRACE_UPLOAD_RECORDS;
+  uint32_t nowMs = millis();
+  uint64_t epochMs = deviceEpochMs(nowMs);
+  
+  bool uploaded = true;
+  for (uint8_t part = 0; part < parts && uploaded; part++) {
+    char* out = records;
+    for (uint16_t i = part * TRACE_UPLOAD_RECORDS; i < count && i < (part + 1) * TRACE_UPLOAD_RECORDS; i++) {
+      const uint8_t* bytes = (const uint8_t*)&traceRing[(first + i) & (TRACE_RING_SIZE - 1)];
+      for (uint8_t b = 0; b < sizeof(TraceRecord); b++) {
+        *out++ = HEX_DIGITS[bytes[b] >> 4];
+        *out++ = HEX_DIGITS[bytes[b] & 0x0F];
+      }
+    }
+    *out = '\0';
+    uploaded = uploadTracePart(commandId, "nodemcu", meter, part, parts, nowMs, epochMs, traceTotal, records, true);
   }
+  traceFrozen = false;
+  
+  DEBUG_SERIAL.print("Trace upload ");
+  DEBUG_SERIAL.println(uploaded ? "OK" : "failed");
+  enqueueCommandAck(commandId, uploaded ? LINK_ACK_ACKNOWLEDGED : LINK_ACK_FAILED,
+                    uploaded ? "Trace NodeMCU diunggah" : "Upload trace gagal", ACK_NO_VALVE, JsonArrayConst(), meter);
+}
 
-  String url = String(GET_COMMANDS_ENDPOINT) + "?id_meter=" + idMeter;
-  String response = httpGET(url, deviceJwtToken);
+// =====================================================
+// FUNGSI METRIK
+// =====================================================
+uint8_t endpointMetricIndex(const char* path) {
+  if (strncmp(path, SUBMIT_READING_ENDPOINT, strlen(SUBMIT_READING_ENDPOINT)) == 0) return METRIC_EP_READING;
+  if (strncmp(path, GET_COMMANDS_ENDPOINT, strlen(GET_COMMANDS_ENDPOINT)) == 0) return METRIC_EP_COMMANDS;
+  if (strncmp(path, ACK_COMMAND_ENDPOINT, strlen(ACK_COMMAND_ENDPOINT)) == 0) return METRIC_EP_ACK;
+  if (strncmp(path, SUBMIT_EVENT_ENDPOINT, strlen(SUBMIT_EVENT_ENDPOINT)) == 0) return METRIC_EP_EVENT;
+  if (strncmp(path, REGISTER_DEVICE_ENDPOINT, strlen(REGISTER_DEVICE_ENDPOINT)) == 0) return METRIC_EP_REGISTER;
+  if (strncmp(path, SUBMIT_BATCH_ENDPOINT, strlen(SUBMIT_BATCH_ENDPOINT)) == 0) return METRIC_EP_READING;
+  if (strncmp(path, REGISTER_BUS_METER_ENDPOINT, strlen(REGISTER_BUS_METER_ENDPOINT)) == 0) return METRIC_EP_REGISTER;
+  if (strncmp(path, REFRESH_TOKEN_ENDPOINT, strlen(REFRESH_TOKEN_ENDPOINT)) == 0) return METRIC_EP_AUTH;
+  return METRIC_EP_OTHER;
+}
 
-  DynamicJsonDocument responseDoc(512);
-  DeserializationError error = deserializeJson(responseDoc, response);
+// Path POST yang bodinya dinegosiasikan (lihat UPLINK BINER). Indeks = bit
+// di uplinkCborPaths; entri hanya boleh ditambah di akhir.
+const char* const* uplinkPaths(uint8_t& count) {
+  static const char* const UPLINK_PATHS[] = {
+    SUBMIT_READING_ENDPOINT, SUBMIT_BATCH_ENDPOINT, SUBMIT_EVENT_ENDPOINT, ACK_COMMAND_ENDPOINT,
+    REGISTER_DEVICE_ENDPOINT, REGISTER_BUS_METER_ENDPOINT, REFRESH_TOKEN_ENDPOINT, TRACE_UPLOAD_ENDPOINT
+  };
+  static_assert(sizeof(UPLINK_PATHS) / sizeof(UPLINK_PATHS[0]) <= 8 * sizeof(uplinkCborPaths), "uplinkCborPaths terlalu kecil untuk UPLINK_PATHS");
+  count = sizeof(UPLINK_PATHS) / sizeof(UPLINK_PATHS[0]);
+  return UPLINK_PATHS;
+}
 
-  if (error) {
-    DEBUG_SERIAL.print(F("Poll commands JSON parse failed: "));
-    DEBUG_SERIAL.println(error.c_str());
-    return;
+// Cocok penuh (tanpa query string), bukan prefiks
+uint8_t uplinkPathIndex(const char* path) {
+  uint8_t count;
+  const char* const* paths = uplinkPaths(count);
+  size_t length = strcspn(path, "?");
+  for (uint8_t i = 0; i < count; i++) {
+    if (strlen(paths[i]) == length && strncmp(path, paths[i], length) == 0) {
+      return i;
+    }
   }
+  return UPLINK_PATH_NONE;
+}
 
-  if (responseDoc["status"] == "success" && responseDoc.containsKey("commands")) {
-    JsonArray commands = responseDoc["commands"].as<JsonArray>();
-    
-    for (JsonObject command : commands) {
-      String command_type = command["command_type"].as<String>();
-      int command_id = command["command_id"].as<int>();
-      String current_valve_status = command["current_valve_status"].as<String>();
-
-      DEBUG_SERIAL.print("Received command: ");
-      DEBUG_SERIAL.print(command_type);
-      DEBUG_SERIAL.print(" (ID: ");
-      DEBUG_SERIAL.print(command_id);
-      DEBUG_SERIAL.println(")");
-
-      // Forward command to Arduino
-      DynamicJsonDocument arduinoCommandDoc(256);
-      arduinoCommandDoc["command_type"] = command_type;
-      arduinoCommandDoc["command_id"] = command_id;
-      arduinoCommandDoc["current_valve_status"] = current_valve_status;
-      
-      // Add config data if it's a config update command
-      if (command.containsKey("parameters")) {
-        JsonObject parameters = command["parameters"];
-        if (command_type == "arduino_config_update") {
-          arduinoCommandDoc["config_data"] = parameters;
-        }
-      }
-      
-      String arduinoCommandPayload;
-      serializeJson(arduinoCommandDoc, arduinoCommandPayload);
-      
-      ARDUINO_SERIAL.println(arduinoCommandPayload);
-      DEBUG_SERIAL.print("Tx Arduino (Command): ");
-      DEBUG_SERIAL.println(arduinoCommandPayload);
-    }
+const char* uplinkPathName(uint8_t index) {
+  uint8_t count;
+  const char* const* paths = uplinkPaths(count);
+  return index < count ? paths[index] : "";
+}
+
+void recordHttpMetric(uint8_t endpointIndex, int httpCode, unsigned long latencyMs, size_t bytesSent, size_t bytesReceived) {
+  EndpointMetrics& m = endpointMetrics[endpointIndex];
+  uint8_t bucket = 0;
+  while (bucket < LATENCY_BUCKET_COUNT && latencyMs > LATENCY_BUCKETS_MS[bucket]) {
+    bucket++;
+  }
+  m.buckets[bucket]++;
+  m.latencySumMs += latencyMs;
+  if (httpCode >= 200 && httpCode < 300) {
+    m.success++;
+  } else {
+    m.failure++;
   }
+  m.bytesSent += bytesSent;
+  m.bytesReceived += bytesReceived;
 }
 
-void sendCommandACK(int commandId, String status, String notes, String valveStatusAck) {
-  if (!isDeviceRegistered) {
-    return;
+void metricsPrintf(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(metricsLine, sizeof(metricsLine), format, args);
+  va_end(args);
+  if (len > 0) {
+    server.sendContent(metricsLine, min((size_t)len, sizeof(metricsLine) - 1));
   }
-  
-  DynamicJsonDocument doc(256);
-  doc["command_id"] = commandId;
-  doc["status"] = status;
-  doc["notes"] = notes;
-  doc["valve_status_ack"] = valveStatusAck;
+}
 
-  String payload;
-  serializeJson(doc, payload);
+void handleMetrics() {
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain; version=0.0.4", "");
 
-  String response = httpPOST(ACK_COMMAND_ENDPOINT, payload, deviceJwtToken);
+  metricsPrintf("# TYPE indowater_http_request_duration_ms histogram\n");
+  for (uint8_t ep = 0; ep < METRIC_EP_COUNT; ep++) {
+    EndpointMetrics& m = endpointMetrics[ep];
+    uint32_t cumulative = 0;
+    for (uint8_t b = 0; b < LATENCY_BUCKET_COUNT; b++) {
+      cumulative += m.buckets[b];
+      metricsPrintf("indowater_http_request_duration_ms_bucket{endpoint=\"%s\",le=\"%u\"} %u\n", METRIC_EP_NAMES[ep], LATENCY_BUCKETS_MS[b], cumulative);
+    }
+    cumulative += m.buckets[LATENCY_BUCKET_COUNT];
+    metricsPrintf("indowater_http_request_duration_ms_bucket{endpoint=\"%s\",le=\"+Inf\"} %u\n", METRIC_EP_NAMES[ep], cumulative);
+    metricsPrintf("indowater_http_request_duration_ms_sum{endpoint=\"%s\"} %u\n", METRIC_EP_NAMES[ep], m.latencySumMs);
+    metricsPrintf("indowater_http_request_duration_ms_count{endpoint=\"%s\"} %u\n", METRIC_EP_NAMES[ep], cumulative);
+  }
 
-  DynamicJsonDocument responseDoc(128);
-  DeserializationError error = deserializeJson(responseDoc, response);
+  metricsPrintf("# TYPE indowater_http_requests_total counter\n");
+  for (uint8_t ep = 0; ep < METRIC_EP_COUNT; ep++) {
+    metricsPrintf("indowater_http_requests_total{endpoint=\"%s\",result=\"success\"} %u\n", METRIC_EP_NAMES[ep], endpointMetrics[ep].success);
+    metricsPrintf("indowater_http_requests_total{endpoint=\"%s\",result=\"failure\"} %u\n", METRIC_EP_NAMES[ep], endpointMetrics[ep].failure);
+  }
 
-  if (error) {
-    DEBUG_SERIAL.print(F("Command ACK JSON parse failed: "));
-    DEBUG_SERIAL.println(error.c_str());
-    return;
+  metricsPrintf("# TYPE indowater_http_sent_bytes_total counter\n");
+  for (uint8_t ep = 0; ep < METRIC_EP_COUNT; ep++) {
+    metricsPrintf("indowater_http_sent_bytes_total{endpoint=\"%s\"} %u\n", METRIC_EP_NAMES[ep], endpointMetrics[ep].bytesSent);
+  }
+  metricsPrintf("# TYPE indowater_http_received_bytes_total counter\n");
+  for (uint8_t ep = 0; ep < METRIC_EP_COUNT; ep++) {
+    metricsPrintf("indowater_http_received_bytes_total{endpoint=\"%s\"} %u\n", METRIC_EP_NAMES[ep], endpointMetrics[ep].bytesReceived);
   }
 
-  if (responseDoc["status"] == "success") {
-    DEBUG_SERIAL.print("Command ACK sent successfully for ID: ");
-    DEBUG_SERIAL.println(commandId);
-  } else {
-    DEBUG_SERIAL.print("Failed to send command ACK: ");
-    DEBUG_SERIAL.println(responseDoc["message"].as<String>());
+  uint8_t httpQueued = 0;
+  for (uint8_t i = 0; i < HTTP_QUEUE_SIZE; i++) {
+    if (httpRequests[i].state != HTTP_REQ_FREE) {
+      httpQueued++;
+    }
   }
-}
+  metricsPrintf("# TYPE indowater_http_queue_depth gauge\n");
+  metricsPrintf("indowater_http_queue_depth %u\n", httpQueued);
+  metricsPrintf("# TYPE indowater_http_queue_rejected_total counter\n");
+  metricsPrintf("indowater_http_queue_rejected_total %u\n", httpQueueRejected);
+  metricsPrintf("# TYPE indowater_http_timeouts_total counter\n");
+  metricsPrintf("indowater_http_timeouts_total %u\n", httpTimeouts);
+  metricsPrintf("# TYPE indowater_http_queue_wait_ms gauge\n");
+  metricsPrintf("indowater_http_queue_wait_ms{stat=\"last\"} %lu\n", httpQueueWaitLastMs);
+  metricsPrintf("indowater_http_queue_wait_ms{stat=\"max\"} %lu\n", httpQueueWaitMaxMs);
 
-// =====================================================
-// FUNGSI OTA UPDATE
-// =====================================================
-void checkOTAUpdate() {
-  if (!isDeviceRegistered) {
-    return;
+  metricsPrintf("# TYPE indowater_uplink_cbor_enabled gauge\n");
+  uint8_t pathCount;
+  uplinkPaths(pathCount);
+  for (uint8_t i = 0; i < pathCount; i++) {
+    metricsPrintf("indowater_uplink_cbor_enabled{path=\"%s\"} %u\n", uplinkPathName(i), (uplinkCborPaths >> i) & 1);
   }
-  
-  DEBUG_SERIAL.println("Checking for OTA updates...");
-  
-  WiFiClient client;
-  String url = String(API_BASE_URL) + OTA_UPDATE_ENDPOINT + "?device_id=" + String(ESP.getChipId()) + "&version=1.0.0";
-  
-  HTTPClient http;
-  http.begin(client, url);
-  http.addHeader("Authorization", "Bearer " + deviceJwtToken);
-  
-  int httpCode = http.GET();
-  
-  if (httpCode == HTTP_CODE_OK) {
-    int contentLength = http.getSize();
-    if (contentLength > 0) {
-      DEBUG_SERIAL.println("OTA update available, starting download...");
-      
-      t_httpUpdate_return ret = ESPhttpUpdate.update(client, url, "1.0.0");
-      
-      switch (ret) {
-        case HTTP_UPDATE_FAILED:
-          DEBUG_SERIAL.printf("OTA Update failed. Error (%d): %s\n", ESPhttpUpdate.getLastError(), ESPhttpUpdate.getLastErrorString().c_str());
-          break;
-        case HTTP_UPDATE_NO_UPDATES:
-          DEBUG_SERIAL.println("OTA: No updates available");
-          break;
-        case HTTP_UPDATE_OK:
-          DEBUG_SERIAL.println("OTA Update successful, restarting...");
-          ESP.restart();
-          break;
+  metricsPrintf("# TYPE indowater_uplink_body_bytes_total counter\n");
+  metricsPrintf("indowater_uplink_body_bytes_total{format=\"json\"} %u\n", uplinkBytes[UPLINK_FORMAT_JSON]);
+  metricsPrintf("indowater_uplink_body_bytes_total{format=\"cbor\"} %u\n", uplinkBytes[UPLINK_FORMAT_CBOR]);
+  metricsPrintf("indowater_uplink_body_bytes_total{format=\"cbor_as_json\"} %u\n", uplinkJsonEquivalentBytes);
+  metricsPrintf("# TYPE indowater_uplink_encode_us_total counter\n");
+  metricsPrintf("indowater_uplink_encode_us_total{format=\"json\"} %u\n", uplinkEncodeUs[UPLINK_FORMAT_JSON]);
+  metricsPrintf("indowater_uplink_encode_us_total{format=\"cbor\"} %u\n", uplinkEncodeUs[UPLINK_FORMAT_CBOR]);
+  metricsPrintf("indowater_uplink_encode_us_total{format=\"cbor_as_json\"} %u\n", uplinkJsonEquivalentUs);
+
+  metricsPrintf("# TYPE indowater_jwt_refresh_total counter\n");
+  metricsPrintf("indowater_jwt_refresh_total{result=\"success\"} %u\n", jwtRefreshes);
+  metricsPrintf("indowater_jwt_refresh_total{result=\"failure\"} %u\n", jwtRefreshFailures);
+  metricsPrintf("# TYPE indowater_jwt_unauthorized_total counter\n");
+  metricsPrintf("indowater_jwt_unauthorized_total %u\n", jwtUnauthorized);
+  metricsPrintf("# TYPE indowater_jwt_requests_held_total counter\n");
+  metricsPrintf("indowater_jwt_requests_held_total %u\n", jwtRequestsHeld);
+  metricsPrintf("# TYPE indowater_jwt_rejected gauge\n");
+  metricsPrintf("indowater_jwt_rejected %u\n", deviceJwtState.rejected ? 1 : 0);
+  long jwtRemaining;
+  if (jwtExpiresIn(deviceJwtState, jwtRemaining)) {
+    metricsPrintf("# TYPE indowater_jwt_expires_in_seconds gauge\n");
+    metricsPrintf("indowater_jwt_expires_in_seconds %ld\n", jwtRemaining);
+  }
+
+  metricsPrintf("# TYPE indowater_serial_frames_total counter\n");
+  metricsPrintf("indowater_serial_frames_total %u\n", serialFramesReceived);
+  metricsPrintf("# TYPE indowater_serial_parse_errors_total counter\n");
+  metricsPrintf("indowater_serial_parse_errors_total %u\n", serialParseErrors);
+
+  metricsPrintf("# TYPE indowater_heap_free_bytes gauge\n");
+  metricsPrintf("indowater_heap_free_bytes %u\n", ESP.getFreeHeap());
+  metricsPrintf("# TYPE indowater_heap_max_free_block_bytes gauge\n");
+  metricsPrintf("indowater_heap_max_free_block_bytes %u\n", ESP.getMaxFreeBlockSize());
+  metricsPrintf("# TYPE indowater_heap_fragmentation_percent gauge\n");
+  metricsPrintf("indowater_heap_fragmentation_percent %u\n", ESP.getHeapFragmentation());
+  metricsPrintf("# TYPE indowater_heap_free_after_connect_min_bytes gauge\n");
+  metricsPrintf("indowater_heap_free_after_connect_min_bytes %u\n", httpHeapAfterConnectMin);
+
+  metricsPrintf("# TYPE indowater_wifi_rssi_dbm gauge\n");
+  metricsPrintf("indowater_wifi_rssi_dbm %d\n", WiFi.RSSI());
+  metricsPrintf("# TYPE indowater_wifi_reconnects_total counter\n");
+  metricsPrintf("indowater_wifi_reconnects_total %u\n", wifiReconnectCount);
+  metricsPrintf("# TYPE indowater_wifi_fast_connects_total counter\n");
+  metricsPrintf("indowater_wifi_fast_connects_total{result=\"success\"} %u\n", wifiFastConnects);
+  metricsPrintf("indowater_wifi_fast_connects_total{result=\"fallback\"} %u\n", wifiFastFallbacks);
+  metricsPrintf("# TYPE indowater_wifi_connect_ms gauge\n");
+  metricsPrintf("indowater_wifi_connect_ms %lu\n", wifiConnectMs);
+
+  metricsPrintf("# TYPE indowater_queue_depth gauge\n");
+  metricsPrintf("indowater_queue_depth{queue=\"event\"} %u\n", eventQueueCount);
+  metricsPrintf("indowater_queue_depth{queue=\"reading\"} %u\n", readingQueueCount);
+  metricsPrintf("indowater_queue_depth{queue=\"ack\"} %u\n", ackQueueCount);
+  metricsPrintf("# TYPE indowater_queue_dropped_total counter\n");
+  metricsPrintf("indowater_queue_dropped_total{queue=\"event\"} %lu\n", droppedEvents);
+  metricsPrintf("indowater_queue_dropped_total{queue=\"reading\"} %lu\n", droppedReadings);
+  metricsPrintf("indowater_queue_dropped_total{queue=\"ack\"} %lu\n", droppedAcks);
+  metricsPrintf("indowater_queue_dropped_total{queue=\"aggregate\"} %lu\n", droppedAggregates);
+  metricsPrintf("# TYPE indowater_event_latency_ms gauge\n");
+  metricsPrintf("indowater_event_latency_ms{stat=\"last\"} %lu\n", lastEventLatencyMs);
+  metricsPrintf("indowater_event_latency_ms{stat=\"max\"} %lu\n", maxEventLatencyMs);
+  metricsPrintf("# TYPE indowater_power_duty_percent gauge\n");
+  metricsPrintf("indowater_power_duty_percent %.1f\n", lastPowerDutyPct);
+  metricsPrintf("# TYPE indowater_tls_handshakes_total counter\n");
+  metricsPrintf("indowater_tls_handshakes_total{result=\"success\"} %u\n", tlsHandshakeCount);
+  metricsPrintf("indowater_tls_handshakes_total{result=\"failure\"} %u\n", tlsHandshakeFailures);
+  metricsPrintf("indowater_tls_handshakes_total{result=\"refused\"} %u\n", tlsRefused);
+  metricsPrintf("# TYPE indowater_tls_handshake_ms gauge\n");
+  metricsPrintf("indowater_tls_handshake_ms{stat=\"last\"} %lu\n", tlsHandshakeLastMs);
+  metricsPrintf("indowater_tls_handshake_ms{stat=\"sum\"} %u\n", tlsHandshakeSumMs);
+  metricsPrintf("# TYPE indowater_tls_mfln_enabled gauge\n");
+  metricsPrintf("indowater_tls_mfln_enabled %u\n", tlsMflnSupported ? 1 : 0);
+  if (GATEWAY_MODE) {
+    uint8_t online = 0;
+    for (uint8_t i = 0; i < BUS_METER_SLOTS; i++) {
+      if (busMeters[i].address != 0 && busMeters[i].online) {
+        online++;
       }
     }
-  } else if (httpCode == HTTP_CODE_NOT_MODIFIED) {
-    DEBUG_SERIAL.println("OTA: Firmware is up to date");
-  } else {
-    DEBUG_SERIAL.printf("OTA check failed, HTTP code: %d\n", httpCode);
+    metricsPrintf("# TYPE indowater_bus_meters_online gauge\n");
+    metricsPrintf("indowater_bus_meters_online %u\n", online);
+    metricsPrintf("# TYPE indowater_bus_poll_timeouts_total counter\n");
+    metricsPrintf("indowater_bus_poll_timeouts_total %u\n", busPollTimeouts);
+    metricsPrintf("# TYPE indowater_bus_frames_dropped_total counter\n");
+    metricsPrintf("indowater_bus_frames_dropped_total %u\n", busFramesDropped);
   }
-  
-  http.end();
+  metricsPrintf("# TYPE indowater_time_synced gauge\n");
+  metricsPrintf("indowater_time_synced %u\n", timeSynced ? 1 : 0);
+  metricsPrintf("# TYPE indowater_checkpoint_restored gauge\n");
+  metricsPrintf("indowater_checkpoint_restored %u\n", checkpointRestored ? 1 : 0);
+  metricsPrintf("# TYPE indowater_checkpoint_crash_restores gauge\n");
+  metricsPrintf("indowater_checkpoint_crash_restores %u\n", checkpointCrashRestores);
+  metricsPrintf("# TYPE indowater_checkpoint_discarded gauge\n");
+  metricsPrintf("indowater_checkpoint_discarded %u\n", checkpointDiscarded ? 1 : 0);
+  metricsPrintf("# TYPE indowater_ntp_syncs_total counter\n");
+  metricsPrintf("indowater_ntp_syncs_total{result=\"success\"} %u\n", ntpSyncCount);
+  metricsPrintf("indowater_ntp_syncs_total{result=\"failure\"} %u\n", ntpSyncFailures);
+  metricsPrintf("# TYPE indowater_clock_drift_ppm gauge\n");
+  metricsPrintf("indowater_clock_drift_ppm %.1f\n", clockDriftPpm);
+  metricsPrintf("# TYPE indowater_ntp_offset_ms gauge\n");
+  metricsPrintf("indowater_ntp_offset_ms %ld\n", lastNtpOffsetMs);
+  metricsPrintf("# TYPE indowater_uptime_seconds counter\n");
+  metricsPrintf("indowater_uptime_seconds %lu\n", millis() / 1000);
+
+  server.sendContent("");
+}
+
+void setupMetricsServer() {
+  server.on("/metrics", HTTP_GET, handleMetrics);
+  server.begin();
+  webServerStarted = true;
+  DEBUG_SERIAL.println("Metrics server started at /metrics");
 }
 
 // =====================================================
 // FUNGSI KONEKSI WI-FI
 // =====================================================
+// Jalur cepat: BSSID, channel dan lease terakhir dari RTC memory (tanpa
+// scan dan DHCP, biasanya < 500 ms). Jika gagal dalam
+// WIFI_FAST_CONNECT_TIMEOUT cache dihapus dan koneksi diulang penuh.
 void connectWiFiSTA() {
   DEBUG_SERIAL.print("Connecting to WiFi: ");
   DEBUG_SERIAL.println(sta_ssid);
   
   WiFi.mode(WIFI_STA);
-  WiFi.begin(sta_ssid.c_str(), sta_password.c_str());
+  unsigned long start = millis();
 
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 30) { // Coba 30 kali (30 detik)
-    delay(1000);
-    DEBUG_SERIAL.print(".");
-    attempts++;
+  RtcWifiCache cache;
+  bool fastPath = loadWifiCache(cache);
+  if (fastPath) {
+    WiFi.config(IPAddress(cache.ip), IPAddress(cache.gateway), IPAddress(cache.subnet), IPAddress(cache.dns1), IPAddress(cache.dns2));
+    WiFi.begin(sta_ssid.c_str(), sta_password.c_str(), cache.channel, cache.bssid);
+    if (waitWiFiConnected(WIFI_FAST_CONNECT_TIMEOUT)) {
+      wifiFastConnects++;
+      cache.reuseCount++;
+      storeWifiCache(cache);
+    } else {
+      DEBUG_SERIAL.println("Fast WiFi reconnect failed, falling back to full scan");
+      wifiFastFallbacks++;
+      fastPath = false;
+      clearWifiCache();
+      WiFi.disconnect();
+    }
+  }
+  if (!fastPath) {
+    WiFi.config(0U, 0U, 0U); // Kembali ke DHCP
+    WiFi.begin(sta_ssid.c_str(), sta_password.c_str());
+    if (waitWiFiConnected(WIFI_CONNECT_TIMEOUT)) {
+      saveWifiCache();
+    }
   }
 
-  if (WiFi.status() == WL_CONNECTED) {
+  unsigned long elapsed = millis() - start;
+  bool connected = WiFi.status() == WL_CONNECTED;
+  trace(TRACE_WIFI, connected ? (fastPath ? 2 : 1) : 0, min(elapsed, 65535UL));
+  if (connected) {
     isWiFiConnected = true;
-    DEBUG_SERIAL.println();
-    DEBUG_SERIAL.println("WiFi connected successfully!");
+    wifiConnectMs = elapsed;
+    DEBUG_SERIAL.printf("WiFi connected in %lu ms (%s)\n", elapsed, fastPath ? "fast path" : "full scan");
     DEBUG_SERIAL.print("IP address: ");
     DEBUG_SERIAL.println(WiFi.localIP());
   } else {
     isWiFiConnected = false;
-    DEBUG_SERIAL.println();
     DEBUG_SERIAL.println("Failed to connect to WiFi");
   }
 }
 
+bool waitWiFiConnected(unsigned long timeoutMs) {
+  unsigned long start = millis();
+  while (WiFi.status() != WL_CONNECTED && millis() - start < timeoutMs) {
+    delay(WIFI_CONNECT_POLL);
+  }
+  return WiFi.status() == WL_CONNECTED;
+}
+
+bool loadWifiCache(RtcWifiCache& cache) {
+  if (!ESP.rtcUserMemoryRead(RTC_WIFI_CACHE_BLOCK, (uint32_t*)&cache, sizeof(cache))) {
+    return false;
+  }
+  if (cache.magic != RTC_WIFI_CACHE_MAGIC ||
+      cache.crc != crc32((const uint8_t*)&cache.ssidCrc, sizeof(cache) - 2 * sizeof(uint32_t))) {
+    return false; // Power-on reset atau data rusak
+  }
+  return cache.ssidCrc == crc32((const uint8_t*)sta_ssid.c_str(), sta_ssid.length()) &&
+         cache.reuseCount < WIFI_FAST_MAX_REUSE;
+}
+
+void storeWifiCache(RtcWifiCache& cache) {
+  cache.magic = RTC_WIFI_CACHE_MAGIC;
+  cache.crc = crc32((const uint8_t*)&cache.ssidCrc, sizeof(cache) - 2 * sizeof(uint32_t));
+  ESP.rtcUserMemoryWrite(RTC_WIFI_CACHE_BLOCK, (uint32_t*)&cache, sizeof(cache));
+}
+
+// Simpan AP dan lease dari koneksi penuh yang baru berhasil
+void saveWifiCache() {
+  RtcWifiCache cache;
+  cache.ssidCrc = crc32((const uint8_t*)sta_ssid.c_str(), sta_ssid.length());
+  memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+  cache.channel = WiFi.channel();
+  cache.reuseCount = 0;
+  cache.ip = WiFi.localIP();
+  cache.gateway = WiFi.gatewayIP();
+  cache.subnet = WiFi.subnetMask();
+  cache.dns1 = WiFi.dnsIP(0);
+  cache.dns2 = WiFi.dnsIP(1);
+  storeWifiCache(cache);
+}
+
+void clearWifiCache() {
+  uint32_t magic = 0;
+  ESP.rtcUserMemoryWrite(RTC_WIFI_CACHE_BLOCK, &magic, sizeof(magic));
+}
+
 void startAPMode() {
   DEBUG_SERIAL.println("Starting Access Point mode...");
   
@@ -824,11 +3977,34 @@ void startAPMode() {
   setupWebServer();
 }
 
+void handleProvisioningPage() {
+  // Browser yang sudah punya salinan cukup dapat 304 tanpa body
+  if (server.header("If-None-Match") == PROVISIONING_HTML_GZ_ETAG) {
+    server.sendHeader("ETag", PROVISIONING_HTML_GZ_ETAG);
+    server.send(304);
+    return;
+  }
+
+  server.sendHeader("Content-Encoding", "gzip");
+  server.sendHeader("ETag", PROVISIONING_HTML_GZ_ETAG);
+  server.sendHeader("Cache-Control", "max-age=86400");
+  server.setContentLength(PROVISIONING_HTML_GZ_LEN);
+  server.send(200, "text/html", "");
+
+  // Kirim langsung dari flash per potongan, tanpa salin ke RAM
+  for (size_t offset = 0; offset < PROVISIONING_HTML_GZ_LEN; offset += PROVISIONING_CHUNK_SIZE) {
+    size_t len = PROVISIONING_HTML_GZ_LEN - offset;
+    if (len > PROVISIONING_CHUNK_SIZE) len = PROVISIONING_CHUNK_SIZE;
+    server.sendContent_P((PGM_P)(PROVISIONING_HTML_GZ + offset), len);
+  }
+}
+
 void setupWebServer() {
+  const char* headerKeys[] = {"If-None-Match"};
+  server.collectHeaders(headerKeys, 1);
+
   // Serve main provisioning page
-  server.on("/", HTTP_GET, []() {
-    server.send_P(200, "text/html", PROVISIONING_HTML);
-  });
+  server.on("/", HTTP_GET, handleProvisioningPage);
   
   // Device info endpoint
   server.on("/device-info", HTTP_GET, []() {
@@ -885,6 +4061,7 @@ void setupWebServer() {
   });
 
   server.begin();
+  webServerStarted = true;
   DEBUG_SERIAL.println("HTTP server started");
 }
 
@@ -902,6 +4079,10 @@ void loadCredentials() {
   sta_password = loadString(EEPROM_PASS_ADDR);
   idMeter = loadString(EEPROM_ID_METER_ADDR);
   deviceJwtToken = loadString(EEPROM_JWT_ADDR);
+  deviceProvisioningToken = loadString(EEPROM_PROVISION_ADDR);
+  if (deviceProvisioningToken.length() > PROVISION_TOKEN_MAX) {
+    deviceProvisioningToken = ""; // Area belum pernah ditulis (firmware lama)
+  }
   
   DEBUG_SERIAL.println("Credentials loaded from EEPROM");
   if (sta_ssid.length() > 0) {
@@ -912,6 +4093,35 @@ void loadCredentials() {
     DEBUG_SERIAL.print("Meter ID: ");
     DEBUG_SERIAL.println(idMeter);
   }
+  if (deviceJwtToken.length() > 0) {
+    jwtLoadClaims(BUS_LOCAL_METER);
+  }
+}
+
+// Tabel meter bus: satu entri EEPROM_BUS_ENTRY_SIZE byte per slot
+void saveBusMeter(uint8_t slot) {
+  int addr = EEPROM_BUS_TABLE_ADDR + slot * EEPROM_BUS_ENTRY_SIZE;
+  EEPROM.write(addr, busMeters[slot].address);
+  saveString(addr + 1, busMeters[slot].idMeter);
+  saveString(addr + 25, busMeters[slot].jwt);
+}
+
+void loadBusMeters() {
+  for (uint8_t slot = 0; slot < BUS_METER_SLOTS; slot++) {
+    int addr = EEPROM_BUS_TABLE_ADDR + slot * EEPROM_BUS_ENTRY_SIZE;
+    BusMeter& m = busMeters[slot];
+    memset(&m, 0, sizeof(m));
+    m.batchSeq = -1;
+    uint8_t address = EEPROM.read(addr);
+    if (address == 0 || address > BUS_MAX_ADDRESS) {
+      continue; // Slot kosong (EEPROM baru berisi 0xFF)
+    }
+    m.address = address;
+    strlcpy(m.idMeter, loadString(addr + 1).c_str(), sizeof(m.idMeter));
+    strlcpy(m.jwt, loadString(addr + 25).c_str(), sizeof(m.jwt));
+    DEBUG_SERIAL.printf("Bus meter %u: %s\n", m.address, m.idMeter);
+    jwtLoadClaims(slot);
+  }
 }
 
 void saveString(int addr, String data) {
@@ -0,0 +1,81 @@
+/*
+ * Akses pin AVR yang diselesaikan saat compile (ATmega328P: Arduino Uno/Nano)
+ *
+ * AvrPin<N> memetakan nomor pin Arduino ke register PORT/DDR/PIN dan bit
+ * mask-nya sebagai konstanta. high()/low()/toggle()/read() dengan begitu
+ * menjadi satu instruksi SBI/CBI/SBIS, sedangkan digitalWrite/digitalRead
+ * butuh ~50+ siklus untuk lookup tabel dan cek timer PWM.
+ *
+ * Peta pin board ikut divalidasi saat compile: pin di luar D0-D19 (misal
+ * pin 20 di versi lama) atau pin yang dipakai dua kali (pinsValid/
+ * pinsUnique) gagal build, bukan gagal di lapangan.
+ *
+ * Pin ATmega328P:
+ *   D0-D7   -> PORTD bit 0-7  (PCINT grup 2, D2/D3 juga INT0/INT1)
+ *   D8-D13  -> PORTB bit 0-5  (PCINT grup 0)
+ *   D14-D19 -> PORTC bit 0-5  (A0-A5, PCINT grup 1)
+ * A6/A7 pada Nano hanya analog dan tidak punya akses digital.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#if !defined(__AVR_ATmega328P__) && !defined(__AVR_ATmega328__) && !defined(__AVR_ATmega168__)
+#error "avr_pin.h hanya mendukung ATmega328P/328/168 (Arduino Uno/Nano)"
+#endif
+
+#define AVR_PIN_COUNT 20
+
+template <uint8_t N>
+struct AvrPin {
+    static_assert(N < AVR_PIN_COUNT, "Pin tidak ada di Uno/Nano: pin digital hanya D0-D19 (A0-A5 = D14-D19)");
+
+    static const uint8_t NUMBER = N;
+    static const uint8_t BIT = N < 8 ? N : (N < 14 ? N - 8 : N - 14);
+    static const uint8_t MASK = 1 << BIT;
+    // Interrupt eksternal hanya di D2 (INT0) dan D3 (INT1); -1 = tidak ada
+    static const int8_t EXT_INT = N == 2 ? 0 : (N == 3 ? 1 : -1);
+    // Grup pin change interrupt (PCIE0/1/2) untuk wake-up dari sleep
+    static const uint8_t PCINT_GROUP = N < 8 ? 2 : (N < 14 ? 0 : 1);
+
+    static inline volatile uint8_t& port() __attribute__((always_inline)) {
+        return N < 8 ? PORTD : (N < 14 ? PORTB : PORTC);
+    }
+    static inline volatile uint8_t& ddr() __attribute__((always_inline)) {
+        return N < 8 ? DDRD : (N < 14 ? DDRB : DDRC);
+    }
+    static inline volatile uint8_t& pin() __attribute__((always_inline)) {
+        return N < 8 ? PIND : (N < 14 ? PINB : PINC);
+    }
+
+    static inline void output() __attribute__((always_inline)) { ddr() |= MASK; }
+    static inline void input() __attribute__((always_inline)) { ddr() &= ~MASK; port() &= ~MASK; }
+    static inline void inputPullup() __attribute__((always_inline)) { ddr() &= ~MASK; port() |= MASK; }
+
+    static inline void high() __attribute__((always_inline)) { port() |= MASK; }
+    static inline void low() __attribute__((always_inline)) { port() &= ~MASK; }
+    static inline void write(bool level) __attribute__((always_inline)) {
+        if (level) {
+            high();
+        } else {
+            low();
+        }
+    }
+    // Menulis 1 ke register PIN membalik output (fitur ATmega328P)
+    static inline void toggle() __attribute__((always_inline)) { pin() = MASK; }
+    static inline bool read() __attribute__((always_inline)) { return (pin() & MASK) != 0; }
+};
+
+// Validasi daftar pin saat compile (constexpr C++11: satu return, rekursif)
+constexpr bool pinsValid(const uint8_t* pins, uint8_t count) {
+    return count == 0 ? true : (pins[0] < AVR_PIN_COUNT && pinsValid(pins + 1, count - 1));
+}
+
+constexpr bool pinInList(uint8_t pin, const uint8_t* pins, uint8_t count) {
+    return count == 0 ? false : (pins[0] == pin || pinInList(pin, pins + 1, count - 1));
+}
+
+constexpr bool pinsUnique(const uint8_t* pins, uint8_t count) {
+    return count <= 1 ? true : (!pinInList(pins[0], pins + 1, count - 1) && pinsUnique(pins + 1, count - 1));
+}
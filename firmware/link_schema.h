@@ -0,0 +1,335 @@
+/*
+ * Skema pesan link serial Arduino <-> NodeMCU (dipakai kedua firmware)
+ *
+ * Setiap frame adalah satu baris array JSON posisional:
+ *   [jenis, addr, field..., ekor...]            NodeMCU -> Arduino
+ *   [jenis, addr, field..., ekor..., age_ms]    Arduino -> NodeMCU
+ * jenis = LinkMessage, addr = alamat bus (0 = point-to-point). Daftar
+ * LINK_*_FIELDS menentukan urutan, tipe C++ dan skala setiap field; struct
+ * pesan serta encoder/decoder per jenis dibangkitkan dari daftar yang sama
+ * saat compile (LINK_MESSAGE). Tidak ada kunci string di link: penerima
+ * cukup switch pada jenis lalu membaca field per indeks, dan field yang
+ * salah nama atau tipe di salah satu firmware menjadi error compile.
+ *
+ * - float dengan skala > 0 dikirim sebagai integer (nilai x skala)
+ * - status, posisi valve, hasil dan jenis perintah dikirim sebagai kode
+ *   tabel di bawah; namanya hanya dipakai ke server
+ * - field ekor (objek/array yang diteruskan apa adanya) opsional: frame boleh
+ *   berhenti sebelum ekor, dan pemanggil boleh menambahkan ekor langsung ke
+ *   frame setelah linkEncode() sesuai urutan
+ * - age_ms (umur data saat frame benar-benar dikirim) ditambahkan Arduino
+ *   sebagai elemen terakhir setiap frame
+ *
+ * Decoder menolak frame dengan jenis lain atau field kurang dari skema, jadi
+ * perubahan daftar field harus masuk ke kedua firmware sekaligus. Kunci di
+ * daftar field adalah kunci format objek lama: NodeMCU masih menerima frame
+ * objek dari firmware Arduino sebelum skema ini dan menjawabnya dengan objek
+ * juga (linkDecodeKeyed / linkEncodeKeyed). Arduino hanya memakai array,
+ * sehingga NodeMCU harus di-update lebih dulu.
+ *
+ * Header ini hanya bergantung pada ArduinoJson sehingga juga dipakai program
+ * uji di host (tests/link_schema_test.cpp, round-trip setiap pesan).
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <ArduinoJson.h>
+#include "trace_events.h"   // TraceCommand = kode jenis perintah
+
+enum LinkMessage {
+  LINK_MSG_READING = 1,   // Arduino -> NodeMCU: pembacaan/event (+ agregat, statistik loop)
+  LINK_MSG_ACK = 2,       // Arduino -> NodeMCU: hasil perintah (+ nilai config)
+  LINK_MSG_TRACE = 3,     // Arduino -> NodeMCU: satu bagian dump flight recorder
+  LINK_MSG_UPDATE = 4,    // NodeMCU -> Arduino: saldo, tarif, unlock, interval laporan
+  LINK_MSG_COMMAND = 5,   // NodeMCU -> Arduino: perintah dari server
+  LINK_MSG_POLL = 6,      // NodeMCU -> Arduino: giliran menjawab di bus (mode gateway)
+};
+
+// =====================================================
+// TABEL KODE
+// =====================================================
+// Enum dan nama dibangkitkan dari daftar yang sama. Kode hanya boleh
+// ditambah di akhir (indeks juga disimpan di checkpoint RTC NodeMCU).
+#define LINK_STATUS_LIST(X) \
+  X(LINK_STATUS_NORMAL, "normal") \
+  X(LINK_STATUS_PULSA_HABIS, "pulsa_habis") \
+  X(LINK_STATUS_PINTU_TERBUKA, "pintu_terbuka") \
+  X(LINK_STATUS_TEGANGAN_RENDAH, "tegangan_rendah") \
+  X(LINK_STATUS_KEBOCORAN, "kebocoran") \
+  X(LINK_STATUS_ALIRAN_BERLEBIH, "aliran_berlebih") \
+  X(LINK_STATUS_ALIRAN_SAAT_TERTUTUP, "aliran_saat_tertutup") \
+  X(LINK_STATUS_PINTU_TERTUTUP, "pintu_tertutup")
+
+#define LINK_VALVE_LIST(X) \
+  X(LINK_VALVE_UNKNOWN, "unknown") \
+  X(LINK_VALVE_CLOSED, "closed") \
+  X(LINK_VALVE_OPENING, "opening") \
+  X(LINK_VALVE_OPEN, "open") \
+  X(LINK_VALVE_CLOSING, "closing") \
+  X(LINK_VALVE_FAULT, "fault")
+
+#define LINK_ACK_LIST(X) \
+  X(LINK_ACK_FAILED, "failed") \
+  X(LINK_ACK_ACKNOWLEDGED, "acknowledged")
+
+#define LINK_ENUM_ENTRY(code, name) code,
+#define LINK_NAME_ENTRY(code, name) name,
+
+enum LinkStatus : uint8_t { LINK_STATUS_LIST(LINK_ENUM_ENTRY) LINK_STATUS_COUNT };
+enum LinkValve : uint8_t { LINK_VALVE_LIST(LINK_ENUM_ENTRY) LINK_VALVE_COUNT };
+enum LinkAck : uint8_t { LINK_ACK_LIST(LINK_ENUM_ENTRY) LINK_ACK_COUNT };
+
+const char* const LINK_STATUS_NAMES[] = { LINK_STATUS_LIST(LINK_NAME_ENTRY) };
+const char* const LINK_VALVE_NAMES[] = { LINK_VALVE_LIST(LINK_NAME_ENTRY) };
+const char* const LINK_ACK_NAMES[] = { LINK_ACK_LIST(LINK_NAME_ENTRY) };
+const char* const LINK_COMMAND_NAMES[] = { TRACE_COMMAND_LIST(LINK_NAME_ENTRY) };
+
+// Kunci registry parameter Arduino (config_data / jawaban get_config), urut
+// sesuai tabel PARAMS di Arduino_Corrected.cpp; dicek saat compile lewat
+// linkParamKeysMatch(). Jawaban get_config berisi array nilai tanpa kunci,
+// NodeMCU memetakan ke kunci ini sebelum diteruskan ke server.
+#define LINK_PARAM_VERSION 1 // PARAM_BLOB_VERSION Arduino; ubah jika urutan/arti berubah
+constexpr const char* LINK_PARAM_KEYS[] = {
+  "k_factor", "distance_tolerance", "flow_interval_ms", "low_voltage_v",
+  "low_credit_rp", "buzzer_interval_ms", "idle_entry_ms", "agg_interval_s",
+  "leak_window_s", "leak_min_lpm", "burst_volume_l", "closed_flow_l",
+  "anomaly_close_valve", "valve_travel_ms", "leak_gap_s"
+};
+constexpr uint8_t LINK_PARAM_COUNT = sizeof(LINK_PARAM_KEYS) / sizeof(LINK_PARAM_KEYS[0]);
+
+constexpr bool linkKeyEqual(const char* a, const char* b) {
+  return *a == *b && (*a == '\0' || linkKeyEqual(a + 1, b + 1));
+}
+
+template <typename Def, size_t N>
+constexpr bool linkParamKeysMatch(const Def (&params)[N], size_t i = 0) {
+  return N == LINK_PARAM_COUNT &&
+         (i >= N || (linkKeyEqual(params[i].key, LINK_PARAM_KEYS[i]) && linkParamKeysMatch(params, i + 1)));
+}
+
+// =====================================================
+// ENCODER/DECODER PER TIPE FIELD
+// =====================================================
+// linkPut/linkGet: format array (scale > 0 = float fixed-point).
+// linkPutKeyed/linkGetKeyed: format objek lama; nilai kosong (bilangan tak
+// bertanda 0, bilangan bertanda negatif, teks/ekor null) tidak ditulis.
+inline void linkPut(JsonArray out, float value, long scale) {
+  if (scale > 0) {
+    out.add(lround(value * scale));
+  } else {
+    out.add(value);
+  }
+}
+inline void linkPut(JsonArray out, bool value, long) { out.add(value ? 1 : 0); }
+inline void linkPut(JsonArray out, uint8_t value, long) { out.add(value); }
+inline void linkPut(JsonArray out, uint16_t value, long) { out.add(value); }
+inline void linkPut(JsonArray out, long value, long) { out.add(value); }
+inline void linkPut(JsonArray out, unsigned long value, long) { out.add(value); }
+inline void linkPut(JsonArray out, const char* value, long) { out.add(value); }
+inline void linkPut(JsonArray out, JsonVariantConst value, long) { out.add(value); }
+
+inline void linkGet(JsonVariantConst in, float& value, long scale) {
+  value = scale > 0 ? in.as<long>() / (float)scale : in.as<float>();
+}
+inline void linkGet(JsonVariantConst in, bool& value, long) { value = in.as<int>() != 0; }
+inline void linkGet(JsonVariantConst in, uint8_t& value, long) { value = in.as<uint8_t>(); }
+inline void linkGet(JsonVariantConst in, uint16_t& value, long) { value = in.as<uint16_t>(); }
+inline void linkGet(JsonVariantConst in, long& value, long) { value = in.as<long>(); }
+inline void linkGet(JsonVariantConst in, unsigned long& value, long) { value = in.as<unsigned long>(); }
+inline void linkGet(JsonVariantConst in, const char*& value, long) { value = in | ""; }
+inline void linkGet(JsonVariantConst in, JsonVariantConst& value, long) { value = in; }
+
+inline void linkPutKeyed(JsonObject out, const char* key, float value, long) { out[key] = value; }
+inline void linkPutKeyed(JsonObject out, const char* key, bool value, long) { out[key] = value; }
+inline void linkPutKeyed(JsonObject out, const char* key, uint8_t value, long) {
+  if (value != 0) out[key] = value;
+}
+inline void linkPutKeyed(JsonObject out, const char* key, uint16_t value, long) {
+  if (value != 0) out[key] = value;
+}
+inline void linkPutKeyed(JsonObject out, const char* key, long value, long) {
+  if (value >= 0) out[key] = value;
+}
+inline void linkPutKeyed(JsonObject out, const char* key, unsigned long value, long) {
+  if (value != 0) out[key] = value;
+}
+inline void linkPutKeyed(JsonObject out, const char* key, const char* value, long) {
+  if (value != nullptr) out[key] = value;
+}
+inline void linkPutKeyed(JsonObject out, const char* key, JsonVariantConst value, long) {
+  if (!value.isNull()) out[key] = value;
+}
+
+inline void linkGetKeyed(JsonVariantConst in, float& value, long) { value = in.as<float>(); }
+inline void linkGetKeyed(JsonVariantConst in, bool& value, long) { value = in.as<bool>(); }
+template <typename T>
+inline void linkGetKeyed(JsonVariantConst in, T& value, long scale) { linkGet(in, value, scale); }
+
+// Tipe kode: nama (ke server/format lama) dan angka (di link)
+#define LINK_CODE_TYPE(Type, names, count) \
+  inline const char* linkName(Type code) { return names[code < count ? code : 0]; } \
+  inline void linkFromName(const char* name, Type& code) { \
+    code = (Type)0; \
+    for (uint8_t i = 0; name != nullptr && i < count; i++) { \
+      if (strcmp(names[i], name) == 0) { \
+        code = (Type)i; \
+        return; \
+      } \
+    } \
+  } \
+  inline void linkPut(JsonArray out, Type code, long) { out.add((uint8_t)code); } \
+  inline void linkGet(JsonVariantConst in, Type& code, long) { \
+    uint8_t value = in.as<uint8_t>(); \
+    code = (Type)(value < count ? value : 0); \
+  } \
+  inline void linkPutKeyed(JsonObject out, const char* key, Type code, long) { out[key] = linkName(code); } \
+  inline void linkGetKeyed(JsonVariantConst in, Type& code, long) { linkFromName(in | "", code); }
+
+LINK_CODE_TYPE(LinkStatus, LINK_STATUS_NAMES, LINK_STATUS_COUNT)
+LINK_CODE_TYPE(LinkValve, LINK_VALVE_NAMES, LINK_VALVE_COUNT)
+LINK_CODE_TYPE(LinkAck, LINK_ACK_NAMES, LINK_ACK_COUNT)
+LINK_CODE_TYPE(TraceCommand, LINK_COMMAND_NAMES, TRACE_CMD_COUNT)
+
+// =====================================================
+// PESAN
+// =====================================================
+// X(tipe, member, kunci format objek lama, skala). Field pertama setiap
+// pesan adalah alamat bus (indeks 1 di frame, lihat linkAddress()).
+
+// Pembacaan meter: snapshot, event dan agregat interval
+#define LINK_READING_FIELDS(X) \
+  X(uint8_t,    address,      "addr",             0) \
+  X(float,      flowRate,     "flow_rate_lpm",    100) \
+  X(float,      meterReading, "meter_reading_m3", 1000) \
+  X(float,      voltage,      "current_voltage",  100) \
+  X(uint8_t,    doorOpen,     "door_status",      0) \
+  X(LinkStatus, status,       "status_message",   0) \
+  X(LinkValve,  valve,        "valve_status",     0) \
+  X(uint16_t,   seq,          "seq",              0)
+#define LINK_READING_TAIL(X) \
+  X(JsonVariantConst, aggregate, "agg",  0) \
+  X(JsonVariantConst, loop,      "loop", 0)
+
+// Hasil perintah; jawaban get_config membawa ekor array nilai PARAMS
+#define LINK_ACK_FIELDS(X) \
+  X(uint8_t,     address,       "addr",             0) \
+  X(long,        commandId,     "command_id_ack",   0) \
+  X(LinkAck,     status,        "ack_status",       0) \
+  X(const char*, notes,         "ack_notes",        0) \
+  X(LinkValve,   valve,         "valve_status_ack", 0) \
+  X(uint8_t,     configVersion, "config_v",         0)
+#define LINK_ACK_TAIL(X) \
+  X(JsonVariantConst, config, "config", 0)
+
+// Bagian dump flight recorder (records = hex TraceRecord, lihat trace_events.h)
+#define LINK_TRACE_FIELDS(X) \
+  X(uint8_t,       address,   "addr",      0) \
+  X(long,          commandId, "trace_cmd", 0) \
+  X(uint8_t,       part,      "part",      0) \
+  X(uint8_t,       parts,     "parts",     0) \
+  X(unsigned long, nowMs,     "now_ms",    0) \
+  X(unsigned long, total,     "total",     0) \
+  X(const char*,   records,   "records",   0)
+#define LINK_TRACE_TAIL(X)
+
+// Saldo dari server; ackSeq -1 = tanpa seq, reportIntervalMs 0 = tidak diubah
+#define LINK_UPDATE_FIELDS(X) \
+  X(uint8_t,       address,          "addr",               0) \
+  X(const char*,   idMeter,          "id_meter",           0) \
+  X(float,         credit,           "data_pulsa",         0) \
+  X(float,         tariff,           "tarif_per_m3",       0) \
+  X(bool,          unlocked,         "is_unlocked",        0) \
+  X(unsigned long, reportIntervalMs, "report_interval_ms", 0) \
+  X(long,          ackSeq,           "ack_seq",            0)
+#define LINK_UPDATE_TAIL(X)
+
+// Perintah server; arduino_config_update membawa ekor objek config_data
+#define LINK_COMMAND_FIELDS(X) \
+  X(uint8_t,      address,   "addr",                 0) \
+  X(TraceCommand, code,      "command_type",         0) \
+  X(long,         commandId, "command_id",           0) \
+  X(LinkValve,    valve,     "current_valve_status", 0)
+#define LINK_COMMAND_TAIL(X) \
+  X(JsonVariantConst, config, "config_data", 0)
+
+#define LINK_POLL_FIELDS(X) \
+  X(uint8_t, address, "addr", 0)
+#define LINK_POLL_TAIL(X)
+
+#define LINK_MEMBER(type, member, key, scale) type member;
+#define LINK_COUNT_FIELD(type, member, key, scale) + 1
+#define LINK_PUT(type, member, key, scale) linkPut(out, m.member, scale);
+#define LINK_GET(type, member, key, scale) linkGet(in[i++], m.member, scale);
+#define LINK_TAIL_LAST(type, member, key, scale) i++; if (!m.member.isNull()) last = i;
+#define LINK_TAIL_PUT(type, member, key, scale) if (i++ < last) out.add(m.member);
+#define LINK_TAIL_GET(type, member, key, scale) m.member = i < end ? in[i] : JsonVariantConst(); i++;
+#define LINK_PUT_KEYED(type, member, key, scale) linkPutKeyed(out, key, m.member, scale);
+#define LINK_GET_KEYED(type, member, key, scale) linkGetKeyed(in[key], m.member, scale);
+
+// Struct pesan + encoder/decoder array dan objek. aged = frame dari Arduino
+// (diakhiri age_ms). Ekor yang tidak diisi (null) di akhir tidak dikirim.
+#define LINK_MESSAGE(Name, code, FIELDS, TAIL, aged) \
+  struct Name { \
+    enum { FIELD_COUNT = 0 FIELDS(LINK_COUNT_FIELD) }; \
+    FIELDS(LINK_MEMBER) \
+    TAIL(LINK_MEMBER) \
+    unsigned long ageMs; \
+  }; \
+  inline void linkEncode(JsonArray out, const Name& m) { \
+    out.add((uint8_t)code); \
+    FIELDS(LINK_PUT) \
+    uint8_t i = 0, last = 0; \
+    TAIL(LINK_TAIL_LAST) \
+    i = 0; \
+    TAIL(LINK_TAIL_PUT) \
+    (void)i; \
+    (void)last; \
+  } \
+  inline bool linkDecode(JsonArrayConst in, Name& m) { \
+    if ((in[0] | 0) != code) return false; \
+    size_t end = in.size() - (aged ? 1 : 0); \
+    if (end < 1 + Name::FIELD_COUNT) return false; \
+    size_t i = 1; \
+    FIELDS(LINK_GET) \
+    TAIL(LINK_TAIL_GET) \
+    m.ageMs = aged ? in[end].as<unsigned long>() : 0; \
+    return true; \
+  } \
+  inline void linkEncodeKeyed(JsonObject out, const Name& m) { \
+    FIELDS(LINK_PUT_KEYED) \
+    TAIL(LINK_PUT_KEYED) \
+  } \
+  inline void linkDecodeKeyed(JsonObjectConst in, Name& m) { \
+    FIELDS(LINK_GET_KEYED) \
+    TAIL(LINK_GET_KEYED) \
+    m.ageMs = in["age_ms"] | 0UL; \
+  }
+
+// Semua pesan; pesan baru cukup ditambah di sini (tests/link_schema_test.cpp
+// ikut menguji round-trip-nya)
+#define LINK_MESSAGES(X) \
+  X(LinkReading, LINK_MSG_READING, LINK_READING_FIELDS, LINK_READING_TAIL, true) \
+  X(LinkAckFrame, LINK_MSG_ACK, LINK_ACK_FIELDS, LINK_ACK_TAIL, true) \
+  X(LinkTrace, LINK_MSG_TRACE, LINK_TRACE_FIELDS, LINK_TRACE_TAIL, true) \
+  X(LinkUpdate, LINK_MSG_UPDATE, LINK_UPDATE_FIELDS, LINK_UPDATE_TAIL, false) \
+  X(LinkCommand, LINK_MSG_COMMAND, LINK_COMMAND_FIELDS, LINK_COMMAND_TAIL, false) \
+  X(LinkPoll, LINK_MSG_POLL, LINK_POLL_FIELDS, LINK_POLL_TAIL, false)
+
+LINK_MESSAGES(LINK_MESSAGE)
+
+// Jenis dan alamat frame array (0 jika bukan frame skema)
+inline uint8_t linkMessageType(JsonArrayConst frame) { return frame[0] | 0; }
+inline uint8_t linkAddress(JsonArrayConst frame) { return frame[1] | 0; }
+
+// Frame array, atau objek berkunci untuk firmware lama (keyed)
+template <typename T>
+void linkEncodeFrame(JsonDocument& doc, const T& m, bool keyed) {
+  if (keyed) {
+    linkEncodeKeyed(doc.to<JsonObject>(), m);
+  } else {
+    linkEncode(doc.to<JsonArray>(), m);
+  }
+}
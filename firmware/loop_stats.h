@@ -0,0 +1,117 @@
+/*
+ * Statistik latensi loop() bersama untuk Arduino_Corrected.cpp dan NodeMCU_Fixed.cpp
+ *
+ * Setiap pass loop (tanpa waktu tidur/idle) masuk histogram log2 dalam ms:
+ * bucket 0 = < 1 ms, bucket k = [2^(k-1), 2^k) ms, bucket terakhir >= 1024 ms.
+ * Loop dibagi menjadi bagian bertag lewat loopSection(); bagian terlama di
+ * jendela laporan dicatat beserta tag-nya sebagai sumber blocking terbesar.
+ * Pass yang lebih lama dari deadline dihitung sebagai miss.
+ *
+ * Statistik berlaku per jendela laporan: fillLoopStats() menulis ringkasan
+ * ke objek "loop" yang ikut data meter, lalu loopStatsReset() memulai
+ * jendela baru. Format JSON:
+ *   {"period_s":..,"n":..,"hist":[..],"max_ms":..,"block_ms":..,
+ *    "block_src":"..","miss":..,"deadline_ms":..}
+ * "hist" dipotong setelah bucket terakhir yang tidak nol.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <ArduinoJson.h>
+
+#define LOOP_HIST_BUCKETS 12
+
+#if defined(__AVR__)
+typedef uint16_t LoopCount;   // Hemat RAM AVR; counter jenuh di 65535
+#else
+typedef uint32_t LoopCount;
+#endif
+
+struct LoopStats {
+  LoopCount passes;
+  LoopCount hist[LOOP_HIST_BUCKETS];
+  LoopCount deadlineMisses;
+  uint32_t maxPassMs;
+  uint32_t maxSectionMs;
+  uint8_t maxSectionTag;
+  uint8_t sectionTag;         // Bagian yang sedang berjalan
+  uint32_t sectionStart;
+  uint32_t windowStart;       // millis() awal jendela laporan
+};
+
+inline void loopCountInc(LoopCount& counter) {
+  if (counter != (LoopCount)-1) {
+    counter++;
+  }
+}
+
+inline uint8_t loopHistBucket(uint32_t ms) {
+  uint8_t bucket = 0;
+  while (ms > 0 && bucket < LOOP_HIST_BUCKETS - 1) {
+    ms >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+// Awal pass: jeda sejak pass sebelumnya (idle/sleep) tidak dihitung
+inline void loopPassBegin(LoopStats& stats, uint8_t tag, uint32_t now) {
+  stats.sectionTag = tag;
+  stats.sectionStart = now;
+}
+
+// Tutup bagian yang sedang berjalan dan mulai bagian bertag `tag`
+inline void loopSection(LoopStats& stats, uint8_t tag, uint32_t now) {
+  uint32_t elapsed = now - stats.sectionStart;
+  if (elapsed > stats.maxSectionMs) {
+    stats.maxSectionMs = elapsed;
+    stats.maxSectionTag = stats.sectionTag;
+  }
+  stats.sectionTag = tag;
+  stats.sectionStart = now;
+}
+
+// Akhir pass: tutup bagian terakhir lalu catat durasi pass; true jika miss
+inline bool loopPassEnd(LoopStats& stats, uint32_t passStart, uint32_t now, uint32_t deadlineMs) {
+  loopSection(stats, stats.sectionTag, now);
+  uint32_t passMs = now - passStart;
+  loopCountInc(stats.passes);
+  loopCountInc(stats.hist[loopHistBucket(passMs)]);
+  if (passMs > stats.maxPassMs) {
+    stats.maxPassMs = passMs;
+  }
+  if (passMs > deadlineMs) {
+    loopCountInc(stats.deadlineMisses);
+    return true;
+  }
+  return false;
+}
+
+inline void loopStatsReset(LoopStats& stats, uint32_t now) {
+  uint8_t tag = stats.sectionTag;
+  uint32_t sectionStart = stats.sectionStart;
+  memset(&stats, 0, sizeof(stats));
+  stats.sectionTag = tag;
+  stats.sectionStart = sectionStart;
+  stats.windowStart = now;
+}
+
+inline void fillLoopStats(JsonObject out, const LoopStats& stats, const char* blockSource, uint32_t deadlineMs, uint32_t now) {
+  out["period_s"] = (now - stats.windowStart + 500) / 1000;
+  out["n"] = stats.passes;
+  uint8_t used = LOOP_HIST_BUCKETS;
+  while (used > 0 && stats.hist[used - 1] == 0) {
+    used--;
+  }
+  JsonArray hist = out.createNestedArray("hist");
+  for (uint8_t i = 0; i < used; i++) {
+    hist.add(stats.hist[i]);
+  }
+  out["max_ms"] = stats.maxPassMs;
+  out["block_ms"] = stats.maxSectionMs;
+  out["block_src"] = blockSource;
+  out["miss"] = stats.deadlineMisses;
+  out["deadline_ms"] = deadlineMs;
+}
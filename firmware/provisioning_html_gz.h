@@ -0,0 +1,107 @@
+// GENERATED by tools/build_provisioning_assets.py from assets/provisioning.html
+// Jangan edit manual. Original: 6726 byte, minified: 4068 byte, gzip: 1584 byte.
+#pragma once
+
+#define PROVISIONING_HTML_GZ_ETAG "\"437d7dcf\""
+const size_t PROVISIONING_HTML_GZ_LEN = 1584;
+const uint8_t PROVISIONING_HTML_GZ[] PROGMEM = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0xa5, 0x57, 0xeb, 0x6e, 0xdb, 0x36,
+  0x14, 0xfe, 0xbf, 0xa7, 0xe0, 0x1c, 0x14, 0xb2, 0x31, 0x4b, 0xf1, 0x25, 0x71, 0x3a, 0xc9, 0x36,
+  0xb0, 0x35, 0x29, 0x90, 0xa1, 0x6b, 0x83, 0x25, 0x45, 0x31, 0x0c, 0xc5, 0x40, 0x8b, 0x94, 0xc5,
+  0x46, 0x26, 0x35, 0x92, 0xb2, 0xe3, 0x1a, 0x7e, 0x81, 0x61, 0xef, 0xb0, 0x57, 0xdc, 0x23, 0xec,
+  0x90, 0x94, 0x64, 0x39, 0x71, 0x92, 0x75, 0x85, 0x03, 0x45, 0x24, 0xcf, 0xe5, 0x3b, 0x77, 0x6a,
+  0xfc, 0xed, 0xf9, 0xbb, 0x57, 0x37, 0xbf, 0x5e, 0x5d, 0xa0, 0x54, 0x2f, 0xb2, 0xe9, 0xb8, 0x7c,
+  0x52, 0x4c, 0xa6, 0xe3, 0x05, 0xd5, 0x18, 0xc5, 0x29, 0x96, 0x8a, 0xea, 0x49, 0xeb, 0xfd, 0xcd,
+  0x6b, 0xff, 0x65, 0xab, 0xdc, 0xe5, 0x78, 0x41, 0x27, 0xad, 0x25, 0xa3, 0xab, 0x5c, 0x48, 0xdd,
+  0x42, 0xb1, 0xe0, 0x9a, 0x72, 0xa0, 0x5a, 0x31, 0xa2, 0xd3, 0x09, 0xa1, 0x4b, 0x16, 0x53, 0xdf,
+  0x2e, 0xba, 0x88, 0x71, 0xa6, 0x19, 0xce, 0x7c, 0x15, 0xe3, 0x8c, 0x4e, 0xfa, 0x41, 0x0f, 0xa4,
+  0x68, 0xa6, 0x33, 0x3a, 0xbd, 0xe4, 0x44, 0x7c, 0xc0, 0x9a, 0x4a, 0x74, 0x6e, 0x39, 0xd0, 0x35,
+  0xd5, 0x45, 0x3e, 0x3e, 0x76, 0xa7, 0x63, 0xa5, 0xd7, 0xf0, 0x6f, 0x26, 0xc8, 0x7a, 0x93, 0x80,
+  0x02, 0x3f, 0xc1, 0x0b, 0x96, 0xad, 0xc3, 0x1f, 0x24, 0x48, 0xeb, 0x2a, 0xcc, 0x95, 0xaf, 0xa8,
+  0x64, 0x49, 0x34, 0xc3, 0xf1, 0xed, 0x5c, 0x8a, 0x82, 0x93, 0x30, 0x63, 0x9c, 0x62, 0xe9, 0xcf,
+  0x25, 0x26, 0x0c, 0x00, 0xb5, 0xfb, 0xc3, 0x53, 0x42, 0xe7, 0xdd, 0xa3, 0xd1, 0xe8, 0x8c, 0x52,
+  0x8c, 0x7a, 0x2f, 0xba, 0x47, 0x67, 0xa3, 0x93, 0x19, 0x1e, 0xa0, 0x7e, 0xaf, 0xf7, 0xa2, 0x13,
+  0x2d, 0xb0, 0x9c, 0x33, 0x1e, 0xf6, 0xa2, 0x1c, 0x13, 0xc2, 0xf8, 0x3c, 0x1c, 0xf4, 0xf2, 0xbb,
+  0x68, 0xc1, 0xb8, 0x9f, 0x52, 0x36, 0x4f, 0x75, 0x08, 0x64, 0xcb, 0x34, 0x22, 0x4c, 0xe5, 0x19,
+  0x5e, 0x87, 0x49, 0x46, 0xef, 0x22, 0x9c, 0xb1, 0x39, 0xf7, 0x99, 0xa6, 0x0b, 0x15, 0xc6, 0xa0,
+  0x84, 0xca, 0xe8, 0x53, 0xa1, 0x34, 0x4b, 0xd6, 0x7e, 0xe9, 0x87, 0x72, 0x7b, 0x1b, 0x98, 0x35,
+  0x06, 0x48, 0x72, 0xd3, 0xc0, 0xb8, 0x4a, 0x81, 0xb7, 0x56, 0x38, 0x34, 0x0a, 0x67, 0x42, 0x12,
+  0x2a, 0x7d, 0x83, 0xba, 0x50, 0x61, 0xff, 0xd4, 0x6e, 0xdd, 0xf9, 0x2a, 0xc5, 0x44, 0xac, 0xc2,
+  0x1e, 0x80, 0xcd, 0xef, 0x90, 0xa1, 0x44, 0x72, 0x3e, 0xc3, 0xed, 0x5e, 0xd7, 0xfe, 0x82, 0xa1,
+  0x31, 0xe0, 0xce, 0xf9, 0x39, 0x3c, 0xe9, 0x19, 0x49, 0xee, 0xdd, 0x18, 0xb7, 0x0d, 0x32, 0x31,
+  0x17, 0x1b, 0x4d, 0xef, 0xb4, 0x6f, 0x21, 0x57, 0x60, 0x9d, 0xcd, 0xfe, 0x4c, 0x68, 0x2d, 0x16,
+  0x56, 0xbf, 0x23, 0x45, 0x69, 0x7f, 0x13, 0x8b, 0x4c, 0xc8, 0xf0, 0x68, 0x10, 0x9f, 0x62, 0xdc,
+  0xdb, 0x79, 0xc7, 0xba, 0x5f, 0xb1, 0xcf, 0x34, 0x1c, 0xbc, 0xac, 0xc9, 0xf3, 0x8a, 0x7a, 0x34,
+  0x1a, 0x55, 0xa4, 0x80, 0x1c, 0xf5, 0xcc, 0xaf, 0xc1, 0xd2, 0x3f, 0x31, 0x2c, 0x89, 0x90, 0x0b,
+  0xdf, 0x78, 0x20, 0xdf, 0xec, 0x03, 0x30, 0x1e, 0xdf, 0x66, 0x78, 0x46, 0xb3, 0x4d, 0xe5, 0xe6,
+  0x59, 0x26, 0xe2, 0xdb, 0x7b, 0x38, 0x8d, 0x4f, 0x4a, 0x7d, 0xc3, 0xe1, 0xd0, 0x89, 0x5f, 0xb9,
+  0x18, 0xcd, 0x44, 0x46, 0xb6, 0x8c, 0xe7, 0x85, 0xfe, 0x4d, 0xaf, 0x73, 0x48, 0x4c, 0x63, 0x73,
+  0xeb, 0x63, 0xb7, 0xb9, 0x95, 0x63, 0xa5, 0x56, 0xe0, 0xe5, 0xd6, 0xc7, 0xcd, 0xce, 0x45, 0x75,
+  0x10, 0xfa, 0x83, 0x3a, 0x08, 0x21, 0xbc, 0x22, 0x25, 0x32, 0x46, 0xd0, 0x11, 0x21, 0xe4, 0x5e,
+  0x68, 0xc0, 0xfa, 0xa6, 0x65, 0xa3, 0x2a, 0x50, 0xec, 0xb3, 0x11, 0x53, 0xd2, 0xc2, 0x4e, 0xa4,
+  0x25, 0xe4, 0x27, 0xe4, 0xbd, 0xe0, 0xd5, 0xae, 0x05, 0x8f, 0x20, 0x68, 0xea, 0x00, 0xd6, 0x30,
+  0x11, 0x71, 0xa1, 0x1e, 0x41, 0xec, 0x0e, 0x37, 0xa2, 0xd0, 0x26, 0xbd, 0x43, 0x2e, 0x38, 0x8d,
+  0x9a, 0x42, 0xab, 0x78, 0x6d, 0x67, 0x05, 0xb8, 0x8a, 0x3f, 0x6e, 0xe0, 0x2e, 0x07, 0xab, 0x08,
+  0x3b, 0x7e, 0x97, 0x91, 0xa5, 0xfd, 0x4d, 0xf1, 0x8f, 0x5b, 0x1d, 0x17, 0x52, 0x01, 0x67, 0x2e,
+  0x98, 0xcd, 0xa9, 0xa6, 0xb9, 0xb5, 0x16, 0x67, 0xac, 0x03, 0x15, 0xa6, 0x62, 0xb9, 0x5f, 0x06,
+  0x47, 0x7d, 0x3a, 0x24, 0xa3, 0xa4, 0x3a, 0x87, 0xd8, 0xe3, 0x59, 0x46, 0xc9, 0x1e, 0x49, 0x1c,
+  0xc7, 0x95, 0x26, 0x2e, 0x4c, 0x1a, 0x67, 0x62, 0x45, 0xc9, 0x36, 0x50, 0x1a, 0x6b, 0xf0, 0x48,
+  0x99, 0x21, 0x5a, 0xe4, 0xae, 0x6e, 0x6b, 0x6b, 0x1f, 0xd6, 0x94, 0x49, 0x9f, 0x87, 0xa5, 0x50,
+  0x25, 0x9c, 0xb1, 0xb9, 0x92, 0x1a, 0xa8, 0x22, 0x8e, 0xa9, 0x52, 0x7b, 0x40, 0xc8, 0x09, 0x25,
+  0x04, 0x57, 0x09, 0xd8, 0x3f, 0x3d, 0x3d, 0x1b, 0x9c, 0x54, 0x0e, 0xeb, 0xef, 0x12, 0x26, 0x1e,
+  0xd2, 0x51, 0x3c, 0xab, 0x25, 0x51, 0x29, 0xc5, 0xbe, 0xcd, 0xc9, 0x4b, 0x72, 0xb6, 0x93, 0x73,
+  0x36, 0xe8, 0xc7, 0x07, 0xe5, 0x24, 0xa7, 0xb1, 0x95, 0x53, 0x36, 0x52, 0xc6, 0x13, 0x71, 0x4f,
+  0x4c, 0xf2, 0x7d, 0x82, 0x77, 0xf6, 0x9e, 0x3e, 0xb0, 0xd7, 0x84, 0xec, 0x61, 0x9d, 0x3d, 0xa8,
+  0xca, 0x86, 0x02, 0xa4, 0xb4, 0x14, 0x7c, 0xbe, 0xdf, 0x02, 0xb6, 0xe3, 0x63, 0xd7, 0x85, 0xc7,
+  0xc7, 0x6e, 0x28, 0x98, 0x6e, 0x3c, 0x1d, 0x13, 0xb6, 0x44, 0x71, 0x06, 0x09, 0x3a, 0x69, 0xd5,
+  0x2d, 0xae, 0xb5, 0xb7, 0x6d, 0x3a, 0x04, 0xec, 0xa4, 0xfd, 0xe9, 0x3f, 0x7f, 0xff, 0xf5, 0x27,
+  0xaa, 0x3b, 0x3d, 0xc8, 0xe9, 0x4f, 0xc7, 0xf9, 0xf4, 0x1a, 0xc0, 0x69, 0xe4, 0x9a, 0xff, 0xcf,
+  0xd4, 0x3c, 0xcb, 0xde, 0x9f, 0x83, 0x2a, 0x90, 0xb3, 0x27, 0xac, 0x81, 0xb2, 0x65, 0xc6, 0x82,
+  0xc1, 0x39, 0x2d, 0x47, 0xc6, 0xe5, 0x79, 0x68, 0x30, 0xda, 0x2d, 0x34, 0x56, 0x39, 0xe6, 0x88,
+  0x91, 0x8a, 0xe5, 0x92, 0xb4, 0xa6, 0x6f, 0x04, 0x36, 0x4e, 0x0a, 0x82, 0x00, 0xe8, 0xe0, 0x18,
+  0x6c, 0x90, 0xb5, 0x90, 0x6b, 0x1b, 0xa8, 0x27, 0x24, 0x38, 0x82, 0xd6, 0xf4, 0x17, 0xb0, 0x7e,
+  0x8d, 0xa0, 0x89, 0x21, 0xe5, 0x70, 0x3a, 0x51, 0x0e, 0xaa, 0xe9, 0x6d, 0x96, 0x27, 0x97, 0x62,
+  0xc9, 0x14, 0x54, 0x01, 0x28, 0x7c, 0x0d, 0x9b, 0xfb, 0x3e, 0xd9, 0xb5, 0x40, 0xd8, 0xb7, 0x1d,
+  0xcf, 0x08, 0x84, 0x16, 0x20, 0x6e, 0x29, 0x6f, 0x4d, 0xaf, 0x1a, 0xcc, 0xe8, 0xc6, 0xec, 0x01,
+  0x2e, 0x4b, 0x36, 0x1d, 0xdb, 0xc6, 0x80, 0x1a, 0x1d, 0xc3, 0xaa, 0x73, 0x8c, 0xe5, 0x34, 0x2e,
+  0x17, 0x92, 0xfe, 0x51, 0x30, 0x49, 0x09, 0x82, 0xc4, 0x8e, 0x69, 0x0a, 0xad, 0x91, 0x82, 0x8a,
+  0x0b, 0x93, 0xee, 0xa8, 0x09, 0x0f, 0x95, 0xf4, 0x30, 0x40, 0x32, 0xca, 0xe7, 0x30, 0xb5, 0x5b,
+  0xc3, 0x41, 0xeb, 0x80, 0xf3, 0x1f, 0x43, 0xad, 0x14, 0x03, 0xef, 0x7e, 0x60, 0xaf, 0x19, 0x7a,
+  0x4b, 0x35, 0x74, 0xaa, 0xdb, 0xe7, 0xe0, 0x5a, 0x8e, 0x12, 0xad, 0x7b, 0x7f, 0x0a, 0xac, 0x95,
+  0xcc, 0x9d, 0x64, 0xcb, 0xf4, 0x25, 0xe0, 0xea, 0xe6, 0xe9, 0x00, 0x5e, 0x95, 0xcb, 0xc3, 0x08,
+  0x6b, 0x62, 0x17, 0xc3, 0x7a, 0xe5, 0x90, 0xee, 0xd6, 0xcf, 0xa2, 0xdd, 0x69, 0x2d, 0x91, 0xba,
+  0xde, 0x56, 0xaa, 0x51, 0xc5, 0x6c, 0xc1, 0x2a, 0x57, 0xd8, 0xf7, 0x1f, 0x35, 0x84, 0xdd, 0xe6,
+  0x7d, 0x79, 0x01, 0x1a, 0x1f, 0x3b, 0x0e, 0xe0, 0x37, 0x96, 0x39, 0x53, 0x2d, 0xbd, 0x4b, 0xc3,
+  0xca, 0xec, 0x72, 0x59, 0xa9, 0xb1, 0x4f, 0x48, 0xdd, 0x58, 0xb2, 0x5c, 0x4f, 0x13, 0xaa, 0xe3,
+  0xb4, 0xed, 0x1d, 0x37, 0xaa, 0xc6, 0xeb, 0x04, 0x3a, 0xa5, 0xbc, 0x2d, 0xa9, 0xca, 0x05, 0x57,
+  0x14, 0x4d, 0xa6, 0xa8, 0x7a, 0x0f, 0x3e, 0x29, 0xc1, 0xdb, 0x9d, 0x92, 0x82, 0x60, 0xb8, 0xde,
+  0xc1, 0xe9, 0x86, 0xc0, 0xcc, 0x59, 0x40, 0x97, 0x0c, 0xe6, 0x54, 0x5f, 0x64, 0xd4, 0xbc, 0xfe,
+  0xb8, 0xbe, 0x24, 0x6d, 0xaf, 0xaa, 0x2c, 0x23, 0x13, 0x42, 0xfb, 0xca, 0x5d, 0x79, 0xd0, 0x04,
+  0x19, 0xd6, 0xb2, 0xa1, 0xfc, 0xce, 0x48, 0xb4, 0xed, 0x04, 0x31, 0x36, 0x48, 0x6c, 0x17, 0xfc,
+  0x9f, 0x32, 0xbd, 0xf7, 0xfc, 0x96, 0x8b, 0x15, 0xf7, 0x40, 0x5c, 0xf4, 0x28, 0xfb, 0xfd, 0xb2,
+  0x03, 0x31, 0xd0, 0x19, 0x2f, 0x96, 0x40, 0xf0, 0x86, 0x29, 0x10, 0x45, 0x65, 0xdb, 0x73, 0x2e,
+  0xf7, 0xba, 0x28, 0x29, 0x78, 0x6c, 0x26, 0x55, 0x9b, 0x76, 0xd0, 0x86, 0x06, 0xb9, 0xa4, 0x86,
+  0xf0, 0x9c, 0x26, 0xb8, 0xc8, 0x74, 0xbb, 0x03, 0xcd, 0x99, 0x2b, 0x8d, 0xea, 0x08, 0x19, 0xcb,
+  0x1e, 0x53, 0x5c, 0x13, 0x79, 0x35, 0x9b, 0x8d, 0xcc, 0x39, 0x84, 0xed, 0x29, 0x36, 0x4b, 0x04,
+  0x3c, 0x35, 0x7f, 0x50, 0x8d, 0x3f, 0x60, 0xd3, 0xb2, 0xa0, 0x8d, 0x93, 0x7b, 0x0e, 0x81, 0x74,
+  0xd1, 0xa6, 0x7c, 0x8b, 0x1c, 0x3a, 0x9a, 0x17, 0xd5, 0xfa, 0x02, 0xdb, 0xa7, 0x83, 0x72, 0xa2,
+  0x19, 0x4a, 0x33, 0xd4, 0xbc, 0x12, 0x96, 0xc9, 0xa6, 0x73, 0x1b, 0x5a, 0xb4, 0xb1, 0x85, 0x1f,
+  0x3e, 0x8e, 0xce, 0x9e, 0x83, 0x0b, 0x97, 0x38, 0x2b, 0x68, 0xd7, 0x14, 0xea, 0x13, 0xc4, 0xe6,
+  0xb8, 0xa6, 0xad, 0xf2, 0xff, 0x09, 0xfa, 0x8a, 0xa4, 0xe2, 0xd9, 0x46, 0x55, 0xba, 0xd6, 0x41,
+  0x84, 0x10, 0x6d, 0xe0, 0x2b, 0x23, 0x15, 0x20, 0xc7, 0xbb, 0x7a, 0x77, 0x7d, 0xe3, 0x75, 0xcd,
+  0xec, 0xa1, 0x52, 0x85, 0x68, 0xe3, 0x95, 0xae, 0xf0, 0x6f, 0xa0, 0xa6, 0x3c, 0x20, 0xc0, 0x79,
+  0x9e, 0x31, 0x48, 0x34, 0x60, 0x3c, 0x36, 0x99, 0xec, 0x75, 0xb7, 0x5d, 0x33, 0xa4, 0x42, 0xf4,
+  0xd3, 0xf5, 0xbb, 0xb7, 0xe0, 0x15, 0x09, 0xde, 0x82, 0xbb, 0x79, 0xbb, 0x72, 0x41, 0x67, 0xfb,
+  0xe5, 0xc5, 0xf0, 0x84, 0x97, 0xed, 0x5d, 0xd5, 0x8b, 0x58, 0x82, 0x2c, 0x79, 0x39, 0xfa, 0xd1,
+  0x64, 0x02, 0x67, 0xe5, 0x4d, 0xc2, 0xeb, 0x34, 0x25, 0xd8, 0x12, 0x7e, 0x0b, 0xad, 0xc5, 0x70,
+  0x97, 0xd4, 0x15, 0x61, 0x23, 0x9c, 0x07, 0x6a, 0x6b, 0x01, 0x24, 0x78, 0x4e, 0xa3, 0x67, 0xca,
+  0xe8, 0xba, 0xcc, 0xae, 0x03, 0x99, 0x03, 0x8d, 0x26, 0x16, 0x8b, 0x3c, 0x83, 0x81, 0x0b, 0xba,
+  0xa8, 0xbe, 0x61, 0x0b, 0x0a, 0xd7, 0xca, 0x76, 0xbb, 0x73, 0xcf, 0xcc, 0x26, 0xeb, 0x77, 0xc0,
+  0x5b, 0x7d, 0xa0, 0xad, 0x58, 0x96, 0x19, 0x67, 0x69, 0x33, 0xbd, 0x19, 0x47, 0x43, 0x18, 0x87,
+  0x90, 0x61, 0x44, 0xd9, 0x64, 0xdc, 0x76, 0xcd, 0x67, 0x55, 0xaf, 0x13, 0x6d, 0x11, 0xcd, 0xc0,
+  0xb1, 0xcf, 0x58, 0x6d, 0x1b, 0xc3, 0x7f, 0xb4, 0xf9, 0x60, 0xa5, 0x24, 0x18, 0xb4, 0x3c, 0x59,
+  0x2a, 0x75, 0x67, 0x05, 0x70, 0x07, 0x1a, 0xd2, 0xf3, 0x71, 0xfd, 0x2a, 0x0b, 0x4c, 0xb2, 0x72,
+  0x6a, 0x9b, 0x8d, 0x23, 0x0d, 0xd0, 0x55, 0x46, 0x31, 0x78, 0x46, 0xcb, 0x35, 0xc2, 0x73, 0xb8,
+  0x37, 0x99, 0x12, 0xfe, 0x7a, 0xd3, 0x3a, 0xe6, 0x0f, 0xee, 0x24, 0x6e, 0x00, 0x7c, 0x03, 0x63,
+  0xc4, 0x5e, 0xd3, 0x8e, 0xed, 0xe7, 0xfc, 0xbf, 0x8f, 0x33, 0xc2, 0xa1, 0xe4, 0x0f, 0x00, 0x00,
+};
@@ -0,0 +1,221 @@
+/*
+ * Uji host untuk link_schema.h: setiap pesan di LINK_MESSAGES dikirim bolak-
+ * balik lewat encoder array (linkEncode/linkDecode, format link sekarang) dan
+ * encoder berkunci (linkEncodeKeyed/linkDecodeKeyed, format objek firmware
+ * lama), lewat teks JSON seperti di serial. Semua field diisi nilai bukan
+ * default sehingga field yang tertukar, hilang atau salah skala ketahuan.
+ *
+ * Butuh ArduinoJson 6 (hanya header):
+ *   git clone --depth 1 --branch v6.21.5 https://github.com/bblanchon/ArduinoJson.git
+ *   g++ -std=c++11 -Wall -Wextra -IArduinoJson/src firmware/tests/link_schema_test.cpp -o link_schema_test
+ *   ./link_schema_test
+ * Exit code 0 = semua lulus.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <ArduinoJson.h>
+#include "../link_schema.h"
+
+#define TEST_AGE_MS 1234UL
+
+static int failures = 0;
+static StaticJsonDocument<128> tailSample; // Isi ekor (objek/array yang diteruskan apa adanya)
+
+static void fail(const char* message, const char* name, const char* detail) {
+  printf("GAGAL %s: %s %s\n", name, message, detail);
+  failures++;
+}
+
+// =====================================================
+// NILAI CONTOH PER TIPE FIELD
+// =====================================================
+// i = posisi field, agar field bertipe sama punya nilai berbeda. Bilangan
+// bukan 0 dan tidak negatif (format berkunci tidak menulis nilai kosong).
+static void sample(float& value, uint8_t i) { value = i + 0.25f; }
+static void sample(bool& value, uint8_t) { value = true; }
+static void sample(uint8_t& value, uint8_t i) { value = 200 + i; }
+static void sample(uint16_t& value, uint8_t i) { value = 60000 + i; }
+static void sample(long& value, uint8_t i) { value = 2000000000L + i; }
+static void sample(unsigned long& value, uint8_t i) { value = 4000000000UL + i; }
+static void sample(const char*& value, uint8_t) { value = "teks \"uji\""; }
+static void sample(JsonVariantConst& value, uint8_t) { value = tailSample.as<JsonVariantConst>(); }
+// Kode tabel: kode terakhir, menguji batas tabel
+static void sample(LinkStatus& value, uint8_t) { value = (LinkStatus)(LINK_STATUS_COUNT - 1); }
+static void sample(LinkValve& value, uint8_t) { value = (LinkValve)(LINK_VALVE_COUNT - 1); }
+static void sample(LinkAck& value, uint8_t) { value = (LinkAck)(LINK_ACK_COUNT - 1); }
+static void sample(TraceCommand& value, uint8_t) { value = (TraceCommand)(TRACE_CMD_COUNT - 1); }
+
+// =====================================================
+// PERBANDINGAN PER TIPE FIELD
+// =====================================================
+static bool same(float a, float b, long scale) {
+  return fabsf(a - b) <= (scale > 0 ? 0.5f / scale : 0.0f) + 1e-4f * (1.0f + fabsf(a));
+}
+static bool same(const char* a, const char* b, long) {
+  return strcmp(a != nullptr ? a : "", b != nullptr ? b : "") == 0;
+}
+static bool same(JsonVariantConst a, JsonVariantConst b, long) {
+  char left[128], right[128];
+  serializeJson(a, left, sizeof(left));
+  serializeJson(b, right, sizeof(right));
+  return strcmp(left, right) == 0;
+}
+template <typename T>
+static bool same(T a, T b, long) {
+  return a == b;
+}
+
+// Struct contoh dan perbandingan per pesan, dari daftar field yang sama
+#define TEST_SAMPLE_FIELD(type, member, key, scale) sample(m.member, i++);
+#define TEST_CHECK_FIELD(type, member, key, scale) \
+  if (!same(sent.member, received.member, scale)) { \
+    fail("field beda", name, key); \
+    ok = false; \
+  }
+#define TEST_MESSAGE_HELPERS(Name, code, FIELDS, TAIL, aged) \
+  static void sample(Name& m) { \
+    uint8_t i = 0; \
+    FIELDS(TEST_SAMPLE_FIELD) \
+    TAIL(TEST_SAMPLE_FIELD) \
+    (void)i; \
+  } \
+  static bool sameMessage(const char* name, const Name& sent, const Name& received) { \
+    bool ok = true; \
+    FIELDS(TEST_CHECK_FIELD) \
+    TAIL(TEST_CHECK_FIELD) \
+    return ok; \
+  }
+LINK_MESSAGES(TEST_MESSAGE_HELPERS)
+
+// =====================================================
+// ROUND-TRIP
+// =====================================================
+// Kirim lewat teks seperti di serial: encode, serialize, parse, decode.
+// keyed = format objek lama, aged = Arduino menambahkan age_ms.
+template <typename T>
+static void roundTrip(const char* name, uint8_t code, bool aged, bool keyed) {
+  char label[48];
+  snprintf(label, sizeof(label), "%s (%s)", name, keyed ? "berkunci" : "array");
+
+  T sent = {};
+  sample(sent);
+  DynamicJsonDocument out(1024);
+  linkEncodeFrame(out, sent, keyed);
+  if (aged) {
+    if (keyed) {
+      out["age_ms"] = TEST_AGE_MS;
+    } else {
+      out.as<JsonArray>().add(TEST_AGE_MS);
+    }
+  }
+  char line[512];
+  size_t length = serializeJson(out, line, sizeof(line));
+  if (length == 0 || length >= sizeof(line) - 1 || out.overflowed()) {
+    fail("frame tidak muat", label, "");
+    return;
+  }
+
+  DynamicJsonDocument in(1024);
+  if (deserializeJson(in, line, length)) {
+    fail("frame tidak bisa di-parse:", label, line);
+    return;
+  }
+  T received = {};
+  if (keyed) {
+    linkDecodeKeyed(in.as<JsonObjectConst>(), received);
+  } else {
+    JsonArrayConst frame = in.as<JsonArrayConst>();
+    if (linkMessageType(frame) != code || linkAddress(frame) != sent.address) {
+      fail("jenis/alamat frame salah:", label, line);
+    }
+    if (!linkDecode(frame, received)) {
+      fail("frame ditolak decoder:", label, line);
+      return;
+    }
+  }
+  if (!sameMessage(label, sent, received)) {
+    printf("  frame: %s\n", line);
+  }
+  if (received.ageMs != (aged ? TEST_AGE_MS : 0)) {
+    fail("age_ms salah", label, "");
+  }
+}
+
+// Decoder array harus menolak jenis lain dan frame yang kurang field; ekor
+// opsional boleh tidak ada
+template <typename T>
+static void rejects(const char* name, uint8_t code, bool aged) {
+  T sent = {};
+  sample(sent);
+  DynamicJsonDocument full(1024);
+  linkEncode(full.to<JsonArray>(), sent);
+  JsonArrayConst fields = full.as<JsonArrayConst>();
+
+  DynamicJsonDocument doc(1024);
+  JsonArray frame = doc.to<JsonArray>();
+  for (size_t i = 0; i <= (size_t)T::FIELD_COUNT; i++) {
+    frame.add(fields[i]); // Tanpa ekor
+  }
+  if (aged) {
+    frame.add(TEST_AGE_MS);
+  }
+  T received = {};
+  if (!linkDecode(doc.as<JsonArrayConst>(), received)) {
+    fail("frame tanpa ekor ditolak", name, "");
+  }
+
+  frame[0] = (uint8_t)(code + 1);
+  if (linkDecode(doc.as<JsonArrayConst>(), received)) {
+    fail("frame jenis lain diterima", name, "");
+  }
+
+  frame[0] = code;
+  frame.remove(frame.size() - 1);
+  if (!aged && linkDecode(doc.as<JsonArrayConst>(), received)) {
+    fail("frame kurang field diterima", name, "");
+  }
+  if (aged) {
+    frame.remove(frame.size() - 1); // age_ms + satu field
+    if (linkDecode(doc.as<JsonArrayConst>(), received)) {
+      fail("frame kurang field diterima", name, "");
+    }
+  }
+}
+
+// Nama <-> kode setiap tabel kode
+template <typename T>
+static void codeTable(const char* name, uint8_t count) {
+  for (uint8_t i = 0; i < count; i++) {
+    T code;
+    linkFromName(linkName((T)i), code);
+    if (code != (T)i) {
+      fail("nama kode tidak kembali ke kodenya:", name, linkName((T)i));
+    }
+  }
+}
+
+#define TEST_MESSAGE(Name, code, FIELDS, TAIL, aged) \
+  roundTrip<Name>(#Name, code, aged, false); \
+  roundTrip<Name>(#Name, code, aged, true); \
+  rejects<Name>(#Name, code, aged); \
+  tested++;
+
+int main() {
+  deserializeJson(tailSample, "{\"vol_l\":1.5,\"hist\":[1,2,3]}");
+
+  int tested = 0;
+  LINK_MESSAGES(TEST_MESSAGE)
+  codeTable<LinkStatus>("LinkStatus", LINK_STATUS_COUNT);
+  codeTable<LinkValve>("LinkValve", LINK_VALVE_COUNT);
+  codeTable<LinkAck>("LinkAck", LINK_ACK_COUNT);
+  codeTable<TraceCommand>("TraceCommand", TRACE_CMD_COUNT);
+
+  if (failures > 0) {
+    printf("%d kegagalan\n", failures);
+    return 1;
+  }
+  printf("OK: %d pesan, format array dan berkunci\n", tested);
+  return 0;
+}
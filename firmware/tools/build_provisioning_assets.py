@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+"""
+Build provisioning UI assets for NodeMCU_Fixed.cpp.
+
+Minifies firmware/assets/provisioning.html (HTML, inline CSS and JS),
+gzips it and writes firmware/provisioning_html_gz.h containing the PROGMEM
+byte array, its length and an ETag derived from the content.
+
+Run after editing the HTML:
+    python3 firmware/tools/build_provisioning_assets.py
+"""
+
+import gzip
+import os
+import re
+import sys
+import zlib
+
+FIRMWARE_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SOURCE = os.path.join(FIRMWARE_DIR, "assets", "provisioning.html")
+OUTPUT = os.path.join(FIRMWARE_DIR, "provisioning_html_gz.h")
+
+
+def minify_css(css):
+    css = re.sub(r"/\*.*?\*/", "", css, flags=re.S)
+    css = re.sub(r"\s+", " ", css)
+    css = re.sub(r"\s*([{};:,>])\s*", r"\1", css)
+    return css.replace(";}", "}").strip()
+
+
+def minify_js(js):
+    lines = []
+    for line in js.splitlines():
+        # Only whole-line // comments are removed; URLs in strings are kept
+        stripped = line.strip()
+        if not stripped or stripped.startswith("//"):
+            continue
+        lines.append(stripped)
+    js = "\n".join(lines)
+    # Join lines where it cannot change meaning (after/before punctuation)
+    js = re.sub(r"\n(?=[.)}\]:,?])", "", js)
+    js = re.sub(r"(?<=[{(\[,;:=>&|+])\n", "", js)
+    return js
+
+
+def minify_html(html):
+    def css_block(match):
+        return match.group(1) + minify_css(match.group(2)) + match.group(3)
+
+    def js_block(match):
+        return match.group(1) + minify_js(match.group(2)) + match.group(3)
+
+    html = re.sub(r"(<style[^>]*>)(.*?)(</style>)", css_block, html, flags=re.S)
+    html = re.sub(r"(<script[^>]*>)(.*?)(</script>)", js_block, html, flags=re.S)
+    html = re.sub(r"<!--.*?-->", "", html, flags=re.S)
+
+    # Collapse whitespace between tags, but not inside <script>. Line breaks
+    # between tags are layout only; a plain space (e.g. "</strong> <span>")
+    # is visible and kept.
+    parts = re.split(r"(<script[^>]*>.*?</script>)", html, flags=re.S)
+    for i in range(0, len(parts), 2):
+        parts[i] = re.sub(r">\s*\n\s*<", "><", parts[i])
+        parts[i] = re.sub(r"\s{2,}", " ", parts[i])
+    return "".join(parts).strip()
+
+
+def to_c_array(data, per_line=16):
+    lines = []
+    for i in range(0, len(data), per_line):
+        chunk = data[i:i + per_line]
+        lines.append("  " + ", ".join("0x%02x" % b for b in chunk) + ",")
+    return "\n".join(lines)
+
+
+def main():
+    with open(SOURCE, "r", encoding="utf-8") as f:
+        html = f.read()
+
+    minified = minify_html(html).encode("utf-8")
+    # mtime=0 keeps the output byte-identical between builds
+    compressed = gzip.compress(minified, compresslevel=9, mtime=0)
+    etag = "%08x" % (zlib.crc32(compressed) & 0xFFFFFFFF)
+
+    header = """// GENERATED by tools/build_provisioning_assets.py from assets/provisioning.html
+// Jangan edit manual. Original: {orig} byte, minified: {mini} byte, gzip: {gz} byte.
+#pragma once
+
+#define PROVISIONING_HTML_GZ_ETAG "\\"{etag}\\""
+const size_t PROVISIONING_HTML_GZ_LEN = {gz};
+const uint8_t PROVISIONING_HTML_GZ[] PROGMEM = {{
+{body}
+}};
+""".format(orig=len(html.encode("utf-8")), mini=len(minified), gz=len(compressed),
+           etag=etag, body=to_c_array(compressed))
+
+    with open(OUTPUT, "w", encoding="utf-8") as f:
+        f.write(header)
+
+    print("provisioning.html: %d -> %d (minified) -> %d bytes (gzip), %.1fx smaller"
+          % (len(html.encode("utf-8")), len(minified), len(compressed),
+             len(html.encode("utf-8")) / float(len(compressed))))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
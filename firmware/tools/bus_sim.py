@@ -0,0 +1,318 @@
+#!/usr/bin/env python3
+"""
+Simulated multi-drop RS-485 bus with several Arduino meters, for testing the
+NodeMCU gateway mode (GATEWAY_MODE 1) on a host.
+
+The simulator sits on one serial line and plays every meter on the bus. Each
+meter only answers frames that carry its own address, exactly like
+Arduino_Corrected.cpp with bus_address set:
+
+- LINK_MSG_POLL is answered after --reply-delay ms with one frame. This is
+  either the oldest queued event/ACK or a fresh reading.
+- LINK_MSG_UPDATE (balance) is applied and logged.
+- LINK_MSG_COMMAND is acknowledged on the next poll. valve_open and
+  valve_close change the simulated valve.
+- Object frames ({"addr":N,"poll":1}) are answered in the old keyed format
+  only by the meters listed in --legacy.
+
+Frames are built and checked with the field lists read from link_schema.h,
+so a schema change that the gateway and the simulator disagree on shows up
+as a decode error. The simulator also checks the bus discipline: a gateway
+frame that arrives while a polled meter is still due to answer is counted as
+a collision.
+
+Fault injection:
+- --drop P: polls go unanswered with probability P, which exercises the
+  timeout and offline handling.
+- --garble P: answers are corrupted with probability P.
+- --event-every S: a door event is queued on a random meter every S seconds.
+
+Two ways to attach it to a gateway:
+- Through a USB-RS485 adapter on the real bus: --port /dev/ttyUSB0 --baud 9600.
+- With BUS_PORT_USB 1 in NodeMCU_Fixed.cpp, straight over the NodeMCU's USB
+  serial: --port /dev/ttyUSB0 --baud 115200. Debug log lines are ignored.
+
+Usage:
+    python3 firmware/tools/bus_sim.py --port /dev/ttyUSB0 [--baud 115200]
+        [--meters 1,2,3] [--legacy 3] [--drop 0.1] [--garble 0.02]
+        [--event-every 60] [--duration 600]
+
+A summary per meter is printed at the end (Ctrl-C or --duration). The exit
+code is 1 if frames failed to decode or the bus saw collisions.
+"""
+
+import argparse
+import json
+import os
+import random
+import re
+import select
+import sys
+import termios
+import time
+
+FIRMWARE_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SCHEMA = os.path.join(FIRMWARE_DIR, "link_schema.h")
+TRACE = os.path.join(FIRMWARE_DIR, "trace_events.h")
+BAUDS = {9600: termios.B9600, 19200: termios.B19200, 38400: termios.B38400,
+         57600: termios.B57600, 115200: termios.B115200}
+
+
+def read_source(path):
+    with open(path, "r", encoding="utf-8") as f:
+        return re.sub(r"//[^\n]*", "", f.read())
+
+
+def macro_body(source, name):
+    # Isi makro multi-baris (baris diakhiri "\")
+    start = re.search(r"#define %s\(X\)" % name, source)
+    lines = []
+    for line in source[start.end():].splitlines():
+        lines.append(line)
+        if not line.rstrip().endswith("\\"):
+            break
+    return "\n".join(lines)
+
+
+def read_fields(source, name):
+    return [(member, key, int(scale)) for _, member, key, scale in
+            re.findall(r"X\(([\w:* ]+?),\s*(\w+),\s*\"(\w+)\",\s*(\d+)\)", macro_body(source, name))]
+
+
+def read_names(source, name):
+    return [label for _, label in re.findall(r"X\((\w+),\s*\"(\w*)\"\)", macro_body(source, name))]
+
+
+LINK = read_source(SCHEMA)
+MESSAGES = {name: int(code) for name, code in
+            re.findall(r"LINK_MSG_(\w+)\s*=\s*(\d+)", LINK)}
+FIELDS = {kind: read_fields(LINK, "LINK_%s_FIELDS" % kind)
+          for kind in ("READING", "ACK", "UPDATE", "COMMAND", "POLL")}
+STATUS = read_names(LINK, "LINK_STATUS_LIST")
+VALVE = read_names(LINK, "LINK_VALVE_LIST")
+ACK = read_names(LINK, "LINK_ACK_LIST")
+COMMANDS = read_names(read_source(TRACE), "TRACE_COMMAND_LIST")
+
+
+def encode(kind, values, keyed):
+    # Frame array skema (+ age_ms) atau objek berkunci format lama
+    if keyed:
+        return {key: values[member] for member, key, _ in FIELDS[kind]}
+    frame = [MESSAGES[kind]]
+    for member, _, scale in FIELDS[kind]:
+        value = values[member]
+        frame.append(int(round(value * scale)) if scale > 0 else value)
+    frame.append(0)  # age_ms: frame langsung dikirim saat diminta
+    return frame
+
+
+def decode(kind, frame):
+    fields = FIELDS[kind]
+    if len(frame) < 1 + len(fields):
+        raise ValueError("frame %s kurang field: %s" % (kind, frame))
+    values = {}
+    for i, (member, _, scale) in enumerate(fields):
+        value = frame[1 + i]
+        values[member] = value / float(scale) if scale > 0 else value
+    values["tail"] = frame[1 + len(fields):]
+    return values
+
+
+class Meter:
+    def __init__(self, address, legacy):
+        self.address = address
+        self.legacy = legacy
+        self.reading_m3 = 10.0 * address
+        self.flow_lpm = 0.0
+        self.valve = VALVE.index("open")
+        self.seq = 0
+        self.outbox = []
+        self.credit = None
+        self.stats = {"poll": 0, "reply": 0, "drop": 0, "update": 0, "command": 0, "event": 0}
+
+    def reading(self, status="normal", door=0):
+        # Aliran acak sebentar-sebentar; meter kumulatif
+        self.flow_lpm = random.choice((0.0, 0.0, 0.0, 4.5, 12.0))
+        self.reading_m3 += self.flow_lpm / 60.0 / 1000.0 * 5
+        self.seq = (self.seq + 1) & 0xFFFF
+        values = {"address": self.address, "flowRate": self.flow_lpm,
+                  "meterReading": self.reading_m3, "voltage": 12.1, "doorOpen": door,
+                  "status": STATUS.index(status), "valve": self.valve, "seq": self.seq}
+        if self.legacy:
+            values.update(status=status, valve=VALVE[self.valve])
+        return encode("READING", values, self.legacy)
+
+    def ack(self, command_id, ok, notes):
+        values = {"address": self.address, "commandId": command_id,
+                  "status": ACK.index("acknowledged" if ok else "failed"), "notes": notes,
+                  "valve": self.valve, "configVersion": 0}
+        if self.legacy:
+            values.update(status=ACK[values["status"]], valve=VALVE[self.valve])
+        return encode("ACK", values, self.legacy)
+
+    def answer(self):
+        return self.outbox.pop(0) if self.outbox else self.reading()
+
+
+class Bus:
+    def __init__(self, fd, meters, args):
+        self.fd = fd
+        self.meters = {m.address: m for m in meters}
+        self.args = args
+        self.pending = None  # (waktu jawab, meter) untuk poll yang sedang dijawab
+        self.buffer = b""
+        self.collisions = 0
+        self.decode_errors = 0
+        self.foreign = 0
+        self.next_event = time.time() + args.event_every if args.event_every else None
+
+    def write(self, frame):
+        data = json.dumps(frame, separators=(",", ":")).encode("utf-8")
+        if random.random() < self.args.garble:
+            data = data[:len(data) // 2] + b"\x00"
+        os.write(self.fd, data + b"\n")
+        return data
+
+    def on_line(self, line):
+        text = line.decode("utf-8", "replace").strip()
+        if not text.startswith(("[", "{")):
+            return  # Log debug NodeMCU (BUS_PORT_USB)
+        try:
+            frame = json.loads(text)
+        except ValueError:
+            return
+        if self.pending is not None:
+            self.collisions += 1
+            print("TABRAKAN: gateway mengirim %s sebelum meter %d menjawab"
+                  % (text, self.pending[1].address))
+            self.pending = None
+
+        keyed = isinstance(frame, dict)
+        address = frame.get("addr", 0) if keyed else (frame[1] if len(frame) > 1 else 0)
+        meter = self.meters.get(address)
+        if meter is None or meter.legacy != keyed:
+            self.foreign += 1  # Alamat lain / format lain: meter diam
+            return
+        try:
+            self.handle(meter, frame, keyed)
+        except (ValueError, IndexError, KeyError) as error:
+            self.decode_errors += 1
+            print("DECODE GAGAL meter %d: %s" % (address, error))
+
+    def handle(self, meter, frame, keyed):
+        if keyed:
+            kind = "POLL" if frame.get("poll") else ("COMMAND" if "command_type" in frame else "UPDATE")
+            values = {member: frame.get(key) for member, key, _ in FIELDS[kind]}
+            if kind == "COMMAND":
+                values["code"] = COMMANDS.index(frame.get("command_type", ""))
+        else:
+            kinds = {code: name for name, code in MESSAGES.items()}
+            kind = kinds.get(frame[0])
+            if kind not in FIELDS or kind in ("READING", "ACK"):
+                raise ValueError("jenis frame tidak dikenal dari gateway: %s" % frame)
+            values = decode(kind, frame)
+
+        if kind == "POLL":
+            meter.stats["poll"] += 1
+            if random.random() < self.args.drop:
+                meter.stats["drop"] += 1
+                return
+            self.pending = (time.time() + self.args.reply_delay / 1000.0, meter)
+        elif kind == "UPDATE":
+            meter.stats["update"] += 1
+            meter.credit = values["credit"]
+            print("meter %d: saldo %.0f, tarif %.0f, unlock %s, ack_seq %s"
+                  % (meter.address, values["credit"] or 0, values["tariff"] or 0,
+                     bool(values["unlocked"]), values.get("ackSeq")))
+        elif kind == "COMMAND":
+            meter.stats["command"] += 1
+            name = COMMANDS[values["code"]] if values["code"] < len(COMMANDS) else "?"
+            if name == "valve_open":
+                meter.valve = VALVE.index("open")
+            elif name == "valve_close":
+                meter.valve = VALVE.index("closed")
+            print("meter %d: perintah %s id=%s" % (meter.address, name or "lain", values["commandId"]))
+            meter.outbox.append(meter.ack(values["commandId"], True, "Simulasi: %s" % (name or "lain")))
+
+    def tick(self):
+        now = time.time()
+        if self.pending is not None and now >= self.pending[0]:
+            meter = self.pending[1]
+            self.pending = None
+            self.write(meter.answer())
+            meter.stats["reply"] += 1
+        if self.next_event is not None and now >= self.next_event:
+            meter = random.choice(list(self.meters.values()))
+            meter.outbox.append(meter.reading("pintu_terbuka", door=1))
+            meter.stats["event"] += 1
+            self.next_event = now + self.args.event_every
+            print("meter %d: event pintu_terbuka diantrikan" % meter.address)
+
+    def run(self, duration):
+        deadline = time.time() + duration if duration else None
+        while deadline is None or time.time() < deadline:
+            timeout = 0.05
+            if self.pending is not None:
+                timeout = max(0.0, min(timeout, self.pending[0] - time.time()))
+            ready, _, _ = select.select([self.fd], [], [], timeout)
+            if ready:
+                chunk = os.read(self.fd, 512)
+                if not chunk:
+                    break
+                self.buffer += chunk
+                while b"\n" in self.buffer:
+                    line, self.buffer = self.buffer.split(b"\n", 1)
+                    self.on_line(line)
+            self.tick()
+
+
+def open_port(path, baud):
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+    if os.isatty(fd):
+        attrs = termios.tcgetattr(fd)
+        attrs[0] = 0                                   # iflag: raw
+        attrs[1] = 0                                   # oflag: raw
+        attrs[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+        attrs[3] = 0                                   # lflag: tanpa echo/kanonik
+        attrs[4] = attrs[5] = BAUDS[baud]
+        attrs[6][termios.VMIN] = 0
+        attrs[6][termios.VTIME] = 0
+        termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    return fd
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--port", required=True, help="serial/pty ke gateway")
+    parser.add_argument("--baud", type=int, default=115200, choices=sorted(BAUDS))
+    parser.add_argument("--meters", default="1,2,3", help="alamat meter simulasi")
+    parser.add_argument("--legacy", default="", help="alamat yang memakai frame objek lama")
+    parser.add_argument("--reply-delay", type=float, default=20.0, help="jeda jawaban poll (ms)")
+    parser.add_argument("--drop", type=float, default=0.0, help="peluang poll tidak dijawab")
+    parser.add_argument("--garble", type=float, default=0.0, help="peluang jawaban rusak")
+    parser.add_argument("--event-every", type=float, default=0.0, help="detik antar event pintu")
+    parser.add_argument("--duration", type=float, default=0.0, help="detik (0 = sampai Ctrl-C)")
+    args = parser.parse_args(argv[1:])
+
+    legacy = {int(a) for a in args.legacy.split(",") if a}
+    meters = [Meter(int(a), int(a) in legacy) for a in args.meters.split(",") if a]
+    bus = Bus(open_port(args.port, args.baud), meters, args)
+    print("Bus simulasi di %s: meter %s%s" % (args.port, ", ".join(str(m.address) for m in meters),
+                                              " (lama: %s)" % args.legacy if legacy else ""))
+    try:
+        bus.run(args.duration)
+    except KeyboardInterrupt:
+        pass
+
+    print("\nmeter  poll  jawab  drop  update  perintah  event")
+    for m in meters:
+        s = m.stats
+        print("%5d %5d %6d %5d %7d %9d %6d" % (m.address, s["poll"], s["reply"], s["drop"],
+                                               s["update"], s["command"], s["event"]))
+    print("frame alamat lain: %d, tabrakan: %d, decode gagal: %d"
+          % (bus.foreign, bus.collisions, bus.decode_errors))
+    return 1 if bus.collisions or bus.decode_errors else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+"""
+Decode flight-recorder dumps (dump_trace) into a single timeline.
+
+Input is what the NodeMCU POSTs to /device/trace_dump.php: one JSON body
+per line, or a JSON array of bodies. Parts of the same dump are joined,
+records are decoded with the event codes in firmware/trace_events.h and
+every source (nodemcu / arduino) is merged by time. When the dump carries
+epoch_ms the timeline is in UTC, otherwise in ms relative to the dump.
+
+Usage:
+    python3 firmware/tools/decode_trace.py dumps.jsonl [more.jsonl ...]
+"""
+
+import datetime
+import json
+import os
+import re
+import struct
+import sys
+
+FIRMWARE_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+RECORD = struct.Struct("<IBBH")  # TraceRecord: t, type, a, b
+
+
+def read_source(path):
+    with open(path, "r", encoding="utf-8") as f:
+        return re.sub(r"//[^\n]*", "", f.read())  # Komentar bisa berisi "a = 1"
+
+
+def read_enum(path, enum_name, prefix):
+    source = read_source(path)
+    block = re.search(r"enum %s\s*\{(.*?)\}" % enum_name, source, re.S).group(1)
+    return {int(value): name[len(prefix):]
+            for name, value in re.findall(r"(\w+)\s*=\s*(\d+)", block)}
+
+
+def read_list(path, list_name, prefix):
+    # Daftar X-macro: X(KODE, "nama") berurutan dari kode 0
+    source = read_source(path)
+    block = re.search(r"#define %s\(X\)(.*?)\n\s*\n" % list_name, source, re.S).group(1)
+    return [name[len(prefix):].lower() for name in re.findall(r"X\((\w+),", block)]
+
+
+def read_endpoints(path):
+    source = read_source(path)
+    return {int(value): name.lower()
+            for name, value in re.findall(r"#define METRIC_EP_(\w+) (\d+)", source)
+            if name != "COUNT"}
+
+
+HEADER = os.path.join(FIRMWARE_DIR, "trace_events.h")
+EVENTS = read_enum(HEADER, "TraceEvent", "TRACE_")
+COMMANDS = dict(enumerate(read_list(HEADER, "TRACE_COMMAND_LIST", "TRACE_CMD_")))
+ANOMALIES = read_enum(HEADER, "TraceAnomaly", "TRACE_ANOMALY_")
+VALVE_STATES = read_list(os.path.join(FIRMWARE_DIR, "link_schema.h"), "LINK_VALVE_LIST", "LINK_VALVE_")
+ENDPOINTS = read_endpoints(os.path.join(FIRMWARE_DIR, "NodeMCU_Fixed.cpp"))
+
+
+def describe(event, a, b):
+    if event == "SERIAL_RX" or event == "SERIAL_TX" or event == "SERIAL_ERROR":
+        return "%d byte" % b
+    if event == "VALVE":
+        state = VALVE_STATES[a] if a < len(VALVE_STATES) else str(a)
+        return "%s (tempuh %d ms)" % (state, b) if b else state
+    if event == "DOOR":
+        return "terbuka (%d cm)" % b if a else "tertutup (%d cm)" % b
+    if event == "VOLTAGE":
+        return "%s %.2f V" % ("rendah" if a else "normal", b / 100.0)
+    if event == "ANOMALY":
+        return ANOMALIES.get(a, str(a)).lower()
+    if event == "COMMAND":
+        return "%s id=%d" % (COMMANDS.get(a, str(a)), b)
+    if event == "HTTP_START":
+        return ENDPOINTS.get(a, str(a))
+    if event == "HTTP":
+        code = b - 0x10000 if b >= 0x8000 else b
+        return "%s -> %d" % (ENDPOINTS.get(a, str(a)), code)
+    if event == "WIFI":
+        if a == 0:
+            return "gagal koneksi (%d ms)" % b if b else "putus"
+        return "terhubung %s (%d ms)" % ("jalur cepat" if a == 2 else "scan penuh", b)
+    if event == "OVERRUN":
+        return "%d ms" % b
+    if event == "BUS_DROP":
+        kind = ("snapshot", "bulk", "event/ack")[a] if a < 3 else str(a)
+        return "outbox bus membuang %s (%d byte)" % (kind, b)
+    if event == "BOOT":
+        return "reset reason %d" % a
+    return "a=%d b=%d" % (a, b)
+
+
+def load_bodies(paths):
+    for path in paths:
+        with open(path, "r", encoding="utf-8") as f:
+            text = f.read().strip()
+        if text.startswith("["):
+            for body in json.loads(text):
+                yield body
+        else:
+            for line in text.splitlines():
+                if line.strip():
+                    yield json.loads(line)
+
+
+def main(argv):
+    if len(argv) < 2:
+        print(__doc__.strip())
+        return 1
+
+    dumps = {}
+    for body in load_bodies(argv[1:]):
+        key = (body.get("command_id"), body.get("id_meter"), body.get("source"))
+        dumps.setdefault(key, []).append(body)
+
+    timeline = []
+    for (command_id, meter, source), parts in dumps.items():
+        parts.sort(key=lambda p: p.get("part", 0))
+        missing = set(range(parts[0].get("parts", 1))) - {p.get("part", 0) for p in parts}
+        if missing:
+            print("peringatan: dump %s/%s/%s kurang bagian %s"
+                  % (command_id, meter, source, sorted(missing)), file=sys.stderr)
+        data = bytes.fromhex("".join(p.get("records", "") for p in parts))
+        now_ms = parts[0].get("now_ms", 0)
+        epoch_ms = parts[0].get("epoch_ms")
+        for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+            t, event_type, a, b = RECORD.unpack_from(data, offset)
+            age_ms = (now_ms - t) & 0xFFFFFFFF  # millis() boleh wrap
+            event = EVENTS.get(event_type, "EVENT_%d" % event_type)
+            timeline.append((epoch_ms - age_ms if epoch_ms else -age_ms, epoch_ms is not None,
+                             source, meter, t, event, describe(event, a, b)))
+
+    timeline.sort(key=lambda row: row[0])
+    for when, absolute, source, meter, t, event, text in timeline:
+        if absolute:
+            stamp = datetime.datetime.fromtimestamp(when / 1000.0, datetime.timezone.utc)
+            stamp = stamp.strftime("%Y-%m-%d %H:%M:%S.") + "%03dZ" % (when % 1000)
+        else:
+            stamp = "%+12d ms" % when
+        print("%s  %-7s  %-12s  t=%-10d  %-12s  %s" % (stamp, source, meter, t, event, text))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""
+Heap soak test for the NodeMCU HTTP request path.
+
+Scrapes /metrics from a running NodeMCU (STA mode) at a fixed interval for
+the whole soak duration and checks that the heap stays flat while API
+requests keep flowing:
+
+- the device must not reboot (indowater_uptime_seconds never goes back),
+- requests must actually be made (indowater_http_requests_total grows),
+- indowater_heap_max_free_block_bytes never falls below --min-block,
+- indowater_heap_free_after_connect_min_bytes (free heap right after a TLS
+  handshake, with the BearSSL buffers allocated) never falls below
+  --min-after-connect; build with GATEWAY_MODE 1 to check the gateway's
+  headroom,
+- after --warmup, the least-squares trend of the free heap and of the
+  largest free block must stay within --max-drift bytes per hour.
+
+Run it against the stand-in API so the device makes requests at full rate
+without touching production:
+
+    python3 firmware/tools/uplink_server.py --port 8080 --jwt-ttl 600
+    python3 firmware/tools/heap_soak.py http://<nodemcu-ip> --hours 24
+
+Every sample is appended to --csv (default heap_soak.csv) so a long run can
+be plotted afterwards. Exit code 0 means the soak passed.
+"""
+
+import argparse
+import csv
+import re
+import sys
+import time
+import urllib.error
+import urllib.request
+
+GAUGES = {
+    "free": "indowater_heap_free_bytes",
+    "max_block": "indowater_heap_max_free_block_bytes",
+    "fragmentation": "indowater_heap_fragmentation_percent",
+    "uptime": "indowater_uptime_seconds",
+    "after_connect": "indowater_heap_free_after_connect_min_bytes",
+}
+SAMPLE = re.compile(r"^(\w+)(\{[^}]*\})?\s+(-?[\d.]+)$")
+
+
+def scrape(url, timeout):
+    with urllib.request.urlopen(url.rstrip("/") + "/metrics", timeout=timeout) as response:
+        text = response.read().decode("utf-8", "replace")
+    values = {}
+    requests = 0
+    for line in text.splitlines():
+        match = SAMPLE.match(line.strip())
+        if not match:
+            continue
+        name, value = match.group(1), float(match.group(3))
+        if name == "indowater_http_requests_total":
+            requests += int(value)
+        for key, metric in GAUGES.items():
+            if name == metric:
+                values[key] = value
+    missing = [GAUGES[key] for key in GAUGES if key not in values]
+    if missing:
+        raise ValueError("metric tidak ada: %s" % ", ".join(missing))
+    values["requests"] = requests
+    return values
+
+
+def slope_per_hour(points):
+    # Tren least-squares (byte per jam) dari pasangan (detik, nilai)
+    if len(points) < 2:
+        return 0.0
+    n = float(len(points))
+    mean_t = sum(t for t, _ in points) / n
+    mean_v = sum(v for _, v in points) / n
+    var = sum((t - mean_t) ** 2 for t, _ in points)
+    if var == 0:
+        return 0.0
+    cov = sum((t - mean_t) * (v - mean_v) for t, v in points)
+    return cov / var * 3600.0
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("device", help="URL NodeMCU, mis. http://192.168.1.50")
+    parser.add_argument("--hours", type=float, default=24.0, help="lama soak (jam)")
+    parser.add_argument("--interval", type=float, default=30.0, help="jeda scrape (detik)")
+    parser.add_argument("--warmup", type=float, default=600.0,
+                        help="detik awal yang tidak ikut dihitung trennya")
+    parser.add_argument("--min-block", type=int, default=6144,
+                        help="batas bawah blok heap terbesar (byte)")
+    parser.add_argument("--min-after-connect", type=int, default=10240,
+                        help="batas bawah heap bebas setelah handshake TLS (byte)")
+    parser.add_argument("--max-drift", type=float, default=256.0,
+                        help="penurunan heap maksimum yang diizinkan (byte per jam)")
+    parser.add_argument("--csv", default="heap_soak.csv")
+    args = parser.parse_args(argv[1:])
+
+    deadline = time.time() + args.hours * 3600.0
+    start = None
+    first_requests = None
+    last_uptime = -1.0
+    failures = []
+    trend = {"free": [], "max_block": []}
+    lowest_block = None
+
+    with open(args.csv, "w", newline="") as f:
+        writer = csv.writer(f)
+        writer.writerow(["elapsed_s", "uptime_s", "requests", "free", "max_block", "fragmentation"])
+        while time.time() < deadline:
+            try:
+                sample = scrape(args.device, timeout=10)
+            except (urllib.error.URLError, OSError, ValueError) as error:
+                print("scrape gagal: %s" % error)
+                time.sleep(args.interval)
+                continue
+
+            now = time.time()
+            if start is None:
+                start = now
+                first_requests = sample["requests"]
+            elapsed = now - start
+
+            if sample["uptime"] < last_uptime:
+                failures.append("device reboot setelah %.0f detik soak (uptime %d -> %d)"
+                                % (elapsed, last_uptime, sample["uptime"]))
+                break
+            last_uptime = sample["uptime"]
+
+            block = int(sample["max_block"])
+            lowest_block = block if lowest_block is None else min(lowest_block, block)
+            if elapsed >= args.warmup:
+                trend["free"].append((elapsed, sample["free"]))
+                trend["max_block"].append((elapsed, sample["max_block"]))
+
+            writer.writerow([int(elapsed), int(sample["uptime"]), sample["requests"],
+                             int(sample["free"]), block, int(sample["fragmentation"])])
+            f.flush()
+            print("%6.0fs  req %6d  heap %6d  blok %6d  frag %3d%%"
+                  % (elapsed, sample["requests"] - first_requests, sample["free"],
+                     block, sample["fragmentation"]))
+            time.sleep(args.interval)
+
+    if start is None:
+        print("GAGAL: device tidak pernah bisa di-scrape")
+        return 1
+    if not failures and sample["requests"] <= first_requests:
+        failures.append("tidak ada request HTTP selama soak; cek API_BASE_URL")
+    if lowest_block is not None and lowest_block < args.min_block:
+        failures.append("blok heap terbesar turun ke %d byte (< %d)" % (lowest_block, args.min_block))
+    after_connect = int(sample["after_connect"])
+    print("heap setelah handshake TLS (terendah): %d byte" % after_connect)
+    if 0 < after_connect < args.min_after_connect:
+        failures.append("heap setelah handshake TLS turun ke %d byte (< %d)"
+                        % (after_connect, args.min_after_connect))
+    for key, points in trend.items():
+        slope = slope_per_hour(points)
+        print("tren %s: %+.1f byte/jam dari %d sampel" % (key, slope, len(points)))
+        if slope < -args.max_drift:
+            failures.append("heap %s turun %.1f byte/jam (> %.0f)" % (key, -slope, args.max_drift))
+
+    for failure in failures:
+        print("GAGAL: %s" % failure)
+    if not failures:
+        print("LULUS: heap datar selama %.1f jam" % ((time.time() - start) / 3600.0))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
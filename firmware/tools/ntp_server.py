@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""
+Local SNTP stand-in for testing the NodeMCU time sync (FUNGSI WAKTU in
+NodeMCU_Fixed.cpp).
+
+Answers SNTP client requests (mode 3) with mode 4 replies. The server clock
+can be distorted so each branch of the firmware's sync logic can be hit on
+purpose:
+
+- --offset-ms: constant offset of the served clock from the host clock.
+- --drift-ppm: the served clock runs fast (+) or slow (-). The device's
+  indowater_clock_drift_ppm should converge to the same value (plus its own
+  crystal error), capped at +/-500 ppm.
+- --step-ms N --step-after S: the clock jumps by N ms after S seconds. Above
+  NTP_STEP_THRESHOLD_MS (10 s) the device must reset its drift estimate
+  instead of folding the jump in.
+- --hold-ms: time between receiving (T2) and answering (T3). The device
+  subtracts it from the round trip.
+- --delay-ms: extra delay after T3, which shows up as network delay.
+- --drop P: requests go unanswered with probability P (sync failure and
+  interval tightening).
+- --kod P: reply with a stratum 0 kiss-of-death with probability P. The
+  device must reject these.
+
+Each answered request is logged with the served time and its offset from
+the host clock (served - host). After a sync, the "ts" of readings arriving
+at tools/uplink_server.py should show the same offset from the host clock.
+
+Usage:
+    python3 firmware/tools/ntp_server.py [--port 1123] [--drift-ppm 200] ...
+
+Set NTP_SERVER to the PC's IP and NTP_PORT to --port. Port 123 needs root.
+"""
+
+import argparse
+import random
+import socket
+import struct
+import sys
+import time
+
+NTP_UNIX_OFFSET = 2208988800  # Detik 1900-01-01 -> 1970-01-01
+
+
+class ServedClock:
+    def __init__(self, args):
+        self.args = args
+        self.start = time.time()
+
+    def now(self):
+        # Jam yang dilayani: jam host + offset + drift + step
+        host = time.time()
+        elapsed = host - self.start
+        served = host + self.args.offset_ms / 1000.0 + elapsed * self.args.drift_ppm / 1e6
+        if self.args.step_ms and elapsed >= self.args.step_after:
+            served += self.args.step_ms / 1000.0
+        return served
+
+
+def ntp_timestamp(unix_seconds):
+    seconds = int(unix_seconds) + NTP_UNIX_OFFSET
+    fraction = int((unix_seconds % 1.0) * (1 << 32)) & 0xFFFFFFFF
+    return struct.pack(">II", seconds & 0xFFFFFFFF, fraction)
+
+
+def reply(request, receive, transmit, stratum):
+    version = (request[0] >> 3) & 0x07 or 4
+    header = struct.pack(">BBbb", (version << 3) | 4, stratum, request[2], -20)
+    root = struct.pack(">II", 0, 0)          # root delay, root dispersion
+    reference = b"LOCL" if stratum else b"RATE"
+    return (header + root + reference + ntp_timestamp(receive)
+            + request[40:48]                 # originate = transmit client
+            + ntp_timestamp(receive) + ntp_timestamp(transmit))
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--port", type=int, default=1123)
+    parser.add_argument("--offset-ms", type=float, default=0.0)
+    parser.add_argument("--drift-ppm", type=float, default=0.0)
+    parser.add_argument("--step-ms", type=float, default=0.0)
+    parser.add_argument("--step-after", type=float, default=0.0, help="detik sebelum step")
+    parser.add_argument("--hold-ms", type=float, default=0.0)
+    parser.add_argument("--delay-ms", type=float, default=0.0)
+    parser.add_argument("--drop", type=float, default=0.0)
+    parser.add_argument("--kod", type=float, default=0.0)
+    parser.add_argument("--stratum", type=int, default=2)
+    args = parser.parse_args(argv[1:])
+
+    clock = ServedClock(args)
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", args.port))
+    print("SNTP stand-in on udp/%d (offset %+.0f ms, drift %+.1f ppm%s)"
+          % (args.port, args.offset_ms, args.drift_ppm,
+             ", step %+.0f ms setelah %.0f s" % (args.step_ms, args.step_after) if args.step_ms else ""))
+
+    try:
+        while True:
+            request, peer = sock.recvfrom(512)
+            receive = clock.now()
+            if len(request) < 48 or request[0] & 0x07 != 3:
+                print("%s: bukan request client SNTP (%d byte), diabaikan" % (peer[0], len(request)))
+                continue
+            if random.random() < args.drop:
+                print("%s: request dibuang" % peer[0])
+                continue
+            stratum = 0 if random.random() < args.kod else args.stratum
+            if args.hold_ms:
+                time.sleep(args.hold_ms / 1000.0)
+            transmit = clock.now()
+            expected_ms = (transmit - time.time()) * 1000.0
+            packet = reply(request, receive, transmit, stratum)
+            if args.delay_ms:
+                time.sleep(args.delay_ms / 1000.0)
+            sock.sendto(packet, peer)
+            print("%s: %s stratum %d, dilayani %s.%03d, offset harapan %+.0f ms"
+                  % (peer[0], "KoD" if stratum == 0 else "jawab", stratum,
+                     time.strftime("%H:%M:%S", time.gmtime(transmit)), int(transmit % 1 * 1000),
+                     expected_ms))
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,309 @@
+#!/usr/bin/env python3
+"""
+Stand-in API server for testing the NodeMCU uplink formats locally.
+
+Every response carries "Accept-Post: application/cbor, application/json", so
+after its first request the NodeMCU sends CBOR bodies to that endpoint (see
+UPLINK BINER in NodeMCU_Fixed.cpp). CBOR bodies are decoded with the
+UPLINK_FIELDS table read from the firmware source: integer keys become field
+names again and fixed-point fields are divided by their scale. Each request
+is printed as JSON together with its size next to the same body in compact
+JSON. With --json-only the server does not advertise CBOR and answers CBOR
+bodies with 415, which exercises the JSON fallback.
+
+POST /device/refresh_token.php answers with a new token (base64 JSON with
+iat/exp, like the API's device tokens) valid for --jwt-ttl seconds. Other
+requests whose Bearer token carries an exp in the past get 401, so a short
+--jwt-ttl exercises both the pre-emptive refresh and the 401
+refresh-and-retry path (see SIKLUS HIDUP JWT in NodeMCU_Fixed.cpp). Tokens
+without a readable exp are accepted there. The refresh path accepts an
+expired token as long as it is readable and its meter_id matches the
+id_meter in the body; a missing, unreadable or foreign token gets 401. With
+--reject-refresh every refresh gets 401, which exercises the fallback to
+re-registration: /device/register_device.php and
+/device/register_bus_meter.php answer with a meter id derived from device_id
+and a fresh token (any non-empty provisioning_token is accepted, like the
+API).
+
+With --tls CERT KEY the server speaks HTTPS as a stand-in for the TLS path
+(see FUNGSI KLIEN TLS in NodeMCU_Fixed.cpp). It prints the certificate's
+SHA-1 fingerprint in the form API_TLS_FINGERPRINT expects, and logs for each
+connection whether the TLS session was resumed or fully negotiated. A
+self-signed pair for a LAN address can be made with:
+
+    openssl req -x509 -newkey rsa:2048 -nodes -days 30 -subj /CN=<pc-ip> \
+        -keyout key.pem -out cert.pem
+
+Usage:
+    python3 firmware/tools/uplink_server.py [--port 8080] [--json-only] [--jwt-ttl 3600]
+                                            [--reject-refresh] [--tls cert.pem key.pem]
+
+Point API_BASE_URL at http://<pc-ip>:8080 (https:// with --tls) for the test.
+"""
+
+import argparse
+import base64
+import binascii
+import hashlib
+import json
+import os
+import re
+import ssl
+import struct
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+FIRMWARE_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def read_uplink_fields(path):
+    with open(path, "r", encoding="utf-8") as f:
+        source = re.sub(r"//[^\n]*", "", f.read())
+    block = re.search(r"UPLINK_FIELDS\[\]\s*=\s*\{(.*?)\};", source, re.S).group(1)
+    return [(name, int(scale)) for name, scale in re.findall(r'\{"(\w+)",\s*(\d+)\}', block)]
+
+
+FIELDS = read_uplink_fields(os.path.join(FIRMWARE_DIR, "NodeMCU_Fixed.cpp"))
+
+
+class CborDecoder:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def take(self, n):
+        if self.pos + n > len(self.data):
+            raise ValueError("CBOR terpotong di offset %d" % self.pos)
+        chunk = self.data[self.pos:self.pos + n]
+        self.pos += n
+        return chunk
+
+    def argument(self, info):
+        if info < 24:
+            return info
+        if info in (24, 25, 26, 27):
+            return int.from_bytes(self.take(1 << (info - 24)), "big")
+        raise ValueError("argumen CBOR tidak didukung: %d" % info)
+
+    def item(self):
+        head = self.take(1)[0]
+        major, info = head >> 5, head & 0x1F
+        if major == 7:
+            if info == 20:
+                return False
+            if info == 21:
+                return True
+            if info in (22, 23):
+                return None
+            if info == 25:
+                return struct.unpack(">e", self.take(2))[0]
+            if info == 26:
+                return struct.unpack(">f", self.take(4))[0]
+            if info == 27:
+                return struct.unpack(">d", self.take(8))[0]
+            raise ValueError("simple value CBOR tidak didukung: %d" % info)
+        value = self.argument(info)
+        if major == 0:
+            return value
+        if major == 1:
+            return -1 - value
+        if major == 2:
+            return self.take(value).hex()
+        if major == 3:
+            return self.take(value).decode("utf-8")
+        if major == 4:
+            return [self.item() for _ in range(value)]
+        if major == 5:
+            return dict(self.pair() for _ in range(value))
+        raise ValueError("major type CBOR tidak didukung: %d" % major)
+
+    def pair(self):
+        key = self.item()
+        value = self.item()
+        if isinstance(key, int) and 0 <= key < len(FIELDS):
+            name, scale = FIELDS[key]
+            if scale and isinstance(value, (int, float)) and not isinstance(value, bool):
+                value = value / scale
+            return name, value
+        return str(key), value
+
+
+def decode_cbor(data):
+    decoder = CborDecoder(data)
+    value = decoder.item()
+    if decoder.pos != len(data):
+        raise ValueError("%d byte sisa setelah item CBOR" % (len(data) - decoder.pos))
+    return value
+
+
+def token_claims(token):
+    # JWT: payload = segmen tengah; token lama = base64 JSON utuh
+    parts = token.split(".")
+    payload = parts[1] if len(parts) == 3 else token
+    try:
+        data = base64.urlsafe_b64decode(payload.replace("+", "-").replace("/", "_")
+                                        + "=" * (-len(payload) % 4))
+        claims = json.loads(data)
+    except (binascii.Error, ValueError):
+        return {}
+    return claims if isinstance(claims, dict) else {}
+
+
+def issue_token(meter_id, ttl):
+    now = int(time.time())
+    claims = {"meter_id": meter_id, "type": "device", "iat": now, "exp": now + ttl}
+    return base64.b64encode(json.dumps(claims, separators=(",", ":")).encode("utf-8")).decode("ascii")
+
+
+class UplinkHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.0"
+    json_only = False
+    jwt_ttl = 3600
+    reject_refresh = False
+
+    def token_expired(self):
+        auth = self.headers.get("Authorization", "")
+        if not auth.startswith("Bearer "):
+            return False
+        exp = token_claims(auth[7:]).get("exp")
+        if isinstance(exp, (int, float)) and exp <= time.time():
+            print("     token kedaluwarsa %d detik lalu -> 401" % (time.time() - exp))
+            return True
+        return False
+
+    def refresh_rejection(self, body):
+        # Token kedaluwarsa boleh, asal terbaca dan milik meter yang diminta
+        if self.reject_refresh:
+            return "Refresh rejected (--reject-refresh)"
+        auth = self.headers.get("Authorization", "")
+        if not auth.startswith("Bearer "):
+            return "Missing token"
+        claims = token_claims(auth[7:])
+        if not claims:
+            return "Token not readable"
+        if claims.get("meter_id") != body.get("id_meter"):
+            return "Token belongs to %s, not %s" % (claims.get("meter_id"), body.get("id_meter"))
+        exp = claims.get("exp")
+        if isinstance(exp, (int, float)) and exp <= time.time():
+            print("     token kedaluwarsa %d detik lalu, refresh tetap diterima" % (time.time() - exp))
+        return None
+
+    def log_tls(self):
+        if isinstance(self.connection, ssl.SSLSocket):
+            print("     TLS %s, %s" % (self.connection.version(),
+                                      "sesi dilanjutkan" if self.connection.session_reused
+                                      else "handshake penuh"))
+
+    def reply(self, code, body):
+        payload = json.dumps(body, separators=(",", ":")).encode("utf-8")
+        self.send_response(code)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(payload)))
+        self.send_header("Accept-Post", "application/json" if self.json_only
+                         else "application/cbor, application/json")
+        self.end_headers()
+        self.wfile.write(payload)
+
+    def do_GET(self):
+        print("GET  %s" % self.path)
+        self.log_tls()
+        if self.token_expired():
+            self.reply(401, {"status": "error", "message": "Token expired"})
+            return
+        self.reply(200, {"status": "success", "commands": []})
+
+    def do_POST(self):
+        data = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        self.log_tls()
+        content_type = self.headers.get("Content-Type", "")
+        if content_type.startswith("application/cbor"):
+            if self.json_only:
+                print("POST %s  CBOR %d byte -> 415" % (self.path, len(data)))
+                self.reply(415, {"status": "error", "message": "Unsupported Media Type"})
+                return
+            try:
+                body = decode_cbor(data)
+            except ValueError as error:
+                print("POST %s  CBOR tidak valid: %s (%s)" % (self.path, error, data.hex()))
+                self.reply(400, {"status": "error", "message": str(error)})
+                return
+            as_json = len(json.dumps(body, separators=(",", ":")).encode("utf-8"))
+            print("POST %s  CBOR %d byte (JSON %d byte, %.0f%%)"
+                  % (self.path, len(data), as_json, 100.0 * len(data) / as_json))
+        else:
+            body = json.loads(data or b"{}")
+            print("POST %s  JSON %d byte" % (self.path, len(data)))
+        print("     %s" % json.dumps(body))
+        path = self.path.split("?", 1)[0]
+        response = {"status": "success"}
+        if path == "/device/refresh_token.php":
+            rejection = self.refresh_rejection(body)
+            if rejection:
+                print("     refresh ditolak: %s -> 401" % rejection)
+                self.reply(401, {"status": "error", "message": rejection})
+                return
+            response["jwt_token"] = issue_token(body.get("id_meter", ""), self.jwt_ttl)
+            print("     token baru berlaku %d detik" % self.jwt_ttl)
+        elif path == "/device/register_device.php" and not body.get("provisioning_token"):
+            self.reply(401, {"status": "error", "message": "Invalid provisioning token"})
+            return
+        elif self.token_expired():
+            self.reply(401, {"status": "error", "message": "Token expired"})
+            return
+        if path in ("/device/register_device.php", "/device/register_bus_meter.php"):
+            # Meter yang sama untuk device_id yang sama, seperti API
+            response["id_meter"] = "SIM_%s" % body.get("device_id", "")
+            response["jwt_token"] = issue_token(response["id_meter"], self.jwt_ttl)
+            print("     %s terdaftar, token baru berlaku %d detik" % (response["id_meter"], self.jwt_ttl))
+        if "meter_reading_m3" in body:
+            response.update({"data_pulsa": 100000, "tarif_per_m3": 5000,
+                             "is_unlocked": True, "commands": []})
+            if "seq" in body:
+                response["ack_seq"] = body["seq"]
+        self.reply(200, response)
+
+    def log_message(self, format, *args):
+        pass
+
+
+def certificate_fingerprint(path):
+    with open(path, "r", encoding="ascii") as f:
+        der = ssl.PEM_cert_to_DER_cert(f.read())
+    digest = hashlib.sha1(der).hexdigest().upper()
+    return ":".join(digest[i:i + 2] for i in range(0, len(digest), 2))
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--json-only", action="store_true",
+                        help="jangan iklankan CBOR, jawab body CBOR dengan 415")
+    parser.add_argument("--jwt-ttl", type=int, default=3600,
+                        help="umur token dari refresh_token.php (detik)")
+    parser.add_argument("--reject-refresh", action="store_true",
+                        help="tolak setiap refresh (uji fallback registrasi ulang)")
+    parser.add_argument("--tls", nargs=2, metavar=("CERT", "KEY"),
+                        help="layani HTTPS dengan sertifikat dan kunci PEM ini")
+    args = parser.parse_args(argv[1:])
+
+    UplinkHandler.json_only = args.json_only
+    UplinkHandler.jwt_ttl = args.jwt_ttl
+    UplinkHandler.reject_refresh = args.reject_refresh
+    server = HTTPServer(("", args.port), UplinkHandler)
+    if args.tls:
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(*args.tls)
+        server.socket = context.wrap_socket(server.socket, server_side=True)
+        print("HTTPS, API_TLS_FINGERPRINT = \"%s\"" % certificate_fingerprint(args.tls[0]))
+    print("Uplink stand-in server on :%d (%d field CBOR, %s)"
+          % (args.port, len(FIELDS), "JSON saja" if args.json_only else "CBOR + JSON"))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,67 @@
+/*
+ * Flight recorder (trace) bersama untuk Arduino_Corrected.cpp dan NodeMCU_Fixed.cpp
+ *
+ * Setiap MCU menyimpan ring RAM berisi TraceRecord 8 byte. Pencatatan cukup
+ * beberapa store + millis() sehingga boleh tetap aktif di produksi. Perintah
+ * dump_trace dari server membuat NodeMCU mengunggah ring miliknya dan
+ * meneruskan perintah ke Arduino; frame trace Arduino diunggah NodeMCU apa
+ * adanya. tools/decode_trace.py membaca enum di file ini untuk mengubah dump
+ * menjadi timeline.
+ *
+ * Format dump: hex dari record (little-endian, urut dari yang paling lama):
+ *   uint32 t    millis() sumber saat event
+ *   uint8  type TraceEvent
+ *   uint8  a    argumen kecil (lihat komentar per event)
+ *   uint16 b    argumen 16 bit
+ *
+ * Kode hanya boleh ditambah di akhir; kode lama tidak boleh diubah artinya.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct TraceRecord {
+  uint32_t t;
+  uint8_t type;
+  uint8_t a;
+  uint16_t b;
+};
+static_assert(sizeof(TraceRecord) == 8, "TraceRecord harus 8 byte di AVR dan ESP8266");
+
+enum TraceEvent {
+  TRACE_NONE = 0,
+  TRACE_BOOT = 1,          // a = alasan reset (NodeMCU: rst_info.reason)
+  TRACE_SERIAL_RX = 2,     // b = panjang frame
+  TRACE_SERIAL_TX = 3,     // b = panjang frame
+  TRACE_SERIAL_ERROR = 4,  // b = panjang frame yang gagal di-parse
+  TRACE_VALVE = 5,         // a = posisi valve (0 unknown, 1 closed, 2 opening, 3 open, 4 closing, 5 fault)
+  TRACE_DOOR = 6,          // a = 1 terbuka / 0 tertutup
+  TRACE_VOLTAGE = 7,       // a = 1 rendah / 0 normal, b = tegangan x100
+  TRACE_ANOMALY = 8,       // a = TraceAnomaly
+  TRACE_COMMAND = 9,       // a = TraceCommand, b = command_id (16 bit bawah)
+  TRACE_HTTP_START = 10,   // a = indeks endpoint metrik (METRIC_EP_*)
+  TRACE_HTTP = 11,         // a = indeks endpoint metrik, b = kode HTTP (int16, -1 = gagal koneksi)
+  TRACE_WIFI = 12,         // a = 0 putus/gagal / 1 terhubung (scan penuh) / 2 terhubung (jalur cepat), b = waktu koneksi ms
+  TRACE_OVERRUN = 13,      // b = durasi satu pass loop (ms, maks 65535)
+  TRACE_BUS_DROP = 14,     // a = kelas frame outbox bus Arduino (0 snapshot, 1 bulk, 2 event/ACK), b = panjang frame
+};
+
+// Nama = command_type di API. Kode yang sama dipakai frame perintah di link
+// serial (link_schema.h).
+#define TRACE_COMMAND_LIST(X) \
+  X(TRACE_CMD_OTHER, "") \
+  X(TRACE_CMD_VALVE_OPEN, "valve_open") \
+  X(TRACE_CMD_VALVE_CLOSE, "valve_close") \
+  X(TRACE_CMD_CONFIG_UPDATE, "arduino_config_update") \
+  X(TRACE_CMD_GET_CONFIG, "get_config") \
+  X(TRACE_CMD_DUMP_TRACE, "dump_trace")
+
+#define TRACE_COMMAND_ENUM(code, name) code,
+enum TraceCommand : uint8_t { TRACE_COMMAND_LIST(TRACE_COMMAND_ENUM) TRACE_CMD_COUNT };
+
+enum TraceAnomaly {
+  TRACE_ANOMALY_LEAK = 1,          // kebocoran
+  TRACE_ANOMALY_BURST = 2,         // aliran_berlebih
+  TRACE_ANOMALY_CLOSED_FLOW = 3,   // aliran_saat_tertutup
+};